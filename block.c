@@ -379,6 +379,7 @@ BlockDriverState *bdrv_new(void)
     notifier_with_return_list_init(&bs->before_write_notifiers);
     qemu_co_mutex_init(&bs->reqs_lock);
     qemu_mutex_init(&bs->dirty_bitmap_mutex);
+    qemu_mutex_init(&bs->latency_lock);
     bs->refcnt = 1;
     bs->aio_context = qemu_get_aio_context();
 
@@ -894,6 +895,30 @@ int bdrv_parse_cache_mode(const char *mode, int *flags, bool *writethrough)
     return 0;
 }
 
+/**
+ * Set open flags for a given AIO mode
+ *
+ * Return 0 on success, -1 if the AIO mode was invalid.
+ */
+int bdrv_parse_aio(const char *mode, int *flags)
+{
+    *flags &= ~(BDRV_O_NATIVE_AIO | BDRV_O_IO_URING);
+
+    if (!strcmp(mode, "threads")) {
+        /* this is the default */
+    } else if (!strcmp(mode, "native")) {
+        *flags |= BDRV_O_NATIVE_AIO;
+#ifdef CONFIG_LINUX_IO_URING
+    } else if (!strcmp(mode, "io_uring")) {
+        *flags |= BDRV_O_IO_URING;
+#endif
+    } else {
+        return -1;
+    }
+
+    return 0;
+}
+
 static char *bdrv_child_get_parent_desc(BdrvChild *c)
 {
     BlockDriverState *parent = c->opaque;
@@ -972,7 +997,7 @@ static void bdrv_temp_snapshot_options(int *child_flags, QDict *child_options,
 
     /* aio=native doesn't work for cache.direct=off, so disable it for the
      * temporary snapshot */
-    *child_flags &= ~BDRV_O_NATIVE_AIO;
+    *child_flags &= ~(BDRV_O_NATIVE_AIO | BDRV_O_IO_URING);
 }
 
 /*
@@ -4273,6 +4298,7 @@ static void bdrv_delete(BlockDriverState *bs)
 
     bdrv_close(bs);
 
+    qemu_mutex_destroy(&bs->latency_lock);
     g_free(bs);
 }
 
@@ -4284,7 +4310,9 @@ static void bdrv_delete(BlockDriverState *bs)
  * check are stored in res.
  */
 static int coroutine_fn bdrv_co_check(BlockDriverState *bs,
-                                      BdrvCheckResult *res, BdrvCheckMode fix)
+                                      BdrvCheckResult *res, BdrvCheckMode fix,
+                                      BlockDriverCheckStatusCB *status_cb,
+                                      void *cb_opaque)
 {
     if (bs->drv == NULL) {
         return -ENOMEDIUM;
@@ -4294,25 +4322,29 @@ static int coroutine_fn bdrv_co_check(BlockDriverState *bs,
     }
 
     memset(res, 0, sizeof(*res));
-    return bs->drv->bdrv_co_check(bs, res, fix);
+    return bs->drv->bdrv_co_check(bs, res, fix, status_cb, cb_opaque);
 }
 
 typedef struct CheckCo {
     BlockDriverState *bs;
     BdrvCheckResult *res;
     BdrvCheckMode fix;
+    BlockDriverCheckStatusCB *status_cb;
+    void *cb_opaque;
     int ret;
 } CheckCo;
 
 static void coroutine_fn bdrv_check_co_entry(void *opaque)
 {
     CheckCo *cco = opaque;
-    cco->ret = bdrv_co_check(cco->bs, cco->res, cco->fix);
+    cco->ret = bdrv_co_check(cco->bs, cco->res, cco->fix, cco->status_cb,
+                             cco->cb_opaque);
     aio_wait_kick();
 }
 
 int bdrv_check(BlockDriverState *bs,
-               BdrvCheckResult *res, BdrvCheckMode fix)
+               BdrvCheckResult *res, BdrvCheckMode fix,
+               BlockDriverCheckStatusCB *status_cb, void *cb_opaque)
 {
     Coroutine *co;
     CheckCo cco = {
@@ -4320,6 +4352,8 @@ int bdrv_check(BlockDriverState *bs,
         .res = res,
         .ret = -EINPROGRESS,
         .fix = fix,
+        .status_cb = status_cb,
+        .cb_opaque = cb_opaque,
     };
 
     if (qemu_in_coroutine()) {
@@ -5146,6 +5180,27 @@ int bdrv_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
     return drv->bdrv_get_info(bs, bdi);
 }
 
+/*
+ * Get a host file descriptor from which the data of @bs can be read
+ * directly, and in *@offset where offset 0 of @bs is in that file.
+ * The file descriptor belongs to the node and may be closed when the node
+ * is reopened or closed, so callers that keep it must dup() it.
+ *
+ * Returns -ENOTSUP if reads from @bs cannot bypass the block layer.
+ */
+int bdrv_get_host_fd(BlockDriverState *bs, int64_t *offset)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (!drv) {
+        return -ENOMEDIUM;
+    }
+    if (!drv->bdrv_get_host_fd || atomic_read(&bs->copy_on_read)) {
+        return -ENOTSUP;
+    }
+    return drv->bdrv_get_host_fd(bs, offset);
+}
+
 ImageInfoSpecific *bdrv_get_specific_info(BlockDriverState *bs,
                                           Error **errp)
 {
@@ -5156,6 +5211,15 @@ ImageInfoSpecific *bdrv_get_specific_info(BlockDriverState *bs,
     return NULL;
 }
 
+BlockStatsSpecific *bdrv_get_specific_stats(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+    if (!drv || !drv->bdrv_get_specific_stats) {
+        return NULL;
+    }
+    return drv->bdrv_get_specific_stats(bs);
+}
+
 void bdrv_debug_event(BlockDriverState *bs, BlkdebugEvent event)
 {
     if (!bs || !bs->drv || !bs->drv->bdrv_debug_event) {
@@ -26,6 +26,7 @@
 #include "qemu/osdep.h"
 #include "block/accounting.h"
 #include "block/block_int.h"
+#include "qemu/host-utils.h"
 #include "qemu/timer.h"
 #include "sysemu/qtest.h"
 
@@ -182,6 +183,100 @@ void block_latency_histograms_clear(BlockAcctStats *stats)
     }
 }
 
+static unsigned block_latency_log_bucket(uint64_t latency_ns)
+{
+    int msb;
+
+    if (latency_ns < (1 << BLOCK_LAT_SUB_BITS)) {
+        return latency_ns;
+    }
+    msb = 63 - clz64(latency_ns);
+    if (msb >= BLOCK_LAT_MAX_BITS) {
+        return BLOCK_LAT_NBUCKETS - 1;
+    }
+    return ((msb - BLOCK_LAT_SUB_BITS + 1) << BLOCK_LAT_SUB_BITS) +
+           ((latency_ns >> (msb - BLOCK_LAT_SUB_BITS)) &
+            ((1 << BLOCK_LAT_SUB_BITS) - 1));
+}
+
+/* Highest latency that falls in bucket @i */
+static uint64_t block_latency_log_bucket_max(unsigned i)
+{
+    unsigned shift, sub;
+
+    if (i < (1 << BLOCK_LAT_SUB_BITS)) {
+        return i;
+    }
+    shift = (i >> BLOCK_LAT_SUB_BITS) - 1;
+    sub = (1 << BLOCK_LAT_SUB_BITS) + (i & ((1 << BLOCK_LAT_SUB_BITS) - 1));
+    return ((uint64_t)(sub + 1) << shift) - 1;
+}
+
+/* Called with the lock that protects @hist */
+void block_latency_log_histogram_account(BlockLatencyLogHistogram *hist,
+                                         int64_t latency_ns)
+{
+    if (latency_ns < 0) {
+        latency_ns = 0;
+    }
+    hist->bins[block_latency_log_bucket(latency_ns)]++;
+    hist->count++;
+    hist->max = MAX(hist->max, latency_ns);
+}
+
+/* Return the latency below which @percentile percent of the requests in
+ * @hist fall, or 0 if the histogram is empty.  The value is the highest
+ * one of its bucket, capped to the highest latency seen.
+ *
+ * Called with the lock that protects @hist. */
+uint64_t block_latency_log_histogram_percentile(BlockLatencyLogHistogram *hist,
+                                                double percentile)
+{
+    double exact_rank = hist->count * percentile / 100;
+    uint64_t rank = exact_rank;
+    uint64_t seen = 0;
+    unsigned i;
+
+    if (!hist->count) {
+        return 0;
+    }
+    if (rank < exact_rank || rank == 0) {
+        rank++;
+    }
+    for (i = 0; i < BLOCK_LAT_NBUCKETS; i++) {
+        seen += hist->bins[i];
+        if (seen >= rank) {
+            return MIN(block_latency_log_bucket_max(i), hist->max);
+        }
+    }
+    return hist->max;
+}
+
+int64_t block_acct_time_ns(void)
+{
+    return qemu_clock_get_ns(clock_type);
+}
+
+/* Account a request that a BlockBackend received at @submit_time_ns and
+ * passed to its root node at @dispatch_time_ns, and that has just completed.
+ * Both times must come from block_acct_time_ns(). */
+void block_acct_request_done(BlockAcctStats *stats, enum BlockAcctType type,
+                             int64_t submit_time_ns, int64_t dispatch_time_ns)
+{
+    int64_t time_ns = qemu_clock_get_ns(clock_type);
+
+    assert(type < BLOCK_MAX_IOTYPE);
+
+    qemu_mutex_lock(&stats->lock);
+    block_latency_log_histogram_account(
+        &stats->latency_log[type][BLOCK_ACCT_PHASE_QUEUE],
+        dispatch_time_ns - submit_time_ns);
+    block_latency_log_histogram_account(
+        &stats->latency_log[type][BLOCK_ACCT_PHASE_DRIVER],
+        time_ns - dispatch_time_ns);
+    qemu_mutex_unlock(&stats->lock);
+}
+
 static void block_account_one_io(BlockAcctStats *stats, BlockAcctCookie *cookie,
                                  bool failed)
 {
@@ -206,6 +301,8 @@ static void block_account_one_io(BlockAcctStats *stats, BlockAcctCookie *cookie,
 
     block_latency_histogram_account(&stats->latency_histogram[cookie->type],
                                     latency_ns);
+    block_latency_log_histogram_account(
+        &stats->latency_log[cookie->type][BLOCK_ACCT_PHASE_TOTAL], latency_ns);
 
     if (!failed || stats->account_failed) {
         stats->total_time_ns[cookie->type] += latency_ns;
@@ -0,0 +1,290 @@
+/*
+ * backup-top filter driver
+ *
+ * Copyright (c) 2019 QEMU contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 or
+ * (at your option) version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The filter is inserted above the source of a backup job.  Before a write,
+ * write-zeroes or discard request is passed to the source, the job copies
+ * the old data of the affected range to the backup target (copy before
+ * write).  All other requests are passed through unchanged.
+ */
+
+#include "qemu/osdep.h"
+
+#include "qapi/error.h"
+#include "qemu/cutils.h"
+#include "block/block_int.h"
+#include "block/backup-top.h"
+
+typedef struct BDRVBackupTopState {
+    BackupTopCowFunc *cow;
+    void *cow_opaque;
+
+    /* False until the filter is in place, and again when it is dropped */
+    bool active;
+} BDRVBackupTopState;
+
+static int coroutine_fn backup_top_cow(BlockDriverState *bs,
+                                       uint64_t offset, uint64_t bytes)
+{
+    BDRVBackupTopState *s = bs->opaque;
+
+    if (!s->cow) {
+        return 0;
+    }
+
+    return s->cow(s->cow_opaque, offset, bytes);
+}
+
+static int coroutine_fn backup_top_co_preadv(BlockDriverState *bs,
+                                             uint64_t offset, uint64_t bytes,
+                                             QEMUIOVector *qiov, int flags)
+{
+    return bdrv_co_preadv(bs->backing, offset, bytes, qiov, flags);
+}
+
+static int coroutine_fn backup_top_co_pwritev(BlockDriverState *bs,
+                                              uint64_t offset, uint64_t bytes,
+                                              QEMUIOVector *qiov, int flags)
+{
+    int ret;
+
+    /* Such writes do not change the data, so there is nothing to save */
+    if (!(flags & BDRV_REQ_WRITE_UNCHANGED)) {
+        ret = backup_top_cow(bs, offset, bytes);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return bdrv_co_pwritev(bs->backing, offset, bytes, qiov, flags);
+}
+
+static int coroutine_fn backup_top_co_pwrite_zeroes(BlockDriverState *bs,
+                                                    int64_t offset, int bytes,
+                                                    BdrvRequestFlags flags)
+{
+    int ret;
+
+    if (!(flags & BDRV_REQ_WRITE_UNCHANGED)) {
+        ret = backup_top_cow(bs, offset, bytes);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return bdrv_co_pwrite_zeroes(bs->backing, offset, bytes, flags);
+}
+
+static int coroutine_fn backup_top_co_pdiscard(BlockDriverState *bs,
+                                               int64_t offset, int bytes)
+{
+    int ret;
+
+    ret = backup_top_cow(bs, offset, bytes);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return bdrv_co_pdiscard(bs->backing, offset, bytes);
+}
+
+static int coroutine_fn backup_top_co_copy_range_from(BlockDriverState *bs,
+        BdrvChild *src, uint64_t src_offset, BdrvChild *dst,
+        uint64_t dst_offset, uint64_t bytes, BdrvRequestFlags read_flags,
+        BdrvRequestFlags write_flags)
+{
+    return bdrv_co_copy_range_from(bs->backing, src_offset, dst, dst_offset,
+                                   bytes, read_flags, write_flags);
+}
+
+static int coroutine_fn backup_top_co_copy_range_to(BlockDriverState *bs,
+        BdrvChild *src, uint64_t src_offset, BdrvChild *dst,
+        uint64_t dst_offset, uint64_t bytes, BdrvRequestFlags read_flags,
+        BdrvRequestFlags write_flags)
+{
+    int ret;
+
+    ret = backup_top_cow(bs, dst_offset, bytes);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return bdrv_co_copy_range_to(src, src_offset, bs->backing, dst_offset,
+                                 bytes, read_flags, write_flags);
+}
+
+static int coroutine_fn backup_top_co_flush(BlockDriverState *bs)
+{
+    if (!bs->backing) {
+        /* We can be here after a failed bdrv_append() */
+        return 0;
+    }
+
+    return bdrv_co_flush(bs->backing->bs);
+}
+
+static void backup_top_refresh_filename(BlockDriverState *bs)
+{
+    if (bs->backing == NULL) {
+        /*
+         * We can be here after failed bdrv_attach_child in
+         * bdrv_set_backing_hd
+         */
+        return;
+    }
+    pstrcpy(bs->exact_filename, sizeof(bs->exact_filename),
+            bs->backing->bs->filename);
+}
+
+static void backup_top_child_perm(BlockDriverState *bs, BdrvChild *c,
+                                  const BdrvChildRole *role,
+                                  BlockReopenQueue *reopen_queue,
+                                  uint64_t perm, uint64_t shared,
+                                  uint64_t *nperm, uint64_t *nshared)
+{
+    BDRVBackupTopState *s = bs->opaque;
+
+    if (!s->active) {
+        /*
+         * bdrv_append() attaches the source as our backing file while the
+         * source still has its other parents, so we cannot unshare writes
+         * yet.  bdrv_backup_top_append() refreshes the permissions once the
+         * parents have been moved over to us.
+         */
+        *nperm = 0;
+        *nshared = BLK_PERM_ALL;
+        return;
+    }
+
+    bdrv_filter_default_perms(bs, c, role, reopen_queue, perm, shared,
+                              nperm, nshared);
+
+    /* Old data must be read before a write can be passed on */
+    if (perm & BLK_PERM_WRITE) {
+        *nperm |= BLK_PERM_CONSISTENT_READ;
+    }
+
+    /* A write that does not go through us would not be copied first */
+    *nshared &= ~BLK_PERM_WRITE;
+}
+
+static BlockDriver bdrv_backup_top_filter = {
+    .format_name                = "backup-top",
+    .instance_size              = sizeof(BDRVBackupTopState),
+
+    .bdrv_co_preadv             = backup_top_co_preadv,
+    .bdrv_co_pwritev            = backup_top_co_pwritev,
+    .bdrv_co_pwrite_zeroes      = backup_top_co_pwrite_zeroes,
+    .bdrv_co_pdiscard           = backup_top_co_pdiscard,
+    .bdrv_co_copy_range_from    = backup_top_co_copy_range_from,
+    .bdrv_co_copy_range_to      = backup_top_co_copy_range_to,
+    .bdrv_co_flush              = backup_top_co_flush,
+
+    .bdrv_co_block_status       = bdrv_co_block_status_from_backing,
+    .bdrv_refresh_filename      = backup_top_refresh_filename,
+    .bdrv_child_perm            = backup_top_child_perm,
+};
+
+BlockDriverState *bdrv_backup_top_append(BlockDriverState *source,
+                                         const char *filter_node_name,
+                                         Error **errp)
+{
+    BDRVBackupTopState *s;
+    BlockDriverState *top;
+    Error *local_err = NULL;
+
+    top = bdrv_new_open_driver(&bdrv_backup_top_filter, filter_node_name,
+                               BDRV_O_RDWR, errp);
+    if (!top) {
+        return NULL;
+    }
+    if (!filter_node_name) {
+        top->implicit = true;
+    }
+
+    /* So that we can always drop this node */
+    top->never_freeze = true;
+
+    top->total_sectors = source->total_sectors;
+    top->supported_write_flags = BDRV_REQ_WRITE_UNCHANGED |
+                                 (BDRV_REQ_FUA & source->supported_write_flags);
+    top->supported_zero_flags = BDRV_REQ_WRITE_UNCHANGED |
+                                BDRV_REQ_NO_FALLBACK |
+                                ((BDRV_REQ_FUA | BDRV_REQ_MAY_UNMAP) &
+                                 source->supported_zero_flags);
+    s = top->opaque;
+
+    /*
+     * bdrv_append() takes ownership of one reference; the other one is
+     * dropped by bdrv_backup_top_drop().
+     */
+    bdrv_ref(top);
+    bdrv_drained_begin(source);
+    bdrv_append(top, source, &local_err);
+    if (local_err) {
+        error_prepend(&local_err, "Cannot append backup-top filter: ");
+        bdrv_drained_end(source);
+        bdrv_unref(top);
+        error_propagate(errp, local_err);
+        return NULL;
+    }
+
+    s->active = true;
+    bdrv_child_refresh_perms(top, top->backing, &local_err);
+    bdrv_drained_end(source);
+
+    if (local_err) {
+        error_prepend(&local_err,
+                      "Cannot set permissions for backup-top filter: ");
+        bdrv_backup_top_drop(top);
+        error_propagate(errp, local_err);
+        return NULL;
+    }
+
+    return top;
+}
+
+void bdrv_backup_top_set_cow(BlockDriverState *bs, BackupTopCowFunc *cow,
+                             void *opaque)
+{
+    BDRVBackupTopState *s = bs->opaque;
+
+    assert(bs->drv == &bdrv_backup_top_filter);
+    s->cow = cow;
+    s->cow_opaque = opaque;
+}
+
+void bdrv_backup_top_drop(BlockDriverState *bs)
+{
+    BDRVBackupTopState *s = bs->opaque;
+
+    assert(bs->drv == &bdrv_backup_top_filter);
+
+    bdrv_drained_begin(bs);
+
+    s->cow = NULL;
+    s->active = false;
+    bdrv_child_refresh_perms(bs, bs->backing, &error_abort);
+    bdrv_replace_node(bs, backing_bs(bs), &error_abort);
+    bdrv_set_backing_hd(bs, NULL, &error_abort);
+
+    bdrv_drained_end(bs);
+
+    bdrv_unref(bs);
+}
@@ -0,0 +1,58 @@
+/*
+ * backup-top filter driver
+ *
+ * Copyright (c) 2019 QEMU contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 or
+ * (at your option) version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BLOCK_BACKUP_TOP_H
+#define BLOCK_BACKUP_TOP_H
+
+#include "block/block_int.h"
+
+/*
+ * Called before data in [offset, offset + bytes) of the source is changed.
+ * Returns 0 when the old data has been saved, or a negative errno, which
+ * fails the write.
+ */
+typedef int coroutine_fn BackupTopCowFunc(void *opaque, uint64_t offset,
+                                          uint64_t bytes);
+
+/*
+ * Insert a backup-top filter above @source.  All parents of @source are
+ * moved to the filter, and writes to @source that do not go through the
+ * filter are no longer allowed.  Until a function is installed with
+ * bdrv_backup_top_set_cow(), the filter just passes requests through.
+ *
+ * The caller must hold the AioContext lock of @source.
+ */
+BlockDriverState *bdrv_backup_top_append(BlockDriverState *source,
+                                         const char *filter_node_name,
+                                         Error **errp);
+
+/*
+ * Install @cow as the function that saves old data before it is
+ * overwritten, or remove it if @cow is NULL.
+ */
+void bdrv_backup_top_set_cow(BlockDriverState *bs, BackupTopCowFunc *cow,
+                             void *opaque);
+
+/*
+ * Move the parents of the filter back to its source and drop the reference
+ * taken by bdrv_backup_top_append().
+ */
+void bdrv_backup_top_drop(BlockDriverState *bs);
+
+#endif
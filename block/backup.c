@@ -18,15 +18,20 @@
 #include "block/block_int.h"
 #include "block/blockjob_int.h"
 #include "block/block_backup.h"
+#include "block/backup-top.h"
+#include "block/aio_task.h"
 #include "qapi/error.h"
 #include "qapi/qmp/qerror.h"
 #include "qemu/ratelimit.h"
 #include "qemu/cutils.h"
+#include "qemu/units.h"
 #include "sysemu/block-backend.h"
 #include "qemu/bitmap.h"
 #include "qemu/error-report.h"
 
 #define BACKUP_CLUSTER_SIZE_DEFAULT (1 << 16)
+#define BACKUP_MAX_WORKERS_DEFAULT 8
+#define BACKUP_MAX_CHUNK_DEFAULT (1 * MiB)
 
 typedef struct CowRequest {
     int64_t start_byte;
@@ -37,6 +42,8 @@ typedef struct CowRequest {
 
 typedef struct BackupBlockJob {
     BlockJob common;
+    BlockDriverState *source_bs;
+    BlockDriverState *backup_top;
     BlockBackend *target;
 
     BdrvDirtyBitmap *sync_bitmap;
@@ -50,36 +57,40 @@ typedef struct BackupBlockJob {
     uint64_t len;
     uint64_t bytes_read;
     int64_t cluster_size;
-    NotifierWithReturn before_write;
     QLIST_HEAD(, CowRequest) inflight_reqs;
 
     bool use_copy_range;
     int64_t copy_range_size;
 
+    /*
+     * Copies run in up to max_workers coroutines per backup_do_cow() call.
+     * chunk_size is the size of one copy with a bounce buffer; it grows up
+     * to max_chunk while guest writes do not have to wait for background
+     * copies, and shrinks when they do.
+     */
+    int max_workers;
+    int64_t max_chunk;
+    int64_t chunk_size;
+
     BdrvRequestFlags write_flags;
     bool initializing_bitmap;
 } BackupBlockJob;
 
 static const BlockJobDriver backup_job_driver;
 
-/* See if in-flight requests overlap and wait for them to complete */
-static void coroutine_fn wait_for_overlapping_requests(BackupBlockJob *job,
-                                                       int64_t start,
-                                                       int64_t end)
+/* Return an in-flight request that overlaps [start, end), if any */
+static CowRequest *find_overlapping_request(BackupBlockJob *job,
+                                            int64_t start, int64_t end)
 {
     CowRequest *req;
-    bool retry;
 
-    do {
-        retry = false;
-        QLIST_FOREACH(req, &job->inflight_reqs, list) {
-            if (end > req->start_byte && start < req->end_byte) {
-                qemu_co_queue_wait(&req->wait_queue, NULL);
-                retry = true;
-                break;
-            }
+    QLIST_FOREACH(req, &job->inflight_reqs, list) {
+        if (end > req->start_byte && start < req->end_byte) {
+            return req;
         }
-    } while (retry);
+    }
+
+    return NULL;
 }
 
 /* Keep track of an in-flight request */
@@ -99,82 +110,71 @@ static void cow_request_end(CowRequest *req)
     qemu_co_queue_restart_all(&req->wait_queue);
 }
 
-/* Copy range to target with a bounce buffer and return the bytes copied. If
- * error occurred, return a negative error number */
+/* Copy range to target with a bounce buffer. Return 0 or a negative errno */
 static int coroutine_fn backup_cow_with_bounce_buffer(BackupBlockJob *job,
                                                       int64_t start,
                                                       int64_t end,
                                                       bool is_write_notifier,
-                                                      bool *error_is_read,
-                                                      void **bounce_buffer)
+                                                      bool *error_is_read)
 {
-    int ret;
+    int ret = 0;
     BlockBackend *blk = job->common.blk;
-    int nbytes;
     int read_flags = is_write_notifier ? BDRV_REQ_NO_SERIALISING : 0;
+    int64_t buf_size = MIN(end - start, job->max_chunk);
+    void *bounce_buffer;
 
     assert(QEMU_IS_ALIGNED(start, job->cluster_size));
-    bdrv_reset_dirty_bitmap(job->copy_bitmap, start, job->cluster_size);
-    nbytes = MIN(job->cluster_size, job->len - start);
-    if (!*bounce_buffer) {
-        *bounce_buffer = blk_blockalign(blk, job->cluster_size);
+    bounce_buffer = blk_try_blockalign(blk, buf_size);
+    if (!bounce_buffer) {
+        *error_is_read = true;
+        return -ENOMEM;
     }
 
-    ret = blk_co_pread(blk, start, nbytes, *bounce_buffer, read_flags);
-    if (ret < 0) {
-        trace_backup_do_cow_read_fail(job, start, ret);
-        if (error_is_read) {
+    while (start < end) {
+        int nbytes = MIN(buf_size, end - start);
+
+        ret = blk_co_pread(blk, start, nbytes, bounce_buffer, read_flags);
+        if (ret < 0) {
+            trace_backup_do_cow_read_fail(job, start, ret);
             *error_is_read = true;
+            break;
         }
-        goto fail;
-    }
 
-    ret = blk_co_pwrite(job->target, start, nbytes, *bounce_buffer,
-                        job->write_flags);
-    if (ret < 0) {
-        trace_backup_do_cow_write_fail(job, start, ret);
-        if (error_is_read) {
+        ret = blk_co_pwrite(job->target, start, nbytes, bounce_buffer,
+                            job->write_flags);
+        if (ret < 0) {
+            trace_backup_do_cow_write_fail(job, start, ret);
             *error_is_read = false;
+            break;
         }
-        goto fail;
-    }
 
-    return nbytes;
-fail:
-    bdrv_set_dirty_bitmap(job->copy_bitmap, start, job->cluster_size);
-    return ret;
+        start += nbytes;
+    }
 
+    qemu_vfree(bounce_buffer);
+    return ret < 0 ? ret : 0;
 }
 
-/* Copy range to target and return the bytes copied. If error occurred, return a
- * negative error number. */
+/* Copy range to target. Return 0 or a negative errno */
 static int coroutine_fn backup_cow_with_offload(BackupBlockJob *job,
                                                 int64_t start,
                                                 int64_t end,
                                                 bool is_write_notifier)
 {
     int ret;
-    int nr_clusters;
     BlockBackend *blk = job->common.blk;
-    int nbytes;
     int read_flags = is_write_notifier ? BDRV_REQ_NO_SERIALISING : 0;
 
-    assert(QEMU_IS_ALIGNED(job->copy_range_size, job->cluster_size));
     assert(QEMU_IS_ALIGNED(start, job->cluster_size));
-    nbytes = MIN(job->copy_range_size, end - start);
-    nr_clusters = DIV_ROUND_UP(nbytes, job->cluster_size);
-    bdrv_reset_dirty_bitmap(job->copy_bitmap, start,
-                            job->cluster_size * nr_clusters);
-    ret = blk_co_copy_range(blk, start, job->target, start, nbytes,
+    assert(end - start <= job->copy_range_size);
+    ret = blk_co_copy_range(blk, start, job->target, start, end - start,
                             read_flags, job->write_flags);
     if (ret < 0) {
         trace_backup_do_cow_copy_range_fail(job, start, ret);
-        bdrv_set_dirty_bitmap(job->copy_bitmap, start,
-                              job->cluster_size * nr_clusters);
         return ret;
     }
 
-    return nbytes;
+    return 0;
 }
 
 /*
@@ -184,7 +184,7 @@ static int coroutine_fn backup_cow_with_offload(BackupBlockJob *job,
 static int backup_is_cluster_allocated(BackupBlockJob *s, int64_t offset,
                                        int64_t *pnum)
 {
-    BlockDriverState *bs = blk_bs(s->common.blk);
+    BlockDriverState *bs = s->source_bs;
     int64_t count, total_count = 0;
     int64_t bytes = s->len - offset;
     int ret;
@@ -248,15 +248,90 @@ static int64_t backup_bitmap_reset_unallocated(BackupBlockJob *s,
     return ret;
 }
 
+/* State shared by the copies started by one backup_do_cow() call */
+typedef struct BackupCowState {
+    int ret;
+    bool error_is_read;
+} BackupCowState;
+
+typedef struct BackupCowTask {
+    AioTask task;
+    BackupBlockJob *job;
+    BackupCowState *state;
+    CowRequest req;
+    bool is_write_notifier;
+} BackupCowTask;
+
+/*
+ * Copy the clusters claimed by @task->req, which have already been cleared
+ * in the copy bitmap.  On failure they are marked dirty again, so that
+ * whoever waits for the request copies them itself.
+ */
+static int coroutine_fn backup_cow_task_entry(AioTask *task)
+{
+    BackupCowTask *t = container_of(task, BackupCowTask, task);
+    BackupBlockJob *job = t->job;
+    int64_t start = t->req.start_byte;
+    int64_t end = MIN(t->req.end_byte, job->len);
+    bool error_is_read = false;
+    int ret = -ENOTSUP;
+
+    trace_backup_do_cow_process(job, start, end - start);
+
+    if (job->use_copy_range) {
+        ret = backup_cow_with_offload(job, start, end, t->is_write_notifier);
+        if (ret < 0) {
+            job->use_copy_range = false;
+        }
+    }
+    if (ret < 0) {
+        ret = backup_cow_with_bounce_buffer(job, start, end,
+                                            t->is_write_notifier,
+                                            &error_is_read);
+    }
+
+    if (ret < 0) {
+        bdrv_set_dirty_bitmap(job->copy_bitmap, start,
+                              t->req.end_byte - start);
+        job->chunk_size = job->cluster_size;
+        if (!t->state->ret) {
+            t->state->ret = ret;
+            t->state->error_is_read = error_is_read;
+        }
+    } else {
+        /*
+         * Publish progress, guest I/O counts as progress too.  Note that the
+         * offset field is an opaque progress value, it is not a disk offset.
+         */
+        job->bytes_read += end - start;
+        job_progress_update(&job->common.job, end - start);
+        if (!t->is_write_notifier) {
+            job->chunk_size = MIN(job->chunk_size * 2, job->max_chunk);
+        }
+    }
+
+    cow_request_end(&t->req);
+    return ret;
+}
+
+/*
+ * Copy the dirty clusters in [offset, offset + bytes) to the target.
+ *
+ * The copy bitmap is the work queue shared by the background loop and by
+ * guest writes: a range is claimed by clearing its bits and registering it
+ * as an in-flight request, and the claimed ranges are copied by up to
+ * job->max_workers coroutines.  Clusters that somebody else is copying are
+ * waited for, but do not block the copies of other clusters.
+ */
 static int coroutine_fn backup_do_cow(BackupBlockJob *job,
                                       int64_t offset, uint64_t bytes,
                                       bool *error_is_read,
                                       bool is_write_notifier)
 {
-    CowRequest cow_request;
+    BackupCowState state = { 0 };
+    AioTaskPool *aio = NULL;
     int ret = 0;
     int64_t start, end; /* bytes */
-    void *bounce_buffer = NULL;
     int64_t status_bytes;
 
     qemu_co_rwlock_rdlock(&job->flush_rwlock);
@@ -266,67 +341,93 @@ static int coroutine_fn backup_do_cow(BackupBlockJob *job,
 
     trace_backup_do_cow_enter(job, start, offset, bytes);
 
-    wait_for_overlapping_requests(job, start, end);
-    cow_request_begin(&cow_request, job, start, end);
-
-    while (start < end) {
-        int64_t dirty_end;
+    while (start < end && !state.ret) {
+        CowRequest *req;
+        BackupCowTask *task;
+        int64_t dirty_end, chunk;
 
         if (!bdrv_dirty_bitmap_get(job->copy_bitmap, start)) {
+            req = find_overlapping_request(job, start,
+                                           start + job->cluster_size);
+            if (req) {
+                /* Being copied; the bit is set again if that fails */
+                trace_backup_do_cow_wait(job, start);
+                if (is_write_notifier) {
+                    job->chunk_size = MAX(job->chunk_size / 2,
+                                          job->cluster_size);
+                }
+                qemu_co_queue_wait(&req->wait_queue, NULL);
+                continue;
+            }
             trace_backup_do_cow_skip(job, start);
             start += job->cluster_size;
             continue; /* already copied */
         }
 
-        dirty_end = bdrv_dirty_bitmap_next_zero(job->copy_bitmap, start,
-                                                (end - start));
-        if (dirty_end < 0) {
-            dirty_end = end;
-        }
-
         if (job->initializing_bitmap) {
             ret = backup_bitmap_reset_unallocated(job, start, &status_bytes);
+            if (ret < 0) {
+                state.ret = ret;
+                state.error_is_read = true;
+                break;
+            }
             if (ret == 0) {
                 trace_backup_do_cow_skip_range(job, start, status_bytes);
                 start += status_bytes;
                 continue;
             }
-            /* Clamp to known allocated region */
-            dirty_end = MIN(dirty_end, start + status_bytes);
+            if (!bdrv_dirty_bitmap_get(job->copy_bitmap, start)) {
+                /* Claimed by somebody else while we were checking */
+                continue;
+            }
+        } else {
+            status_bytes = end - start;
         }
 
-        trace_backup_do_cow_process(job, start);
-
-        if (job->use_copy_range) {
-            ret = backup_cow_with_offload(job, start, dirty_end,
-                                          is_write_notifier);
-            if (ret < 0) {
-                job->use_copy_range = false;
-            }
+        dirty_end = bdrv_dirty_bitmap_next_zero(job->copy_bitmap, start,
+                                                end - start);
+        if (dirty_end < 0) {
+            dirty_end = end;
         }
-        if (!job->use_copy_range) {
-            ret = backup_cow_with_bounce_buffer(job, start, dirty_end,
-                                                is_write_notifier,
-                                                error_is_read, &bounce_buffer);
+        /* Clamp to known allocated region */
+        dirty_end = MIN(dirty_end, start + status_bytes);
+
+        chunk = job->use_copy_range ? job->copy_range_size : job->chunk_size;
+        chunk = MIN(chunk, dirty_end - start);
+
+        /* Claim the range before anything can yield */
+        task = g_new(BackupCowTask, 1);
+        *task = (BackupCowTask) {
+            .task.func = backup_cow_task_entry,
+            .job = job,
+            .state = &state,
+            .is_write_notifier = is_write_notifier,
+        };
+        bdrv_reset_dirty_bitmap(job->copy_bitmap, start, chunk);
+        cow_request_begin(&task->req, job, start, start + chunk);
+        start += chunk;
+
+        /* The pool is only worth it if there is more than one copy */
+        if (!aio && start < end) {
+            aio = aio_task_pool_new(job->max_workers);
         }
-        if (ret < 0) {
-            break;
+        if (aio) {
+            aio_task_pool_start_task(aio, &task->task);
+        } else {
+            backup_cow_task_entry(&task->task);
+            g_free(task);
         }
-
-        /* Publish progress, guest I/O counts as progress too.  Note that the
-         * offset field is an opaque progress value, it is not a disk offset.
-         */
-        start += ret;
-        job->bytes_read += ret;
-        job_progress_update(&job->common.job, ret);
-        ret = 0;
     }
 
-    if (bounce_buffer) {
-        qemu_vfree(bounce_buffer);
+    if (aio) {
+        aio_task_pool_wait_all(aio);
+        aio_task_pool_free(aio);
     }
 
-    cow_request_end(&cow_request);
+    ret = state.ret;
+    if (ret < 0 && error_is_read) {
+        *error_is_read = state.error_is_read;
+    }
 
     trace_backup_do_cow_return(job, offset, bytes, ret);
 
@@ -335,24 +436,19 @@ static int coroutine_fn backup_do_cow(BackupBlockJob *job,
     return ret;
 }
 
-static int coroutine_fn backup_before_write_notify(
-        NotifierWithReturn *notifier,
-        void *opaque)
+/* Called by the backup-top filter before a guest write changes the source */
+static int coroutine_fn backup_top_cow(void *opaque, uint64_t offset,
+                                       uint64_t bytes)
 {
-    BackupBlockJob *job = container_of(notifier, BackupBlockJob, before_write);
-    BdrvTrackedRequest *req = opaque;
+    BackupBlockJob *job = opaque;
 
-    assert(req->bs == blk_bs(job->common.blk));
-    assert(QEMU_IS_ALIGNED(req->offset, BDRV_SECTOR_SIZE));
-    assert(QEMU_IS_ALIGNED(req->bytes, BDRV_SECTOR_SIZE));
-
-    return backup_do_cow(job, req->offset, req->bytes, NULL, true);
+    return backup_do_cow(job, offset, bytes, NULL, true);
 }
 
 static void backup_cleanup_sync_bitmap(BackupBlockJob *job, int ret)
 {
     BdrvDirtyBitmap *bm;
-    BlockDriverState *bs = blk_bs(job->common.blk);
+    BlockDriverState *bs = job->source_bs;
     bool sync = (((ret == 0) || (job->bitmap_mode == BITMAP_SYNC_MODE_ALWAYS)) \
                  && (job->bitmap_mode != BITMAP_SYNC_MODE_NEVER));
 
@@ -398,16 +494,21 @@ static void backup_abort(Job *job)
 static void backup_clean(Job *job)
 {
     BackupBlockJob *s = container_of(job, BackupBlockJob, common.job);
-    BlockDriverState *bs = blk_bs(s->common.blk);
 
     if (s->copy_bitmap) {
-        bdrv_release_dirty_bitmap(bs, s->copy_bitmap);
+        bdrv_release_dirty_bitmap(s->source_bs, s->copy_bitmap);
         s->copy_bitmap = NULL;
     }
 
-    assert(s->target);
-    blk_unref(s->target);
-    s->target = NULL;
+    if (s->target) {
+        blk_unref(s->target);
+        s->target = NULL;
+    }
+
+    if (s->backup_top) {
+        bdrv_backup_top_drop(s->backup_top);
+        s->backup_top = NULL;
+    }
 }
 
 void backup_do_checkpoint(BlockJob *job, Error **errp)
@@ -482,18 +583,27 @@ static int coroutine_fn backup_loop(BackupBlockJob *job)
 
     bdbi = bdrv_dirty_iter_new(job->copy_bitmap);
     while ((offset = bdrv_dirty_iter_next(bdbi)) != -1) {
+        int64_t bytes;
+
         do {
             if (yield_and_check(job)) {
                 goto out;
             }
-            ret = backup_do_cow(job, offset,
-                                job->cluster_size, &error_is_read, false);
+            /* Give each worker a chunk */
+            bytes = job->use_copy_range ? job->copy_range_size
+                                        : job->chunk_size;
+            bytes = MIN(bytes * job->max_workers, job->len - offset);
+            ret = backup_do_cow(job, offset, bytes, &error_is_read, false);
             if (ret < 0 && backup_error_action(job, error_is_read, -ret) ==
                            BLOCK_ERROR_ACTION_REPORT)
             {
                 goto out;
             }
         } while (ret < 0);
+
+        if (offset + bytes < job->len) {
+            bdrv_set_dirty_iter(bdbi, offset + bytes);
+        }
     }
 
  out:
@@ -529,7 +639,6 @@ static void backup_init_copy_bitmap(BackupBlockJob *job)
 static int coroutine_fn backup_run(Job *job, Error **errp)
 {
     BackupBlockJob *s = container_of(job, BackupBlockJob, common.job);
-    BlockDriverState *bs = blk_bs(s->common.blk);
     int ret = 0;
 
     QLIST_INIT(&s->inflight_reqs);
@@ -537,8 +646,7 @@ static int coroutine_fn backup_run(Job *job, Error **errp)
 
     backup_init_copy_bitmap(s);
 
-    s->before_write.notify = backup_before_write_notify;
-    bdrv_add_before_write_notifier(bs, &s->before_write);
+    bdrv_backup_top_set_cow(s->backup_top, backup_top_cow, s);
 
     if (s->sync_mode == MIRROR_SYNC_MODE_TOP) {
         int64_t offset = 0;
@@ -564,8 +672,10 @@ static int coroutine_fn backup_run(Job *job, Error **errp)
         /* All bits are set in copy_bitmap to allow any cluster to be copied.
          * This does not actually require them to be copied. */
         while (!job_is_cancelled(job)) {
-            /* Yield until the job is cancelled.  We just let our before_write
-             * notify callback service CoW requests. */
+            /*
+             * Yield until the job is cancelled.  We just let the backup-top
+             * filter service CoW requests.
+             */
             job_yield(job);
         }
     } else {
@@ -573,7 +683,7 @@ static int coroutine_fn backup_run(Job *job, Error **errp)
     }
 
  out:
-    notifier_with_return_remove(&s->before_write);
+    bdrv_backup_top_set_cow(s->backup_top, NULL, NULL);
 
     /* wait until pending backup_do_cow() calls have completed */
     qemu_co_rwlock_wrlock(&s->flush_rwlock);
@@ -637,7 +747,8 @@ BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
                   BlockDriverState *target, int64_t speed,
                   MirrorSyncMode sync_mode, BdrvDirtyBitmap *sync_bitmap,
                   BitmapSyncMode bitmap_mode,
-                  bool compress,
+                  bool compress, int max_workers, int64_t max_chunk,
+                  const char *filter_node_name,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   int creation_flags,
@@ -649,6 +760,8 @@ BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
     int ret;
     int64_t cluster_size;
     BdrvDirtyBitmap *copy_bitmap = NULL;
+    BlockDriverState *backup_top = NULL;
+    BdrvRequestFlags write_flags;
 
     assert(bs);
     assert(target);
@@ -674,6 +787,18 @@ BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
         return NULL;
     }
 
+    if (max_workers < 0 || max_workers > 256) {
+        error_setg(errp, "max-workers must be between 1 and 256, "
+                   "or 0 for the default");
+        return NULL;
+    }
+
+    if (max_chunk < 0 || max_chunk > BDRV_REQUEST_MAX_BYTES) {
+        error_setg(errp, "max-chunk must be between 0 and %" PRId64,
+                   (int64_t)BDRV_REQUEST_MAX_BYTES);
+        return NULL;
+    }
+
     if (compress && target->drv->bdrv_co_pwritev_compressed == NULL) {
         error_setg(errp, "Compression is not supported for this drive %s",
                    bdrv_get_device_name(target));
@@ -719,8 +844,26 @@ BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
     }
     bdrv_disable_dirty_bitmap(copy_bitmap);
 
+    /*
+     * Set write flags:
+     * 1. Detect image-fleecing (and similar) schemes
+     * 2. Handle compression
+     */
+    write_flags =
+        (bdrv_chain_contains(target, bs) ? BDRV_REQ_SERIALISING : 0) |
+        (compress ? BDRV_REQ_WRITE_COMPRESSED : 0);
+
+    /*
+     * Guest writes go through this filter from now on; backup_run() makes it
+     * copy the old data first.
+     */
+    backup_top = bdrv_backup_top_append(bs, filter_node_name, errp);
+    if (!backup_top) {
+        goto error;
+    }
+
     /* job->len is fixed, so we can't allow resize */
-    job = block_job_create(job_id, &backup_job_driver, txn, bs,
+    job = block_job_create(job_id, &backup_job_driver, txn, backup_top,
                            BLK_PERM_CONSISTENT_READ,
                            BLK_PERM_CONSISTENT_READ | BLK_PERM_WRITE |
                            BLK_PERM_WRITE_UNCHANGED | BLK_PERM_GRAPH_MOD,
@@ -728,6 +871,17 @@ BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
     if (!job) {
         goto error;
     }
+    job->source_bs = bs;
+    job->backup_top = backup_top;
+    backup_top = NULL;
+
+    ret = block_job_add_bdrv(&job->common, "source", bs, 0,
+                             BLK_PERM_CONSISTENT_READ | BLK_PERM_WRITE |
+                             BLK_PERM_WRITE_UNCHANGED | BLK_PERM_GRAPH_MOD,
+                             errp);
+    if (ret < 0) {
+        goto error;
+    }
 
     /* The target must match the source in size, so no resize here either */
     job->target = blk_new(job->common.job.aio_context,
@@ -745,15 +899,7 @@ BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
     job->sync_mode = sync_mode;
     job->sync_bitmap = sync_bitmap;
     job->bitmap_mode = bitmap_mode;
-
-    /*
-     * Set write flags:
-     * 1. Detect image-fleecing (and similar) schemes
-     * 2. Handle compression
-     */
-    job->write_flags =
-        (bdrv_chain_contains(target, bs) ? BDRV_REQ_SERIALISING : 0) |
-        (compress ? BDRV_REQ_WRITE_COMPRESSED : 0);
+    job->write_flags = write_flags;
 
     job->cluster_size = cluster_size;
     job->copy_bitmap = copy_bitmap;
@@ -764,6 +910,11 @@ BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
     job->copy_range_size = MAX(job->cluster_size,
                                QEMU_ALIGN_UP(job->copy_range_size,
                                              job->cluster_size));
+    job->max_workers = max_workers ?: BACKUP_MAX_WORKERS_DEFAULT;
+    job->max_chunk = MAX(job->cluster_size,
+                         QEMU_ALIGN_DOWN(max_chunk ?: BACKUP_MAX_CHUNK_DEFAULT,
+                                         job->cluster_size));
+    job->chunk_size = job->cluster_size;
 
     /* Required permissions are already taken with target's blk_new() */
     block_job_add_bdrv(&job->common, "target", target, 0, BLK_PERM_ALL,
@@ -783,6 +934,8 @@ BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
     if (job) {
         backup_clean(&job->common.job);
         job_early_fail(&job->common.job);
+    } else if (backup_top) {
+        bdrv_backup_top_drop(backup_top);
     }
 
     return NULL;
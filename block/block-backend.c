@@ -1151,6 +1151,8 @@ int coroutine_fn blk_co_preadv(BlockBackend *blk, int64_t offset,
 {
     int ret;
     BlockDriverState *bs;
+    int64_t submit_time_ns = block_acct_time_ns();
+    int64_t dispatch_time_ns;
 
     blk_wait_while_drained(blk);
 
@@ -1171,7 +1173,10 @@ int coroutine_fn blk_co_preadv(BlockBackend *blk, int64_t offset,
                 bytes, false);
     }
 
+    dispatch_time_ns = block_acct_time_ns();
     ret = bdrv_co_preadv(blk->root, offset, bytes, qiov, flags);
+    block_acct_request_done(&blk->stats, BLOCK_ACCT_READ,
+                            submit_time_ns, dispatch_time_ns);
     bdrv_dec_in_flight(bs);
     return ret;
 }
@@ -1182,6 +1187,8 @@ int coroutine_fn blk_co_pwritev(BlockBackend *blk, int64_t offset,
 {
     int ret;
     BlockDriverState *bs;
+    int64_t submit_time_ns = block_acct_time_ns();
+    int64_t dispatch_time_ns;
 
     blk_wait_while_drained(blk);
 
@@ -1205,7 +1212,10 @@ int coroutine_fn blk_co_pwritev(BlockBackend *blk, int64_t offset,
         flags |= BDRV_REQ_FUA;
     }
 
+    dispatch_time_ns = block_acct_time_ns();
     ret = bdrv_co_pwritev(blk->root, offset, bytes, qiov, flags);
+    block_acct_request_done(&blk->stats, BLOCK_ACCT_WRITE,
+                            submit_time_ns, dispatch_time_ns);
     bdrv_dec_in_flight(bs);
     return ret;
 }
@@ -1576,13 +1586,21 @@ int blk_co_pdiscard(BlockBackend *blk, int64_t offset, int bytes)
 
 int blk_co_flush(BlockBackend *blk)
 {
+    int64_t submit_time_ns = block_acct_time_ns();
+    int64_t dispatch_time_ns;
+    int ret;
+
     blk_wait_while_drained(blk);
 
     if (!blk_is_available(blk)) {
         return -ENOMEDIUM;
     }
 
-    return bdrv_co_flush(blk_bs(blk));
+    dispatch_time_ns = block_acct_time_ns();
+    ret = bdrv_co_flush(blk_bs(blk));
+    block_acct_request_done(&blk->stats, BLOCK_ACCT_FLUSH,
+                            submit_time_ns, dispatch_time_ns);
+    return ret;
 }
 
 static void blk_flush_entry(void *opaque)
@@ -2201,6 +2219,11 @@ void blk_set_io_limits(BlockBackend *blk, ThrottleConfig *cfg)
     throttle_group_config(&blk->public.throttle_group_member, cfg);
 }
 
+void blk_set_io_limits_weight(BlockBackend *blk, unsigned weight)
+{
+    throttle_group_set_weight(&blk->public.throttle_group_member, weight);
+}
+
 void blk_io_limits_disable(BlockBackend *blk)
 {
     BlockDriverState *bs = blk_bs(blk);
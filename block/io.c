@@ -649,6 +649,17 @@ void bdrv_drain_all(void)
     bdrv_drain_all_end();
 }
 
+/* Add the latency of a completed request to the histogram of @type */
+static void bdrv_account_latency(BlockDriverState *bs, enum BlockAcctType type,
+                                 int64_t start_time_ns)
+{
+    int64_t latency_ns = block_acct_time_ns() - start_time_ns;
+
+    qemu_mutex_lock(&bs->latency_lock);
+    block_latency_log_histogram_account(&bs->latency[type], latency_ns);
+    qemu_mutex_unlock(&bs->latency_lock);
+}
+
 /**
  * Remove an active request from the tracked requests list
  *
@@ -656,6 +667,12 @@ void bdrv_drain_all(void)
  */
 static void tracked_request_end(BdrvTrackedRequest *req)
 {
+    if (req->type == BDRV_TRACKED_READ) {
+        bdrv_account_latency(req->bs, BLOCK_ACCT_READ, req->start_time_ns);
+    } else if (req->type == BDRV_TRACKED_WRITE) {
+        bdrv_account_latency(req->bs, BLOCK_ACCT_WRITE, req->start_time_ns);
+    }
+
     if (req->serialising) {
         atomic_dec(&req->bs->serialising_in_flight);
     }
@@ -686,6 +703,7 @@ static void tracked_request_begin(BdrvTrackedRequest *req,
         .serialising    = false,
         .overlap_offset = offset,
         .overlap_bytes  = bytes,
+        .start_time_ns  = block_acct_time_ns(),
     };
 
     qemu_co_queue_init(&req->wait_queue);
@@ -2580,6 +2598,7 @@ int coroutine_fn bdrv_co_flush(BlockDriverState *bs)
 {
     int current_gen;
     int ret = 0;
+    int64_t start_time_ns = block_acct_time_ns();
 
     bdrv_inc_in_flight(bs);
 
@@ -2683,6 +2702,8 @@ out:
     qemu_co_queue_next(&bs->flush_queue);
     qemu_co_mutex_unlock(&bs->reqs_lock);
 
+    bdrv_account_latency(bs, BLOCK_ACCT_FLUSH, start_time_ns);
+
 early_exit:
     bdrv_dec_in_flight(bs);
     return ret;
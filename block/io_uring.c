@@ -0,0 +1,640 @@
+/*
+ * Linux io_uring support.
+ *
+ * Requests are queued in a ring shared with the kernel and completions
+ * are reaped from the AioContext, either when the ring file descriptor
+ * becomes readable or while aio_poll() busy-polls the completion queue.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include <liburing.h>
+#include "block/aio.h"
+#include "qemu/queue.h"
+#include "block/block.h"
+#include "block/raw-aio.h"
+#include "qemu/coroutine.h"
+#include "qapi/error.h"
+#include "trace.h"
+
+/* io_uring ring size */
+#define MAX_ENTRIES 128
+
+/* Number of slots in the table of registered files */
+#define MAX_FIXED_FILES 16
+
+/* Maximum number of registered buffers */
+#define MAX_FIXED_BUFS 16
+
+typedef struct LuringAIOCB {
+    Coroutine *co;
+    struct io_uring_sqe sqeq;
+    ssize_t ret;
+    QEMUIOVector *qiov;
+    bool is_read;
+    QSIMPLEQ_ENTRY(LuringAIOCB) next;
+
+    /*
+     * Buffered reads may require resubmission, see
+     * luring_resubmit_short_read().
+     */
+    int total_read;
+    QEMUIOVector resubmit_qiov;
+} LuringAIOCB;
+
+typedef struct LuringQueue {
+    int plugged;
+    unsigned int in_queue;
+    unsigned int in_flight;
+    bool blocked;
+    QSIMPLEQ_HEAD(, LuringAIOCB) submit_queue;
+} LuringQueue;
+
+struct LuringState {
+    AioContext *aio_context;
+
+    struct io_uring ring;
+
+    /*
+     * Files registered with the ring, indexed by slot, -1 for a free slot.
+     * NULL if the kernel cannot update the table.  A file is identified by
+     * its owner and its fd, since the fd number alone may be reused for
+     * another file by someone else.
+     */
+    int *fixed_fds;
+    void *fixed_owners[MAX_FIXED_FILES];
+
+    /*
+     * Buffers registered with bdrv_register_buf(), indexed by slot, with a
+     * NULL iov_base for a free slot.
+     */
+    struct iovec fixed_bufs[MAX_FIXED_BUFS];
+    /* whether the kernel table is sparse and updated one slot at a time */
+    bool bufs_sparse;
+    /* otherwise, the used slots come first and are registered together */
+    int nr_fixed_bufs;
+    bool bufs_registered;
+
+    /* io queue for submit at batch.  Protected by AioContext lock. */
+    LuringQueue io_q;
+
+    /* I/O completion processing.  Only runs in I/O thread.  */
+    QEMUBH *completion_bh;
+};
+
+static void ioq_submit(LuringState *s);
+
+/**
+ * luring_resubmit:
+ *
+ * Resubmit a request by appending it to submit_queue.  The caller must ensure
+ * that ioq_submit() is called later so that submit_queue requests are started.
+ */
+static void luring_resubmit(LuringState *s, LuringAIOCB *luringcb)
+{
+    QSIMPLEQ_INSERT_TAIL(&s->io_q.submit_queue, luringcb, next);
+    s->io_q.in_queue++;
+}
+
+/**
+ * luring_resubmit_short_read:
+ *
+ * Buffered reads can complete short when only the start of the range is
+ * in the page cache, so read the rest with a new request.  Older kernels
+ * do that, newer ones punt such reads to a worker instead.
+ */
+static void luring_resubmit_short_read(LuringState *s, LuringAIOCB *luringcb,
+                                       int nread)
+{
+    QEMUIOVector *resubmit_qiov;
+    size_t remaining;
+
+    trace_luring_resubmit_short_read(s, luringcb, nread);
+
+    /* Update read position */
+    luringcb->total_read += nread;
+    remaining = luringcb->qiov->size - luringcb->total_read;
+
+    /* Update sqe */
+    luringcb->sqeq.off += nread;
+    if (luringcb->sqeq.opcode == IORING_OP_READ_FIXED) {
+        /* A single buffer, no need to shorten the qiov */
+        luringcb->sqeq.addr += nread;
+        luringcb->sqeq.len = remaining;
+    } else {
+        /* Shorten qiov */
+        resubmit_qiov = &luringcb->resubmit_qiov;
+        if (resubmit_qiov->iov == NULL) {
+            qemu_iovec_init(resubmit_qiov, luringcb->qiov->niov);
+        } else {
+            qemu_iovec_reset(resubmit_qiov);
+        }
+        qemu_iovec_concat(resubmit_qiov, luringcb->qiov, luringcb->total_read,
+                          remaining);
+
+        luringcb->sqeq.addr = (__u64)(uintptr_t)resubmit_qiov->iov;
+        luringcb->sqeq.len = resubmit_qiov->niov;
+    }
+
+    luring_resubmit(s, luringcb);
+}
+
+/**
+ * luring_process_completions:
+ * @s: AIO state
+ *
+ * Fetches completed I/O requests, consumes cqes and invokes their callbacks.
+ * The function is somewhat tricky because it supports nested event loops, for
+ * example when a request callback invokes aio_poll().
+ *
+ * Function schedules BH completion so it can be called again in a nested
+ * event loop.  When there are no events left to complete the BH is being
+ * canceled.
+ */
+static void luring_process_completions(LuringState *s)
+{
+    struct io_uring_cqe *cqe;
+
+    /* Reschedule so nested event loops see currently pending completions */
+    qemu_bh_schedule(s->completion_bh);
+
+    while (io_uring_peek_cqe(&s->ring, &cqe) == 0 && cqe) {
+        LuringAIOCB *luringcb = io_uring_cqe_get_data(cqe);
+        int ret = cqe->res;
+        int total_bytes;
+
+        io_uring_cqe_seen(&s->ring, cqe);
+
+        /* Change counters one-by-one because we can be nested. */
+        s->io_q.in_flight--;
+        trace_luring_process_completion(s, luringcb, ret);
+
+        if (ret == -EINTR) {
+            luring_resubmit(s, luringcb);
+            continue;
+        }
+
+        /* total_read is non-zero only for resubmitted read requests */
+        total_bytes = ret + luringcb->total_read;
+
+        if (ret < 0 || !luringcb->qiov) {
+            /* Errors and flushes are passed through */
+        } else if (total_bytes == luringcb->qiov->size) {
+            ret = 0;
+        } else if (!luringcb->is_read) {
+            ret = -ENOSPC;
+        } else if (ret > 0) {
+            luring_resubmit_short_read(s, luringcb, ret);
+            continue;
+        } else {
+            /* Short reads mean EOF, pad with zeros. */
+            qemu_iovec_memset(luringcb->qiov, total_bytes, 0,
+                              luringcb->qiov->size - total_bytes);
+            ret = 0;
+        }
+
+        luringcb->ret = ret;
+        if (luringcb->resubmit_qiov.iov) {
+            qemu_iovec_destroy(&luringcb->resubmit_qiov);
+        }
+
+        /*
+         * If the coroutine is already entered it must be in ioq_submit()
+         * and will notice luringcb->ret has been filled in when it
+         * eventually runs later.  Coroutines cannot be entered recursively
+         * so avoid doing that!
+         */
+        if (!qemu_coroutine_entered(luringcb->co)) {
+            aio_co_wake(luringcb->co);
+        }
+    }
+
+    qemu_bh_cancel(s->completion_bh);
+}
+
+static void ioq_submit(LuringState *s)
+{
+    LuringAIOCB *luringcb, *luringcb_next;
+    int ret;
+
+    while (s->io_q.in_queue > 0) {
+        /*
+         * Move as many queued requests as fit into the submission ring,
+         * the rest waits for completions to make room.
+         */
+        QSIMPLEQ_FOREACH_SAFE(luringcb, &s->io_q.submit_queue, next,
+                              luringcb_next) {
+            struct io_uring_sqe *sqe = io_uring_get_sqe(&s->ring);
+            if (!sqe) {
+                break;
+            }
+            *sqe = luringcb->sqeq;
+            QSIMPLEQ_REMOVE_HEAD(&s->io_q.submit_queue, next);
+        }
+
+        ret = io_uring_submit(&s->ring);
+        trace_luring_io_uring_submit(s, ret);
+        if (ret == -EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            /*
+             * The sqes stay in the ring and go with the next submission,
+             * which happens as soon as a request completes.
+             */
+            break;
+        }
+        s->io_q.in_flight += ret;
+        s->io_q.in_queue  -= ret;
+    }
+    s->io_q.blocked = (s->io_q.in_queue > 0);
+
+    if (s->io_q.in_flight) {
+        /*
+         * We can try to complete something just right away if there are
+         * still requests in-flight.
+         */
+        luring_process_completions(s);
+    }
+}
+
+static void luring_process_completions_and_submit(LuringState *s)
+{
+    aio_context_acquire(s->aio_context);
+    luring_process_completions(s);
+
+    if (!s->io_q.plugged && s->io_q.in_queue > 0) {
+        ioq_submit(s);
+    }
+    aio_context_release(s->aio_context);
+}
+
+static void qemu_luring_completion_bh(void *opaque)
+{
+    LuringState *s = opaque;
+
+    luring_process_completions_and_submit(s);
+}
+
+static void qemu_luring_completion_cb(void *opaque)
+{
+    LuringState *s = opaque;
+
+    luring_process_completions_and_submit(s);
+}
+
+static bool qemu_luring_poll_cb(void *opaque)
+{
+    LuringState *s = opaque;
+
+    if (!io_uring_cq_ready(&s->ring)) {
+        return false;
+    }
+
+    luring_process_completions_and_submit(s);
+    return true;
+}
+
+static void ioq_init(LuringQueue *io_q)
+{
+    QSIMPLEQ_INIT(&io_q->submit_queue);
+    io_q->plugged = 0;
+    io_q->in_queue = 0;
+    io_q->in_flight = 0;
+    io_q->blocked = false;
+}
+
+void luring_io_plug(BlockDriverState *bs, LuringState *s)
+{
+    trace_luring_io_plug(s);
+    s->io_q.plugged++;
+}
+
+void luring_io_unplug(BlockDriverState *bs, LuringState *s)
+{
+    assert(s->io_q.plugged);
+    trace_luring_io_unplug(s, s->io_q.blocked, s->io_q.plugged,
+                           s->io_q.in_queue, s->io_q.in_flight);
+    if (--s->io_q.plugged == 0 &&
+        !s->io_q.blocked && s->io_q.in_queue > 0) {
+        ioq_submit(s);
+    }
+}
+
+/*
+ * Return the slot of @fd of @owner in the registered files, registering it
+ * on first use, or -1 if it cannot be registered.
+ */
+static int luring_fixed_file(LuringState *s, void *owner, int fd)
+{
+    int i, free_slot = -1;
+
+    if (!s->fixed_fds) {
+        return -1;
+    }
+
+    for (i = 0; i < MAX_FIXED_FILES; i++) {
+        if (s->fixed_fds[i] == fd && s->fixed_owners[i] == owner) {
+            return i;
+        }
+        if (s->fixed_fds[i] == -1 && free_slot == -1) {
+            free_slot = i;
+        }
+    }
+
+    if (free_slot == -1 ||
+        io_uring_register_files_update(&s->ring, free_slot, &fd, 1) != 1) {
+        return -1;
+    }
+    trace_luring_register_fd(s, fd, free_slot);
+    s->fixed_fds[free_slot] = fd;
+    s->fixed_owners[free_slot] = owner;
+    return free_slot;
+}
+
+/**
+ * luring_unregister_fd:
+ * @s: AIO state
+ * @owner: the owner of @fd, as passed to luring_co_submit()
+ * @fd: file descriptor about to be closed
+ *
+ * Drop @fd from the registered files, if it was used for requests on @s.
+ * Must be called with no request in flight on @fd and before closing it,
+ * otherwise the slot would keep a reference to the old file.
+ */
+void luring_unregister_fd(LuringState *s, void *owner, int fd)
+{
+    int i, none = -1;
+
+    if (!s->fixed_fds || fd < 0) {
+        return;
+    }
+
+    for (i = 0; i < MAX_FIXED_FILES; i++) {
+        if (s->fixed_fds[i] == fd && s->fixed_owners[i] == owner) {
+            trace_luring_unregister_fd(s, fd, i);
+            io_uring_register_files_update(&s->ring, i, &none, 1);
+            s->fixed_fds[i] = -1;
+            s->fixed_owners[i] = NULL;
+            return;
+        }
+    }
+}
+
+/* Make the kernel table match fixed_bufs after @slot was changed */
+static void luring_update_bufs(LuringState *s, int slot)
+{
+    int ret;
+
+#ifdef CONFIG_LINUX_IO_URING_BUF_UPDATE
+    if (s->bufs_sparse) {
+        ret = io_uring_register_buffers_update_tag(&s->ring, slot,
+                                                   &s->fixed_bufs[slot],
+                                                   NULL, 1);
+        trace_luring_update_buf(s, slot, ret);
+        if (ret != 1) {
+            /* Pinning the memory may exceed RLIMIT_MEMLOCK */
+            s->fixed_bufs[slot] = (struct iovec) { 0 };
+        }
+        return;
+    }
+#endif
+
+    if (s->bufs_registered) {
+        io_uring_unregister_buffers(&s->ring);
+        s->bufs_registered = false;
+    }
+    if (!s->nr_fixed_bufs) {
+        return;
+    }
+
+    /* Pinning the memory may exceed RLIMIT_MEMLOCK, just do without then */
+    ret = io_uring_register_buffers(&s->ring, s->fixed_bufs, s->nr_fixed_bufs);
+    trace_luring_update_bufs(s, s->nr_fixed_bufs, ret);
+    s->bufs_registered = (ret == 0);
+}
+
+/**
+ * luring_register_buf:
+ * @s: AIO state
+ * @host: start of the buffer
+ * @size: size of the buffer
+ *
+ * Register a buffer that is going to be used for many requests, so that
+ * requests with a single element completely inside of it use the fixed
+ * read and write operations and skip mapping the pages each time.
+ *
+ * If the kernel supports sparse buffer tables, only the slot of the buffer
+ * is updated.  Otherwise the whole table is registered again, which must
+ * happen while there are no queued requests on @s.
+ */
+void luring_register_buf(LuringState *s, void *host, size_t size)
+{
+    int i;
+
+    for (i = 0; i < MAX_FIXED_BUFS; i++) {
+        if (!s->fixed_bufs[i].iov_base) {
+            break;
+        }
+    }
+    if (i == MAX_FIXED_BUFS) {
+        return;
+    }
+
+    s->fixed_bufs[i] = (struct iovec) {
+        .iov_base = host,
+        .iov_len = size,
+    };
+    if (!s->bufs_sparse) {
+        s->nr_fixed_bufs++;
+    }
+    luring_update_bufs(s, i);
+}
+
+void luring_unregister_buf(LuringState *s, void *host)
+{
+    int i;
+
+    for (i = 0; i < MAX_FIXED_BUFS; i++) {
+        if (s->fixed_bufs[i].iov_base == host) {
+            break;
+        }
+    }
+    if (i == MAX_FIXED_BUFS) {
+        return;
+    }
+
+    if (s->bufs_sparse) {
+        s->fixed_bufs[i] = (struct iovec) { 0 };
+    } else {
+        /* Keep the used slots first */
+        s->fixed_bufs[i] = s->fixed_bufs[--s->nr_fixed_bufs];
+        s->fixed_bufs[s->nr_fixed_bufs] = (struct iovec) { 0 };
+    }
+    luring_update_bufs(s, i);
+}
+
+/* Return the registered buffer containing all of @qiov, or -1 */
+static int luring_fixed_buf(LuringState *s, QEMUIOVector *qiov)
+{
+    uintptr_t start, end;
+    int i;
+
+    if (!(s->bufs_sparse || s->bufs_registered) || qiov->niov != 1) {
+        return -1;
+    }
+
+    start = (uintptr_t)qiov->iov[0].iov_base;
+    end = start + qiov->iov[0].iov_len;
+    for (i = 0; i < MAX_FIXED_BUFS; i++) {
+        uintptr_t buf = (uintptr_t)s->fixed_bufs[i].iov_base;
+
+        if (buf && start >= buf && end <= buf + s->fixed_bufs[i].iov_len) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int luring_do_submit(void *owner, int fd, LuringAIOCB *luringcb,
+                            LuringState *s, uint64_t offset, int type)
+{
+    struct io_uring_sqe *sqe = &luringcb->sqeq;
+    QEMUIOVector *qiov = luringcb->qiov;
+    int slot, buf;
+
+    switch (type) {
+    case QEMU_AIO_WRITE:
+        buf = luring_fixed_buf(s, qiov);
+        if (buf >= 0) {
+            io_uring_prep_write_fixed(sqe, fd, qiov->iov[0].iov_base,
+                                      qiov->iov[0].iov_len, offset, buf);
+        } else {
+            io_uring_prep_writev(sqe, fd, qiov->iov, qiov->niov, offset);
+        }
+        break;
+    case QEMU_AIO_READ:
+        buf = luring_fixed_buf(s, qiov);
+        if (buf >= 0) {
+            io_uring_prep_read_fixed(sqe, fd, qiov->iov[0].iov_base,
+                                     qiov->iov[0].iov_len, offset, buf);
+        } else {
+            io_uring_prep_readv(sqe, fd, qiov->iov, qiov->niov, offset);
+        }
+        break;
+    case QEMU_AIO_FLUSH:
+        io_uring_prep_fsync(sqe, fd, IORING_FSYNC_DATASYNC);
+        break;
+    default:
+        fprintf(stderr, "%s: invalid AIO request type 0x%x.\n",
+                        __func__, type);
+        return -EIO;
+    }
+
+    slot = luring_fixed_file(s, owner, fd);
+    if (slot >= 0) {
+        sqe->fd = slot;
+        sqe->flags |= IOSQE_FIXED_FILE;
+    }
+    io_uring_sqe_set_data(sqe, luringcb);
+
+    QSIMPLEQ_INSERT_TAIL(&s->io_q.submit_queue, luringcb, next);
+    s->io_q.in_queue++;
+    trace_luring_do_submit(s, s->io_q.blocked, s->io_q.plugged,
+                           s->io_q.in_queue, s->io_q.in_flight);
+    if (!s->io_q.blocked &&
+        (!s->io_q.plugged ||
+         s->io_q.in_flight + s->io_q.in_queue >= MAX_ENTRIES)) {
+        ioq_submit(s);
+    }
+
+    return 0;
+}
+
+int coroutine_fn luring_co_submit(BlockDriverState *bs, LuringState *s, int fd,
+                                  uint64_t offset, QEMUIOVector *qiov, int type)
+{
+    int ret;
+    LuringAIOCB luringcb = {
+        .co         = qemu_coroutine_self(),
+        .ret        = -EINPROGRESS,
+        .qiov       = qiov,
+        .is_read    = (type == QEMU_AIO_READ),
+    };
+
+    trace_luring_co_submit(bs, s, &luringcb, fd, offset,
+                           qiov ? qiov->size : 0, type);
+    ret = luring_do_submit(bs, fd, &luringcb, s, offset, type);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (luringcb.ret == -EINPROGRESS) {
+        qemu_coroutine_yield();
+    }
+    return luringcb.ret;
+}
+
+void luring_detach_aio_context(LuringState *s, AioContext *old_context)
+{
+    aio_set_fd_handler(old_context, s->ring.ring_fd, false,
+                       NULL, NULL, NULL, s);
+    qemu_bh_delete(s->completion_bh);
+    s->aio_context = NULL;
+}
+
+void luring_attach_aio_context(LuringState *s, AioContext *new_context)
+{
+    s->aio_context = new_context;
+    s->completion_bh = aio_bh_new(new_context, qemu_luring_completion_bh, s);
+    aio_set_fd_handler(s->aio_context, s->ring.ring_fd, false,
+                       qemu_luring_completion_cb, NULL,
+                       qemu_luring_poll_cb, s);
+}
+
+LuringState *luring_init(Error **errp)
+{
+    int rc, i;
+    LuringState *s;
+
+    s = g_new0(LuringState, 1);
+    rc = io_uring_queue_init(MAX_ENTRIES, &s->ring, 0);
+    if (rc < 0) {
+        error_setg_errno(errp, -rc, "failed to init linux io_uring ring");
+        g_free(s);
+        return NULL;
+    }
+
+    ioq_init(&s->io_q);
+
+    /*
+     * Registered files save the kernel a lookup of the file per request.
+     * The table is sparse and filled on demand, which needs Linux 5.5.
+     */
+    s->fixed_fds = g_new(int, MAX_FIXED_FILES);
+    for (i = 0; i < MAX_FIXED_FILES; i++) {
+        s->fixed_fds[i] = -1;
+    }
+    if (io_uring_register_files(&s->ring, s->fixed_fds, MAX_FIXED_FILES) < 0) {
+        g_free(s->fixed_fds);
+        s->fixed_fds = NULL;
+    }
+
+#ifdef CONFIG_LINUX_IO_URING_BUF_UPDATE
+    /* An empty sparse table can be filled slot by slot, since Linux 5.19 */
+    s->bufs_sparse = io_uring_register_buffers_sparse(&s->ring,
+                                                      MAX_FIXED_BUFS) == 0;
+#endif
+
+    trace_luring_init_state(s, s->fixed_fds != NULL);
+    return s;
+}
+
+void luring_cleanup(LuringState *s)
+{
+    io_uring_queue_exit(&s->ring);
+    trace_luring_cleanup_state(s);
+    g_free(s->fixed_fds);
+    g_free(s);
+}
@@ -28,6 +28,15 @@
 #define MAX_IO_BYTES (1 << 20) /* 1 Mb */
 #define DEFAULT_MIRROR_BUF_SIZE (MAX_IN_FLIGHT * MAX_IO_BYTES)
 
+/* Bounds for the adaptive in-flight depth and chunk size */
+#define MAX_IN_FLIGHT_LIMIT 64
+#define MIN_IO_BYTES (64 * 1024)
+
+/* Interval between two adjustments of the I/O parameters */
+#define MIRROR_ADAPT_PERIOD_NS (200 * SCALE_MS)
+/* A chunk should take about this long to write at the measured throughput */
+#define MIRROR_CHUNK_TIME_NS (20 * SCALE_MS)
+
 /* The mirroring buffer is a list of granularity-sized chunks.
  * Free chunks are organized in a list.
  */
@@ -79,6 +88,25 @@ typedef struct MirrorBlockJob {
     bool unmap;
     int target_cluster_size;
     int max_iov;
+
+    /*
+     * Copies are split into chunks of at most max_io_bytes, and at most
+     * max_in_flight operations are started at a time.  Both are adjusted
+     * by mirror_adapt() from the throughput and write latency of the
+     * target, measured over periods of MIRROR_ADAPT_PERIOD_NS.
+     */
+    int max_in_flight;
+    int64_t max_io_bytes;
+    int64_t min_io_bytes;
+    int64_t period_start_ns;
+    uint64_t period_bytes;
+    uint64_t period_ops;
+    uint64_t period_latency_ns;
+    /* Lowest average write latency seen for the current chunk size */
+    uint64_t min_latency_ns;
+    /* Moving average of the target throughput, in bytes per second */
+    uint64_t throughput;
+
     bool initial_zeroing_ongoing;
     int in_active_write_counter;
     bool prepared;
@@ -216,9 +244,68 @@ static void coroutine_fn mirror_write_complete(MirrorOp *op, int ret)
     mirror_iteration_done(op, ret);
 }
 
+/*
+ * Account a completed copy of @bytes that took @latency_ns to write, and
+ * once per period derive new I/O parameters from the measurements:
+ *
+ * - the in-flight depth grows by one while the average write latency stays
+ *   close to the lowest one seen, i.e. while the target does not queue our
+ *   requests, and is halved when the latency shows that it does;
+ *
+ * - the chunk size follows the throughput, so that a chunk takes about
+ *   MIRROR_CHUNK_TIME_NS to write.  It changes by powers of two, and every
+ *   change resets the latency baseline because larger chunks take longer.
+ */
+static void mirror_adapt(MirrorBlockJob *s, uint64_t bytes, int64_t latency_ns)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int64_t elapsed = now - s->period_start_ns;
+    uint64_t avg_latency, rate;
+    int64_t io_bytes;
+
+    s->period_bytes += bytes;
+    s->period_latency_ns += latency_ns;
+    s->period_ops++;
+    if (elapsed < MIRROR_ADAPT_PERIOD_NS) {
+        return;
+    }
+
+    rate = (double)s->period_bytes * NANOSECONDS_PER_SECOND / elapsed;
+    s->throughput = s->throughput ? (3 * s->throughput + rate) / 4 : rate;
+
+    avg_latency = s->period_latency_ns / s->period_ops;
+    if (!s->min_latency_ns || avg_latency < s->min_latency_ns) {
+        s->min_latency_ns = avg_latency;
+    }
+    if (avg_latency <= 2 * s->min_latency_ns) {
+        s->max_in_flight = MIN(s->max_in_flight + 1, MAX_IN_FLIGHT_LIMIT);
+    } else if (avg_latency >= 4 * s->min_latency_ns) {
+        s->max_in_flight = MAX(s->max_in_flight / 2, 1);
+    }
+    /* Let the baseline age, so that it follows a target that gets slower */
+    s->min_latency_ns += s->min_latency_ns / 16;
+
+    io_bytes = s->throughput * MIRROR_CHUNK_TIME_NS / NANOSECONDS_PER_SECOND;
+    io_bytes = MIN(MAX(io_bytes, s->min_io_bytes), s->buf_size);
+    io_bytes = MAX(pow2floor(io_bytes), s->min_io_bytes);
+    if (io_bytes != s->max_io_bytes) {
+        s->max_io_bytes = io_bytes;
+        s->min_latency_ns = 0;
+    }
+
+    trace_mirror_adapt(s, s->throughput, avg_latency, s->max_in_flight,
+                       s->max_io_bytes);
+
+    s->period_start_ns = now;
+    s->period_bytes = 0;
+    s->period_ops = 0;
+    s->period_latency_ns = 0;
+}
+
 static void coroutine_fn mirror_read_complete(MirrorOp *op, int ret)
 {
     MirrorBlockJob *s = op->s;
+    int64_t start_ns;
 
     if (ret < 0) {
         BlockErrorAction action;
@@ -233,7 +320,12 @@ static void coroutine_fn mirror_read_complete(MirrorOp *op, int ret)
         return;
     }
 
+    start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     ret = blk_co_pwritev(s->target, op->offset, op->qiov.size, &op->qiov, 0);
+    if (ret >= 0) {
+        mirror_adapt(s, op->qiov.size,
+                     qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start_ns);
+    }
     mirror_write_complete(op, ret);
 }
 
@@ -449,12 +541,12 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
 {
     BlockDriverState *source = s->mirror_top_bs->backing->bs;
     MirrorOp *pseudo_op;
-    int64_t offset;
+    int64_t offset, end, max_end, in_flight_chunk;
     uint64_t delay_ns = 0, ret = 0;
-    /* At least the first dirty chunk is mirrored in one iteration. */
-    int nb_chunks = 1;
+    int nb_chunks;
     bool write_zeroes_ok = bdrv_can_write_zeroes_with_unmap(blk_bs(s->target));
-    int max_io_bytes = MAX(s->buf_size / MAX_IN_FLIGHT, MAX_IO_BYTES);
+    int64_t status_end = 0;
+    int status_ret = 0;
 
     bdrv_dirty_bitmap_lock(s->dirty_bitmap);
     offset = bdrv_dirty_iter_next(s->dbi);
@@ -470,29 +562,32 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
 
     job_pause_point(&s->common.job);
 
-    /* Find the number of consective dirty chunks following the first dirty
-     * one, and wait for in flight requests in them. */
+    /*
+     * Merge the dirty chunks following the first dirty one, up to the
+     * first clean or in-flight chunk, in a single scan of the bitmaps.
+     */
     bdrv_dirty_bitmap_lock(s->dirty_bitmap);
-    while (nb_chunks * s->granularity < s->buf_size) {
-        int64_t next_dirty;
-        int64_t next_offset = offset + nb_chunks * s->granularity;
-        int64_t next_chunk = next_offset / s->granularity;
-        if (next_offset >= s->bdev_length ||
-            !bdrv_dirty_bitmap_get_locked(s->dirty_bitmap, next_offset)) {
-            break;
-        }
-        if (test_bit(next_chunk, s->in_flight_bitmap)) {
-            break;
-        }
+    max_end = MIN(offset + s->buf_size, s->bdev_length);
+    end = bdrv_dirty_bitmap_next_zero(s->dirty_bitmap, offset,
+                                      max_end - offset);
+    if (end < 0) {
+        end = max_end;
+    }
+    in_flight_chunk = find_next_bit(s->in_flight_bitmap,
+                                    DIV_ROUND_UP(end, s->granularity),
+                                    offset / s->granularity + 1);
+    end = MIN(end, in_flight_chunk * s->granularity);
+    /* At least the first dirty chunk is mirrored in one iteration. */
+    nb_chunks = MAX(DIV_ROUND_UP(end - offset, s->granularity), 1);
 
-        next_dirty = bdrv_dirty_iter_next(s->dbi);
-        if (next_dirty > next_offset || next_dirty < 0) {
-            /* The bitmap iterator's cache is stale, refresh it */
-            bdrv_set_dirty_iter(s->dbi, next_offset);
-            next_dirty = bdrv_dirty_iter_next(s->dbi);
+    /* Move the iterator past the merged chunks */
+    end = offset + nb_chunks * s->granularity;
+    if (end < s->bdev_length) {
+        bdrv_set_dirty_iter(s->dbi, end);
+    } else {
+        while (bdrv_dirty_iter_next(s->dbi) >= 0) {
+            /* Drop cached bits that are reset below */
         }
-        assert(next_dirty == next_offset);
-        nb_chunks++;
     }
 
     /* Clear dirty bits before querying the block status, because
@@ -526,13 +621,27 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
         MirrorMethod mirror_method = MIRROR_METHOD_COPY;
 
         assert(!(offset % s->granularity));
-        ret = bdrv_block_status_above(source, NULL, offset,
-                                      nb_chunks * s->granularity,
-                                      &io_bytes, NULL, NULL);
+        /*
+         * The status of an extent is queried once, even if it is copied in
+         * several chunks.  The dirty bits of the whole range were cleared
+         * above, so writes that change the status will mark it dirty again.
+         */
+        if (offset < status_end) {
+            ret = status_ret;
+            io_bytes = status_end - offset;
+        } else {
+            ret = bdrv_block_status_above(source, NULL, offset,
+                                          nb_chunks * s->granularity,
+                                          &io_bytes, NULL, NULL);
+            if (ret >= 0) {
+                status_ret = ret;
+                status_end = offset + io_bytes;
+            }
+        }
         if (ret < 0) {
-            io_bytes = MIN(nb_chunks * s->granularity, max_io_bytes);
+            io_bytes = MIN(nb_chunks * s->granularity, s->max_io_bytes);
         } else if (ret & BDRV_BLOCK_DATA) {
-            io_bytes = MIN(io_bytes, max_io_bytes);
+            io_bytes = MIN(io_bytes, s->max_io_bytes);
         }
 
         io_bytes -= io_bytes % s->granularity;
@@ -551,7 +660,7 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
             }
         }
 
-        while (s->in_flight >= MAX_IN_FLIGHT) {
+        while (s->in_flight >= s->max_in_flight) {
             trace_mirror_yield_in_flight(s, offset, s->in_flight);
             mirror_wait_for_free_in_flight_slot(s);
         }
@@ -787,7 +896,7 @@ static int coroutine_fn mirror_dirty_init(MirrorBlockJob *s)
                 return 0;
             }
 
-            if (s->in_flight >= MAX_IN_FLIGHT) {
+            if (s->in_flight >= s->max_in_flight) {
                 trace_mirror_yield(s, UINT64_MAX, s->buf_free_count,
                                    s->in_flight);
                 mirror_wait_for_free_in_flight_slot(s);
@@ -925,6 +1034,11 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
 
     mirror_free_init(s);
 
+    s->max_in_flight = MAX_IN_FLIGHT;
+    s->min_io_bytes = MAX(s->granularity, MIN_IO_BYTES);
+    s->max_io_bytes = MAX(s->buf_size / MAX_IN_FLIGHT, MAX_IO_BYTES);
+    s->period_start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
     s->last_pause_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     if (!s->is_none_mode) {
         ret = mirror_dirty_init(s);
@@ -966,7 +1080,7 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
         delta = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - s->last_pause_ns;
         if (delta < BLOCK_JOB_SLICE_TIME &&
             s->common.iostatus == BLOCK_DEVICE_IO_STATUS_OK) {
-            if (s->in_flight >= MAX_IN_FLIGHT || s->buf_free_count == 0 ||
+            if (s->in_flight >= s->max_in_flight || s->buf_free_count == 0 ||
                 (cnt == 0 && s->in_flight > 0)) {
                 trace_mirror_yield(s, cnt, s->buf_free_count, s->in_flight);
                 mirror_wait_for_free_in_flight_slot(s);
@@ -1164,6 +1278,27 @@ static void mirror_drain(BlockJob *job)
     }
 }
 
+static void mirror_query(Job *job, JobInfo *info)
+{
+    MirrorBlockJob *s = container_of(job, MirrorBlockJob, common.job);
+    uint64_t remaining;
+
+    if (!s->throughput) {
+        return;
+    }
+
+    /*
+     * The progress counts bytes; its remaining part is updated by
+     * mirror_run() from the dirty bitmap and the requests in flight.
+     */
+    remaining = job->progress_total - job->progress_current;
+
+    info->has_throughput = true;
+    info->throughput = s->throughput;
+    info->has_remaining_time = true;
+    info->remaining_time = (double)remaining * 1000 / s->throughput;
+}
+
 static const BlockJobDriver mirror_job_driver = {
     .job_driver = {
         .instance_size          = sizeof(MirrorBlockJob),
@@ -1176,6 +1311,7 @@ static const BlockJobDriver mirror_job_driver = {
         .abort                  = mirror_abort,
         .pause                  = mirror_pause,
         .complete               = mirror_complete,
+        .query                  = mirror_query,
     },
     .drained_poll           = mirror_drained_poll,
     .drain                  = mirror_drain,
@@ -1193,6 +1329,7 @@ static const BlockJobDriver commit_active_job_driver = {
         .abort                  = mirror_abort,
         .pause                  = mirror_pause,
         .complete               = mirror_complete,
+        .query                  = mirror_query,
     },
     .drained_poll           = mirror_drained_poll,
     .drain                  = mirror_drain,
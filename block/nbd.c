@@ -33,6 +33,7 @@
 #include "qemu/uri.h"
 #include "qemu/option.h"
 #include "qemu/cutils.h"
+#include "qemu/error-report.h"
 #include "qemu/main-loop.h"
 
 #include "qapi/qapi-visit-sockets.h"
@@ -44,6 +45,10 @@
 
 #define EN_OPTSTR ":exportname="
 #define MAX_NBD_REQUESTS    16
+#define MAX_NBD_CONNECTIONS 16
+
+/* How long to wait for the server to greet an extra multi-conn connection */
+#define NBD_EXTRA_CONN_TIMEOUT_NS (5 * NANOSECONDS_PER_SECOND)
 
 #define HANDLE_TO_INDEX(bs, handle) ((handle) ^ (uint64_t)(intptr_t)(bs))
 #define INDEX_TO_HANDLE(bs, index)  ((index)  ^ (uint64_t)(intptr_t)(bs))
@@ -74,8 +79,19 @@ typedef struct BDRVNBDState {
     NBDReply reply;
     BlockDriverState *bs;
 
+    /*
+     * All connections to the export, starting with this one.  Only the
+     * BDRVNBDState in bs->opaque has this array; the others use just the
+     * fields above and share the connection parameters below with it.
+     */
+    struct BDRVNBDState **conns;
+    int num_conns;
+    int next_conn;
+
     /* Connection parameters */
     uint32_t reconnect_delay;
+    uint32_t multi_conn;
+    int64_t connect_timeout_ns;
     SocketAddress *saddr;
     char *export, *tlscredsid;
     QCryptoTLSCreds *tlscreds;
@@ -105,22 +121,31 @@ static void nbd_recv_coroutines_wake_all(BDRVNBDState *s)
 static void nbd_client_detach_aio_context(BlockDriverState *bs)
 {
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    int i;
 
-    qio_channel_detach_aio_context(QIO_CHANNEL(s->ioc));
+    for (i = 0; i < s->num_conns; i++) {
+        qio_channel_detach_aio_context(QIO_CHANNEL(s->conns[i]->ioc));
+    }
 }
 
 static void nbd_client_attach_aio_context_bh(void *opaque)
 {
     BlockDriverState *bs = opaque;
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    int i;
 
     /*
-     * The node is still drained, so we know the coroutine has yielded in
-     * nbd_read_eof(), the only place where bs->in_flight can reach 0, or it is
-     * entered for the first time. Both places are safe for entering the
-     * coroutine.
+     * The node is still drained, so we know the coroutines have yielded in
+     * nbd_read_eof(), the only place where bs->in_flight can reach 0, or they
+     * are entered for the first time. Both places are safe for entering the
+     * coroutines.
      */
-    qemu_aio_coroutine_enter(bs->aio_context, s->connection_co);
+    for (i = 0; i < s->num_conns; i++) {
+        if (s->conns[i]->connection_co) {
+            qemu_aio_coroutine_enter(bs->aio_context,
+                                     s->conns[i]->connection_co);
+        }
+    }
     bdrv_dec_in_flight(bs);
 }
 
@@ -128,8 +153,12 @@ static void nbd_client_attach_aio_context(BlockDriverState *bs,
                                           AioContext *new_context)
 {
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    int i;
 
-    qio_channel_attach_aio_context(QIO_CHANNEL(s->ioc), new_context);
+    for (i = 0; i < s->num_conns; i++) {
+        qio_channel_attach_aio_context(QIO_CHANNEL(s->conns[i]->ioc),
+                                       new_context);
+    }
 
     bdrv_inc_in_flight(bs);
 
@@ -141,19 +170,17 @@ static void nbd_client_attach_aio_context(BlockDriverState *bs,
 }
 
 
-static void nbd_teardown_connection(BlockDriverState *bs)
+static void nbd_teardown_connection(BDRVNBDState *s)
 {
-    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
-
     assert(s->ioc);
 
     /* finish any pending coroutines */
     qio_channel_shutdown(s->ioc,
                          QIO_CHANNEL_SHUTDOWN_BOTH,
                          NULL);
-    BDRV_POLL_WHILE(bs, s->connection_co);
+    BDRV_POLL_WHILE(s->bs, s->connection_co);
 
-    nbd_client_detach_aio_context(bs);
+    qio_channel_detach_aio_context(QIO_CHANNEL(s->ioc));
     object_unref(OBJECT(s->sioc));
     s->sioc = NULL;
     object_unref(OBJECT(s->ioc));
@@ -227,11 +254,34 @@ static coroutine_fn void nbd_connection_entry(void *opaque)
     aio_wait_kick();
 }
 
-static int nbd_co_send_request(BlockDriverState *bs,
+/*
+ * Pick the connection that has the fewest requests in flight, starting the
+ * search at a different connection each time so that ties are spread out.
+ */
+static BDRVNBDState *nbd_client_select_conn(BlockDriverState *bs)
+{
+    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    BDRVNBDState *best = NULL;
+    int i;
+
+    for (i = 0; i < s->num_conns; i++) {
+        BDRVNBDState *conn = s->conns[(s->next_conn + i) % s->num_conns];
+
+        if (conn->state == NBD_CLIENT_CONNECTED &&
+            (!best || conn->in_flight < best->in_flight)) {
+            best = conn;
+        }
+    }
+    s->next_conn = (s->next_conn + 1) % s->num_conns;
+
+    /* If all connections are gone, let the request fail on the first one */
+    return best ?: s;
+}
+
+static int nbd_co_send_request(BDRVNBDState *s,
                                NBDRequest *request,
                                QEMUIOVector *qiov)
 {
-    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
     int rc, i = -1;
 
     qemu_co_mutex_lock(&s->send_mutex);
@@ -913,12 +963,11 @@ static int nbd_co_receive_blockstatus_reply(BDRVNBDState *s,
     return iter.ret;
 }
 
-static int nbd_co_request(BlockDriverState *bs, NBDRequest *request,
+static int nbd_co_request(BDRVNBDState *s, NBDRequest *request,
                           QEMUIOVector *write_qiov)
 {
     int ret, request_ret;
     Error *local_err = NULL;
-    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
 
     assert(request->type != NBD_CMD_READ);
     if (write_qiov) {
@@ -927,7 +976,7 @@ static int nbd_co_request(BlockDriverState *bs, NBDRequest *request,
     } else {
         assert(request->type != NBD_CMD_WRITE);
     }
-    ret = nbd_co_send_request(bs, request, write_qiov);
+    ret = nbd_co_send_request(s, request, write_qiov);
     if (ret < 0) {
         return ret;
     }
@@ -949,7 +998,7 @@ static int nbd_client_co_preadv(BlockDriverState *bs, uint64_t offset,
 {
     int ret, request_ret;
     Error *local_err = NULL;
-    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    BDRVNBDState *s = nbd_client_select_conn(bs);
     NBDRequest request = {
         .type = NBD_CMD_READ,
         .from = offset,
@@ -981,7 +1030,7 @@ static int nbd_client_co_preadv(BlockDriverState *bs, uint64_t offset,
         request.len -= slop;
     }
 
-    ret = nbd_co_send_request(bs, &request, NULL);
+    ret = nbd_co_send_request(s, &request, NULL);
     if (ret < 0) {
         return ret;
     }
@@ -1001,7 +1050,7 @@ static int nbd_client_co_preadv(BlockDriverState *bs, uint64_t offset,
 static int nbd_client_co_pwritev(BlockDriverState *bs, uint64_t offset,
                                  uint64_t bytes, QEMUIOVector *qiov, int flags)
 {
-    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    BDRVNBDState *s = nbd_client_select_conn(bs);
     NBDRequest request = {
         .type = NBD_CMD_WRITE,
         .from = offset,
@@ -1019,13 +1068,13 @@ static int nbd_client_co_pwritev(BlockDriverState *bs, uint64_t offset,
     if (!bytes) {
         return 0;
     }
-    return nbd_co_request(bs, &request, qiov);
+    return nbd_co_request(s, &request, qiov);
 }
 
 static int nbd_client_co_pwrite_zeroes(BlockDriverState *bs, int64_t offset,
                                        int bytes, BdrvRequestFlags flags)
 {
-    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    BDRVNBDState *s = nbd_client_select_conn(bs);
     NBDRequest request = {
         .type = NBD_CMD_WRITE_ZEROES,
         .from = offset,
@@ -1048,12 +1097,12 @@ static int nbd_client_co_pwrite_zeroes(BlockDriverState *bs, int64_t offset,
     if (!bytes) {
         return 0;
     }
-    return nbd_co_request(bs, &request, NULL);
+    return nbd_co_request(s, &request, NULL);
 }
 
 static int nbd_client_co_flush(BlockDriverState *bs)
 {
-    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    BDRVNBDState *s = nbd_client_select_conn(bs);
     NBDRequest request = { .type = NBD_CMD_FLUSH };
 
     if (!(s->info.flags & NBD_FLAG_SEND_FLUSH)) {
@@ -1063,13 +1112,13 @@ static int nbd_client_co_flush(BlockDriverState *bs)
     request.from = 0;
     request.len = 0;
 
-    return nbd_co_request(bs, &request, NULL);
+    return nbd_co_request(s, &request, NULL);
 }
 
 static int nbd_client_co_pdiscard(BlockDriverState *bs, int64_t offset,
                                   int bytes)
 {
-    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    BDRVNBDState *s = nbd_client_select_conn(bs);
     NBDRequest request = {
         .type = NBD_CMD_TRIM,
         .from = offset,
@@ -1081,7 +1130,7 @@ static int nbd_client_co_pdiscard(BlockDriverState *bs, int64_t offset,
         return 0;
     }
 
-    return nbd_co_request(bs, &request, NULL);
+    return nbd_co_request(s, &request, NULL);
 }
 
 static int coroutine_fn nbd_client_co_block_status(
@@ -1090,7 +1139,7 @@ static int coroutine_fn nbd_client_co_block_status(
 {
     int ret, request_ret;
     NBDExtent extent = { 0 };
-    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    BDRVNBDState *s = nbd_client_select_conn(bs);
     Error *local_err = NULL;
 
     NBDRequest request = {
@@ -1127,7 +1176,7 @@ static int coroutine_fn nbd_client_co_block_status(
     if (s->info.min_block) {
         assert(QEMU_IS_ALIGNED(request.len, s->info.min_block));
     }
-    ret = nbd_co_send_request(bs, &request, NULL);
+    ret = nbd_co_send_request(s, &request, NULL);
     if (ret < 0) {
         return ret;
     }
@@ -1154,16 +1203,31 @@ static int coroutine_fn nbd_client_co_block_status(
         BDRV_BLOCK_OFFSET_VALID;
 }
 
-static void nbd_client_close(BlockDriverState *bs)
+static void nbd_client_close_conn(BDRVNBDState *s)
 {
-    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
     NBDRequest request = { .type = NBD_CMD_DISC };
 
     assert(s->ioc);
 
     nbd_send_request(s->ioc, &request);
 
-    nbd_teardown_connection(bs);
+    nbd_teardown_connection(s);
+}
+
+static void nbd_client_close(BlockDriverState *bs)
+{
+    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    int i;
+
+    for (i = s->num_conns - 1; i >= 0; i--) {
+        nbd_client_close_conn(s->conns[i]);
+        if (s->conns[i] != s) {
+            g_free(s->conns[i]);
+        }
+    }
+    g_free(s->conns);
+    s->conns = NULL;
+    s->num_conns = 0;
 }
 
 static QIOChannelSocket *nbd_establish_connection(SocketAddress *saddr,
@@ -1187,9 +1251,9 @@ static QIOChannelSocket *nbd_establish_connection(SocketAddress *saddr,
     return sioc;
 }
 
-static int nbd_client_connect(BlockDriverState *bs, Error **errp)
+static int nbd_client_connect(BDRVNBDState *s, Error **errp)
 {
-    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    BlockDriverState *bs = s->bs;
     AioContext *aio_context = bdrv_get_aio_context(bs);
     int ret;
 
@@ -1203,6 +1267,22 @@ static int nbd_client_connect(BlockDriverState *bs, Error **errp)
         return -ECONNREFUSED;
     }
 
+    /*
+     * A server that does not accept the connection yet leaves it in its
+     * listen backlog, so connect() succeeds but no greeting ever comes.
+     */
+    if (s->connect_timeout_ns) {
+        GPollFD pfd = { .fd = sioc->fd, .events = G_IO_IN };
+
+        if (qemu_poll_ns(&pfd, 1, s->connect_timeout_ns) <= 0) {
+            error_setg(errp, "NBD server did not answer within %" PRId64
+                       " seconds", s->connect_timeout_ns /
+                       NANOSECONDS_PER_SECOND);
+            object_unref(OBJECT(sioc));
+            return -ETIMEDOUT;
+        }
+    }
+
     /* NBD handshake */
     trace_nbd_client_connect(s->export);
     qio_channel_set_blocking(QIO_CHANNEL(sioc), false, NULL);
@@ -1575,6 +1655,12 @@ static QemuOptsList nbd_runtime_opts = {
             .help = "experimental: expose named dirty bitmap in place of "
                     "block status",
         },
+        {
+            .name = "multi-conn",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of connections to open to the server, if it "
+                    "allows several connections to the export. Default 1",
+        },
         {
             .name = "reconnect-delay",
             .type = QEMU_OPT_NUMBER,
@@ -1636,6 +1722,13 @@ static int nbd_process_options(BlockDriverState *bs, QDict *options,
     s->x_dirty_bitmap = g_strdup(qemu_opt_get(opts, "x-dirty-bitmap"));
     s->reconnect_delay = qemu_opt_get_number(opts, "reconnect-delay", 0);
 
+    s->multi_conn = qemu_opt_get_number(opts, "multi-conn", 1);
+    if (s->multi_conn < 1 || s->multi_conn > MAX_NBD_CONNECTIONS) {
+        error_setg(errp, "multi-conn must be between 1 and %d",
+                   MAX_NBD_CONNECTIONS);
+        goto error;
+    }
+
     ret = 0;
 
  error:
@@ -1649,6 +1742,69 @@ static int nbd_process_options(BlockDriverState *bs, QDict *options,
     return ret;
 }
 
+static void nbd_client_start(BDRVNBDState *s)
+{
+    s->state = NBD_CLIENT_CONNECTED;
+
+    s->connection_co = qemu_coroutine_create(nbd_connection_entry, s);
+    bdrv_inc_in_flight(s->bs);
+    aio_co_schedule(bdrv_get_aio_context(s->bs), s->connection_co);
+}
+
+/*
+ * Open the additional connections requested with multi-conn.  This is only
+ * done if the server promises that all connections see the same data, which
+ * also tells us that it accepts more than one client at a time.  Failing to
+ * open them is not fatal.
+ */
+static void nbd_client_connect_extra(BlockDriverState *bs)
+{
+    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    Error *local_err = NULL;
+
+    if (s->multi_conn > 1 && !(s->info.flags & NBD_FLAG_CAN_MULTI_CONN)) {
+        trace_nbd_client_multi_conn_unsupported(s->export ?: "");
+        return;
+    }
+
+    while (s->num_conns < s->multi_conn) {
+        BDRVNBDState *conn = g_new0(BDRVNBDState, 1);
+
+        conn->bs = bs;
+        conn->reconnect_delay = s->reconnect_delay;
+        conn->connect_timeout_ns = NBD_EXTRA_CONN_TIMEOUT_NS;
+        conn->saddr = s->saddr;
+        conn->export = s->export;
+        conn->tlscreds = s->tlscreds;
+        conn->hostname = s->hostname;
+        conn->x_dirty_bitmap = s->x_dirty_bitmap;
+        qemu_co_mutex_init(&conn->send_mutex);
+        qemu_co_queue_init(&conn->free_sema);
+
+        if (nbd_client_connect(conn, &local_err) < 0) {
+            g_free(conn);
+            break;
+        }
+        if (conn->info.size != s->info.size ||
+            conn->info.flags != s->info.flags) {
+            error_setg(&local_err, "server sent different export "
+                       "parameters on another connection");
+            nbd_client_close_conn(conn);
+            g_free(conn);
+            break;
+        }
+
+        nbd_client_start(conn);
+        s->conns[s->num_conns++] = conn;
+    }
+
+    if (local_err) {
+        warn_reportf_err(local_err, "NBD: using %d of %" PRIu32
+                         " connections: ", s->num_conns, s->multi_conn);
+    }
+    trace_nbd_client_multi_conn(s->export ?: "", s->num_conns);
+}
+
 static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
                     Error **errp)
 {
@@ -1664,16 +1820,16 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
     qemu_co_mutex_init(&s->send_mutex);
     qemu_co_queue_init(&s->free_sema);
 
-    ret = nbd_client_connect(bs, errp);
+    ret = nbd_client_connect(s, errp);
     if (ret < 0) {
         return ret;
     }
     /* successfully connected */
-    s->state = NBD_CLIENT_CONNECTED;
+    nbd_client_start(s);
 
-    s->connection_co = qemu_coroutine_create(nbd_connection_entry, s);
-    bdrv_inc_in_flight(bs);
-    aio_co_schedule(bdrv_get_aio_context(bs), s->connection_co);
+    s->conns = g_new0(BDRVNBDState *, s->multi_conn);
+    s->conns[s->num_conns++] = s;
+    nbd_client_connect_extra(bs);
 
     return 0;
 }
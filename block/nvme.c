@@ -31,6 +31,7 @@
 #define NVME_CQ_ENTRY_BYTES 16
 #define NVME_QUEUE_SIZE 128
 #define NVME_BAR_SIZE 8192
+#define NVME_NUM_BOUNCE_BUFS 8
 
 typedef struct {
     int32_t  head, tail;
@@ -43,6 +44,8 @@ typedef struct {
 typedef struct {
     BlockCompletionFunc *cb;
     void *opaque;
+    /* If not NULL, receives the command specific result of the completion */
+    uint32_t *result;
     int cid;
     void *prp_list_page;
     uint64_t prp_list_iova;
@@ -57,6 +60,9 @@ typedef struct {
     int         index;
     uint8_t     *prp_list_pages;
 
+    /* AioContext that the queue is bound to, set under s->bind_lock */
+    AioContext  *ctx;
+
     /* Fields protected by @lock */
     NVMeQueue   sq, cq;
     int         cq_phase;
@@ -117,12 +123,25 @@ typedef struct {
     /* Total size of mapped qiov, accessed under dma_map_lock */
     int dma_map_count;
 
+    /* Bounce buffers for unaligned requests.  They are allocated on demand
+     * and stay DMA mapped until close, so that unaligned I/O doesn't need a
+     * temporary mapping for every request.  Accessed under dma_map_lock. */
+    void *bounce_bufs[NVME_NUM_BOUNCE_BUFS];
+    int nr_free_bounce_bufs;
+    int nr_bounce_bufs;
+
+    /* Protects binding I/O queues to AioContexts */
+    QemuMutex bind_lock;
+    /* I/O queue shared next once every queue is bound, under bind_lock */
+    int next_queue;
+
     /* PCI address (required for nvme_refresh_filename()) */
     char *device;
 } BDRVNVMeState;
 
 #define NVME_BLOCK_OPT_DEVICE "device"
 #define NVME_BLOCK_OPT_NAMESPACE "namespace"
+#define NVME_BLOCK_OPT_NUM_QUEUES "num-queues"
 
 static QemuOptsList runtime_opts = {
     .name = "nvme",
@@ -138,6 +157,11 @@ static QemuOptsList runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "NVMe namespace",
         },
+        {
+            .name = NVME_BLOCK_OPT_NUM_QUEUES,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of I/O queue pairs (default: 1)",
+        },
         { /* end of list */ }
     },
 };
@@ -340,6 +364,10 @@ static bool nvme_process_completion(BDRVNVMeState *s, NVMeQueuePair *q)
         assert(req.cb);
         preq->busy = false;
         preq->cb = preq->opaque = NULL;
+        preq->result = NULL;
+        if (req.result) {
+            *req.result = le32_to_cpu(c->result);
+        }
         qemu_mutex_unlock(&q->lock);
         req.cb(req.opaque, nvme_translate_error(c));
         qemu_mutex_lock(&q->lock);
@@ -398,8 +426,12 @@ static void nvme_cmd_sync_cb(void *opaque, int ret)
     aio_wait_kick();
 }
 
-static int nvme_cmd_sync(BlockDriverState *bs, NVMeQueuePair *q,
-                         NvmeCmd *cmd)
+/*
+ * Like nvme_cmd_sync(), but also returns dword 0 of the completion entry
+ * in @result.
+ */
+static int nvme_cmd_sync_result(BlockDriverState *bs, NVMeQueuePair *q,
+                                NvmeCmd *cmd, uint32_t *result)
 {
     NVMeRequest *req;
     BDRVNVMeState *s = bs->opaque;
@@ -408,12 +440,19 @@ static int nvme_cmd_sync(BlockDriverState *bs, NVMeQueuePair *q,
     if (!req) {
         return -EBUSY;
     }
+    req->result = result;
     nvme_submit_command(s, q, req, cmd, nvme_cmd_sync_cb, &ret);
 
     BDRV_POLL_WHILE(bs, ret == -EINPROGRESS);
     return ret;
 }
 
+static int nvme_cmd_sync(BlockDriverState *bs, NVMeQueuePair *q,
+                         NvmeCmd *cmd)
+{
+    return nvme_cmd_sync_result(bs, q, cmd, NULL);
+}
+
 static void nvme_identify(BlockDriverState *bs, int namespace, Error **errp)
 {
     BDRVNVMeState *s = bs->opaque;
@@ -496,6 +535,12 @@ static bool nvme_poll_queues(BDRVNVMeState *s)
 
     for (i = 0; i < s->nr_queues; i++) {
         NVMeQueuePair *q = s->queues[i];
+
+        /* Don't bother taking the lock of queues that have nothing in
+         * flight; with many I/O queues most of them are idle at any time. */
+        if (!atomic_read(&q->inflight)) {
+            continue;
+        }
         qemu_mutex_lock(&q->lock);
         while (nvme_process_completion(s, q)) {
             /* Keep polling */
@@ -555,6 +600,54 @@ static bool nvme_add_io_queue(BlockDriverState *bs, Error **errp)
     return true;
 }
 
+/*
+ * Ask the controller for @num_queues I/O queue pairs and create as many of
+ * them as it grants.
+ */
+static bool nvme_add_io_queues(BlockDriverState *bs, int num_queues,
+                               Error **errp)
+{
+    BDRVNVMeState *s = bs->opaque;
+    int requested = num_queues;
+    int max_queues, granted;
+    uint32_t result = 0;
+    NvmeCmd cmd;
+    int ret;
+
+    /* The doorbells of all queue pairs, including the admin queue, must fit
+     * in the mapped BAR. */
+    max_queues = (NVME_BAR_SIZE - offsetof(NVMeRegs, doorbells)) /
+                 (2 * s->doorbell_scale * sizeof(uint32_t)) - 1;
+    num_queues = MIN(num_queues, max_queues);
+
+    /*
+     * Number of Queues feature: 0's based counts of submission queues in
+     * bits 15:0 and completion queues in bits 31:16, both in the request
+     * and in the number allocated by the controller that it returns in
+     * dword 0 of the completion.
+     */
+    cmd = (NvmeCmd) {
+        .opcode = NVME_ADM_CMD_SET_FEATURES,
+        .cdw10 = cpu_to_le32(0x07),
+        .cdw11 = cpu_to_le32(((num_queues - 1) << 16) | (num_queues - 1)),
+    };
+    ret = nvme_cmd_sync_result(bs, s->queues[0], &cmd, &result);
+    if (ret) {
+        error_setg_errno(errp, -ret, "Failed to set the number of queues");
+        return false;
+    }
+    granted = MIN(result & 0xffff, result >> 16) + 1;
+    num_queues = MIN(num_queues, granted);
+
+    while (s->nr_queues <= num_queues) {
+        if (!nvme_add_io_queue(bs, errp)) {
+            return false;
+        }
+    }
+    trace_nvme_add_io_queues(s, requested, s->nr_queues - 1);
+    return true;
+}
+
 static bool nvme_poll_cb(void *opaque)
 {
     EventNotifier *e = opaque;
@@ -567,7 +660,7 @@ static bool nvme_poll_cb(void *opaque)
 }
 
 static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
-                     Error **errp)
+                     int num_queues, Error **errp)
 {
     BDRVNVMeState *s = bs->opaque;
     int ret;
@@ -578,6 +671,7 @@ static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
 
     qemu_co_mutex_init(&s->dma_map_lock);
     qemu_co_queue_init(&s->dma_flush_queue);
+    qemu_mutex_init(&s->bind_lock);
     s->device = g_strdup(device);
     s->nsid = namespace;
     s->aio_context = bdrv_get_aio_context(bs);
@@ -674,7 +768,7 @@ static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
     }
 
     /* Set up command queues. */
-    if (!nvme_add_io_queue(bs, errp)) {
+    if (!nvme_add_io_queues(bs, num_queues, errp)) {
         ret = -EIO;
     }
 out:
@@ -751,7 +845,12 @@ static void nvme_close(BlockDriverState *bs)
     event_notifier_cleanup(&s->irq_notifier);
     qemu_vfio_pci_unmap_bar(s->vfio, 0, (void *)s->regs, 0, NVME_BAR_SIZE);
     qemu_vfio_close(s->vfio);
+    assert(s->nr_free_bounce_bufs == s->nr_bounce_bufs);
+    for (i = 0; i < s->nr_bounce_bufs; ++i) {
+        qemu_vfree(s->bounce_bufs[i]);
+    }
 
+    qemu_mutex_destroy(&s->bind_lock);
     g_free(s->device);
 }
 
@@ -761,6 +860,7 @@ static int nvme_file_open(BlockDriverState *bs, QDict *options, int flags,
     const char *device;
     QemuOpts *opts;
     int namespace;
+    int num_queues;
     int ret;
     BDRVNVMeState *s = bs->opaque;
 
@@ -774,7 +874,14 @@ static int nvme_file_open(BlockDriverState *bs, QDict *options, int flags,
     }
 
     namespace = qemu_opt_get_number(opts, NVME_BLOCK_OPT_NAMESPACE, 1);
-    ret = nvme_init(bs, device, namespace, errp);
+    num_queues = qemu_opt_get_number(opts, NVME_BLOCK_OPT_NUM_QUEUES, 1);
+    if (num_queues < 1 || num_queues > UINT16_MAX) {
+        error_setg(errp, "'" NVME_BLOCK_OPT_NUM_QUEUES "' must be between 1 "
+                   "and %d", UINT16_MAX);
+        qemu_opts_del(opts);
+        return -EINVAL;
+    }
+    ret = nvme_init(bs, device, namespace, num_queues, errp);
     qemu_opts_del(opts);
     if (ret) {
         goto fail;
@@ -938,6 +1045,50 @@ static void nvme_rw_cb(void *opaque, int ret)
     aio_bh_schedule_oneshot(data->ctx, nvme_rw_cb_bh, data);
 }
 
+/*
+ * Return the I/O queue bound to the current AioContext.  The first
+ * request from a context binds it to a queue that no other context uses,
+ * so that submissions from different iothreads don't contend on the queue
+ * locks.  Once every queue is bound, further contexts share the queues
+ * round-robin.
+ */
+static NVMeQueuePair *nvme_select_io_queue(BDRVNVMeState *s)
+{
+    AioContext *ctx = qemu_get_current_aio_context();
+    NVMeQueuePair *q = NULL;
+    int n = s->nr_queues - 1;
+    int i;
+
+    assert(n > 0);
+    for (i = 1; i <= n; i++) {
+        if (atomic_read(&s->queues[i]->ctx) == ctx) {
+            return s->queues[i];
+        }
+    }
+
+    qemu_mutex_lock(&s->bind_lock);
+    for (i = 1; i <= n; i++) {
+        AioContext *bound = atomic_read(&s->queues[i]->ctx);
+
+        if (bound == ctx) {
+            q = s->queues[i];
+            break;
+        } else if (!bound && !q) {
+            q = s->queues[i];
+        }
+    }
+    if (q && !q->ctx) {
+        atomic_set(&q->ctx, ctx);
+        trace_nvme_bind_io_queue(s, ctx, q->index);
+    } else if (!q) {
+        /* Every queue is taken, share one without binding it */
+        q = s->queues[1 + s->next_queue];
+        s->next_queue = (s->next_queue + 1) % n;
+    }
+    qemu_mutex_unlock(&s->bind_lock);
+    return q;
+}
+
 static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
                                             uint64_t offset, uint64_t bytes,
                                             QEMUIOVector *qiov,
@@ -946,7 +1097,7 @@ static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
 {
     int r;
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[1];
+    NVMeQueuePair *ioq;
     NVMeRequest *req;
 
     uint32_t cdw12 = (((bytes >> s->blkshift) - 1) & 0xFFFF) |
@@ -964,7 +1115,7 @@ static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
     };
 
     trace_nvme_prw_aligned(s, is_write, offset, bytes, flags, qiov->niov);
-    assert(s->nr_queues > 1);
+    ioq = nvme_select_io_queue(s);
     req = nvme_get_free_req(ioq);
     assert(req);
 
@@ -1010,12 +1161,49 @@ static inline bool nvme_qiov_aligned(BlockDriverState *bs,
     return true;
 }
 
+/* Get a premapped bounce buffer of s->max_transfer bytes, allocating it if
+ * the pool is not full yet.  Returns NULL if none is available. */
+static coroutine_fn void *nvme_get_bounce_buf(BlockDriverState *bs)
+{
+    BDRVNVMeState *s = bs->opaque;
+    void *buf = NULL;
+
+    qemu_co_mutex_lock(&s->dma_map_lock);
+    if (s->nr_free_bounce_bufs) {
+        buf = s->bounce_bufs[--s->nr_free_bounce_bufs];
+    } else if (s->nr_bounce_bufs < NVME_NUM_BOUNCE_BUFS) {
+        buf = qemu_try_blockalign(bs, s->max_transfer);
+        if (buf && qemu_vfio_dma_map(s->vfio, buf, s->max_transfer,
+                                     false, NULL)) {
+            qemu_vfree(buf);
+            buf = NULL;
+        }
+        if (buf) {
+            s->nr_bounce_bufs++;
+            trace_nvme_bounce_buf_alloc(s, buf, s->nr_bounce_bufs);
+        }
+    }
+    qemu_co_mutex_unlock(&s->dma_map_lock);
+    return buf;
+}
+
+static coroutine_fn void nvme_put_bounce_buf(BlockDriverState *bs, void *buf)
+{
+    BDRVNVMeState *s = bs->opaque;
+
+    qemu_co_mutex_lock(&s->dma_map_lock);
+    assert(s->nr_free_bounce_bufs < s->nr_bounce_bufs);
+    s->bounce_bufs[s->nr_free_bounce_bufs++] = buf;
+    qemu_co_mutex_unlock(&s->dma_map_lock);
+}
+
 static int nvme_co_prw(BlockDriverState *bs, uint64_t offset, uint64_t bytes,
                        QEMUIOVector *qiov, bool is_write, int flags)
 {
     BDRVNVMeState *s = bs->opaque;
     int r;
     uint8_t *buf = NULL;
+    bool pooled = true;
     QEMUIOVector local_qiov;
 
     assert(QEMU_IS_ALIGNED(offset, s->page_size));
@@ -1025,7 +1213,11 @@ static int nvme_co_prw(BlockDriverState *bs, uint64_t offset, uint64_t bytes,
         return nvme_co_prw_aligned(bs, offset, bytes, qiov, is_write, flags);
     }
     trace_nvme_prw_buffered(s, offset, bytes, qiov->niov, is_write);
-    buf = qemu_try_blockalign(bs, bytes);
+    buf = nvme_get_bounce_buf(bs);
+    if (!buf) {
+        pooled = false;
+        buf = qemu_try_blockalign(bs, bytes);
+    }
 
     if (!buf) {
         return -ENOMEM;
@@ -1040,7 +1232,11 @@ static int nvme_co_prw(BlockDriverState *bs, uint64_t offset, uint64_t bytes,
     if (!r && !is_write) {
         qemu_iovec_from_buf(qiov, 0, buf, bytes);
     }
-    qemu_vfree(buf);
+    if (pooled) {
+        nvme_put_bounce_buf(bs, buf);
+    } else {
+        qemu_vfree(buf);
+    }
     return r;
 }
 
@@ -1061,7 +1257,7 @@ static coroutine_fn int nvme_co_pwritev(BlockDriverState *bs,
 static coroutine_fn int nvme_co_flush(BlockDriverState *bs)
 {
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[1];
+    NVMeQueuePair *ioq;
     NVMeRequest *req;
     NvmeCmd cmd = {
         .opcode = NVME_CMD_FLUSH,
@@ -1072,7 +1268,7 @@ static coroutine_fn int nvme_co_flush(BlockDriverState *bs)
         .ret = -EINPROGRESS,
     };
 
-    assert(s->nr_queues > 1);
+    ioq = nvme_select_io_queue(s);
     req = nvme_get_free_req(ioq);
     assert(req);
     nvme_submit_command(s, ioq, req, &cmd, nvme_rw_cb, &data);
@@ -1121,6 +1317,15 @@ static void nvme_attach_aio_context(BlockDriverState *bs,
                                     AioContext *new_context)
 {
     BDRVNVMeState *s = bs->opaque;
+    int i;
+
+    /* The node is drained, let the new submitters bind the queues again */
+    qemu_mutex_lock(&s->bind_lock);
+    for (i = 1; i < s->nr_queues; i++) {
+        atomic_set(&s->queues[i]->ctx, NULL);
+    }
+    s->next_queue = 0;
+    qemu_mutex_unlock(&s->bind_lock);
 
     s->aio_context = new_context;
     aio_set_event_notifier(new_context, &s->irq_notifier,
@@ -404,7 +404,9 @@ static coroutine_fn int parallels_co_readv(BlockDriverState *bs,
 
 static int coroutine_fn parallels_co_check(BlockDriverState *bs,
                                            BdrvCheckResult *res,
-                                           BdrvCheckMode fix)
+                                           BdrvCheckMode fix,
+                                           BlockDriverCheckStatusCB *status_cb,
+                                           void *cb_opaque)
 {
     BDRVParallelsState *s = bs->opaque;
     int64_t size, prev_off, high_off;
@@ -140,6 +140,9 @@ BlockDeviceInfo *bdrv_block_device_info(BlockBackend *blk,
         info->has_group = true;
         info->group =
             g_strdup(throttle_group_get_name(&blkp->throttle_group_member));
+
+        info->has_weight = true;
+        info->weight = throttle_group_get_weight(&blkp->throttle_group_member);
     }
 
     info->write_threshold = bdrv_write_threshold_get(bs);
@@ -433,6 +436,47 @@ static void bdrv_latency_histogram_stats(BlockLatencyHistogram *hist,
     }
 }
 
+static BlockLatencyPercentiles *
+bdrv_latency_percentiles(BlockLatencyLogHistogram *hist)
+{
+    BlockLatencyPercentiles *p = g_new0(BlockLatencyPercentiles, 1);
+
+    p->count = hist->count;
+    p->p50 = block_latency_log_histogram_percentile(hist, 50);
+    p->p90 = block_latency_log_histogram_percentile(hist, 90);
+    p->p99 = block_latency_log_histogram_percentile(hist, 99);
+    p->p999 = block_latency_log_histogram_percentile(hist, 99.9);
+    p->max = hist->max;
+    return p;
+}
+
+/* @total and @queue are NULL for a node.  Any previous value of @info is
+ * replaced, so that the numbers of a BlockBackend take the place of those
+ * of its root node. */
+static void bdrv_latency_percentile_stats(BlockLatencyLogHistogram *total,
+                                          BlockLatencyLogHistogram *queue,
+                                          BlockLatencyLogHistogram *driver,
+                                          bool *not_null,
+                                          BlockLatencyPercentileStats **info)
+{
+    qapi_free_BlockLatencyPercentileStats(*info);
+    *info = NULL;
+
+    *not_null = driver->count || (total && total->count);
+    if (!*not_null) {
+        return;
+    }
+
+    *info = g_new0(BlockLatencyPercentileStats, 1);
+    if (total) {
+        (*info)->has_total = true;
+        (*info)->total = bdrv_latency_percentiles(total);
+        (*info)->has_queue = true;
+        (*info)->queue = bdrv_latency_percentiles(queue);
+    }
+    (*info)->driver = bdrv_latency_percentiles(driver);
+}
+
 static void bdrv_query_blk_stats(BlockDeviceStats *ds, BlockBackend *blk)
 {
     BlockAcctStats *stats = blk_get_stats(blk);
@@ -508,6 +552,41 @@ static void bdrv_query_blk_stats(BlockDeviceStats *ds, BlockBackend *blk)
     bdrv_latency_histogram_stats(&stats->latency_histogram[BLOCK_ACCT_FLUSH],
                                  &ds->has_flush_latency_histogram,
                                  &ds->flush_latency_histogram);
+
+    qemu_mutex_lock(&stats->lock);
+    bdrv_latency_percentile_stats(
+        &stats->latency_log[BLOCK_ACCT_READ][BLOCK_ACCT_PHASE_TOTAL],
+        &stats->latency_log[BLOCK_ACCT_READ][BLOCK_ACCT_PHASE_QUEUE],
+        &stats->latency_log[BLOCK_ACCT_READ][BLOCK_ACCT_PHASE_DRIVER],
+        &ds->has_rd_latency_percentiles, &ds->rd_latency_percentiles);
+    bdrv_latency_percentile_stats(
+        &stats->latency_log[BLOCK_ACCT_WRITE][BLOCK_ACCT_PHASE_TOTAL],
+        &stats->latency_log[BLOCK_ACCT_WRITE][BLOCK_ACCT_PHASE_QUEUE],
+        &stats->latency_log[BLOCK_ACCT_WRITE][BLOCK_ACCT_PHASE_DRIVER],
+        &ds->has_wr_latency_percentiles, &ds->wr_latency_percentiles);
+    bdrv_latency_percentile_stats(
+        &stats->latency_log[BLOCK_ACCT_FLUSH][BLOCK_ACCT_PHASE_TOTAL],
+        &stats->latency_log[BLOCK_ACCT_FLUSH][BLOCK_ACCT_PHASE_QUEUE],
+        &stats->latency_log[BLOCK_ACCT_FLUSH][BLOCK_ACCT_PHASE_DRIVER],
+        &ds->has_flush_latency_percentiles, &ds->flush_latency_percentiles);
+    qemu_mutex_unlock(&stats->lock);
+
+    if (blk_get_public(blk)->throttle_group_member.throttle_state) {
+        ThrottleGroupMember *tgm = &blk_get_public(blk)->throttle_group_member;
+        uint64_t ops, time_ns;
+
+        throttle_group_get_wait_stats(tgm, false, &ops, &time_ns);
+        ds->has_throttled_rd_operations = true;
+        ds->throttled_rd_operations = ops;
+        ds->has_throttled_rd_time_ns = true;
+        ds->throttled_rd_time_ns = time_ns;
+
+        throttle_group_get_wait_stats(tgm, true, &ops, &time_ns);
+        ds->has_throttled_wr_operations = true;
+        ds->throttled_wr_operations = ops;
+        ds->has_throttled_wr_time_ns = true;
+        ds->throttled_wr_time_ns = time_ns;
+    }
 }
 
 static BlockStats *bdrv_query_bds_stats(BlockDriverState *bs,
@@ -537,6 +616,21 @@ static BlockStats *bdrv_query_bds_stats(BlockDriverState *bs,
 
     s->stats->wr_highest_offset = stat64_get(&bs->wr_highest_offset);
 
+    qemu_mutex_lock(&bs->latency_lock);
+    bdrv_latency_percentile_stats(NULL, NULL, &bs->latency[BLOCK_ACCT_READ],
+                                  &s->stats->has_rd_latency_percentiles,
+                                  &s->stats->rd_latency_percentiles);
+    bdrv_latency_percentile_stats(NULL, NULL, &bs->latency[BLOCK_ACCT_WRITE],
+                                  &s->stats->has_wr_latency_percentiles,
+                                  &s->stats->wr_latency_percentiles);
+    bdrv_latency_percentile_stats(NULL, NULL, &bs->latency[BLOCK_ACCT_FLUSH],
+                                  &s->stats->has_flush_latency_percentiles,
+                                  &s->stats->flush_latency_percentiles);
+    qemu_mutex_unlock(&bs->latency_lock);
+
+    s->driver_specific = bdrv_get_specific_stats(bs);
+    s->has_driver_specific = s->driver_specific != NULL;
+
     if (bs->file) {
         s->has_parent = true;
         s->parent = bdrv_query_bds_stats(bs->file->bs, blk_level);
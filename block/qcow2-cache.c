@@ -31,6 +31,10 @@ typedef struct Qcow2CachedTable {
     uint64_t lru_counter;
     int      ref;
     bool     dirty;
+    /* Next entry in the same hash bucket, or -1 */
+    int      hash_next;
+    /* Only linked while ref == 0 */
+    QTAILQ_ENTRY(Qcow2CachedTable) lru_next;
 } Qcow2CachedTable;
 
 struct Qcow2Cache {
@@ -42,6 +46,15 @@ struct Qcow2Cache {
     void                   *table_array;
     uint64_t                lru_counter;
     uint64_t                cache_clean_lru_counter;
+
+    /*
+     * Cached entries are found through a hash table indexed by offset, and
+     * unused entries are kept in LRU order (empty ones first), so that
+     * neither a lookup nor an eviction has to scan the whole cache.
+     */
+    int                    *buckets;
+    unsigned                nb_buckets;
+    QTAILQ_HEAD(, Qcow2CachedTable) lru;
 };
 
 static inline void *qcow2_cache_get_table_addr(Qcow2Cache *c, int table)
@@ -57,6 +70,63 @@ static inline int qcow2_cache_get_table_idx(Qcow2Cache *c, void *table)
     return idx;
 }
 
+static inline unsigned qcow2_cache_bucket(Qcow2Cache *c, uint64_t offset)
+{
+    return (offset / c->table_size) & (c->nb_buckets - 1);
+}
+
+static int qcow2_cache_lookup(Qcow2Cache *c, uint64_t offset)
+{
+    int i;
+
+    for (i = c->buckets[qcow2_cache_bucket(c, offset)]; i != -1;
+         i = c->entries[i].hash_next) {
+        if (c->entries[i].offset == offset) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void qcow2_cache_hash_insert(Qcow2Cache *c, int i)
+{
+    unsigned bucket = qcow2_cache_bucket(c, c->entries[i].offset);
+
+    c->entries[i].hash_next = c->buckets[bucket];
+    c->buckets[bucket] = i;
+}
+
+static void qcow2_cache_hash_remove(Qcow2Cache *c, int i)
+{
+    int *p = &c->buckets[qcow2_cache_bucket(c, c->entries[i].offset)];
+
+    while (*p != i) {
+        assert(*p != -1);
+        p = &c->entries[*p].hash_next;
+    }
+    *p = c->entries[i].hash_next;
+    c->entries[i].hash_next = -1;
+}
+
+/*
+ * Drop the table cached in an unused entry and make the entry the first
+ * candidate for eviction
+ */
+static void qcow2_cache_entry_reset(Qcow2Cache *c, int i)
+{
+    Qcow2CachedTable *t = &c->entries[i];
+
+    assert(t->ref == 0);
+    if (t->offset) {
+        qcow2_cache_hash_remove(c, i);
+    }
+    t->offset = 0;
+    t->lru_counter = 0;
+
+    QTAILQ_REMOVE(&c->lru, t, lru_next);
+    QTAILQ_INSERT_HEAD(&c->lru, t, lru_next);
+}
+
 static inline const char *qcow2_cache_get_name(BDRVQcow2State *s, Qcow2Cache *c)
 {
     if (c == s->refcount_block_cache) {
@@ -104,8 +174,7 @@ void qcow2_cache_clean_unused(Qcow2Cache *c)
 
         /* And count how many we can clean in a row */
         while (i < c->size && can_clean_entry(c, i)) {
-            c->entries[i].offset = 0;
-            c->entries[i].lru_counter = 0;
+            qcow2_cache_entry_reset(c, i);
             i++;
             to_clean++;
         }
@@ -123,6 +192,7 @@ Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
 {
     BDRVQcow2State *s = bs->opaque;
     Qcow2Cache *c;
+    int i;
 
     assert(num_tables > 0);
     assert(is_power_of_2(table_size));
@@ -135,12 +205,24 @@ Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
     c->entries = g_try_new0(Qcow2CachedTable, num_tables);
     c->table_array = qemu_try_blockalign(bs->file->bs,
                                          (size_t) num_tables * c->table_size);
+    c->nb_buckets = pow2ceil(num_tables);
+    c->buckets = g_try_new(int, c->nb_buckets);
 
-    if (!c->entries || !c->table_array) {
+    if (!c->entries || !c->table_array || !c->buckets) {
         qemu_vfree(c->table_array);
         g_free(c->entries);
+        g_free(c->buckets);
         g_free(c);
-        c = NULL;
+        return NULL;
+    }
+
+    QTAILQ_INIT(&c->lru);
+    for (i = 0; i < c->nb_buckets; i++) {
+        c->buckets[i] = -1;
+    }
+    for (i = 0; i < num_tables; i++) {
+        c->entries[i].hash_next = -1;
+        QTAILQ_INSERT_TAIL(&c->lru, &c->entries[i], lru_next);
     }
 
     return c;
@@ -156,6 +238,7 @@ int qcow2_cache_destroy(Qcow2Cache *c)
 
     qemu_vfree(c->table_array);
     g_free(c->entries);
+    g_free(c->buckets);
     g_free(c);
 
     return 0;
@@ -304,9 +387,7 @@ int qcow2_cache_empty(BlockDriverState *bs, Qcow2Cache *c)
     }
 
     for (i = 0; i < c->size; i++) {
-        assert(c->entries[i].ref == 0);
-        c->entries[i].offset = 0;
-        c->entries[i].lru_counter = 0;
+        qcow2_cache_entry_reset(c, i);
     }
 
     qcow2_cache_table_release(c, 0, c->size);
@@ -320,11 +401,9 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
     uint64_t offset, void **table, bool read_from_disk)
 {
     BDRVQcow2State *s = bs->opaque;
+    Qcow2CachedTable *t;
     int i;
     int ret;
-    int lookup_index;
-    uint64_t min_lru_counter = UINT64_MAX;
-    int min_lru_index = -1;
 
     assert(offset != 0);
 
@@ -339,29 +418,20 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
     }
 
     /* Check if the table is already cached */
-    i = lookup_index = (offset / c->table_size * 4) % c->size;
-    do {
-        const Qcow2CachedTable *t = &c->entries[i];
-        if (t->offset == offset) {
-            goto found;
-        }
-        if (t->ref == 0 && t->lru_counter < min_lru_counter) {
-            min_lru_counter = t->lru_counter;
-            min_lru_index = i;
-        }
-        if (++i == c->size) {
-            i = 0;
-        }
-    } while (i != lookup_index);
+    i = qcow2_cache_lookup(c, offset);
+    if (i != -1) {
+        goto found;
+    }
 
-    if (min_lru_index == -1) {
+    t = QTAILQ_FIRST(&c->lru);
+    if (!t) {
         /* This can't happen in current synchronous code, but leave the check
          * here as a reminder for whoever starts using AIO with the cache */
         abort();
     }
 
-    /* Cache miss: write a table back and replace it */
-    i = min_lru_index;
+    /* Cache miss: write the least recently used table back and replace it */
+    i = t - c->entries;
     trace_qcow2_cache_get_replace_entry(qemu_coroutine_self(),
                                         c == s->l2_table_cache, i);
 
@@ -372,7 +442,10 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
 
     trace_qcow2_cache_get_read(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
-    c->entries[i].offset = 0;
+    if (c->entries[i].offset) {
+        qcow2_cache_hash_remove(c, i);
+        c->entries[i].offset = 0;
+    }
     if (read_from_disk) {
         if (c == s->l2_table_cache) {
             BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
@@ -387,10 +460,13 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
     }
 
     c->entries[i].offset = offset;
+    qcow2_cache_hash_insert(c, i);
 
     /* And return the right table */
 found:
-    c->entries[i].ref++;
+    if (c->entries[i].ref++ == 0) {
+        QTAILQ_REMOVE(&c->lru, &c->entries[i], lru_next);
+    }
     *table = qcow2_cache_get_table_addr(c, i);
 
     trace_qcow2_cache_get_done(qemu_coroutine_self(),
@@ -418,11 +494,12 @@ void qcow2_cache_put(Qcow2Cache *c, void **table)
     c->entries[i].ref--;
     *table = NULL;
 
+    assert(c->entries[i].ref >= 0);
+
     if (c->entries[i].ref == 0) {
         c->entries[i].lru_counter = ++c->lru_counter;
+        QTAILQ_INSERT_TAIL(&c->lru, &c->entries[i], lru_next);
     }
-
-    assert(c->entries[i].ref >= 0);
 }
 
 void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table)
@@ -434,24 +511,16 @@ void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table)
 
 void *qcow2_cache_is_table_offset(Qcow2Cache *c, uint64_t offset)
 {
-    int i;
+    int i = qcow2_cache_lookup(c, offset);
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].offset == offset) {
-            return qcow2_cache_get_table_addr(c, i);
-        }
-    }
-    return NULL;
+    return i == -1 ? NULL : qcow2_cache_get_table_addr(c, i);
 }
 
 void qcow2_cache_discard(Qcow2Cache *c, void *table)
 {
     int i = qcow2_cache_get_table_idx(c, table);
 
-    assert(c->entries[i].ref == 0);
-
-    c->entries[i].offset = 0;
-    c->entries[i].lru_counter = 0;
+    qcow2_cache_entry_reset(c, i);
     c->entries[i].dirty = false;
 
     qcow2_cache_table_release(c, i, 1);
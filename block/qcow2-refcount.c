@@ -25,6 +25,7 @@
 #include "qemu/osdep.h"
 #include "qapi/error.h"
 #include "qcow2.h"
+#include "block/aio_task.h"
 #include "qemu/range.h"
 #include "qemu/bswap.h"
 #include "qemu/cutils.h"
@@ -1253,7 +1254,7 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
     l2_slice = NULL;
     l1_table = NULL;
     l1_size2 = l1_size * sizeof(uint64_t);
-    slice_size2 = s->l2_slice_size * sizeof(uint64_t);
+    slice_size2 = s->l2_slice_size * l2_entry_size(s);
     n_slices = s->cluster_size / slice_size2;
 
     s->cache_discards = true;
@@ -1309,7 +1310,7 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
                     uint64_t cluster_index;
                     uint64_t offset;
 
-                    entry = be64_to_cpu(l2_slice[j]);
+                    entry = get_l2_entry(s, l2_slice, j);
                     old_entry = entry;
                     entry &= ~QCOW_OFLAG_COPIED;
                     offset = entry & L2E_OFFSET_MASK;
@@ -1383,7 +1384,7 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
                             qcow2_cache_set_dependency(bs, s->l2_table_cache,
                                                        s->refcount_block_cache);
                         }
-                        l2_slice[j] = cpu_to_be64(entry);
+                        set_l2_entry(s, l2_slice, j, entry);
                         qcow2_cache_entry_mark_dirty(s->l2_table_cache,
                                                      l2_slice);
                     }
@@ -1585,38 +1586,108 @@ enum {
     CHECK_FRAG_INFO = 0x2,      /* update BlockFragInfo counters */
 };
 
+/*
+ * Progress of qcow2_check_refcounts(), counted in metadata clusters read: the
+ * L2 tables of the active L1 table, the refcount blocks, and the same L2
+ * tables again for the OFLAG_COPIED check.
+ */
+typedef struct Qcow2CheckProgress {
+    BlockDriverCheckStatusCB *status_cb;
+    void *cb_opaque;
+
+    /* Work of the parts of the check that have completed */
+    int64_t done;
+    int64_t work_size;
+} Qcow2CheckProgress;
+
+static void check_progress_report(BlockDriverState *bs,
+                                  Qcow2CheckProgress *progress, int64_t offset)
+{
+    if (progress) {
+        progress->status_cb(bs, progress->done + offset, progress->work_size,
+                            progress->cb_opaque);
+    }
+}
+
 /*
  * Increases the refcount in the given refcount table for the all clusters
- * referenced in the L2 table. While doing so, performs some checks on L2
- * entries.
+ * referenced in the L2 table, which the caller has read from @l2_offset into
+ * @l2_table. While doing so, performs some checks on L2 entries.
  *
  * Returns the number of errors found by the checks or -errno if an internal
  * error occurred.
  */
 static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
                               void **refcount_table,
-                              int64_t *refcount_table_size, int64_t l2_offset,
+                              int64_t *refcount_table_size,
+                              uint64_t *l2_table, int64_t l2_offset,
                               int flags, BdrvCheckMode fix, bool active)
 {
     BDRVQcow2State *s = bs->opaque;
-    uint64_t *l2_table, l2_entry;
+    uint64_t l2_entry, l2_bitmap;
     uint64_t next_contiguous_offset = 0;
-    int i, l2_size, nb_csectors, ret;
-
-    /* Read L2 table from disk */
-    l2_size = s->l2_size * sizeof(uint64_t);
-    l2_table = g_malloc(l2_size);
-
-    ret = bdrv_pread(bs->file, l2_offset, l2_table, l2_size);
-    if (ret < 0) {
-        fprintf(stderr, "ERROR: I/O error in check_refcounts_l2\n");
-        res->check_errors++;
-        goto fail;
-    }
+    int i, nb_csectors, ret;
 
     /* Do the actual checks */
     for(i = 0; i < s->l2_size; i++) {
-        l2_entry = be64_to_cpu(l2_table[i]);
+        l2_entry = get_l2_entry(s, l2_table, i);
+        l2_bitmap = get_l2_bitmap(s, l2_table, i);
+
+        if (has_subclusters(s)) {
+            uint64_t new_bitmap = l2_bitmap;
+
+            switch (qcow2_get_cluster_type(bs, l2_entry)) {
+            case QCOW2_CLUSTER_COMPRESSED:
+                /* Compressed clusters have no subclusters */
+                new_bitmap = 0;
+                break;
+            case QCOW2_CLUSTER_UNALLOCATED:
+                /* Subclusters can't be allocated without a host cluster */
+                new_bitmap &= ~QCOW_L2_BITMAP_ALL_ALLOC;
+                break;
+            default:
+                /* Subclusters can't be both allocated and zero; prefer zero */
+                new_bitmap &= ~((l2_bitmap >> 32) & QCOW_L2_BITMAP_ALL_ALLOC);
+                break;
+            }
+
+            if (new_bitmap != l2_bitmap) {
+                res->corruptions++;
+                fprintf(stderr, "%s L2 entry %d (L2 offset %#" PRIx64 "): "
+                        "invalid subcluster allocation bitmap %#" PRIx64 "\n",
+                        fix & BDRV_FIX_ERRORS ? "Repairing" : "ERROR",
+                        i, l2_offset, l2_bitmap);
+                if (fix & BDRV_FIX_ERRORS) {
+                    uint64_t l2e_offset =
+                        l2_offset + (uint64_t)i * l2_entry_size(s);
+                    int ign = active ? QCOW2_OL_ACTIVE_L2 :
+                                       QCOW2_OL_INACTIVE_L2;
+
+                    set_l2_bitmap(s, l2_table, i, new_bitmap);
+                    ret = qcow2_pre_write_overlap_check(bs, ign, l2e_offset,
+                                                        l2_entry_size(s),
+                                                        false);
+                    if (ret < 0) {
+                        fprintf(stderr, "ERROR: Overlap check failed\n");
+                        res->check_errors++;
+                        goto fail;
+                    }
+
+                    ret = bdrv_pwrite_sync(bs->file, l2e_offset,
+                                           &l2_table[i * l2_entry_size(s) /
+                                                     sizeof(uint64_t)],
+                                           l2_entry_size(s));
+                    if (ret < 0) {
+                        fprintf(stderr, "ERROR: Failed to overwrite L2 "
+                                "table entry: %s\n", strerror(-ret));
+                        res->check_errors++;
+                    } else {
+                        res->corruptions--;
+                        res->corruptions_fixed++;
+                    }
+                }
+            }
+        }
 
         switch (qcow2_get_cluster_type(bs, l2_entry)) {
         case QCOW2_CLUSTER_COMPRESSED:
@@ -1680,14 +1751,14 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
                             offset);
                     if (fix & BDRV_FIX_ERRORS) {
                         uint64_t l2e_offset =
-                            l2_offset + (uint64_t)i * sizeof(uint64_t);
+                            l2_offset + (uint64_t)i * l2_entry_size(s);
                         int ign = active ? QCOW2_OL_ACTIVE_L2 :
                                            QCOW2_OL_INACTIVE_L2;
 
                         l2_entry = QCOW_OFLAG_ZERO;
-                        l2_table[i] = cpu_to_be64(l2_entry);
+                        set_l2_entry(s, l2_table, i, l2_entry);
                         ret = qcow2_pre_write_overlap_check(bs, ign,
-                                l2e_offset, sizeof(uint64_t), false);
+                                l2e_offset, l2_entry_size(s), false);
                         if (ret < 0) {
                             fprintf(stderr, "ERROR: Overlap check failed\n");
                             res->check_errors++;
@@ -1697,7 +1768,9 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
                         }
 
                         ret = bdrv_pwrite_sync(bs->file, l2e_offset,
-                                               &l2_table[i], sizeof(uint64_t));
+                                               &l2_table[i * l2_entry_size(s) /
+                                                         sizeof(uint64_t)],
+                                               l2_entry_size(s));
                         if (ret < 0) {
                             fprintf(stderr, "ERROR: Failed to overwrite L2 "
                                     "table entry: %s\n", strerror(-ret));
@@ -1748,18 +1821,51 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
         }
     }
 
-    g_free(l2_table);
     return 0;
 
 fail:
-    g_free(l2_table);
     return ret;
 }
 
+/*
+ * Number of L2 tables that check_refcounts_l1() reads ahead of the one it is
+ * checking.  Bounds the memory used for the tables to this many clusters.
+ */
+#define CHECK_L2_READ_AHEAD (QCOW2_MAX_WORKERS * 2)
+
+typedef struct CheckL2Slot {
+    uint64_t *l2_table;
+    int ret;
+    bool done;
+} CheckL2Slot;
+
+typedef struct CheckL2ReadTask {
+    AioTask task;
+
+    BlockDriverState *bs;
+    int64_t l2_offset;
+    CheckL2Slot *slot;
+} CheckL2ReadTask;
+
+static coroutine_fn int check_l2_read_task_entry(AioTask *task)
+{
+    CheckL2ReadTask *t = container_of(task, CheckL2ReadTask, task);
+    BDRVQcow2State *s = t->bs->opaque;
+
+    t->slot->ret = bdrv_co_pread(t->bs->file, t->l2_offset,
+                                 s->l2_size * l2_entry_size(s),
+                                 t->slot->l2_table, 0);
+    t->slot->done = true;
+
+    /* Errors are reported through the slot, not through the pool */
+    return 0;
+}
+
 /*
  * Increases the refcount for the L1 table, its L2 tables and all referenced
  * clusters in the given refcount table. While doing so, performs some checks
- * on L1 and L2 entries.
+ * on L1 and L2 entries. If @progress is not NULL, one unit of work is
+ * reported for each L1 entry.
  *
  * Returns the number of errors found by the checks or -errno if an internal
  * error occurred.
@@ -1769,10 +1875,16 @@ static int check_refcounts_l1(BlockDriverState *bs,
                               void **refcount_table,
                               int64_t *refcount_table_size,
                               int64_t l1_table_offset, int l1_size,
-                              int flags, BdrvCheckMode fix, bool active)
+                              int flags, BdrvCheckMode fix, bool active,
+                              Qcow2CheckProgress *progress)
 {
     BDRVQcow2State *s = bs->opaque;
     uint64_t *l1_table = NULL, l2_offset, l1_size2;
+    int l2_size = s->l2_size * l2_entry_size(s);
+    AioTaskPool *aio = NULL;
+    CheckL2Slot *slots = NULL;
+    int nb_slots = 0, read_index = 0;
+    int64_t nb_read = 0, nb_checked = 0;
     int i, ret;
 
     l1_size2 = l1_size * sizeof(uint64_t);
@@ -1802,39 +1914,116 @@ static int check_refcounts_l1(BlockDriverState *bs,
             be64_to_cpus(&l1_table[i]);
     }
 
+    /*
+     * When only checking, read L2 tables ahead with several requests in
+     * flight, through a ring of CHECK_L2_READ_AHEAD buffers.  The tables
+     * are still checked one by one in L1 order, so the output and the
+     * refcounts are the same as with sequential reads.  Repairs write to the
+     * L2 tables, so they keep reading them one at a time.
+     */
+    if (!fix && qemu_in_coroutine()) {
+        aio = aio_task_pool_new(QCOW2_MAX_WORKERS);
+        nb_slots = CHECK_L2_READ_AHEAD;
+    } else {
+        nb_slots = 1;
+    }
+    slots = g_new0(CheckL2Slot, nb_slots);
+    for (i = 0; i < nb_slots; i++) {
+        slots[i].l2_table = g_try_malloc(l2_size);
+        if (slots[i].l2_table == NULL) {
+            ret = -ENOMEM;
+            res->check_errors++;
+            goto fail;
+        }
+    }
+
     /* Do the actual checks */
-    for(i = 0; i < l1_size; i++) {
-        l2_offset = l1_table[i];
-        if (l2_offset) {
-            /* Mark L2 table as used */
-            l2_offset &= L1E_OFFSET_MASK;
-            ret = qcow2_inc_refcounts_imrt(bs, res,
-                                           refcount_table, refcount_table_size,
-                                           l2_offset, s->cluster_size);
-            if (ret < 0) {
-                goto fail;
-            }
+    for (i = 0; i < l1_size; i++) {
+        CheckL2Slot *slot;
 
-            /* L2 tables are cluster aligned */
-            if (offset_into_cluster(s, l2_offset)) {
-                fprintf(stderr, "ERROR l2_offset=%" PRIx64 ": Table is not "
-                    "cluster aligned; L1 entry corrupted\n", l2_offset);
-                res->corruptions++;
-            }
+        check_progress_report(bs, progress, i);
+        if (!l1_table[i]) {
+            continue;
+        }
+        l2_offset = l1_table[i] & L1E_OFFSET_MASK;
 
-            /* Process and check L2 entries */
-            ret = check_refcounts_l2(bs, res, refcount_table,
-                                     refcount_table_size, l2_offset, flags,
-                                     fix, active);
-            if (ret < 0) {
-                goto fail;
+        /* Mark L2 table as used */
+        ret = qcow2_inc_refcounts_imrt(bs, res,
+                                       refcount_table, refcount_table_size,
+                                       l2_offset, s->cluster_size);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        /* L2 tables are cluster aligned */
+        if (offset_into_cluster(s, l2_offset)) {
+            fprintf(stderr, "ERROR l2_offset=%" PRIx64 ": Table is not "
+                "cluster aligned; L1 entry corrupted\n", l2_offset);
+            res->corruptions++;
+        }
+
+        /* Read L2 table from disk */
+        slot = &slots[nb_checked % nb_slots];
+        if (aio) {
+            /* Queue reads for the following tables, this one included */
+            while (read_index < l1_size &&
+                   nb_read < nb_checked + nb_slots)
+            {
+                CheckL2ReadTask *task;
+                uint64_t l1_entry = l1_table[read_index++];
+
+                if (!l1_entry) {
+                    continue;
+                }
+
+                task = g_new(CheckL2ReadTask, 1);
+                *task = (CheckL2ReadTask) {
+                    .task.func = check_l2_read_task_entry,
+                    .bs = bs,
+                    .l2_offset = l1_entry & L1E_OFFSET_MASK,
+                    .slot = &slots[nb_read++ % nb_slots],
+                };
+                task->slot->done = false;
+                aio_task_pool_start_task(aio, &task->task);
+            }
+            while (!slot->done) {
+                aio_task_pool_wait_one(aio);
             }
+            ret = slot->ret;
+        } else {
+            ret = bdrv_pread(bs->file, l2_offset, slot->l2_table, l2_size);
+        }
+        nb_checked++;
+        if (ret < 0) {
+            fprintf(stderr, "ERROR: I/O error in check_refcounts_l2\n");
+            res->check_errors++;
+            goto fail;
+        }
+
+        /* Process and check L2 entries */
+        ret = check_refcounts_l2(bs, res, refcount_table,
+                                 refcount_table_size, slot->l2_table,
+                                 l2_offset, flags, fix, active);
+        if (ret < 0) {
+            goto fail;
         }
     }
-    g_free(l1_table);
-    return 0;
+    if (progress) {
+        progress->done += l1_size;
+    }
+    ret = 0;
 
 fail:
+    if (aio) {
+        aio_task_pool_wait_all(aio);
+        aio_task_pool_free(aio);
+    }
+    if (slots) {
+        for (i = 0; i < nb_slots; i++) {
+            g_free(slots[i].l2_table);
+        }
+        g_free(slots);
+    }
     g_free(l1_table);
     return ret;
 }
@@ -1848,7 +2037,7 @@ fail:
  * (qcow2_check_refcounts) by the time this function is called).
  */
 static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
-                              BdrvCheckMode fix)
+                              BdrvCheckMode fix, Qcow2CheckProgress *progress)
 {
     BDRVQcow2State *s = bs->opaque;
     uint64_t *l2_table = qemu_blockalign(bs, s->cluster_size);
@@ -1874,6 +2063,7 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
         uint64_t l2_offset = l1_entry & L1E_OFFSET_MASK;
         int l2_dirty = 0;
 
+        check_progress_report(bs, progress, i);
         if (!l2_offset) {
             continue;
         }
@@ -1904,7 +2094,7 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
         }
 
         ret = bdrv_pread(bs->file, l2_offset, l2_table,
-                         s->l2_size * sizeof(uint64_t));
+                         s->l2_size * l2_entry_size(s));
         if (ret < 0) {
             fprintf(stderr, "ERROR: Could not read L2 table: %s\n",
                     strerror(-ret));
@@ -1913,7 +2103,7 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
         }
 
         for (j = 0; j < s->l2_size; j++) {
-            uint64_t l2_entry = be64_to_cpu(l2_table[j]);
+            uint64_t l2_entry = get_l2_entry(s, l2_table, j);
             uint64_t data_offset = l2_entry & L2E_OFFSET_MASK;
             QCow2ClusterType cluster_type = qcow2_get_cluster_type(bs, l2_entry);
 
@@ -1936,9 +2126,10 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
                             "l2_entry=%" PRIx64 " refcount=%" PRIu64 "\n",
                             repair ? "Repairing" : "ERROR", l2_entry, refcount);
                     if (repair) {
-                        l2_table[j] = cpu_to_be64(refcount == 1
-                                    ? l2_entry |  QCOW_OFLAG_COPIED
-                                    : l2_entry & ~QCOW_OFLAG_COPIED);
+                        set_l2_entry(s, l2_table, j,
+                                     refcount == 1 ?
+                                     l2_entry |  QCOW_OFLAG_COPIED :
+                                     l2_entry & ~QCOW_OFLAG_COPIED);
                         l2_dirty++;
                     }
                 }
@@ -1968,6 +2159,9 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
             res->corruptions_fixed += l2_dirty;
         }
     }
+    if (progress) {
+        progress->done += s->l1_size;
+    }
 
     ret = 0;
 
@@ -2088,7 +2282,8 @@ resize_fail:
  */
 static int calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
                                BdrvCheckMode fix, bool *rebuild,
-                               void **refcount_table, int64_t *nb_clusters)
+                               void **refcount_table, int64_t *nb_clusters,
+                               Qcow2CheckProgress *progress)
 {
     BDRVQcow2State *s = bs->opaque;
     int64_t i;
@@ -2115,7 +2310,7 @@ static int calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
     /* current L1 table */
     ret = check_refcounts_l1(bs, res, refcount_table, nb_clusters,
                              s->l1_table_offset, s->l1_size, CHECK_FRAG_INFO,
-                             fix, true);
+                             fix, true, progress);
     if (ret < 0) {
         return ret;
     }
@@ -2145,7 +2340,7 @@ static int calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
         }
         ret = check_refcounts_l1(bs, res, refcount_table, nb_clusters,
                                  sn->l1_table_offset, sn->l1_size, 0, fix,
-                                 false);
+                                 false, NULL);
         if (ret < 0) {
             return ret;
         }
@@ -2190,7 +2385,8 @@ static int calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
 static void compare_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
                               BdrvCheckMode fix, bool *rebuild,
                               int64_t *highest_cluster,
-                              void *refcount_table, int64_t nb_clusters)
+                              void *refcount_table, int64_t nb_clusters,
+                              Qcow2CheckProgress *progress)
 {
     BDRVQcow2State *s = bs->opaque;
     int64_t i;
@@ -2198,6 +2394,11 @@ static void compare_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
     int ret;
 
     for (i = 0, *highest_cluster = 0; i < nb_clusters; i++) {
+        /* One unit of work for each refcount block */
+        if (!(i & (s->refcount_block_size - 1))) {
+            check_progress_report(bs, progress, i >> s->refcount_block_bits);
+        }
+
         ret = qcow2_get_refcount(bs, i, &refcount1);
         if (ret < 0) {
             fprintf(stderr, "Can't get refcount for cluster %" PRId64 ": %s\n",
@@ -2249,6 +2450,9 @@ static void compare_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
             }
         }
     }
+    if (progress) {
+        progress->done += DIV_ROUND_UP(nb_clusters, s->refcount_block_size);
+    }
 }
 
 /*
@@ -2519,16 +2723,20 @@ fail:
 }
 
 /*
- * Checks an image for refcount consistency.
+ * Checks an image for refcount consistency. If @status_cb is not NULL, it is
+ * called to report the progress of the check.
  *
  * Returns 0 if no errors are found, the number of errors in case the image is
  * detected as corrupted, and -errno when an internal error occurred.
  */
 int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
-                          BdrvCheckMode fix)
+                          BdrvCheckMode fix,
+                          BlockDriverCheckStatusCB *status_cb,
+                          void *cb_opaque)
 {
     BDRVQcow2State *s = bs->opaque;
     BdrvCheckResult pre_compare_res;
+    Qcow2CheckProgress progress_info, *progress = NULL;
     int64_t size, highest_cluster, nb_clusters;
     void *refcount_table = NULL;
     bool rebuild = false;
@@ -2549,8 +2757,19 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
     res->bfi.total_clusters =
         size_to_clusters(s, bs->total_sectors * BDRV_SECTOR_SIZE);
 
+    /* The extra passes that repairs need are not reported */
+    if (status_cb) {
+        progress_info = (Qcow2CheckProgress) {
+            .status_cb  = status_cb,
+            .cb_opaque  = cb_opaque,
+            .work_size  = 2 * s->l1_size +
+                          DIV_ROUND_UP(nb_clusters, s->refcount_block_size),
+        };
+        progress = &progress_info;
+    }
+
     ret = calculate_refcounts(bs, res, fix, &rebuild, &refcount_table,
-                              &nb_clusters);
+                              &nb_clusters, progress);
     if (ret < 0) {
         goto fail;
     }
@@ -2560,7 +2779,7 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
      * result should be ignored */
     pre_compare_res = *res;
     compare_refcounts(bs, res, 0, &rebuild, &highest_cluster, refcount_table,
-                      nb_clusters);
+                      nb_clusters, progress);
 
     if (rebuild && (fix & BDRV_FIX_ERRORS)) {
         BdrvCheckResult old_res = *res;
@@ -2581,7 +2800,7 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
         rebuild = false;
         memset(refcount_table, 0, refcount_array_byte_size(s, nb_clusters));
         ret = calculate_refcounts(bs, res, 0, &rebuild, &refcount_table,
-                                  &nb_clusters);
+                                  &nb_clusters, NULL);
         if (ret < 0) {
             goto fail;
         }
@@ -2594,7 +2813,8 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
             *res = (BdrvCheckResult){ 0 };
 
             compare_refcounts(bs, res, BDRV_FIX_LEAKS, &rebuild,
-                              &highest_cluster, refcount_table, nb_clusters);
+                              &highest_cluster, refcount_table, nb_clusters,
+                              NULL);
             if (rebuild) {
                 fprintf(stderr, "ERROR rebuilt refcount structure is still "
                         "broken\n");
@@ -2625,12 +2845,12 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
         if (res->leaks || res->corruptions) {
             *res = pre_compare_res;
             compare_refcounts(bs, res, fix, &rebuild, &highest_cluster,
-                              refcount_table, nb_clusters);
+                              refcount_table, nb_clusters, NULL);
         }
     }
 
     /* check OFLAG_COPIED */
-    ret = check_oflag_copied(bs, res, fix);
+    ret = check_oflag_copied(bs, res, fix, progress);
     if (ret < 0) {
         goto fail;
     }
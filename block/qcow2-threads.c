@@ -28,19 +28,30 @@
 #define ZLIB_CONST
 #include <zlib.h>
 
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#include <zstd_errors.h>
+#endif
+
 #include "qcow2.h"
 #include "block/thread-pool.h"
 #include "crypto.h"
 
+/*
+ * Run @func in the thread pool once fewer than @max_threads tasks of this
+ * image are running there.  Encryption uses QCOW2_MAX_THREADS, the number of
+ * cipher instances; compression uses the compress-threads option.
+ */
 static int coroutine_fn
-qcow2_co_process(BlockDriverState *bs, ThreadPoolFunc *func, void *arg)
+qcow2_co_process(BlockDriverState *bs, ThreadPoolFunc *func, void *arg,
+                 int max_threads)
 {
     int ret;
     BDRVQcow2State *s = bs->opaque;
     ThreadPool *pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
 
     qemu_co_mutex_lock(&s->lock);
-    while (s->nb_threads >= QCOW2_MAX_THREADS) {
+    while (s->nb_threads >= max_threads) {
         qemu_co_queue_wait(&s->thread_task_queue, &s->lock);
     }
     s->nb_threads++;
@@ -50,7 +61,8 @@ qcow2_co_process(BlockDriverState *bs, ThreadPoolFunc *func, void *arg)
 
     qemu_co_mutex_lock(&s->lock);
     s->nb_threads--;
-    qemu_co_queue_next(&s->thread_task_queue);
+    /* Waiters have different limits, let all of them check again */
+    qemu_co_queue_restart_all(&s->thread_task_queue);
     qemu_co_mutex_unlock(&s->lock);
 
     return ret;
@@ -61,7 +73,8 @@ qcow2_co_process(BlockDriverState *bs, ThreadPoolFunc *func, void *arg)
  * Compression
  */
 
-typedef ssize_t (*Qcow2CompressFunc)(void *dest, size_t dest_size,
+typedef ssize_t (*Qcow2CompressFunc)(Qcow2CompressionType type,
+                                     void *dest, size_t dest_size,
                                      const void *src, size_t src_size);
 typedef struct Qcow2CompressData {
     void *dest;
@@ -70,11 +83,14 @@ typedef struct Qcow2CompressData {
     size_t src_size;
     ssize_t ret;
 
+    Qcow2CompressionType type;
     Qcow2CompressFunc func;
 } Qcow2CompressData;
 
 /*
- * qcow2_compress()
+ * qcow2_zlib_compress()
+ *
+ * Compress @src_size bytes of data using zlib compression method
  *
  * @dest - destination buffer, @dest_size bytes
  * @src - source buffer, @src_size bytes
@@ -83,8 +99,8 @@ typedef struct Qcow2CompressData {
  *          -ENOMEM destination buffer is not enough to store compressed data
  *          -EIO    on any other error
  */
-static ssize_t qcow2_compress(void *dest, size_t dest_size,
-                              const void *src, size_t src_size)
+static ssize_t qcow2_zlib_compress(void *dest, size_t dest_size,
+                                   const void *src, size_t src_size)
 {
     ssize_t ret;
     z_stream strm;
@@ -119,19 +135,19 @@ static ssize_t qcow2_compress(void *dest, size_t dest_size,
 }
 
 /*
- * qcow2_decompress()
+ * qcow2_zlib_decompress()
  *
  * Decompress some data (not more than @src_size bytes) to produce exactly
- * @dest_size bytes.
+ * @dest_size bytes using zlib compression method
  *
  * @dest - destination buffer, @dest_size bytes
  * @src - source buffer, @src_size bytes
  *
  * Returns: 0 on success
- *          -1 on fail
+ *          -EIO on fail
  */
-static ssize_t qcow2_decompress(void *dest, size_t dest_size,
-                                const void *src, size_t src_size)
+static ssize_t qcow2_zlib_decompress(void *dest, size_t dest_size,
+                                     const void *src, size_t src_size)
 {
     int ret = 0;
     z_stream strm;
@@ -144,7 +160,7 @@ static ssize_t qcow2_decompress(void *dest, size_t dest_size,
 
     ret = inflateInit2(&strm, -12);
     if (ret != Z_OK) {
-        return -1;
+        return -EIO;
     }
 
     ret = inflate(&strm, Z_FINISH);
@@ -154,7 +170,9 @@ static ssize_t qcow2_decompress(void *dest, size_t dest_size,
          * @src buffer may be processed partly (because in qcow2 we know size of
          * compressed data with precision of one sector)
          */
-        ret = -1;
+        ret = -EIO;
+    } else {
+        ret = 0;
     }
 
     inflateEnd(&strm);
@@ -162,11 +180,189 @@ static ssize_t qcow2_decompress(void *dest, size_t dest_size,
     return ret;
 }
 
+#ifdef CONFIG_ZSTD
+
+/*
+ * qcow2_zstd_compress()
+ *
+ * Compress @src_size bytes of data using zstd compression method
+ *
+ * @dest - destination buffer, @dest_size bytes
+ * @src - source buffer, @src_size bytes
+ *
+ * Returns: compressed size on success
+ *          -ENOMEM destination buffer is not enough to store compressed data
+ *          -EIO    on any other error
+ */
+static ssize_t qcow2_zstd_compress(void *dest, size_t dest_size,
+                                   const void *src, size_t src_size)
+{
+    ssize_t ret;
+    size_t zstd_ret;
+    ZSTD_outBuffer output = {
+        .dst = dest,
+        .size = dest_size,
+        .pos = 0
+    };
+    ZSTD_inBuffer input = {
+        .src = src,
+        .size = src_size,
+        .pos = 0
+    };
+    ZSTD_CCtx *cctx = ZSTD_createCCtx();
+
+    if (!cctx) {
+        return -EIO;
+    }
+
+    /*
+     * Use the streaming interface so that the result is a single frame
+     * that the streaming decompression below can stop at.  With
+     * ZSTD_e_end a single call compresses and flushes everything unless
+     * @dest is too small, and we cannot give it more space anyway.
+     */
+    zstd_ret = ZSTD_compressStream2(cctx, &output, &input, ZSTD_e_end);
+    if (ZSTD_isError(zstd_ret)) {
+        ret = ZSTD_getErrorCode(zstd_ret) == ZSTD_error_dstSize_tooSmall ?
+              -ENOMEM : -EIO;
+    } else if (zstd_ret) {
+        /* Not everything could be flushed to @dest */
+        ret = -ENOMEM;
+    } else {
+        assert(output.pos <= dest_size);
+        ret = output.pos;
+    }
+
+    ZSTD_freeCCtx(cctx);
+    return ret;
+}
+
+/*
+ * qcow2_zstd_decompress()
+ *
+ * Decompress some data (not more than @src_size bytes) to produce exactly
+ * @dest_size bytes using zstd compression method
+ *
+ * @dest - destination buffer, @dest_size bytes
+ * @src - source buffer, @src_size bytes
+ *
+ * Returns: 0 on success
+ *          -EIO on any error
+ */
+static ssize_t qcow2_zstd_decompress(void *dest, size_t dest_size,
+                                     const void *src, size_t src_size)
+{
+    size_t zstd_ret = 0;
+    ssize_t ret = 0;
+    ZSTD_outBuffer output = {
+        .dst = dest,
+        .size = dest_size,
+        .pos = 0
+    };
+    ZSTD_inBuffer input = {
+        .src = src,
+        .size = src_size,
+        .pos = 0
+    };
+    ZSTD_DCtx *dctx = ZSTD_createDCtx();
+
+    if (!dctx) {
+        return -EIO;
+    }
+
+    /*
+     * As with zlib, @src may extend past the end of the compressed data
+     * up to the next sector boundary, so decompress until @dest is full
+     * rather than until the input is consumed.
+     */
+    while (output.pos < output.size) {
+        size_t last_in_pos = input.pos;
+        size_t last_out_pos = output.pos;
+
+        zstd_ret = ZSTD_decompressStream(dctx, &output, &input);
+        if (ZSTD_isError(zstd_ret)) {
+            ret = -EIO;
+            break;
+        }
+
+        /* Corrupted input could otherwise keep us looping forever */
+        if (last_in_pos >= input.pos && last_out_pos >= output.pos) {
+            ret = -EIO;
+            break;
+        }
+    }
+
+    /*
+     * A frame that is not finished when @dest is full decompresses to
+     * more than a cluster, so the data is corrupted.
+     */
+    if (zstd_ret > 0) {
+        ret = -EIO;
+    }
+
+    ZSTD_freeDCtx(dctx);
+    return ret;
+}
+
+#endif
+
+/*
+ * qcow2_compress()
+ *
+ * Compress @src_size bytes of data from @src into @dest using the
+ * compression method @type.  This is the synchronous helper behind
+ * qcow2_co_compress(), usable outside of coroutine context.
+ *
+ * Returns: compressed size on success
+ *          -ENOMEM destination buffer is not enough to store compressed data
+ *          -EIO    on any other error
+ */
+ssize_t qcow2_compress(Qcow2CompressionType type,
+                       void *dest, size_t dest_size,
+                       const void *src, size_t src_size)
+{
+    switch (type) {
+    case QCOW2_COMPRESSION_TYPE_ZLIB:
+        return qcow2_zlib_compress(dest, dest_size, src, src_size);
+#ifdef CONFIG_ZSTD
+    case QCOW2_COMPRESSION_TYPE_ZSTD:
+        return qcow2_zstd_compress(dest, dest_size, src, src_size);
+#endif
+    default:
+        abort();
+    }
+}
+
+/*
+ * qcow2_decompress()
+ *
+ * Decompress some data (not more than @src_size bytes) to produce exactly
+ * @dest_size bytes using the compression method @type.
+ *
+ * Returns: 0 on success
+ *          -EIO on fail
+ */
+ssize_t qcow2_decompress(Qcow2CompressionType type,
+                         void *dest, size_t dest_size,
+                         const void *src, size_t src_size)
+{
+    switch (type) {
+    case QCOW2_COMPRESSION_TYPE_ZLIB:
+        return qcow2_zlib_decompress(dest, dest_size, src, src_size);
+#ifdef CONFIG_ZSTD
+    case QCOW2_COMPRESSION_TYPE_ZSTD:
+        return qcow2_zstd_decompress(dest, dest_size, src, src_size);
+#endif
+    default:
+        abort();
+    }
+}
+
 static int qcow2_compress_pool_func(void *opaque)
 {
     Qcow2CompressData *data = opaque;
 
-    data->ret = data->func(data->dest, data->dest_size,
+    data->ret = data->func(data->type, data->dest, data->dest_size,
                            data->src, data->src_size);
 
     return 0;
@@ -176,15 +372,17 @@ static ssize_t coroutine_fn
 qcow2_co_do_compress(BlockDriverState *bs, void *dest, size_t dest_size,
                      const void *src, size_t src_size, Qcow2CompressFunc func)
 {
+    BDRVQcow2State *s = bs->opaque;
     Qcow2CompressData arg = {
         .dest = dest,
         .dest_size = dest_size,
         .src = src,
         .src_size = src_size,
+        .type = s->compression_type,
         .func = func,
     };
 
-    qcow2_co_process(bs, qcow2_compress_pool_func, &arg);
+    qcow2_co_process(bs, qcow2_compress_pool_func, &arg, s->compress_threads);
 
     return arg.ret;
 }
@@ -248,7 +446,8 @@ qcow2_co_encdec(BlockDriverState *bs, uint64_t file_cluster_offset,
         .func = func,
     };
 
-    return qcow2_co_process(bs, qcow2_encdec_pool_func, &arg);
+    return qcow2_co_process(bs, qcow2_encdec_pool_func, &arg,
+                            QCOW2_MAX_THREADS);
 }
 
 int coroutine_fn
@@ -1609,7 +1609,9 @@ static void coroutine_fn bdrv_qed_co_invalidate_cache(BlockDriverState *bs,
 
 static int coroutine_fn bdrv_qed_co_check(BlockDriverState *bs,
                                           BdrvCheckResult *result,
-                                          BdrvCheckMode fix)
+                                          BdrvCheckMode fix,
+                                          BlockDriverCheckStatusCB *status_cb,
+                                          void *cb_opaque)
 {
     BDRVQEDState *s = bs->opaque;
     int ret;
@@ -359,6 +359,18 @@ static int raw_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
     return bdrv_get_info(bs->file->bs, bdi);
 }
 
+static int raw_get_host_fd(BlockDriverState *bs, int64_t *offset)
+{
+    BDRVRawState *s = bs->opaque;
+    int fd;
+
+    fd = bdrv_get_host_fd(bs->file->bs, offset);
+    if (fd >= 0) {
+        *offset += s->offset;
+    }
+    return fd;
+}
+
 static void raw_refresh_limits(BlockDriverState *bs, Error **errp)
 {
     if (bs->probed) {
@@ -569,6 +581,7 @@ BlockDriver bdrv_raw = {
     .has_variable_length  = true,
     .bdrv_measure         = &raw_measure,
     .bdrv_get_info        = &raw_get_info,
+    .bdrv_get_host_fd     = &raw_get_host_fd,
     .bdrv_refresh_limits  = &raw_refresh_limits,
     .bdrv_probe_blocksizes = &raw_probe_blocksizes,
     .bdrv_probe_geometry  = &raw_probe_geometry,
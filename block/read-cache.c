@@ -0,0 +1,792 @@
+/*
+ * Read cache filter driver, shared between processes
+ *
+ * Copyright (c) 2019 QEMU contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 or
+ * (at your option) version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The cache lives in a file that is mapped with MAP_SHARED, so every
+ * process that opens the same file (typically on tmpfs) sees the same
+ * cache.  Lines are keyed by a hash of the image ID and by the line's index
+ * in the image, so nodes that read the same base image through different
+ * chains, in the same or in different processes, share the cached data.
+ * The image ID is given by the user, who must choose a new one whenever the
+ * image changes other than by writes through a node that uses the cache.
+ *
+ * The file holds a header, a table of slots and the cached data.  The
+ * slots form sets of READ_CACHE_WAYS entries; a line can only be stored in
+ * the set that its key hashes to.
+ *
+ * Slots are protected by a sequence counter that is odd while the slot is
+ * being written.  Writers claim a slot with a compare-and-swap from an even
+ * to an odd value, readers copy the data out and check that the counter
+ * did not change in the meantime.  A process that dies while writing a slot
+ * leaves it unusable, which only costs one line of cache.
+ *
+ * Writes bump a generation counter in the header before and after they
+ * run, and then drop the lines they touched.  A read only inserts what it
+ * read if the generation did not change meanwhile, and checks it again
+ * after the insertion, so that a line read from the image before a write
+ * in another process finished does not survive that write.
+ */
+
+#include "qemu/osdep.h"
+#include <sys/file.h>
+#include <sys/mman.h>
+#include "block/block_int.h"
+#include "qapi/error.h"
+#include "qapi/qapi-visit-block-core.h"
+#include "qemu/atomic.h"
+#include "qemu/module.h"
+#include "qemu/option.h"
+#include "qemu/units.h"
+#include "qemu/xxhash.h"
+#include "trace.h"
+
+#define READ_CACHE_MAGIC        0x48434143524d4551ULL /* "QEMRCACH" */
+#define READ_CACHE_VERSION      2
+#define READ_CACHE_HEADER_SIZE  4096
+#define READ_CACHE_WAYS         8
+
+#define READ_CACHE_DEFAULT_SIZE         (256 * MiB)
+#define READ_CACHE_DEFAULT_LINE_SIZE    (64 * KiB)
+/* Most bytes of consecutive missing lines read with one child request */
+#define READ_CACHE_MAX_FILL             (2 * MiB)
+
+typedef struct ReadCacheHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t line_size;
+    uint64_t nb_lines;
+    uint32_t clock;
+    uint32_t write_gen; /* incremented around every write to any image */
+} ReadCacheHeader;
+
+/*
+ * All fields are 32 bits wide so that they can be accessed atomically on
+ * every host.
+ */
+typedef struct ReadCacheSlot {
+    uint32_t seq;       /* odd while the slot is being written */
+    uint32_t len;       /* number of valid bytes in the line */
+    uint32_t image[2];  /* hash of the image ID */
+    uint32_t line;      /* index of the line in the image plus 1, 0 if free */
+    uint32_t last_use;  /* header->clock at the last insertion or hit */
+} ReadCacheSlot;
+
+typedef struct BDRVReadCacheState {
+    int fd;
+    void *map;
+    size_t map_size;
+
+    ReadCacheHeader *header;
+    ReadCacheSlot *slots;
+    uint8_t *data;
+    uint64_t nb_sets;
+    uint32_t line_size;
+
+    uint32_t image[2];
+    bool lru;
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+} BDRVReadCacheState;
+
+static QemuOptsList read_cache_opts = {
+    .name = "read-cache",
+    .head = QTAILQ_HEAD_INITIALIZER(read_cache_opts.head),
+    .desc = {
+        {
+            .name = "path",
+            .type = QEMU_OPT_STRING,
+            .help = "File that holds the cache",
+        },
+        {
+            .name = "image-id",
+            .type = QEMU_OPT_STRING,
+            .help = "Identifies the image content in the cache",
+        },
+        {
+            .name = "size",
+            .type = QEMU_OPT_SIZE,
+            .help = "Size of the cached data (default: 256M)",
+        },
+        {
+            .name = "line-size",
+            .type = QEMU_OPT_SIZE,
+            .help = "Size of a cache line (default: 64k)",
+        },
+        {
+            .name = "eviction",
+            .type = QEMU_OPT_STRING,
+            .help = "Eviction policy (lru, fifo; default: lru)",
+        },
+        { /* end of list */ }
+    },
+};
+
+static void read_cache_hash_image_id(const char *image_id, uint32_t *image)
+{
+    /* 64-bit FNV-1a */
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (; *image_id; image_id++) {
+        hash ^= (uint8_t)*image_id;
+        hash *= 0x100000001b3ULL;
+    }
+    image[0] = hash;
+    image[1] = hash >> 32;
+}
+
+static ReadCacheSlot *read_cache_find_set(BDRVReadCacheState *s,
+                                          uint32_t line)
+{
+    uint64_t image = ((uint64_t)s->image[1] << 32) | s->image[0];
+    uint64_t set = qemu_xxhash4(image, line) % s->nb_sets;
+
+    return &s->slots[set * READ_CACHE_WAYS];
+}
+
+static uint8_t *read_cache_slot_data(BDRVReadCacheState *s,
+                                     ReadCacheSlot *slot)
+{
+    return s->data + (uint64_t)(slot - s->slots) * s->line_size;
+}
+
+static bool read_cache_slot_matches(BDRVReadCacheState *s,
+                                    ReadCacheSlot *slot, uint32_t line)
+{
+    return atomic_read(&slot->line) == line + 1 &&
+           atomic_read(&slot->image[0]) == s->image[0] &&
+           atomic_read(&slot->image[1]) == s->image[1];
+}
+
+/*
+ * Copy line @line to @buf if it is in the cache.  Returns the number of
+ * bytes copied, or 0 on a miss.
+ */
+static uint32_t read_cache_lookup(BDRVReadCacheState *s, uint32_t line,
+                                  uint8_t *buf)
+{
+    ReadCacheSlot *set = read_cache_find_set(s, line);
+    int i;
+
+    for (i = 0; i < READ_CACHE_WAYS; i++) {
+        ReadCacheSlot *slot = &set[i];
+        uint32_t seq = atomic_load_acquire(&slot->seq);
+        uint32_t len;
+
+        if ((seq & 1) || !read_cache_slot_matches(s, slot, line)) {
+            continue;
+        }
+
+        len = MIN(atomic_read(&slot->len), s->line_size);
+        memcpy(buf, read_cache_slot_data(s, slot), len);
+
+        /* The slot may have been reused while we were copying */
+        smp_rmb();
+        if (atomic_read(&slot->seq) != seq) {
+            return 0;
+        }
+
+        if (s->lru) {
+            atomic_set(&slot->last_use,
+                       atomic_fetch_inc(&s->header->clock));
+        }
+        return len;
+    }
+
+    return 0;
+}
+
+/* Claim @slot for writing.  Returns the old sequence number or -1. */
+static int64_t read_cache_claim_slot(ReadCacheSlot *slot)
+{
+    uint32_t seq = atomic_read(&slot->seq);
+
+    if ((seq & 1) || atomic_cmpxchg(&slot->seq, seq, seq + 1) != seq) {
+        return -1;
+    }
+    return seq;
+}
+
+static void read_cache_release_slot(ReadCacheSlot *slot, uint32_t seq)
+{
+    atomic_store_release(&slot->seq, seq + 2);
+}
+
+static void read_cache_insert(BDRVReadCacheState *s, uint32_t line,
+                              const uint8_t *buf, uint32_t len)
+{
+    ReadCacheSlot *set = read_cache_find_set(s, line);
+    ReadCacheSlot *victim = NULL;
+    uint32_t now = atomic_read(&s->header->clock);
+    int64_t seq;
+    int i;
+
+    /* Take a free slot, or else the one that was used least recently */
+    for (i = 0; i < READ_CACHE_WAYS; i++) {
+        ReadCacheSlot *slot = &set[i];
+
+        if (atomic_read(&slot->seq) & 1) {
+            continue;
+        }
+        if (!atomic_read(&slot->line)) {
+            victim = slot;
+            break;
+        }
+        if (!victim ||
+            now - atomic_read(&slot->last_use) >
+            now - atomic_read(&victim->last_use)) {
+            victim = slot;
+        }
+    }
+    if (!victim) {
+        return;
+    }
+
+    seq = read_cache_claim_slot(victim);
+    if (seq < 0) {
+        /* Somebody else is writing to it, just don't cache this line */
+        return;
+    }
+    if (atomic_read(&victim->line)) {
+        s->evictions++;
+    }
+
+    atomic_set(&victim->line, 0);
+    atomic_set(&victim->image[0], s->image[0]);
+    atomic_set(&victim->image[1], s->image[1]);
+    atomic_set(&victim->len, len);
+    memcpy(read_cache_slot_data(s, victim), buf, len);
+    atomic_set(&victim->last_use, atomic_fetch_inc(&s->header->clock));
+    atomic_set(&victim->line, line + 1);
+
+    read_cache_release_slot(victim, seq);
+}
+
+/* Drop the lines that cover [@offset, @offset + @bytes) from the cache */
+static void read_cache_invalidate(BDRVReadCacheState *s, uint64_t offset,
+                                  uint64_t bytes)
+{
+    uint64_t line;
+
+    if (!bytes) {
+        return;
+    }
+
+    for (line = offset / s->line_size;
+         line <= (offset + bytes - 1) / s->line_size; line++)
+    {
+        ReadCacheSlot *set = read_cache_find_set(s, line);
+        int i;
+
+        for (i = 0; i < READ_CACHE_WAYS; i++) {
+            ReadCacheSlot *slot = &set[i];
+            int64_t seq;
+
+            if (!read_cache_slot_matches(s, slot, line)) {
+                continue;
+            }
+            /*
+             * If the claim fails, the slot is being rewritten; whoever
+             * does it read the data before our write finished, and the
+             * write_gen check makes it drop the line again.
+             */
+            seq = read_cache_claim_slot(slot);
+            if (seq >= 0) {
+                if (read_cache_slot_matches(s, slot, line)) {
+                    atomic_set(&slot->line, 0);
+                }
+                read_cache_release_slot(slot, seq);
+            }
+        }
+    }
+}
+
+/*
+ * Open (and if necessary create) the cache file and map it.  The geometry
+ * of an existing cache file must match the options.
+ */
+static int read_cache_map(BDRVReadCacheState *s, const char *path,
+                          uint64_t nb_lines, Error **errp)
+{
+    size_t slots_size = ROUND_UP(nb_lines * sizeof(ReadCacheSlot),
+                                 qemu_real_host_page_size);
+    size_t map_size = READ_CACHE_HEADER_SIZE + slots_size +
+                      nb_lines * s->line_size;
+    ReadCacheHeader *header;
+    struct stat st;
+    int ret;
+
+    s->fd = qemu_open(path, O_RDWR | O_CREAT, 0600);
+    if (s->fd < 0) {
+        error_setg_errno(errp, errno, "Could not open '%s'", path);
+        return -errno;
+    }
+
+    /* Serialize the initialization of a new cache file */
+    if (flock(s->fd, LOCK_EX) < 0) {
+        ret = -errno;
+        error_setg_errno(errp, errno, "Could not lock '%s'", path);
+        goto fail;
+    }
+
+    if (fstat(s->fd, &st) < 0) {
+        ret = -errno;
+        error_setg_errno(errp, errno, "Could not stat '%s'", path);
+        goto fail;
+    }
+    if (st.st_size == 0) {
+        if (ftruncate(s->fd, map_size) < 0) {
+            ret = -errno;
+            error_setg_errno(errp, errno, "Could not resize '%s'", path);
+            goto fail;
+        }
+    } else if (st.st_size != map_size) {
+        error_setg(errp, "Cache file '%s' was created with a different size "
+                   "or line size", path);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    s->map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                  s->fd, 0);
+    if (s->map == MAP_FAILED) {
+        ret = -errno;
+        error_setg_errno(errp, errno, "Could not map '%s'", path);
+        s->map = NULL;
+        goto fail;
+    }
+    s->map_size = map_size;
+
+    header = s->map;
+    if (header->magic == 0) {
+        header->version = READ_CACHE_VERSION;
+        header->line_size = s->line_size;
+        header->nb_lines = nb_lines;
+        header->magic = READ_CACHE_MAGIC;
+    } else if (header->magic != READ_CACHE_MAGIC ||
+               header->version != READ_CACHE_VERSION ||
+               header->line_size != s->line_size ||
+               header->nb_lines != nb_lines) {
+        error_setg(errp, "'%s' is not a compatible cache file", path);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    flock(s->fd, LOCK_UN);
+
+    s->header = header;
+    s->slots = (void *)((uint8_t *)s->map + READ_CACHE_HEADER_SIZE);
+    s->data = (uint8_t *)s->map + READ_CACHE_HEADER_SIZE + slots_size;
+    s->nb_sets = nb_lines / READ_CACHE_WAYS;
+    return 0;
+
+fail:
+    if (s->map) {
+        munmap(s->map, map_size);
+        s->map = NULL;
+    }
+    qemu_close(s->fd);
+    s->fd = -1;
+    return ret;
+}
+
+static int read_cache_open(BlockDriverState *bs, QDict *options, int flags,
+                           Error **errp)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    QemuOpts *opts;
+    Error *local_err = NULL;
+    const char *path, *image_id, *eviction;
+    uint64_t size, line_size;
+    int ret;
+
+    bs->file = bdrv_open_child(NULL, options, "file", bs, &child_file, false,
+                               errp);
+    if (!bs->file) {
+        return -EINVAL;
+    }
+
+    bs->supported_write_flags = BDRV_REQ_WRITE_UNCHANGED |
+        (BDRV_REQ_FUA & bs->file->bs->supported_write_flags);
+    bs->supported_zero_flags = BDRV_REQ_WRITE_UNCHANGED |
+        ((BDRV_REQ_FUA | BDRV_REQ_MAY_UNMAP | BDRV_REQ_NO_FALLBACK) &
+            bs->file->bs->supported_zero_flags);
+
+    opts = qemu_opts_create(&read_cache_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    path = qemu_opt_get(opts, "path");
+    if (!path) {
+        error_setg(errp, "The 'path' option is required");
+        ret = -EINVAL;
+        goto out;
+    }
+
+    image_id = qemu_opt_get(opts, "image-id");
+    if (!image_id || !image_id[0]) {
+        error_setg(errp, "The 'image-id' option is required");
+        ret = -EINVAL;
+        goto out;
+    }
+    read_cache_hash_image_id(image_id, s->image);
+
+    eviction = qemu_opt_get(opts, "eviction");
+    s->lru = qapi_enum_parse(&ReadCacheEviction_lookup, eviction,
+                             READ_CACHE_EVICTION_LRU, &local_err) ==
+             READ_CACHE_EVICTION_LRU;
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    line_size = qemu_opt_get_size(opts, "line-size",
+                                  READ_CACHE_DEFAULT_LINE_SIZE);
+    if (line_size < 4 * KiB || line_size > 2 * MiB ||
+        !is_power_of_2(line_size)) {
+        error_setg(errp, "line-size must be a power of two between 4k and 2M");
+        ret = -EINVAL;
+        goto out;
+    }
+    s->line_size = line_size;
+
+    size = qemu_opt_get_size(opts, "size", READ_CACHE_DEFAULT_SIZE);
+    if (size < line_size * READ_CACHE_WAYS || size > SIZE_MAX / 2) {
+        error_setg(errp, "size must be at least %" PRIu64 " bytes",
+                   line_size * READ_CACHE_WAYS);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    ret = read_cache_map(s, path,
+                         QEMU_ALIGN_DOWN(size / line_size, READ_CACHE_WAYS),
+                         errp);
+    if (ret < 0) {
+        goto out;
+    }
+    trace_read_cache_open(bs, path, image_id, s->nb_sets * READ_CACHE_WAYS,
+                          s->line_size);
+
+    ret = 0;
+out:
+    qemu_opts_del(opts);
+    return ret;
+}
+
+static void read_cache_close(BlockDriverState *bs)
+{
+    BDRVReadCacheState *s = bs->opaque;
+
+    munmap(s->map, s->map_size);
+    qemu_close(s->fd);
+}
+
+static int64_t read_cache_getlength(BlockDriverState *bs)
+{
+    return bdrv_getlength(bs->file->bs);
+}
+
+/*
+ * Read the consecutive missing lines from @start to @stop with a single
+ * request to the child into @buf, add them to the cache and copy the part
+ * of them that is in the request at @offset to @qiov.
+ */
+static int coroutine_fn read_cache_fill(BlockDriverState *bs, uint64_t start,
+                                        uint64_t stop, int64_t length,
+                                        uint64_t offset, uint64_t bytes,
+                                        QEMUIOVector *qiov, uint8_t *buf)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    uint64_t end = offset + bytes;
+    uint64_t avail = length > start ? MIN(stop, length) - start : 0;
+    uint32_t gen = atomic_read(&s->header->write_gen);
+    uint64_t pos;
+    int ret;
+
+    s->misses += (stop - start) / s->line_size;
+    if (avail) {
+        ret = bdrv_co_pread(bs->file, start, avail, buf, 0);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    for (pos = start; pos < stop; pos += s->line_size) {
+        uint64_t line = pos / s->line_size;
+        uint64_t skip = MAX(offset, pos) - pos;
+        uint64_t n = MIN(end, pos + s->line_size) - pos - skip;
+        uint8_t *data = buf + (pos - start);
+        uint32_t len = start + avail > pos ?
+                       MIN(s->line_size, start + avail - pos) : 0;
+
+        if (len && line < UINT32_MAX &&
+            atomic_read(&s->header->write_gen) == gen) {
+            read_cache_insert(s, line, data, len);
+
+            /*
+             * A write may have finished and invalidated the line
+             * between the check and the insertion.
+             */
+            smp_mb();
+            if (atomic_read(&s->header->write_gen) != gen) {
+                read_cache_invalidate(s, pos, len);
+            }
+        }
+
+        if (skip + n > len) {
+            /* Beyond the data we have for this line, ask the child */
+            ret = bdrv_co_pread(bs->file, pos + skip, n, data + skip, 0);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+        qemu_iovec_from_buf(qiov, pos + skip - offset, data + skip, n);
+    }
+    return 0;
+}
+
+static int coroutine_fn read_cache_co_preadv(BlockDriverState *bs,
+                                             uint64_t offset, uint64_t bytes,
+                                             QEMUIOVector *qiov, int flags)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    uint64_t max_fill = MAX(READ_CACHE_MAX_FILL, s->line_size);
+    uint64_t end = offset + bytes;
+    uint64_t pos, fill_start = 0, fill_stop = 0;
+    int64_t length;
+    uint8_t *buf, *line_buf;
+    int ret = 0;
+
+    if (flags) {
+        return bdrv_co_preadv(bs->file, offset, bytes, qiov, flags);
+    }
+
+    length = bdrv_getlength(bs->file->bs);
+    if (length < 0) {
+        return length;
+    }
+
+    /* Room for the lines to fill, then for a line found in the cache */
+    buf = qemu_try_blockalign(bs->file->bs, max_fill + s->line_size);
+    if (!buf) {
+        return -ENOMEM;
+    }
+    line_buf = buf + max_fill;
+
+    for (pos = QEMU_ALIGN_DOWN(offset, s->line_size); pos < end;
+         pos += s->line_size)
+    {
+        uint64_t line = pos / s->line_size;
+        uint64_t skip = MAX(offset, pos) - pos;
+        uint64_t n = MIN(end, pos + s->line_size) - pos - skip;
+        uint32_t len = 0;
+
+        if (line < UINT32_MAX) {
+            len = read_cache_lookup(s, line, line_buf);
+        }
+
+        if (!len) {
+            /* Missing lines are read together, in as few requests as we can */
+            if (fill_start == fill_stop) {
+                fill_start = fill_stop = pos;
+            }
+            fill_stop += s->line_size;
+            if (fill_stop - fill_start == max_fill) {
+                ret = read_cache_fill(bs, fill_start, fill_stop, length,
+                                      offset, bytes, qiov, buf);
+                if (ret < 0) {
+                    goto out;
+                }
+                fill_start = fill_stop;
+            }
+            continue;
+        }
+
+        s->hits++;
+        if (skip + n > len) {
+            /* Beyond the data we have for this line, ask the child */
+            ret = bdrv_co_pread(bs->file, pos + skip, n, line_buf + skip, 0);
+            if (ret < 0) {
+                goto out;
+            }
+        }
+        qemu_iovec_from_buf(qiov, pos + skip - offset, line_buf + skip, n);
+    }
+
+    if (fill_start != fill_stop) {
+        ret = read_cache_fill(bs, fill_start, fill_stop, length, offset, bytes,
+                              qiov, buf);
+        if (ret < 0) {
+            goto out;
+        }
+    }
+    ret = 0;
+
+out:
+    qemu_vfree(buf);
+    return ret;
+}
+
+/*
+ * Requests that modify the image bump write_gen before and after they
+ * run, so that reads that overlap them in time, in any process, do not
+ * keep what they read, and drop the affected lines when they are done.
+ */
+static void read_cache_write_begin(BDRVReadCacheState *s)
+{
+    atomic_inc(&s->header->write_gen);
+}
+
+static void read_cache_write_end(BDRVReadCacheState *s, uint64_t offset,
+                                 uint64_t bytes)
+{
+    atomic_inc(&s->header->write_gen);
+    read_cache_invalidate(s, offset, bytes);
+}
+
+static int coroutine_fn read_cache_co_pwritev(BlockDriverState *bs,
+                                              uint64_t offset, uint64_t bytes,
+                                              QEMUIOVector *qiov, int flags)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int ret;
+
+    read_cache_write_begin(s);
+    ret = bdrv_co_pwritev(bs->file, offset, bytes, qiov, flags);
+    read_cache_write_end(s, offset, bytes);
+    return ret;
+}
+
+static int coroutine_fn read_cache_co_pwrite_zeroes(BlockDriverState *bs,
+                                                    int64_t offset, int bytes,
+                                                    BdrvRequestFlags flags)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int ret;
+
+    read_cache_write_begin(s);
+    ret = bdrv_co_pwrite_zeroes(bs->file, offset, bytes, flags);
+    read_cache_write_end(s, offset, bytes);
+    return ret;
+}
+
+static int coroutine_fn read_cache_co_pdiscard(BlockDriverState *bs,
+                                               int64_t offset, int bytes)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int ret;
+
+    read_cache_write_begin(s);
+    ret = bdrv_co_pdiscard(bs->file, offset, bytes);
+    read_cache_write_end(s, offset, bytes);
+    return ret;
+}
+
+static int coroutine_fn read_cache_co_truncate(BlockDriverState *bs,
+                                               int64_t offset,
+                                               PreallocMode prealloc,
+                                               Error **errp)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int64_t old_length = bdrv_getlength(bs->file->bs);
+    int ret;
+
+    read_cache_write_begin(s);
+    ret = bdrv_co_truncate(bs->file, offset, prealloc, errp);
+    if (old_length >= 0) {
+        /* The line that held the old end of the image is short */
+        uint64_t start = MIN(offset, old_length);
+
+        read_cache_write_end(s, start, MAX(offset, old_length) - start);
+    } else {
+        atomic_inc(&s->header->write_gen);
+    }
+    return ret;
+}
+
+static int coroutine_fn read_cache_co_flush(BlockDriverState *bs)
+{
+    return bdrv_co_flush(bs->file->bs);
+}
+
+static bool read_cache_is_first_non_filter(BlockDriverState *bs,
+                                           BlockDriverState *candidate)
+{
+    return bdrv_recurse_is_first_non_filter(bs->file->bs, candidate);
+}
+
+static BlockStatsSpecific *read_cache_get_specific_stats(BlockDriverState *bs)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    BlockStatsSpecific *stats = g_new(BlockStatsSpecific, 1);
+
+    stats->driver = BLOCKDEV_DRIVER_READ_CACHE;
+    stats->u.read_cache = (BlockStatsSpecificReadCache) {
+        .hits = s->hits,
+        .misses = s->misses,
+        .evictions = s->evictions,
+    };
+    return stats;
+}
+
+static const char *const read_cache_strong_runtime_opts[] = {
+    "image-id",
+
+    NULL
+};
+
+static BlockDriver bdrv_read_cache = {
+    .format_name                        = "read-cache",
+    .instance_size                      = sizeof(BDRVReadCacheState),
+
+    .bdrv_open                          = read_cache_open,
+    .bdrv_close                         = read_cache_close,
+    .bdrv_child_perm                    = bdrv_filter_default_perms,
+
+    .bdrv_getlength                     = read_cache_getlength,
+    .bdrv_co_truncate                   = read_cache_co_truncate,
+
+    .bdrv_co_preadv                     = read_cache_co_preadv,
+    .bdrv_co_pwritev                    = read_cache_co_pwritev,
+    .bdrv_co_pwrite_zeroes              = read_cache_co_pwrite_zeroes,
+    .bdrv_co_pdiscard                   = read_cache_co_pdiscard,
+    .bdrv_co_flush                      = read_cache_co_flush,
+
+    .bdrv_co_block_status               = bdrv_co_block_status_from_file,
+    .bdrv_get_specific_stats            = read_cache_get_specific_stats,
+
+    .bdrv_recurse_is_first_non_filter   = read_cache_is_first_non_filter,
+
+    .strong_runtime_opts                = read_cache_strong_runtime_opts,
+    .has_variable_length                = true,
+    .is_filter                          = true,
+};
+
+static void bdrv_read_cache_init(void)
+{
+    bdrv_register(&bdrv_read_cache);
+}
+
+block_init(bdrv_read_cache_init);
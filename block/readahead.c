@@ -0,0 +1,568 @@
+/*
+ * Read-ahead filter driver
+ *
+ * Copyright (c) 2019 QEMU contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 or
+ * (at your option) version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The filter is meant to sit on top of protocol drivers with a high
+ * latency per request, like curl, ssh or nfs, where a guest that reads
+ * an image sequentially waits for one round trip per request.
+ *
+ * Reads are matched against a small set of streams, each of which
+ * remembers where the last read it matched ended.  Once a stream has
+ * seen sequential reads, windows of data after its position are read
+ * from the child in the background, up to @depth windows ahead; the
+ * distance grows by one window for each sequential read.  The windows
+ * are kept in a cache of bounded size, ordered by last use, from which
+ * later reads are served.  Parts of a read that are not cached are
+ * passed to the child directly.
+ */
+
+#include "qemu/osdep.h"
+#include "block/block_int.h"
+#include "qapi/error.h"
+#include "qemu/coroutine.h"
+#include "qemu/module.h"
+#include "qemu/option.h"
+#include "qemu/queue.h"
+#include "qemu/units.h"
+#include "trace.h"
+
+#define READAHEAD_DEFAULT_WINDOW        (1 * MiB)
+#define READAHEAD_DEFAULT_DEPTH         4
+#define READAHEAD_DEFAULT_STREAMS       4
+#define READAHEAD_DEFAULT_CACHE_SIZE    (32 * MiB)
+
+#define READAHEAD_MAX_DEPTH             64
+#define READAHEAD_MAX_STREAMS           64
+
+typedef struct ReadaheadChunk {
+    BlockDriverState *bs;
+    uint64_t offset;
+    uint64_t bytes;
+    uint8_t *buf;
+    int ret;
+
+    /* One reference for the cache list, the fetch and each reader */
+    int refcnt;
+    bool in_flight;
+    /* Dropped from the cache, so the data must not be used anymore */
+    bool stale;
+    /* At least one read was served from this chunk */
+    bool used;
+
+    CoQueue waiters;
+    QTAILQ_ENTRY(ReadaheadChunk) next;
+} ReadaheadChunk;
+
+typedef struct ReadaheadStream {
+    uint64_t pos;       /* end of the last read of the stream */
+    unsigned seq;       /* number of sequential reads in a row */
+    uint64_t last_use;
+} ReadaheadStream;
+
+typedef struct BDRVReadaheadState {
+    uint64_t window;
+    unsigned depth;
+    unsigned max_chunks;
+
+    unsigned nb_streams;
+    ReadaheadStream *streams;
+    uint64_t clock;
+
+    /* Most recently used first */
+    QTAILQ_HEAD(, ReadaheadChunk) chunks;
+    unsigned nb_chunks;
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t prefetches;
+    uint64_t unused;
+} BDRVReadaheadState;
+
+static QemuOptsList readahead_opts = {
+    .name = "readahead",
+    .head = QTAILQ_HEAD_INITIALIZER(readahead_opts.head),
+    .desc = {
+        {
+            .name = "window",
+            .type = QEMU_OPT_SIZE,
+            .help = "Size of a read-ahead request (default: 1M)",
+        },
+        {
+            .name = "depth",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of windows read ahead of a stream (default: 4)",
+        },
+        {
+            .name = "streams",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of sequential streams tracked (default: 4)",
+        },
+        {
+            .name = "cache-size",
+            .type = QEMU_OPT_SIZE,
+            .help = "Size of the read-ahead cache (default: 32M)",
+        },
+        { /* end of list */ }
+    },
+};
+
+static int readahead_open(BlockDriverState *bs, QDict *options, int flags,
+                          Error **errp)
+{
+    BDRVReadaheadState *s = bs->opaque;
+    QemuOpts *opts;
+    Error *local_err = NULL;
+    uint64_t window, depth, streams, cache_size;
+    int ret;
+
+    bs->file = bdrv_open_child(NULL, options, "file", bs, &child_file, false,
+                               errp);
+    if (!bs->file) {
+        return -EINVAL;
+    }
+
+    bs->supported_write_flags = BDRV_REQ_WRITE_UNCHANGED |
+        (BDRV_REQ_FUA & bs->file->bs->supported_write_flags);
+    bs->supported_zero_flags = BDRV_REQ_WRITE_UNCHANGED |
+        ((BDRV_REQ_FUA | BDRV_REQ_MAY_UNMAP | BDRV_REQ_NO_FALLBACK) &
+            bs->file->bs->supported_zero_flags);
+
+    opts = qemu_opts_create(&readahead_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    window = qemu_opt_get_size(opts, "window", READAHEAD_DEFAULT_WINDOW);
+    if (window < 64 * KiB || window > 64 * MiB || !is_power_of_2(window)) {
+        error_setg(errp, "window must be a power of two between 64k and 64M");
+        ret = -EINVAL;
+        goto out;
+    }
+
+    depth = qemu_opt_get_number(opts, "depth", READAHEAD_DEFAULT_DEPTH);
+    if (depth < 1 || depth > READAHEAD_MAX_DEPTH) {
+        error_setg(errp, "depth must be between 1 and %d",
+                   READAHEAD_MAX_DEPTH);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    streams = qemu_opt_get_number(opts, "streams", READAHEAD_DEFAULT_STREAMS);
+    if (streams < 1 || streams > READAHEAD_MAX_STREAMS) {
+        error_setg(errp, "streams must be between 1 and %d",
+                   READAHEAD_MAX_STREAMS);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    cache_size = qemu_opt_get_size(opts, "cache-size",
+                                   READAHEAD_DEFAULT_CACHE_SIZE);
+    if (cache_size < window * depth || cache_size / window > UINT_MAX) {
+        error_setg(errp, "cache-size must be at least window * depth "
+                   "(%" PRIu64 " bytes)", window * depth);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    s->window = window;
+    s->depth = depth;
+    s->max_chunks = cache_size / window;
+    s->nb_streams = streams;
+    s->streams = g_new0(ReadaheadStream, streams);
+    QTAILQ_INIT(&s->chunks);
+
+    ret = 0;
+out:
+    qemu_opts_del(opts);
+    return ret;
+}
+
+static void readahead_chunk_unref(ReadaheadChunk *chunk)
+{
+    BDRVReadaheadState *s = chunk->bs->opaque;
+
+    if (--chunk->refcnt == 0) {
+        if (chunk->ret == 0 && !chunk->used) {
+            s->unused++;
+        }
+        qemu_vfree(chunk->buf);
+        g_free(chunk);
+    }
+}
+
+/* Take @chunk out of the cache; readers still holding it will skip it */
+static void readahead_drop(BDRVReadaheadState *s, ReadaheadChunk *chunk)
+{
+    QTAILQ_REMOVE(&s->chunks, chunk, next);
+    s->nb_chunks--;
+    chunk->stale = true;
+    readahead_chunk_unref(chunk);
+}
+
+static void readahead_invalidate(BDRVReadaheadState *s, uint64_t offset,
+                                 uint64_t bytes)
+{
+    ReadaheadChunk *chunk, *next;
+
+    QTAILQ_FOREACH_SAFE(chunk, &s->chunks, next, next) {
+        if (chunk->offset < offset + bytes &&
+            offset < chunk->offset + s->window) {
+            readahead_drop(s, chunk);
+        }
+    }
+}
+
+static void readahead_close(BlockDriverState *bs)
+{
+    BDRVReadaheadState *s = bs->opaque;
+
+    /* Draining waited for the fetches, so only the cache holds chunks */
+    readahead_invalidate(s, 0, UINT64_MAX / 2);
+    g_free(s->streams);
+}
+
+static int64_t readahead_getlength(BlockDriverState *bs)
+{
+    return bdrv_getlength(bs->file->bs);
+}
+
+static ReadaheadChunk *readahead_find(BDRVReadaheadState *s, uint64_t offset)
+{
+    ReadaheadChunk *chunk;
+
+    offset = QEMU_ALIGN_DOWN(offset, s->window);
+    QTAILQ_FOREACH(chunk, &s->chunks, next) {
+        if (chunk->offset == offset) {
+            return chunk;
+        }
+    }
+    return NULL;
+}
+
+static void coroutine_fn readahead_fetch_entry(void *opaque)
+{
+    ReadaheadChunk *chunk = opaque;
+    BlockDriverState *bs = chunk->bs;
+    BDRVReadaheadState *s = bs->opaque;
+
+    chunk->ret = bdrv_co_pread(bs->file, chunk->offset, chunk->bytes,
+                               chunk->buf, 0);
+    chunk->in_flight = false;
+    qemu_co_queue_restart_all(&chunk->waiters);
+
+    if (chunk->ret < 0 && !chunk->stale) {
+        readahead_drop(s, chunk);
+    }
+    readahead_chunk_unref(chunk);
+    bdrv_dec_in_flight(bs);
+}
+
+/*
+ * Start reading the window at @offset into the cache.  Returns false if
+ * there is no room for it, because all chunks are in use.
+ */
+static bool readahead_fetch(BlockDriverState *bs, uint64_t offset,
+                            int64_t length)
+{
+    BDRVReadaheadState *s = bs->opaque;
+    ReadaheadChunk *chunk;
+    Coroutine *co;
+    uint8_t *buf;
+
+    if (s->nb_chunks >= s->max_chunks) {
+        QTAILQ_FOREACH_REVERSE(chunk, &s->chunks, next) {
+            if (chunk->refcnt == 1) {
+                break;
+            }
+        }
+        if (!chunk) {
+            return false;
+        }
+        readahead_drop(s, chunk);
+    }
+
+    buf = qemu_try_blockalign(bs->file->bs, s->window);
+    if (!buf) {
+        return false;
+    }
+
+    chunk = g_new(ReadaheadChunk, 1);
+    *chunk = (ReadaheadChunk) {
+        .bs         = bs,
+        .offset     = offset,
+        .bytes      = MIN(s->window, length - offset),
+        .buf        = buf,
+        .refcnt     = 2,
+        .in_flight  = true,
+    };
+    qemu_co_queue_init(&chunk->waiters);
+    QTAILQ_INSERT_HEAD(&s->chunks, chunk, next);
+    s->nb_chunks++;
+    s->prefetches++;
+
+    trace_readahead_fetch(bs, offset, chunk->bytes);
+
+    bdrv_inc_in_flight(bs);
+    co = qemu_coroutine_create(readahead_fetch_entry, chunk);
+    aio_co_enter(bdrv_get_aio_context(bs), co);
+    return true;
+}
+
+/*
+ * Find the stream that a read at @offset continues, or take over the
+ * least recently used one, and read ahead of it.  Reads that start
+ * within a window of the end of the last read count as sequential, so
+ * that concurrent requests that complete out of order still match.
+ */
+static void readahead_update_streams(BlockDriverState *bs, uint64_t offset,
+                                     uint64_t bytes)
+{
+    BDRVReadaheadState *s = bs->opaque;
+    ReadaheadStream *st = NULL, *lru = &s->streams[0];
+    uint64_t ahead, pos;
+    int64_t length;
+    unsigned i;
+
+    for (i = 0; i < s->nb_streams; i++) {
+        ReadaheadStream *cur = &s->streams[i];
+
+        if (cur->last_use && offset + s->window >= cur->pos &&
+            offset <= cur->pos + s->window) {
+            st = cur;
+            break;
+        }
+        if (cur->last_use < lru->last_use) {
+            lru = cur;
+        }
+    }
+
+    if (!st) {
+        *lru = (ReadaheadStream) {
+            .pos        = offset + bytes,
+            .last_use   = ++s->clock,
+        };
+        return;
+    }
+
+    st->pos = MAX(st->pos, offset + bytes);
+    st->seq = MIN(st->seq + 1, s->depth);
+    st->last_use = ++s->clock;
+
+    length = bdrv_getlength(bs->file->bs);
+    if (length < 0) {
+        return;
+    }
+
+    /*
+     * Start at the next window boundary, so that the rest of this read is
+     * not held up behind a whole window
+     */
+    pos = QEMU_ALIGN_UP(st->pos, s->window);
+    ahead = MIN(pos + st->seq * s->window, length);
+    for (; pos < ahead; pos += s->window) {
+        if (!readahead_find(s, pos) && !readahead_fetch(bs, pos, length)) {
+            break;
+        }
+    }
+}
+
+static int coroutine_fn readahead_read_child(BlockDriverState *bs,
+                                             uint64_t offset, uint64_t bytes,
+                                             QEMUIOVector *qiov,
+                                             size_t qiov_offset)
+{
+    QEMUIOVector local_qiov;
+    int ret;
+
+    qemu_iovec_init(&local_qiov, qiov->niov);
+    qemu_iovec_concat(&local_qiov, qiov, qiov_offset, bytes);
+    ret = bdrv_co_preadv(bs->file, offset, bytes, &local_qiov, 0);
+    qemu_iovec_destroy(&local_qiov);
+
+    return ret;
+}
+
+static int coroutine_fn readahead_co_preadv(BlockDriverState *bs,
+                                            uint64_t offset, uint64_t bytes,
+                                            QEMUIOVector *qiov, int flags)
+{
+    BDRVReadaheadState *s = bs->opaque;
+    uint64_t end = offset + bytes;
+    uint64_t pos = offset;
+    int ret;
+
+    if (flags) {
+        return bdrv_co_preadv(bs->file, offset, bytes, qiov, flags);
+    }
+
+    readahead_update_streams(bs, offset, bytes);
+
+    while (pos < end) {
+        ReadaheadChunk *chunk = readahead_find(s, pos);
+        uint64_t n;
+
+        if (!chunk) {
+            /* Pass everything up to the next cached window to the child */
+            n = QEMU_ALIGN_UP(pos + 1, s->window) - pos;
+            while (pos + n < end && !readahead_find(s, pos + n)) {
+                n += s->window;
+            }
+            n = MIN(n, end - pos);
+
+            s->misses++;
+            ret = readahead_read_child(bs, pos, n, qiov, pos - offset);
+            if (ret < 0) {
+                return ret;
+            }
+            pos += n;
+            continue;
+        }
+
+        chunk->refcnt++;
+        while (chunk->in_flight) {
+            qemu_co_queue_wait(&chunk->waiters, NULL);
+        }
+
+        n = MIN(end, chunk->offset + s->window) - pos;
+        if (!chunk->stale && chunk->ret == 0 &&
+            pos + n <= chunk->offset + chunk->bytes)
+        {
+            s->hits++;
+            chunk->used = true;
+            qemu_iovec_from_buf(qiov, pos - offset,
+                                chunk->buf + (pos - chunk->offset), n);
+            QTAILQ_REMOVE(&s->chunks, chunk, next);
+            QTAILQ_INSERT_HEAD(&s->chunks, chunk, next);
+            ret = 0;
+        } else {
+            s->misses++;
+            ret = readahead_read_child(bs, pos, n, qiov, pos - offset);
+        }
+        readahead_chunk_unref(chunk);
+        if (ret < 0) {
+            return ret;
+        }
+        pos += n;
+    }
+
+    return 0;
+}
+
+static int coroutine_fn readahead_co_pwritev(BlockDriverState *bs,
+                                             uint64_t offset, uint64_t bytes,
+                                             QEMUIOVector *qiov, int flags)
+{
+    int ret = bdrv_co_pwritev(bs->file, offset, bytes, qiov, flags);
+
+    readahead_invalidate(bs->opaque, offset, bytes);
+    return ret;
+}
+
+static int coroutine_fn readahead_co_pwrite_zeroes(BlockDriverState *bs,
+                                                   int64_t offset, int bytes,
+                                                   BdrvRequestFlags flags)
+{
+    int ret = bdrv_co_pwrite_zeroes(bs->file, offset, bytes, flags);
+
+    readahead_invalidate(bs->opaque, offset, bytes);
+    return ret;
+}
+
+static int coroutine_fn readahead_co_pdiscard(BlockDriverState *bs,
+                                              int64_t offset, int bytes)
+{
+    int ret = bdrv_co_pdiscard(bs->file, offset, bytes);
+
+    readahead_invalidate(bs->opaque, offset, bytes);
+    return ret;
+}
+
+static int coroutine_fn readahead_co_truncate(BlockDriverState *bs,
+                                              int64_t offset,
+                                              PreallocMode prealloc,
+                                              Error **errp)
+{
+    int ret = bdrv_co_truncate(bs->file, offset, prealloc, errp);
+
+    /* The window that held the old end of the image is short */
+    readahead_invalidate(bs->opaque, 0, UINT64_MAX / 2);
+    return ret;
+}
+
+static int coroutine_fn readahead_co_flush(BlockDriverState *bs)
+{
+    return bdrv_co_flush(bs->file->bs);
+}
+
+static bool readahead_is_first_non_filter(BlockDriverState *bs,
+                                          BlockDriverState *candidate)
+{
+    return bdrv_recurse_is_first_non_filter(bs->file->bs, candidate);
+}
+
+static BlockStatsSpecific *readahead_get_specific_stats(BlockDriverState *bs)
+{
+    BDRVReadaheadState *s = bs->opaque;
+    BlockStatsSpecific *stats = g_new(BlockStatsSpecific, 1);
+
+    stats->driver = BLOCKDEV_DRIVER_READAHEAD;
+    stats->u.readahead = (BlockStatsSpecificReadahead) {
+        .hits = s->hits,
+        .misses = s->misses,
+        .prefetches = s->prefetches,
+        .unused = s->unused,
+    };
+    return stats;
+}
+
+static BlockDriver bdrv_readahead = {
+    .format_name                        = "readahead",
+    .instance_size                      = sizeof(BDRVReadaheadState),
+
+    .bdrv_open                          = readahead_open,
+    .bdrv_close                         = readahead_close,
+    .bdrv_child_perm                    = bdrv_filter_default_perms,
+
+    .bdrv_getlength                     = readahead_getlength,
+    .bdrv_co_truncate                   = readahead_co_truncate,
+
+    .bdrv_co_preadv                     = readahead_co_preadv,
+    .bdrv_co_pwritev                    = readahead_co_pwritev,
+    .bdrv_co_pwrite_zeroes              = readahead_co_pwrite_zeroes,
+    .bdrv_co_pdiscard                   = readahead_co_pdiscard,
+    .bdrv_co_flush                      = readahead_co_flush,
+
+    .bdrv_co_block_status               = bdrv_co_block_status_from_file,
+    .bdrv_get_specific_stats            = readahead_get_specific_stats,
+
+    .bdrv_recurse_is_first_non_filter   = readahead_is_first_non_filter,
+
+    .has_variable_length                = true,
+    .is_filter                          = true,
+};
+
+static void bdrv_readahead_init(void)
+{
+    bdrv_register(&bdrv_readahead);
+}
+
+block_init(bdrv_readahead_init);
@@ -234,6 +234,12 @@ static ThrottleGroupMember *next_throttle_token(ThrottleGroupMember *tgm,
 
     start = token = tg->tokens[is_write];
 
+    /* The member that has the turn keeps it until it has used up the
+     * share given by its weight */
+    if (token->deficit[is_write] > 0 && tgm_has_pending_reqs(token, is_write)) {
+        return token;
+    }
+
     /* get next bs round in round robin style */
     token = throttle_group_next_tgm(token);
     while (token != start && !tgm_has_pending_reqs(token, is_write)) {
@@ -254,6 +260,24 @@ static ThrottleGroupMember *next_throttle_token(ThrottleGroupMember *tgm,
     return token;
 }
 
+/* Give the turn to @token.  A member that gets the turn starts with a
+ * deficit equal to its weight, i.e. the number of requests it may start
+ * before the turn passes on.  @token is NULL when the group is left empty.
+ *
+ * This assumes that tg->lock is held.
+ */
+static void throttle_group_set_token(ThrottleGroup *tg,
+                                     ThrottleGroupMember *token,
+                                     bool is_write)
+{
+    if (tg->tokens[is_write] != token) {
+        if (token) {
+            token->deficit[is_write] = token->weight;
+        }
+        tg->tokens[is_write] = token;
+    }
+}
+
 /* Check if the next I/O request for a ThrottleGroupMember needs to be
  * throttled or not. If there's no timer set in this group, set one and update
  * the token accordingly.
@@ -285,7 +309,7 @@ static bool throttle_group_schedule_timer(ThrottleGroupMember *tgm,
 
     /* If a timer just got armed, set tgm as the current token */
     if (must_wait) {
-        tg->tokens[is_write] = tgm;
+        throttle_group_set_token(tg, tgm, is_write);
         tg->any_timer_armed[is_write] = true;
     }
 
@@ -345,7 +369,7 @@ static void schedule_next_request(ThrottleGroupMember *tgm, bool is_write)
             timer_mod(tt->timers[is_write], now);
             tg->any_timer_armed[is_write] = true;
         }
-        tg->tokens[is_write] = token;
+        throttle_group_set_token(tg, token, is_write);
     }
 }
 
@@ -372,6 +396,8 @@ void coroutine_fn throttle_group_co_io_limits_intercept(ThrottleGroupMember *tgm
 
     /* Wait if there's a timer set or queued requests of this type */
     if (must_wait || tgm->pending_reqs[is_write]) {
+        int64_t start_ns = qemu_clock_get_ns(tg->clock_type);
+
         tgm->pending_reqs[is_write]++;
         qemu_mutex_unlock(&tg->lock);
         qemu_co_mutex_lock(&tgm->throttled_reqs_lock);
@@ -380,10 +406,14 @@ void coroutine_fn throttle_group_co_io_limits_intercept(ThrottleGroupMember *tgm
         qemu_co_mutex_unlock(&tgm->throttled_reqs_lock);
         qemu_mutex_lock(&tg->lock);
         tgm->pending_reqs[is_write]--;
+        tgm->throttled_ops[is_write]++;
+        tgm->throttled_time_ns[is_write] +=
+            qemu_clock_get_ns(tg->clock_type) - start_ns;
     }
 
     /* The I/O will be executed, so do the accounting */
     throttle_account(tgm->throttle_state, is_write, bytes);
+    tgm->deficit[is_write]--;
 
     /* Schedule the next request */
     schedule_next_request(tgm, is_write);
@@ -493,6 +523,61 @@ void throttle_group_get_config(ThrottleGroupMember *tgm, ThrottleConfig *cfg)
     qemu_mutex_unlock(&tg->lock);
 }
 
+/* Set the weight of a ThrottleGroupMember, i.e. how many requests it can
+ * start in a row while other members of the group have requests queued.
+ * This can be called whether or not @tgm is registered in a group, and the
+ * weight is kept if it moves to another group.
+ *
+ * @tgm:    a ThrottleGroupMember
+ * @weight: the new weight, at least 1
+ */
+void throttle_group_set_weight(ThrottleGroupMember *tgm, unsigned weight)
+{
+    ThrottleGroup *tg;
+
+    assert(weight > 0);
+    if (!tgm->throttle_state) {
+        tgm->weight = weight;
+        return;
+    }
+
+    tg = container_of(tgm->throttle_state, ThrottleGroup, ts);
+    qemu_mutex_lock(&tg->lock);
+    tgm->weight = weight;
+    qemu_mutex_unlock(&tg->lock);
+}
+
+/* Get the weight of a ThrottleGroupMember that is a member of a group */
+unsigned throttle_group_get_weight(ThrottleGroupMember *tgm)
+{
+    ThrottleGroup *tg = container_of(tgm->throttle_state, ThrottleGroup, ts);
+    unsigned weight;
+
+    qemu_mutex_lock(&tg->lock);
+    weight = tgm->weight;
+    qemu_mutex_unlock(&tg->lock);
+    return weight;
+}
+
+/* Get how many requests of a ThrottleGroupMember had to wait because of
+ * throttling, and how long they waited in total.
+ *
+ * @tgm:      a ThrottleGroupMember that is a member of a group
+ * @is_write: the type of operation (read/write)
+ * @ops:      the number of requests that waited is written here
+ * @time_ns:  the total time they waited, in nanoseconds, is written here
+ */
+void throttle_group_get_wait_stats(ThrottleGroupMember *tgm, bool is_write,
+                                   uint64_t *ops, uint64_t *time_ns)
+{
+    ThrottleGroup *tg = container_of(tgm->throttle_state, ThrottleGroup, ts);
+
+    qemu_mutex_lock(&tg->lock);
+    *ops = tgm->throttled_ops[is_write];
+    *time_ns = tgm->throttled_time_ns[is_write];
+    qemu_mutex_unlock(&tg->lock);
+}
+
 /* ThrottleTimers callback. This wakes up a request that was waiting
  * because it had been throttled.
  *
@@ -545,12 +630,15 @@ void throttle_group_register_tgm(ThrottleGroupMember *tgm,
     tgm->throttle_state = ts;
     tgm->aio_context = ctx;
     atomic_set(&tgm->restart_pending, 0);
+    if (!tgm->weight) {
+        tgm->weight = 1;
+    }
 
     qemu_mutex_lock(&tg->lock);
     /* If the ThrottleGroup is new set this ThrottleGroupMember as the token */
     for (i = 0; i < 2; i++) {
         if (!tg->tokens[i]) {
-            tg->tokens[i] = tgm;
+            throttle_group_set_token(tg, tgm, i);
         }
     }
 
@@ -605,7 +693,7 @@ void throttle_group_unregister_tgm(ThrottleGroupMember *tgm)
             if (token == tgm) {
                 token = NULL;
             }
-            tg->tokens[i] = token;
+            throttle_group_set_token(tg, token, i);
         }
     }
 
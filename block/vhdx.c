@@ -37,6 +37,9 @@
 #define VHDX_BLOCK_OPT_BLOCK_SIZE "block_size"
 #define VHDX_BLOCK_OPT_ZERO "block_state_zero"
 
+/* Maximum number of BAT entries that are written through one log entry */
+#define VHDX_BAT_LOG_BATCH_MAX 512
+
 typedef enum VHDXImageType {
     VHDX_TYPE_DYNAMIC = 0,
     VHDX_TYPE_FIXED,
@@ -1100,8 +1103,12 @@ static coroutine_fn int vhdx_co_readv(BlockDriverState *bs, int64_t sector_num,
 
     qemu_iovec_init(&hd_qiov, qiov->niov);
 
-    qemu_co_mutex_lock(&s->lock);
-
+    /*
+     * The BAT is kept in memory and the lookups below do not yield, so reads
+     * do not need s->lock.  A block that a concurrent write is allocating
+     * may be read before its data is written, just like when the lock is
+     * dropped around the I/O.
+     */
     while (nb_sectors > 0) {
         /* We are a differencing file, so we need to inspect the sector bitmap
          * to see if we have the data or not */
@@ -1126,11 +1133,9 @@ static coroutine_fn int vhdx_co_readv(BlockDriverState *bs, int64_t sector_num,
                 qemu_iovec_memset(&hd_qiov, 0, 0, sinfo.bytes_avail);
                 break;
             case PAYLOAD_BLOCK_FULLY_PRESENT:
-                qemu_co_mutex_unlock(&s->lock);
                 ret = bdrv_co_preadv(bs->file, sinfo.file_offset,
                                      sinfo.sectors_avail * BDRV_SECTOR_SIZE,
                                      &hd_qiov, 0);
-                qemu_co_mutex_lock(&s->lock);
                 if (ret < 0) {
                     goto exit;
                 }
@@ -1150,7 +1155,6 @@ static coroutine_fn int vhdx_co_readv(BlockDriverState *bs, int64_t sector_num,
     }
     ret = 0;
 exit:
-    qemu_co_mutex_unlock(&s->lock);
     qemu_iovec_destroy(&hd_qiov);
     return ret;
 }
@@ -1214,6 +1218,28 @@ static void vhdx_update_bat_table_entry(BlockDriverState *bs, BDRVVHDXState *s,
 
 }
 
+/*
+ * Write @count consecutive entries of the in-memory BAT, starting at
+ * @bat_idx, to the image through a single log entry.
+ */
+static int vhdx_log_bat_entries(BlockDriverState *bs, BDRVVHDXState *s,
+                                uint32_t bat_idx, uint32_t count)
+{
+    uint64_t *entries = g_new(uint64_t, count);
+    uint32_t i;
+    int ret;
+
+    for (i = 0; i < count; i++) {
+        entries[i] = cpu_to_le64(s->bat[bat_idx + i]);
+    }
+    ret = vhdx_log_write_and_flush(bs, s, entries,
+                                   count * sizeof(VHDXBatEntry),
+                                   s->bat_offset +
+                                   bat_idx * sizeof(VHDXBatEntry));
+    g_free(entries);
+    return ret;
+}
+
 /* Per the spec, on the first write of guest-visible data to the file the
  * data write guid must be updated in the header */
 int vhdx_user_visible_write(BlockDriverState *bs, BDRVVHDXState *s)
@@ -1243,6 +1269,14 @@ static coroutine_fn int vhdx_co_writev(BlockDriverState *bs, int64_t sector_num,
     int bat_state;
     uint64_t bat_prior_offset = 0;
     bool bat_update = false;
+    /*
+     * Run of consecutive blocks allocated by this request whose BAT entries
+     * still have to be logged.  It may include sector bitmap entries, which
+     * are never changed.
+     */
+    uint32_t bat_run_start = 0;
+    uint32_t bat_run_count = 0;
+    bool bat_run_open = false;
 
     assert(!flags);
     qemu_iovec_init(&hd_qiov, qiov->niov);
@@ -1256,6 +1290,7 @@ static coroutine_fn int vhdx_co_writev(BlockDriverState *bs, int64_t sector_num,
 
     while (nb_sectors > 0) {
         bool use_zero_buffers = false;
+        bat_run_open = bat_update;
         bat_update = false;
         if (s->params.data_bits & VHDX_PARAMS_HAS_PARENT) {
             /* not supported yet */
@@ -1367,13 +1402,24 @@ static coroutine_fn int vhdx_co_writev(BlockDriverState *bs, int64_t sector_num,
             }
 
             if (bat_update) {
-                /* this will update the BAT entry into the log journal, and
-                 * then flush the log journal out to disk */
-                ret =  vhdx_log_write_and_flush(bs, s, &bat_entry,
-                                                sizeof(VHDXBatEntry),
-                                                bat_entry_offset);
-                if (ret < 0) {
-                    goto exit;
+                /*
+                 * The BAT entry is written into the log journal together
+                 * with those of the blocks allocated right before it, once
+                 * the run ends.
+                 */
+                if (bat_run_open &&
+                    sinfo.bat_idx - bat_run_start < VHDX_BAT_LOG_BATCH_MAX) {
+                    bat_run_count = sinfo.bat_idx - bat_run_start + 1;
+                } else {
+                    if (bat_run_count) {
+                        ret = vhdx_log_bat_entries(bs, s, bat_run_start,
+                                                   bat_run_count);
+                        if (ret < 0) {
+                            goto exit;
+                        }
+                    }
+                    bat_run_start = sinfo.bat_idx;
+                    bat_run_count = 1;
                 }
             }
 
@@ -1395,6 +1441,14 @@ error_bat_restore:
                                     &bat_entry_offset, bat_state);
     }
 exit:
+    /* Blocks that were written successfully are logged even on failure */
+    if (bat_run_count) {
+        int log_ret = vhdx_log_bat_entries(bs, s, bat_run_start,
+                                           bat_run_count);
+        if (log_ret < 0 && ret >= 0) {
+            ret = log_ret;
+        }
+    }
     qemu_vfree(iov1.iov_base);
     qemu_vfree(iov2.iov_base);
     qemu_co_mutex_unlock(&s->lock);
@@ -2065,7 +2119,9 @@ fail:
  */
 static int coroutine_fn vhdx_co_check(BlockDriverState *bs,
                                       BdrvCheckResult *result,
-                                      BdrvCheckMode fix)
+                                      BdrvCheckMode fix,
+                                      BlockDriverCheckStatusCB *status_cb,
+                                      void *cb_opaque)
 {
     BDRVVHDXState *s = bs->opaque;
 
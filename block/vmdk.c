@@ -35,6 +35,7 @@
 #include "qemu/bswap.h"
 #include "migration/blocker.h"
 #include "qemu/cutils.h"
+#include "qemu/units.h"
 #include <zlib.h>
 
 #define VMDK3_MAGIC (('C' << 24) | ('O' << 16) | ('W' << 8) | 'D')
@@ -129,7 +130,20 @@ typedef struct VMDKSESparseVolatileHeader {
     uint8_t pad[480];
 } QEMU_PACKED VMDKSESparseVolatileHeader;
 
-#define L2_CACHE_SIZE 16
+/*
+ * Each extent caches as many grain tables as fit in L2_CACHE_MAX_BYTES, but
+ * at least L2_CACHE_MIN_TABLES of them.  With the default geometry of
+ * monolithicSparse images, 1 MB of tables maps 16 GB of guest data.
+ */
+#define L2_CACHE_MIN_TABLES 16
+#define L2_CACHE_MAX_BYTES (1 * MiB)
+
+typedef struct VmdkL2CacheEntry {
+    uint32_t l2_offset;         /* in sectors, 0 if the entry is unused */
+    unsigned int l1_index;
+    uint64_t lru_counter;
+    bool dirty;
+} VmdkL2CacheEntry;
 
 typedef struct VmdkExtent {
     BdrvChild *file;
@@ -154,8 +168,9 @@ typedef struct VmdkExtent {
 
     unsigned int l2_size;
     void *l2_cache;
-    uint32_t l2_cache_offsets[L2_CACHE_SIZE];
-    uint32_t l2_cache_counts[L2_CACHE_SIZE];
+    VmdkL2CacheEntry *l2_cache_entries;
+    unsigned int l2_cache_size;
+    uint64_t l2_cache_lru_counter;
 
     int64_t cluster_sectors;
     int64_t next_cluster_sector;
@@ -177,11 +192,9 @@ typedef struct BDRVVmdkState {
 } BDRVVmdkState;
 
 typedef struct VmdkMetaData {
-    unsigned int l1_index;
     unsigned int l2_index;
-    unsigned int l2_offset;
+    int l2_cache_index;         /* -1 if there is no grain table */
     int valid;
-    uint32_t *l2_cache_entry;
 } VmdkMetaData;
 
 typedef struct VmdkGrainMarker {
@@ -270,6 +283,7 @@ static void vmdk_free_extents(BlockDriverState *bs)
         e = &s->extents[i];
         g_free(e->l1_table);
         g_free(e->l2_cache);
+        g_free(e->l2_cache_entries);
         g_free(e->l1_backup_table);
         g_free(e->type);
         if (e->file != bs->file) {
@@ -526,6 +540,7 @@ static int vmdk_init_tables(BlockDriverState *bs, VmdkExtent *extent,
 {
     int ret;
     size_t l1_size;
+    size_t l2_size_bytes;
     int i;
 
     /* read the L1 table */
@@ -578,8 +593,13 @@ static int vmdk_init_tables(BlockDriverState *bs, VmdkExtent *extent,
         }
     }
 
-    extent->l2_cache =
-        g_malloc(extent->entry_size * extent->l2_size * L2_CACHE_SIZE);
+    l2_size_bytes = extent->entry_size * extent->l2_size;
+    extent->l2_cache_size = MIN(extent->l1_size,
+                                L2_CACHE_MAX_BYTES / l2_size_bytes);
+    extent->l2_cache_size = MAX(extent->l2_cache_size, L2_CACHE_MIN_TABLES);
+    extent->l2_cache = g_malloc(l2_size_bytes * extent->l2_cache_size);
+    extent->l2_cache_entries = g_new0(VmdkL2CacheEntry,
+                                      extent->l2_cache_size);
     return 0;
  fail_l1b:
     g_free(extent->l1_backup_table);
@@ -1410,33 +1430,132 @@ exit:
     return ret;
 }
 
-static int vmdk_L2update(VmdkExtent *extent, VmdkMetaData *m_data,
-                         uint32_t offset)
+static void vmdk_L2update(VmdkExtent *extent, VmdkMetaData *m_data,
+                          uint32_t offset)
 {
-    offset = cpu_to_le32(offset);
-    /* update L2 table */
+    unsigned int l2_size_bytes = extent->l2_size * extent->entry_size;
+    uint32_t *l2_table = (uint32_t *)((char *)extent->l2_cache +
+                                      m_data->l2_cache_index * l2_size_bytes);
+
+    /* The table is written back by vmdk_l2_cache_flush() */
+    l2_table[m_data->l2_index] = cpu_to_le32(offset);
+    extent->l2_cache_entries[m_data->l2_cache_index].dirty = true;
+}
+
+static int vmdk_l2_cache_write_table(VmdkExtent *extent, int index)
+{
+    VmdkL2CacheEntry *entry = &extent->l2_cache_entries[index];
+    unsigned int l2_size_bytes = extent->l2_size * extent->entry_size;
+    void *l2_table = (char *)extent->l2_cache + index * l2_size_bytes;
+    int ret;
+
     BLKDBG_EVENT(extent->file, BLKDBG_L2_UPDATE);
-    if (bdrv_pwrite_sync(extent->file,
-                ((int64_t)m_data->l2_offset * 512)
-                    + (m_data->l2_index * sizeof(offset)),
-                &offset, sizeof(offset)) < 0) {
-        return VMDK_ERROR;
+    ret = bdrv_pwrite(extent->file, (int64_t)entry->l2_offset * 512,
+                      l2_table, l2_size_bytes);
+    if (ret < 0) {
+        return ret;
     }
     /* update backup L2 table */
     if (extent->l1_backup_table_offset != 0) {
-        m_data->l2_offset = extent->l1_backup_table[m_data->l1_index];
-        if (bdrv_pwrite_sync(extent->file,
-                    ((int64_t)m_data->l2_offset * 512)
-                        + (m_data->l2_index * sizeof(offset)),
-                    &offset, sizeof(offset)) < 0) {
-            return VMDK_ERROR;
+        ret = bdrv_pwrite(extent->file,
+                          (int64_t)extent->l1_backup_table[entry->l1_index] *
+                              512,
+                          l2_table, l2_size_bytes);
+        if (ret < 0) {
+            return ret;
         }
     }
-    if (m_data->l2_cache_entry) {
-        *m_data->l2_cache_entry = offset;
+    entry->dirty = false;
+    return 0;
+}
+
+/*
+ * Write back all dirty grain tables of @extent.  The grains that new
+ * entries point to must reach the disk before the tables do, so the
+ * extent file is flushed first; this is done once for the whole batch of
+ * tables rather than for every allocated grain.
+ */
+static int vmdk_l2_cache_flush(VmdkExtent *extent)
+{
+    bool dirty = false;
+    int i, ret;
+
+    for (i = 0; i < extent->l2_cache_size; i++) {
+        dirty |= extent->l2_cache_entries[i].dirty;
+    }
+    if (!dirty) {
+        return 0;
     }
 
-    return VMDK_OK;
+    ret = bdrv_flush(extent->file->bs);
+    if (ret < 0) {
+        return ret;
+    }
+    for (i = 0; i < extent->l2_cache_size; i++) {
+        if (extent->l2_cache_entries[i].dirty) {
+            ret = vmdk_l2_cache_write_table(extent, i);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * Return the index of the cache entry that holds the grain table at
+ * @l2_offset (in sectors), loading the table into the least recently used
+ * entry if it is not cached yet.  The lookup starts at a position derived
+ * from @l1_index, like in Qcow2Cache, so that hits are usually found at the
+ * first try.  Returns a negative errno on failure.
+ */
+static int vmdk_l2_cache_get(VmdkExtent *extent, unsigned int l1_index,
+                             uint32_t l2_offset)
+{
+    unsigned int l2_size_bytes = extent->l2_size * extent->entry_size;
+    unsigned int start = l1_index % extent->l2_cache_size;
+    unsigned int i = start, min_index = start;
+    uint64_t min_lru_counter = UINT64_MAX;
+    VmdkL2CacheEntry *entry;
+    int ret;
+
+    do {
+        entry = &extent->l2_cache_entries[i];
+        if (entry->l2_offset == l2_offset) {
+            entry->lru_counter = ++extent->l2_cache_lru_counter;
+            return i;
+        }
+        if (entry->lru_counter < min_lru_counter) {
+            min_lru_counter = entry->lru_counter;
+            min_index = i;
+        }
+        if (++i == extent->l2_cache_size) {
+            i = 0;
+        }
+    } while (i != start);
+
+    /* not found: load the table into the least recently used entry */
+    entry = &extent->l2_cache_entries[min_index];
+    if (entry->dirty) {
+        ret = vmdk_l2_cache_flush(extent);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    entry->l2_offset = 0;
+    BLKDBG_EVENT(extent->file, BLKDBG_L2_LOAD);
+    ret = bdrv_pread(extent->file, (int64_t)l2_offset * 512,
+                     (char *)extent->l2_cache + min_index * l2_size_bytes,
+                     l2_size_bytes);
+    if (ret < 0) {
+        return ret;
+    }
+
+    entry->l2_offset = l2_offset;
+    entry->l1_index = l1_index;
+    entry->lru_counter = ++extent->l2_cache_lru_counter;
+    return min_index;
 }
 
 /**
@@ -1469,8 +1588,7 @@ static int get_cluster_offset(BlockDriverState *bs,
                               uint64_t skip_end_bytes)
 {
     unsigned int l1_index, l2_offset, l2_index;
-    int min_index, i, j;
-    uint32_t min_count;
+    int cache_index;
     void *l2_table;
     bool zeroed = false;
     int64_t ret;
@@ -1479,6 +1597,7 @@ static int get_cluster_offset(BlockDriverState *bs,
 
     if (m_data) {
         m_data->valid = 0;
+        m_data->l2_cache_index = -1;
     }
     if (extent->flat) {
         *cluster_offset = extent->flat_start_offset;
@@ -1523,41 +1642,16 @@ static int get_cluster_offset(BlockDriverState *bs,
     if (!l2_offset) {
         return VMDK_UNALLOC;
     }
-    for (i = 0; i < L2_CACHE_SIZE; i++) {
-        if (l2_offset == extent->l2_cache_offsets[i]) {
-            /* increment the hit count */
-            if (++extent->l2_cache_counts[i] == 0xffffffff) {
-                for (j = 0; j < L2_CACHE_SIZE; j++) {
-                    extent->l2_cache_counts[j] >>= 1;
-                }
-            }
-            l2_table = (char *)extent->l2_cache + (i * l2_size_bytes);
-            goto found;
-        }
-    }
-    /* not found: load a new entry in the least used one */
-    min_index = 0;
-    min_count = 0xffffffff;
-    for (i = 0; i < L2_CACHE_SIZE; i++) {
-        if (extent->l2_cache_counts[i] < min_count) {
-            min_count = extent->l2_cache_counts[i];
-            min_index = i;
-        }
-    }
-    l2_table = (char *)extent->l2_cache + (min_index * l2_size_bytes);
-    BLKDBG_EVENT(extent->file, BLKDBG_L2_LOAD);
-    if (bdrv_pread(extent->file,
-                (int64_t)l2_offset * 512,
-                l2_table,
-                l2_size_bytes
-            ) != l2_size_bytes) {
+    cache_index = vmdk_l2_cache_get(extent, l1_index, l2_offset);
+    if (cache_index < 0) {
         return VMDK_ERROR;
     }
-
-    extent->l2_cache_offsets[min_index] = l2_offset;
-    extent->l2_cache_counts[min_index] = 1;
- found:
+    l2_table = (char *)extent->l2_cache + (cache_index * l2_size_bytes);
     l2_index = ((offset >> 9) / extent->cluster_sectors) % extent->l2_size;
+    if (m_data) {
+        m_data->l2_index = l2_index;
+        m_data->l2_cache_index = cache_index;
+    }
 
     if (extent->sesparse) {
         cluster_sector = le64_to_cpu(((uint64_t *)l2_table)[l2_index]);
@@ -1617,10 +1711,6 @@ static int get_cluster_offset(BlockDriverState *bs,
         }
         if (m_data) {
             m_data->valid = 1;
-            m_data->l1_index = l1_index;
-            m_data->l2_index = l2_index;
-            m_data->l2_offset = l2_offset;
-            m_data->l2_cache_entry = ((uint32_t *)l2_table) + l2_index;
         }
     }
     *cluster_offset = cluster_sector << BDRV_SECTOR_BITS;
@@ -1878,6 +1968,7 @@ vmdk_co_preadv(BlockDriverState *bs, uint64_t offset, uint64_t bytes,
                     ret = -EINVAL;
                     goto fail;
                 }
+                qemu_co_mutex_unlock(&s->lock);
 
                 qemu_iovec_reset(&local_qiov);
                 qemu_iovec_concat(&local_qiov, qiov, bytes_done, n_bytes);
@@ -1886,6 +1977,7 @@ vmdk_co_preadv(BlockDriverState *bs, uint64_t offset, uint64_t bytes,
                 BLKDBG_EVENT(bs->file, BLKDBG_READ_BACKING_AIO);
                 ret = bdrv_co_preadv(bs->backing, offset, n_bytes,
                                      &local_qiov, 0);
+                qemu_co_mutex_lock(&s->lock);
                 if (ret < 0) {
                     goto fail;
                 }
@@ -1893,11 +1985,17 @@ vmdk_co_preadv(BlockDriverState *bs, uint64_t offset, uint64_t bytes,
                 qemu_iovec_memset(qiov, bytes_done, 0, n_bytes);
             }
         } else {
+            /*
+             * Allocated grains never move, so the lock is only needed for
+             * the lookup and concurrent reads can proceed in parallel.
+             */
+            qemu_co_mutex_unlock(&s->lock);
             qemu_iovec_reset(&local_qiov);
             qemu_iovec_concat(&local_qiov, qiov, bytes_done, n_bytes);
 
             ret = vmdk_read_extent(extent, cluster_offset, offset_in_cluster,
                                    &local_qiov, n_bytes);
+            qemu_co_mutex_lock(&s->lock);
             if (ret) {
                 goto fail;
             }
@@ -1978,19 +2076,29 @@ static int vmdk_pwritev(BlockDriverState *bs, uint64_t offset,
         if (zeroed) {
             /* Do zeroed write, buf is ignored */
             if (extent->has_zero_grain &&
+                    m_data.l2_cache_index >= 0 &&
                     offset_in_cluster == 0 &&
                     n_bytes >= extent->cluster_sectors * BDRV_SECTOR_SIZE) {
                 n_bytes = extent->cluster_sectors * BDRV_SECTOR_SIZE;
                 if (!zero_dry_run) {
                     /* update L2 tables */
-                    if (vmdk_L2update(extent, &m_data, VMDK_GTE_ZEROED)
-                            != VMDK_OK) {
-                        return -EIO;
-                    }
+                    vmdk_L2update(extent, &m_data, VMDK_GTE_ZEROED);
                 }
             } else {
                 return -ENOTSUP;
             }
+        } else if (!m_data.valid && !extent->compressed) {
+            /*
+             * The grain is already allocated and never moves, so other
+             * requests can go on while the data is written.
+             */
+            qemu_co_mutex_unlock(&s->lock);
+            ret = vmdk_write_extent(extent, cluster_offset, offset_in_cluster,
+                                    qiov, bytes_done, n_bytes, offset);
+            qemu_co_mutex_lock(&s->lock);
+            if (ret) {
+                return ret;
+            }
         } else {
             ret = vmdk_write_extent(extent, cluster_offset, offset_in_cluster,
                                     qiov, bytes_done, n_bytes, offset);
@@ -1999,11 +2107,8 @@ static int vmdk_pwritev(BlockDriverState *bs, uint64_t offset,
             }
             if (m_data.valid) {
                 /* update L2 tables */
-                if (vmdk_L2update(extent, &m_data,
-                                  cluster_offset >> BDRV_SECTOR_BITS)
-                        != VMDK_OK) {
-                    return -EIO;
-                }
+                vmdk_L2update(extent, &m_data,
+                              cluster_offset >> BDRV_SECTOR_BITS);
             }
         }
         bytes -= n_bytes;
@@ -2744,7 +2849,18 @@ out:
 static void vmdk_close(BlockDriverState *bs)
 {
     BDRVVmdkState *s = bs->opaque;
+    int i, ret;
 
+    for (i = 0; i < s->num_extents; i++) {
+        if (!s->extents[i].flat) {
+            ret = vmdk_l2_cache_flush(&s->extents[i]);
+            if (ret < 0) {
+                error_report("Failed to flush the grain table cache of "
+                             "'%s': %s", s->extents[i].file->bs->filename,
+                             strerror(-ret));
+            }
+        }
+    }
     vmdk_free_extents(bs);
     g_free(s->create_type);
 
@@ -2758,6 +2874,18 @@ static coroutine_fn int vmdk_co_flush(BlockDriverState *bs)
     int i, err;
     int ret = 0;
 
+    for (i = 0; i < s->num_extents; i++) {
+        if (s->extents[i].flat) {
+            continue;
+        }
+        qemu_co_mutex_lock(&s->lock);
+        err = vmdk_l2_cache_flush(&s->extents[i]);
+        qemu_co_mutex_unlock(&s->lock);
+        if (err < 0) {
+            ret = err;
+        }
+    }
+
     for (i = 0; i < s->num_extents; i++) {
         err = bdrv_co_flush(s->extents[i].file->bs);
         if (err < 0) {
@@ -2828,7 +2956,9 @@ static ImageInfo *vmdk_get_extent_info(VmdkExtent *extent)
 
 static int coroutine_fn vmdk_co_check(BlockDriverState *bs,
                                       BdrvCheckResult *result,
-                                      BdrvCheckMode fix)
+                                      BdrvCheckMode fix,
+                                      BlockDriverCheckStatusCB *status_cb,
+                                      void *cb_opaque)
 {
     BDRVVmdkState *s = bs->opaque;
     VmdkExtent *extent = NULL;
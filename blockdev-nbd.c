@@ -16,6 +16,7 @@
 #include "qapi/error.h"
 #include "qapi/qapi-commands-block.h"
 #include "block/nbd.h"
+#include "sysemu/iothread.h"
 #include "io/channel-socket.h"
 #include "io/net-listener.h"
 
@@ -145,12 +146,17 @@ void qmp_nbd_server_start(SocketAddressLegacy *addr,
 
 void qmp_nbd_server_add(const char *device, bool has_name, const char *name,
                         bool has_writable, bool writable,
-                        bool has_bitmap, const char *bitmap, Error **errp)
+                        bool has_bitmap, const char *bitmap,
+                        bool has_iothreads, strList *iothreads,
+                        Error **errp)
 {
     BlockDriverState *bs = NULL;
     BlockBackend *on_eject_blk;
     NBDExport *exp;
     int64_t len;
+    AioContext **conn_ctxs = NULL;
+    int nr_conn_ctxs = 0;
+    strList *e;
 
     if (!nbd_server) {
         error_setg(errp, "NBD server not running");
@@ -187,12 +193,34 @@ void qmp_nbd_server_add(const char *device, bool has_name, const char *name,
         writable = false;
     }
 
+    for (e = iothreads; e; e = e->next) {
+        IOThread *iothread = iothread_by_id(e->value);
+
+        if (!iothread) {
+            error_setg(errp, "IOThread '%s' not found", e->value);
+            g_free(conn_ctxs);
+            return;
+        }
+        conn_ctxs = g_renew(AioContext *, conn_ctxs, nr_conn_ctxs + 1);
+        conn_ctxs[nr_conn_ctxs++] = iothread_get_aio_context(iothread);
+    }
+
+    /*
+     * The server does not limit the number of clients and they all share
+     * the export's BlockBackend, so connections see each other's writes.
+     */
     exp = nbd_export_new(bs, 0, len, name, NULL, bitmap,
-                         writable ? 0 : NBD_FLAG_READ_ONLY,
+                         NBD_FLAG_CAN_MULTI_CONN |
+                         (writable ? 0 : NBD_FLAG_READ_ONLY),
                          NULL, false, on_eject_blk, errp);
     if (!exp) {
+        g_free(conn_ctxs);
         return;
     }
+    if (nr_conn_ctxs) {
+        nbd_export_set_conn_contexts(exp, conn_ctxs, nr_conn_ctxs);
+    }
+    g_free(conn_ctxs);
 
     /* The list of named exports has a strong reference to this export now and
      * our only way of accessing it is through nbd_export_find(), so we can drop
@@ -385,13 +385,9 @@ static void extract_common_blockdev_options(QemuOpts *opts, int *bdrv_flags,
         }
 
         if ((aio = qemu_opt_get(opts, "aio")) != NULL) {
-            if (!strcmp(aio, "native")) {
-                *bdrv_flags |= BDRV_O_NATIVE_AIO;
-            } else if (!strcmp(aio, "threads")) {
-                /* this is the default */
-            } else {
-               error_setg(errp, "invalid aio option");
-               return;
+            if (bdrv_parse_aio(aio, bdrv_flags) < 0) {
+                error_setg(errp, "invalid aio option");
+                return;
             }
         }
     }
@@ -484,6 +480,7 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
     BlockdevDetectZeroesOptions detect_zeroes =
         BLOCKDEV_DETECT_ZEROES_OPTIONS_OFF;
     const char *throttling_group = NULL;
+    uint64_t throttling_weight;
 
     /* Check common options by copying from bs_opts to opts, all other options
      * stay in bs_opts for processing by bdrv_open(). */
@@ -530,6 +527,13 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
         goto early_err;
     }
 
+    throttling_weight = qemu_opt_get_number(opts, "throttling.weight", 1);
+    if (throttling_weight < 1 || throttling_weight > UINT_MAX) {
+        error_setg(errp, "throttling.weight must be between 1 and %u",
+                   UINT_MAX);
+        goto early_err;
+    }
+
     if ((buf = qemu_opt_get(opts, "format")) != NULL) {
         if (is_help_option(buf)) {
             qemu_printf("Supported formats:");
@@ -625,6 +629,7 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
         }
         blk_io_limits_enable(blk, throttling_group);
         blk_set_io_limits(blk, &cfg);
+        blk_set_io_limits_weight(blk, throttling_weight);
     }
 
     blk_set_enable_write_cache(blk, !writethrough);
@@ -2833,6 +2838,11 @@ void qmp_block_set_io_throttle(BlockIOThrottle *arg, Error **errp)
         goto out;
     }
 
+    if (arg->has_weight && (arg->weight < 1 || arg->weight > UINT_MAX)) {
+        error_setg(errp, "weight must be between 1 and %u", UINT_MAX);
+        goto out;
+    }
+
     if (throttle_enabled(&cfg)) {
         /* Enable I/O limits if they're not enabled yet, otherwise
          * just update the throttling group. */
@@ -2846,6 +2856,9 @@ void qmp_block_set_io_throttle(BlockIOThrottle *arg, Error **errp)
         }
         /* Set the new throttling configuration */
         blk_set_io_limits(blk, &cfg);
+        if (arg->has_weight) {
+            blk_set_io_limits_weight(blk, arg->weight);
+        }
     } else if (blk_get_public(blk)->throttle_group_member.throttle_state) {
         /* If all throttling settings are set to 0, disable I/O limits */
         blk_io_limits_disable(blk);
@@ -3600,7 +3613,10 @@ static BlockJob *do_backup_common(BackupCommon *backup,
 
     job = backup_job_create(backup->job_id, bs, target_bs, backup->speed,
                             backup->sync, bmap, backup->bitmap_mode,
-                            backup->compress,
+                            backup->compress, backup->max_workers,
+                            backup->max_chunk,
+                            backup->has_filter_node_name ?
+                            backup->filter_node_name : NULL,
                             backup->on_source_error,
                             backup->on_target_error,
                             job_flags, NULL, NULL, txn, errp);
@@ -4661,7 +4677,7 @@ QemuOptsList qemu_common_drive_opts = {
         },{
             .name = "aio",
             .type = QEMU_OPT_STRING,
-            .help = "host AIO implementation (threads, native)",
+            .help = "host AIO implementation (threads, native, io_uring)",
         },{
             .name = BDRV_OPT_CACHE_WB,
             .type = QEMU_OPT_BOOL,
@@ -4690,6 +4706,10 @@ QemuOptsList qemu_common_drive_opts = {
             .name = "throttling.group",
             .type = QEMU_OPT_STRING,
             .help = "name of the block throttling group",
+        },{
+            .name = "throttling.weight",
+            .type = QEMU_OPT_NUMBER,
+            .help = "share of the throttling group given to this drive",
         },{
             .name = "copy-on-read",
             .type = QEMU_OPT_BOOL,
@@ -0,0 +1,406 @@
+/*
+ * QEMU Crypto XTS-AES using host AES instructions
+ *
+ * Copyright (c) 2019 QEMU contributors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+#include "qapi/error.h"
+#include "crypto/aes.h"
+#include "crypto/xts.h"
+#include "cipherpriv.h"
+
+/*
+ * The cipher backends encrypt XTS one block at a time through
+ * xts_encrypt(), with an indirect call for each block.  Here the whole
+ * buffer is handled in one pass, AES_ACCEL_BLOCKS blocks at a time, so
+ * that the AES rounds of independent blocks overlap in the pipeline.
+ *
+ * The round keys come from the key schedule in crypto/aes.c, stored as
+ * bytes.  AES_set_decrypt_key() computes the keys of the equivalent
+ * inverse cipher, which is what both AES-NI and the ARMv8 instructions
+ * expect for decryption.
+ */
+#define AES_ACCEL_BLOCKS 8
+
+typedef struct QCryptoAESAccelKey {
+    uint8_t enc[AES_MAXNR + 1][AES_BLOCK_SIZE];
+    uint8_t dec[AES_MAXNR + 1][AES_BLOCK_SIZE];
+    int rounds;
+} QCryptoAESAccelKey;
+
+struct QCryptoAESAccel {
+    QCryptoAESAccelKey key;
+    QCryptoAESAccelKey key_tweak;
+    uint8_t iv[XTS_BLOCK_SIZE];
+};
+
+static void qcrypto_aes_accel_key_copy(uint8_t (*dst)[AES_BLOCK_SIZE],
+                                       const AES_KEY *src)
+{
+    int i;
+
+    for (i = 0; i < 4 * (src->rounds + 1); i++) {
+        stl_be_p(&dst[i / 4][(i % 4) * 4], src->rd_key[i]);
+    }
+}
+
+static int qcrypto_aes_accel_setkey(QCryptoAESAccelKey *key,
+                                    const uint8_t *bytes, size_t nbytes)
+{
+    AES_KEY aes;
+
+    if (AES_set_encrypt_key(bytes, nbytes * 8, &aes) != 0) {
+        return -1;
+    }
+    key->rounds = aes.rounds;
+    qcrypto_aes_accel_key_copy(key->enc, &aes);
+
+    if (AES_set_decrypt_key(bytes, nbytes * 8, &aes) != 0) {
+        return -1;
+    }
+    qcrypto_aes_accel_key_copy(key->dec, &aes);
+    return 0;
+}
+
+/* Multiply the tweak by x in GF(2^128), on its two little-endian halves */
+static inline void qcrypto_aes_accel_mult_x(uint64_t *lo, uint64_t *hi)
+{
+    uint64_t carry = *hi >> 63;
+
+    *hi = (*hi << 1) | (*lo >> 63);
+    *lo = (*lo << 1) ^ (carry * 0x87);
+}
+
+/*
+ * Apply @op with round key @rk to one block, or to AES_ACCEL_BLOCKS
+ * blocks.  The blocks are named one by one so that they stay in
+ * registers.
+ */
+#define AES_ACCEL_X1(b, op, rk) do {                                    \
+    b[0] = op(b[0], rk);                                                \
+} while (0)
+
+#define AES_ACCEL_X8(b, op, rk) do {                                    \
+    b[0] = op(b[0], rk); b[1] = op(b[1], rk);                           \
+    b[2] = op(b[2], rk); b[3] = op(b[3], rk);                           \
+    b[4] = op(b[4], rk); b[5] = op(b[5], rk);                           \
+    b[6] = op(b[6], rk); b[7] = op(b[7], rk);                           \
+} while (0)
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#define AES_ACCEL_TARGET_PRAGMA
+#pragma GCC push_options
+#pragma GCC target("sse2,aes")
+#include <emmintrin.h>
+#include <wmmintrin.h>
+
+typedef __m128i aes_vec;
+
+#define aes_vec_load(p)         _mm_loadu_si128((const __m128i *)(p))
+#define aes_vec_store(p, v)     _mm_storeu_si128((__m128i *)(p), v)
+#define aes_vec_xor(a, b)       _mm_xor_si128(a, b)
+#define aes_vec_make(lo, hi)    _mm_set_epi64x(hi, lo)
+
+#define AES_ACCEL_CIPHER(rks, rounds, b, X, round, last) do {          \
+    int i_;                                                             \
+    X(b, _mm_xor_si128, aes_vec_load(rks[0]));                          \
+    for (i_ = 1; i_ < rounds; i_++) {                                   \
+        X(b, round, aes_vec_load(rks[i_]));                             \
+    }                                                                   \
+    X(b, last, aes_vec_load(rks[rounds]));                              \
+} while (0)
+
+#define AES_ACCEL_ENC(key, b, X) \
+    AES_ACCEL_CIPHER((key)->enc, (key)->rounds, b, X,                   \
+                     _mm_aesenc_si128, _mm_aesenclast_si128)
+#define AES_ACCEL_DEC(key, b, X) \
+    AES_ACCEL_CIPHER((key)->dec, (key)->rounds, b, X,                   \
+                     _mm_aesdec_si128, _mm_aesdeclast_si128)
+
+#elif defined(__aarch64__)
+
+#ifndef __ARM_FEATURE_CRYPTO
+#define AES_ACCEL_TARGET_PRAGMA
+#pragma GCC push_options
+#pragma GCC target("+crypto")
+#endif
+#include <arm_neon.h>
+
+typedef uint8x16_t aes_vec;
+
+#define aes_vec_load(p)         vld1q_u8((const uint8_t *)(p))
+#define aes_vec_store(p, v)     vst1q_u8((uint8_t *)(p), v)
+#define aes_vec_xor(a, b)       veorq_u8(a, b)
+#define aes_vec_make(lo, hi) \
+    vreinterpretq_u8_u64(vcombine_u64(vcreate_u64(lo), vcreate_u64(hi)))
+
+static inline aes_vec qcrypto_aes_accel_aese_mc(aes_vec x, aes_vec rk)
+{
+    return vaesmcq_u8(vaeseq_u8(x, rk));
+}
+
+static inline aes_vec qcrypto_aes_accel_aesd_imc(aes_vec x, aes_vec rk)
+{
+    return vaesimcq_u8(vaesdq_u8(x, rk));
+}
+
+/*
+ * AESE/AESD add the round key before the substitution, unlike AES-NI
+ * which adds it at the end, so the last round key is added separately.
+ */
+#define AES_ACCEL_CIPHER(rks, rounds, b, X, round, last) do {          \
+    int i_;                                                             \
+    for (i_ = 0; i_ < rounds - 1; i_++) {                               \
+        X(b, round, aes_vec_load(rks[i_]));                             \
+    }                                                                   \
+    X(b, last, aes_vec_load(rks[rounds - 1]));                          \
+    X(b, veorq_u8, aes_vec_load(rks[rounds]));                          \
+} while (0)
+
+#define AES_ACCEL_ENC(key, b, X) \
+    AES_ACCEL_CIPHER((key)->enc, (key)->rounds, b, X,                   \
+                     qcrypto_aes_accel_aese_mc, vaeseq_u8)
+#define AES_ACCEL_DEC(key, b, X) \
+    AES_ACCEL_CIPHER((key)->dec, (key)->rounds, b, X,                   \
+                     qcrypto_aes_accel_aesd_imc, vaesdq_u8)
+
+#else
+#error "AES acceleration is only available on x86 and AArch64 hosts"
+#endif
+
+/* XOR the blocks of @src with the next @n tweaks into @b, saving them in @t */
+static inline void qcrypto_aes_accel_xts_load(aes_vec *b, aes_vec *t,
+                                              uint64_t *lo, uint64_t *hi,
+                                              const uint8_t *src, int n)
+{
+    int j;
+
+    for (j = 0; j < n; j++) {
+        t[j] = aes_vec_make(*lo, *hi);
+        qcrypto_aes_accel_mult_x(lo, hi);
+        b[j] = aes_vec_xor(aes_vec_load(src + j * XTS_BLOCK_SIZE), t[j]);
+    }
+}
+
+static inline void qcrypto_aes_accel_xts_store(uint8_t *dst, const aes_vec *b,
+                                               const aes_vec *t, int n)
+{
+    int j;
+
+    for (j = 0; j < n; j++) {
+        aes_vec_store(dst + j * XTS_BLOCK_SIZE, aes_vec_xor(b[j], t[j]));
+    }
+}
+
+/*
+ * Same result as xts_encrypt()/xts_decrypt() for a @length that is a
+ * multiple of the block size, including the value left in @iv.
+ */
+static void qcrypto_aes_accel_xts(QCryptoAESAccel *ctx, bool enc,
+                                  size_t length, uint8_t *dst,
+                                  const uint8_t *src)
+{
+    size_t nblocks = length / XTS_BLOCK_SIZE;
+    aes_vec b[AES_ACCEL_BLOCKS], t[AES_ACCEL_BLOCKS];
+    aes_vec v = aes_vec_load(ctx->iv);
+    uint64_t lo, hi;
+    size_t i;
+
+    AES_ACCEL_ENC(&ctx->key_tweak, (&v), AES_ACCEL_X1);
+    aes_vec_store(ctx->iv, v);
+    lo = ldq_le_p(ctx->iv);
+    hi = ldq_le_p(ctx->iv + 8);
+
+    for (i = 0; i + AES_ACCEL_BLOCKS <= nblocks; i += AES_ACCEL_BLOCKS) {
+        qcrypto_aes_accel_xts_load(b, t, &lo, &hi, src, AES_ACCEL_BLOCKS);
+        if (enc) {
+            AES_ACCEL_ENC(&ctx->key, b, AES_ACCEL_X8);
+        } else {
+            AES_ACCEL_DEC(&ctx->key, b, AES_ACCEL_X8);
+        }
+        qcrypto_aes_accel_xts_store(dst, b, t, AES_ACCEL_BLOCKS);
+        src += AES_ACCEL_BLOCKS * XTS_BLOCK_SIZE;
+        dst += AES_ACCEL_BLOCKS * XTS_BLOCK_SIZE;
+    }
+    for (; i < nblocks; i++) {
+        qcrypto_aes_accel_xts_load(b, t, &lo, &hi, src, 1);
+        if (enc) {
+            AES_ACCEL_ENC(&ctx->key, b, AES_ACCEL_X1);
+        } else {
+            AES_ACCEL_DEC(&ctx->key, b, AES_ACCEL_X1);
+        }
+        qcrypto_aes_accel_xts_store(dst, b, t, 1);
+        src += XTS_BLOCK_SIZE;
+        dst += XTS_BLOCK_SIZE;
+    }
+
+    /* Like xts_encrypt(), leave the decrypted final tweak in the IV */
+    v = aes_vec_make(lo, hi);
+    AES_ACCEL_DEC(&ctx->key_tweak, (&v), AES_ACCEL_X1);
+    aes_vec_store(ctx->iv, v);
+}
+
+#ifdef AES_ACCEL_TARGET_PRAGMA
+#pragma GCC pop_options
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include "qemu/cpuid.h"
+
+static bool qcrypto_aes_accel_probe(void)
+{
+    int a, b, c, d;
+
+    if (__get_cpuid_max(0, NULL) < 1) {
+        return false;
+    }
+    __cpuid(1, a, b, c, d);
+    return (c & bit_AES) && (d & bit_SSE2);
+}
+#else
+#include "elf.h"
+
+#ifndef HWCAP_AES
+#define HWCAP_AES (1 << 3)
+#endif
+
+static bool qcrypto_aes_accel_probe(void)
+{
+    return qemu_getauxval(AT_HWCAP) & HWCAP_AES;
+}
+#endif
+
+static bool qcrypto_aes_accel_available(void)
+{
+    static int available = -1;
+
+    if (available < 0) {
+        available = qcrypto_aes_accel_probe();
+    }
+    return available;
+}
+
+QCryptoAESAccel *
+qcrypto_aes_accel_cipher_ctx_new(QCryptoCipherAlgorithm alg,
+                                 QCryptoCipherMode mode,
+                                 const uint8_t *key,
+                                 size_t nkey, Error **errp)
+{
+    QCryptoAESAccel *ctx;
+
+    if (mode != QCRYPTO_CIPHER_MODE_XTS) {
+        error_setg(errp, "Unsupported cipher mode %s",
+                   QCryptoCipherMode_str(mode));
+        return NULL;
+    }
+    switch (alg) {
+    case QCRYPTO_CIPHER_ALG_AES_128:
+    case QCRYPTO_CIPHER_ALG_AES_192:
+    case QCRYPTO_CIPHER_ALG_AES_256:
+        break;
+    default:
+        error_setg(errp, "Unsupported cipher algorithm %s",
+                   QCryptoCipherAlgorithm_str(alg));
+        return NULL;
+    }
+    if (!qcrypto_aes_accel_available()) {
+        error_setg(errp, "Host CPU has no AES instructions");
+        return NULL;
+    }
+    if (nkey != qcrypto_cipher_get_key_len(alg) * 2) {
+        error_setg(errp, "Cipher key length %zu should be %zu",
+                   nkey, qcrypto_cipher_get_key_len(alg) * 2);
+        return NULL;
+    }
+
+    ctx = g_new0(QCryptoAESAccel, 1);
+    if (qcrypto_aes_accel_setkey(&ctx->key, key, nkey / 2) < 0 ||
+        qcrypto_aes_accel_setkey(&ctx->key_tweak, key + nkey / 2,
+                                 nkey / 2) < 0) {
+        error_setg(errp, "Failed to set encryption key");
+        g_free(ctx);
+        return NULL;
+    }
+
+    return ctx;
+}
+
+static int qcrypto_aes_accel_cipher_encdec(QCryptoCipher *cipher,
+                                           const void *in, void *out,
+                                           size_t len, bool enc,
+                                           Error **errp)
+{
+    QCryptoAESAccel *ctx = cipher->opaque;
+
+    if (len % XTS_BLOCK_SIZE) {
+        error_setg(errp, "Length %zu must be a multiple of block size %d",
+                   len, XTS_BLOCK_SIZE);
+        return -1;
+    }
+
+    qcrypto_aes_accel_xts(ctx, enc, len, out, in);
+    return 0;
+}
+
+static int qcrypto_aes_accel_cipher_encrypt(QCryptoCipher *cipher,
+                                            const void *in, void *out,
+                                            size_t len, Error **errp)
+{
+    return qcrypto_aes_accel_cipher_encdec(cipher, in, out, len, true, errp);
+}
+
+static int qcrypto_aes_accel_cipher_decrypt(QCryptoCipher *cipher,
+                                            const void *in, void *out,
+                                            size_t len, Error **errp)
+{
+    return qcrypto_aes_accel_cipher_encdec(cipher, in, out, len, false, errp);
+}
+
+static int qcrypto_aes_accel_cipher_setiv(QCryptoCipher *cipher,
+                                          const uint8_t *iv, size_t niv,
+                                          Error **errp)
+{
+    QCryptoAESAccel *ctx = cipher->opaque;
+
+    if (niv != XTS_BLOCK_SIZE) {
+        error_setg(errp, "IV must be %d bytes not %zu",
+                   XTS_BLOCK_SIZE, niv);
+        return -1;
+    }
+
+    memcpy(ctx->iv, iv, XTS_BLOCK_SIZE);
+    return 0;
+}
+
+static void qcrypto_aes_accel_cipher_free(QCryptoCipher *cipher)
+{
+    QCryptoAESAccel *ctx = cipher->opaque;
+
+    memset(ctx, 0, sizeof(*ctx));
+    g_free(ctx);
+    cipher->opaque = NULL;
+}
+
+struct QCryptoCipherDriver qcrypto_cipher_aes_accel_driver = {
+    .cipher_encrypt = qcrypto_aes_accel_cipher_encrypt,
+    .cipher_decrypt = qcrypto_aes_accel_cipher_decrypt,
+    .cipher_setiv = qcrypto_aes_accel_cipher_setiv,
+    .cipher_free = qcrypto_aes_accel_cipher_free,
+};
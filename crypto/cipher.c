@@ -166,10 +166,19 @@ QCryptoCipher *qcrypto_cipher_new(QCryptoCipherAlgorithm alg,
     void *ctx = NULL;
     QCryptoCipherDriver *drv = NULL;
 
-#ifdef CONFIG_AF_ALG
-    ctx = qcrypto_afalg_cipher_ctx_new(alg, mode, key, nkey, NULL);
+#ifdef CONFIG_AES_ACCEL
+    ctx = qcrypto_aes_accel_cipher_ctx_new(alg, mode, key, nkey, NULL);
     if (ctx) {
-        drv = &qcrypto_cipher_afalg_driver;
+        drv = &qcrypto_cipher_aes_accel_driver;
+    }
+#endif
+
+#ifdef CONFIG_AF_ALG
+    if (!ctx) {
+        ctx = qcrypto_afalg_cipher_ctx_new(alg, mode, key, nkey, NULL);
+        if (ctx) {
+            drv = &qcrypto_cipher_afalg_driver;
+        }
     }
 #endif
 
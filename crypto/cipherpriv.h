@@ -53,4 +53,18 @@ extern struct QCryptoCipherDriver qcrypto_cipher_afalg_driver;
 
 #endif
 
+#ifdef CONFIG_AES_ACCEL
+
+typedef struct QCryptoAESAccel QCryptoAESAccel;
+
+extern QCryptoAESAccel *
+qcrypto_aes_accel_cipher_ctx_new(QCryptoCipherAlgorithm alg,
+                                 QCryptoCipherMode mode,
+                                 const uint8_t *key,
+                                 size_t nkey, Error **errp);
+
+extern struct QCryptoCipherDriver qcrypto_cipher_aes_accel_driver;
+
+#endif
+
 #endif
@@ -76,6 +76,32 @@ typedef struct BlockLatencyHistogram {
     uint64_t *bins;
 } BlockLatencyHistogram;
 
+/* Always-on latency histogram with log-linear buckets, in the style of
+ * HdrHistogram: latencies below 2^BLOCK_LAT_SUB_BITS ns have a bucket each,
+ * and every power of two above is split in 2^BLOCK_LAT_SUB_BITS linear
+ * sub-buckets.  Any percentile read from it overestimates the real value
+ * by less than 1/2^BLOCK_LAT_SUB_BITS.  Latencies of 2^BLOCK_LAT_MAX_BITS ns
+ * (about 68 seconds) and more all go to the last bucket.
+ */
+#define BLOCK_LAT_SUB_BITS 3
+#define BLOCK_LAT_MAX_BITS 36
+#define BLOCK_LAT_NBUCKETS \
+    ((BLOCK_LAT_MAX_BITS - BLOCK_LAT_SUB_BITS + 1) << BLOCK_LAT_SUB_BITS)
+
+typedef struct BlockLatencyLogHistogram {
+    uint64_t count;
+    uint64_t max;
+    uint64_t bins[BLOCK_LAT_NBUCKETS];
+} BlockLatencyLogHistogram;
+
+/* Where the time of a BlockBackend request is spent */
+enum BlockAcctPhase {
+    BLOCK_ACCT_PHASE_TOTAL,     /* device submission to completion */
+    BLOCK_ACCT_PHASE_QUEUE,     /* BlockBackend submission to root node */
+    BLOCK_ACCT_PHASE_DRIVER,    /* root node submission to completion */
+    BLOCK_ACCT_PHASE_MAX,
+};
+
 struct BlockAcctStats {
     QemuMutex lock;
     uint64_t nr_bytes[BLOCK_MAX_IOTYPE];
@@ -89,6 +115,7 @@ struct BlockAcctStats {
     bool account_invalid;
     bool account_failed;
     BlockLatencyHistogram latency_histogram[BLOCK_MAX_IOTYPE];
+    BlockLatencyLogHistogram latency_log[BLOCK_MAX_IOTYPE][BLOCK_ACCT_PHASE_MAX];
 };
 
 typedef struct BlockAcctCookie {
@@ -117,5 +144,12 @@ double block_acct_queue_depth(BlockAcctTimedStats *stats,
 int block_latency_histogram_set(BlockAcctStats *stats, enum BlockAcctType type,
                                 uint64List *boundaries);
 void block_latency_histograms_clear(BlockAcctStats *stats);
+int64_t block_acct_time_ns(void);
+void block_acct_request_done(BlockAcctStats *stats, enum BlockAcctType type,
+                             int64_t submit_time_ns, int64_t dispatch_time_ns);
+void block_latency_log_histogram_account(BlockLatencyLogHistogram *hist,
+                                         int64_t latency_ns);
+uint64_t block_latency_log_histogram_percentile(BlockLatencyLogHistogram *hist,
+                                                double percentile);
 
 #endif
@@ -50,6 +50,8 @@
 #define BLOCK_OPT_SUBFMT            "subformat"
 #define BLOCK_OPT_COMPAT_LEVEL      "compat"
 #define BLOCK_OPT_LAZY_REFCOUNTS    "lazy_refcounts"
+#define BLOCK_OPT_EXTL2             "extended_l2"
+#define BLOCK_OPT_COMPRESSION_TYPE  "compression_type"
 #define BLOCK_OPT_ADAPTER_TYPE      "adapter_type"
 #define BLOCK_OPT_REDUNDANCY        "redundancy"
 #define BLOCK_OPT_NOCOW             "nocow"
@@ -82,6 +84,8 @@ typedef struct BdrvTrackedRequest {
     CoQueue wait_queue; /* coroutines blocked on this request */
 
     struct BdrvTrackedRequest *waiting_for;
+
+    int64_t start_time_ns; /* for the latency statistics of @bs */
 } BdrvTrackedRequest;
 
 struct BlockDriver {
@@ -355,8 +359,18 @@ struct BlockDriver {
                                   const char *name,
                                   Error **errp);
     int (*bdrv_get_info)(BlockDriverState *bs, BlockDriverInfo *bdi);
+
+    /*
+     * Returns a host file descriptor that holds the node's data verbatim,
+     * so that it can be read without going through the block layer, and
+     * stores in *@offset where offset 0 of the node is in that file.
+     * Returns -ENOTSUP if there is no such file descriptor.
+     */
+    int (*bdrv_get_host_fd)(BlockDriverState *bs, int64_t *offset);
     ImageInfoSpecific *(*bdrv_get_specific_info)(BlockDriverState *bs,
                                                  Error **errp);
+    /* Driver-specific statistics for query-blockstats */
+    BlockStatsSpecific *(*bdrv_get_specific_stats)(BlockDriverState *bs);
 
     int coroutine_fn (*bdrv_save_vmstate)(BlockDriverState *bs,
                                           QEMUIOVector *qiov,
@@ -393,11 +407,14 @@ struct BlockDriver {
 
     /*
      * Returns 0 for completed check, -errno for internal errors.
-     * The check results are stored in result.
+     * The check results are stored in result.  If status_cb is not NULL,
+     * the driver may call it to report the progress of the check.
      */
     int coroutine_fn (*bdrv_co_check)(BlockDriverState *bs,
                                       BdrvCheckResult *result,
-                                      BdrvCheckMode fix);
+                                      BdrvCheckMode fix,
+                                      BlockDriverCheckStatusCB *status_cb,
+                                      void *cb_opaque);
 
     int (*bdrv_amend_options)(BlockDriverState *bs, QemuOpts *opts,
                               BlockDriverAmendStatusCB *status_cb,
@@ -870,6 +887,11 @@ struct BlockDriverState {
     /* Offset after the highest byte written to */
     Stat64 wr_highest_offset;
 
+    /* Latency of the requests submitted to this node, from submission until
+     * completion.  Protected by latency_lock.  */
+    QemuMutex latency_lock;
+    BlockLatencyLogHistogram latency[BLOCK_MAX_IOTYPE];
+
     /* If true, copy read backing sectors into image.  Can be >1 if more
      * than one client has requested copy-on-read.  Accessed with atomic
      * ops.
@@ -1158,6 +1180,13 @@ void mirror_start(const char *job_id, BlockDriverState *bs,
  * @sync_mode: What parts of the disk image should be copied to the destination.
  * @sync_bitmap: The dirty bitmap if sync_mode is 'bitmap' or 'incremental'
  * @bitmap_mode: The bitmap synchronization policy to use.
+ * @compress: Whether to compress the data written to @target.
+ * @max_workers: The maximum number of parallel copies, or 0 for the default.
+ * @max_chunk: The maximum size of a copy through a bounce buffer, or 0 for
+ *             the default.
+ * @filter_node_name: The node name that should be assigned to the filter
+ *                    driver that the backup job inserts into the graph above
+ *                    @bs. NULL means that a node name should be autogenerated.
  * @on_source_error: The action to take upon error reading from the source.
  * @on_target_error: The action to take upon error writing to the target.
  * @creation_flags: Flags that control the behavior of the Job lifetime.
@@ -1174,7 +1203,8 @@ BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
                             MirrorSyncMode sync_mode,
                             BdrvDirtyBitmap *sync_bitmap,
                             BitmapSyncMode bitmap_mode,
-                            bool compress,
+                            bool compress, int max_workers, int64_t max_chunk,
+                            const char *filter_node_name,
                             BlockdevOnError on_source_error,
                             BlockdevOnError on_target_error,
                             int creation_flags,
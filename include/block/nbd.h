@@ -335,6 +335,7 @@ void nbd_export_get(NBDExport *exp);
 void nbd_export_put(NBDExport *exp);
 
 BlockBackend *nbd_export_get_blockdev(NBDExport *exp);
+void nbd_export_set_conn_contexts(NBDExport *exp, AioContext **ctxs, int n);
 
 NBDExport *nbd_export_find(const char *name);
 void nbd_export_close_all(void);
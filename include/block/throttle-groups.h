@@ -56,6 +56,18 @@ typedef struct ThrottleGroupMember {
     unsigned       pending_reqs[2];
     QLIST_ENTRY(ThrottleGroupMember) round_robin;
 
+    /* When several members have queued requests, the group serves them
+     * with deficit round robin: a member keeps the turn until it has
+     * started @weight requests.  @deficit is what is left of its turn.
+     */
+    unsigned       weight;
+    int            deficit[2];
+
+    /* Requests that had to wait because of throttling, and the total time
+     * they waited. */
+    uint64_t       throttled_ops[2];
+    uint64_t       throttled_time_ns[2];
+
 } ThrottleGroupMember;
 
 #define TYPE_THROTTLE_GROUP "throttle-group"
@@ -68,6 +80,10 @@ void throttle_group_unref(ThrottleState *ts);
 
 void throttle_group_config(ThrottleGroupMember *tgm, ThrottleConfig *cfg);
 void throttle_group_get_config(ThrottleGroupMember *tgm, ThrottleConfig *cfg);
+void throttle_group_set_weight(ThrottleGroupMember *tgm, unsigned weight);
+unsigned throttle_group_get_weight(ThrottleGroupMember *tgm);
+void throttle_group_get_wait_stats(ThrottleGroupMember *tgm, bool is_write,
+                                   uint64_t *ops, uint64_t *time_ns);
 
 void throttle_group_register_tgm(ThrottleGroupMember *tgm,
                                 const char *groupname,
@@ -68,6 +68,14 @@ struct RAMBlock {
      */
     unsigned long *clear_bmap;
     uint8_t clear_bmap_shift;
+
+    /*
+     * With mapped-ram, the pages present in the migration file, and
+     * where their bitmap and the pages start in the file.
+     */
+    unsigned long *file_bmap;
+    off_t bitmap_offset;
+    off_t pages_offset;
 };
 
 /**
@@ -18,6 +18,12 @@
 typedef struct HBitmap HBitmap;
 typedef struct HBitmapIter HBitmapIter;
 
+/* A run of set bits, as used by hbitmap_get_extents() */
+typedef struct HBitmapExtent {
+    uint64_t start;
+    uint64_t count;
+} HBitmapExtent;
+
 #define BITS_PER_LEVEL         (BITS_PER_LONG == 32 ? 5 : 6)
 
 /* For 32-bit, the largest that fits in a 4 GiB address space.
@@ -311,6 +317,15 @@ unsigned long hbitmap_iter_skip_words(HBitmapIter *hbi);
  */
 int64_t hbitmap_next_zero(const HBitmap *hb, uint64_t start, uint64_t count);
 
+/**
+ * test_hbitmap_next_accel:
+ *
+ * Switch the word scanning and counting kernels to the next less capable
+ * implementation.  Returns false when the portable C version was already
+ * in use.  For unit tests only.
+ */
+bool test_hbitmap_next_accel(void);
+
 /* hbitmap_next_dirty_area:
  * @hb: The HBitmap to operate on
  * @start: in-out parameter.
@@ -327,6 +342,34 @@ int64_t hbitmap_next_zero(const HBitmap *hb, uint64_t start, uint64_t count);
 bool hbitmap_next_dirty_area(const HBitmap *hb, uint64_t *start,
                              uint64_t *count);
 
+/**
+ * hbitmap_get_extents:
+ * @hb: The HBitmap to operate on
+ * @start: in-out parameter.
+ *         in: the offset to start from
+ *         out: the offset to continue from on the next call
+ * @end: End of the region to look at
+ * @extents: Array to store the dirty areas in
+ * @max_extents: Number of entries in @extents
+ *
+ * Run-length encode the dirty areas in [@start, @end) into @extents, in
+ * ascending order.  Returns the number of extents stored; *@start is set to
+ * @end once the whole region has been looked at.
+ */
+size_t hbitmap_get_extents(const HBitmap *hb, uint64_t *start, uint64_t end,
+                           HBitmapExtent *extents, size_t max_extents);
+
+/**
+ * hbitmap_set_extents:
+ * @hb: The HBitmap to operate on
+ * @extents: Array of dirty areas, e.g. filled by hbitmap_get_extents()
+ * @nb_extents: Number of entries in @extents
+ *
+ * Set the bits of all areas in @extents.
+ */
+void hbitmap_set_extents(HBitmap *hb, const HBitmapExtent *extents,
+                         size_t nb_extents);
+
 /* hbitmap_create_meta:
  * Create a "meta" hbitmap to track dirtiness of the bits in this HBitmap.
  * The caller owns the created bitmap and must call hbitmap_free_meta(hb) to
@@ -265,6 +265,11 @@ struct JobDriver {
      */
     void (*clean)(Job *job);
 
+    /**
+     * If the callback is not NULL, it is called by query-jobs to fill in
+     * the optional fields of @info that are specific to the job type.
+     */
+    void (*query)(Job *job, JobInfo *info);
 
     /** Called when the job is freed */
     void (*free)(Job *job);
@@ -25,6 +25,7 @@
 #include "qemu/error-report.h"
 #include "qemu/main-loop.h"
 #include "qemu/rcu.h"
+#include "qemu/timer.h"
 #include "migration/failover.h"
 #ifdef CONFIG_REPLICATION
 #include "replication.h"
@@ -44,6 +45,17 @@ static Notifier packets_compare_notifier;
 /* User need to know colo mode after COLO failover */
 static COLOMode last_colo_mode;
 
+/*
+ * Checkpoints done and how long the VM was paused for them, in us.
+ * Protected by the BQL, so that query-colo-status sees consistent values.
+ */
+static struct {
+    uint64_t count;
+    int64_t last_pause;
+    int64_t max_pause;
+    int64_t total_pause;
+} colo_checkpoint_stats;
+
 #define COLO_BUFFER_BASE_SIZE (4 * 1024 * 1024)
 
 bool migration_in_colo_state(void)
@@ -273,6 +285,10 @@ COLOStatus *qmp_query_colo_status(Error **errp)
 
     s->mode = get_colo_mode();
     s->last_mode = last_colo_mode;
+    s->checkpoints = colo_checkpoint_stats.count;
+    s->last_pause_time = colo_checkpoint_stats.last_pause;
+    s->max_pause_time = colo_checkpoint_stats.max_pause;
+    s->total_pause_time = colo_checkpoint_stats.total_pause;
 
     switch (failover_get_state()) {
     case FAILOVER_STATUS_NONE:
@@ -292,6 +308,22 @@ COLOStatus *qmp_query_colo_status(Error **errp)
     return s;
 }
 
+/*
+ * Account a checkpoint that paused the VM since @start (in us).
+ * Called with the BQL held.
+ */
+static void colo_checkpoint_done(int64_t start)
+{
+    int64_t pause = qemu_clock_get_us(QEMU_CLOCK_REALTIME) - start;
+
+    colo_checkpoint_stats.count++;
+    colo_checkpoint_stats.last_pause = pause;
+    colo_checkpoint_stats.max_pause = MAX(colo_checkpoint_stats.max_pause,
+                                          pause);
+    colo_checkpoint_stats.total_pause += pause;
+    trace_colo_checkpoint_done(colo_checkpoint_stats.count, pause);
+}
+
 static void colo_send_message(QEMUFile *f, COLOMessage msg,
                               Error **errp)
 {
@@ -395,6 +427,7 @@ static int colo_do_checkpoint_transaction(MigrationState *s,
                                           QEMUFile *fb)
 {
     Error *local_err = NULL;
+    int64_t start;
     int ret = -1;
 
     colo_send_message(s->to_dst_file, COLO_MESSAGE_CHECKPOINT_REQUEST,
@@ -417,6 +450,7 @@ static int colo_do_checkpoint_transaction(MigrationState *s,
         qemu_mutex_unlock_iothread();
         goto out;
     }
+    start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
     vm_stop_force_state(RUN_STATE_COLO);
     qemu_mutex_unlock_iothread();
     trace_colo_vm_state_change("run", "stop");
@@ -501,6 +535,7 @@ static int colo_do_checkpoint_transaction(MigrationState *s,
 
     qemu_mutex_lock_iothread();
     vm_start();
+    colo_checkpoint_done(start);
     qemu_mutex_unlock_iothread();
     trace_colo_vm_state_change("stop", "run");
 
@@ -531,6 +566,9 @@ static void colo_process_checkpoint(MigrationState *s)
     }
 
     failover_init_state();
+    qemu_mutex_lock_iothread();
+    memset(&colo_checkpoint_stats, 0, sizeof(colo_checkpoint_stats));
+    qemu_mutex_unlock_iothread();
 
     s->rp_state.from_dst_file = qemu_file_get_return_path(s->to_dst_file);
     if (!s->rp_state.from_dst_file) {
@@ -710,6 +748,9 @@ void *colo_process_incoming_thread(void *opaque)
     }
 
     failover_init_state();
+    qemu_mutex_lock_iothread();
+    memset(&colo_checkpoint_stats, 0, sizeof(colo_checkpoint_stats));
+    qemu_mutex_unlock_iothread();
 
     mis->to_src_file = qemu_file_get_return_path(mis->from_src_file);
     if (!mis->to_src_file) {
@@ -749,6 +790,7 @@ void *colo_process_incoming_thread(void *opaque)
     }
 
     while (mis->state == MIGRATION_STATUS_COLO) {
+        int64_t start;
         int request = 0;
 
         colo_wait_handle_message(mis->from_src_file, &request, &local_err);
@@ -762,6 +804,7 @@ void *colo_process_incoming_thread(void *opaque)
         }
 
         qemu_mutex_lock_iothread();
+        start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
         vm_stop_force_state(RUN_STATE_COLO);
         trace_colo_vm_state_change("run", "stop");
         qemu_mutex_unlock_iothread();
@@ -855,6 +898,7 @@ void *colo_process_incoming_thread(void *opaque)
         vmstate_loading = false;
         vm_start();
         trace_colo_vm_state_change("stop", "run");
+        colo_checkpoint_done(start);
         qemu_mutex_unlock_iothread();
 
         if (failover_get_state() == FAILOVER_STATUS_RELAUNCH) {
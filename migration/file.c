@@ -0,0 +1,376 @@
+/*
+ * QEMU live migration to and from a file
+ *
+ * Besides carrying the migration stream, the file can hold the RAM at
+ * fixed offsets (see the mapped-ram capability).  That part is read and
+ * written with pread/pwrite by a pool of threads, each one with its own
+ * file descriptor so that O_DIRECT can be used for them only.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "qemu/queue.h"
+#include "qemu/thread.h"
+#include "qemu/atomic.h"
+#include "qapi/error.h"
+#include "channel.h"
+#include "file.h"
+#include "migration.h"
+#include "io/channel-file.h"
+#include "trace.h"
+
+/* Requests are split in chunks of this size among the threads */
+#define FILE_IO_CHUNK (1 * MiB)
+/* Maximum number of queued chunks per thread */
+#define FILE_IO_QUEUE_DEPTH 16
+
+typedef struct FileIOJob {
+    uint8_t *buf;
+    size_t len;
+    off_t offset;
+    QSIMPLEQ_ENTRY(FileIOJob) next;
+} FileIOJob;
+
+typedef struct {
+    bool write;
+    int nr_threads;
+    QemuThread *threads;
+    int *fds;
+    /* protects everything below but pending */
+    QemuMutex lock;
+    /* signalled when a job is queued or quit is set */
+    QemuCond job_cond;
+    /* signalled when a job is completed */
+    QemuCond done_cond;
+    QSIMPLEQ_HEAD(, FileIOJob) jobs;
+    /* jobs queued and not completed yet */
+    unsigned int nr_jobs;
+    bool quit;
+    /* first error hit by the threads, as a negative errno */
+    int error;
+    /* only used by the submitting thread, grows while contiguous */
+    FileIOJob pending;
+} FileIOState;
+
+static FileIOState *file_io;
+/* last file used for migration, in either direction */
+static char *file_path;
+
+void file_start_outgoing_migration(MigrationState *s, const char *filename,
+                                   Error **errp)
+{
+    QIOChannelFile *fioc;
+
+    trace_migration_file_outgoing(filename);
+    fioc = qio_channel_file_new_path(filename, O_CREAT | O_WRONLY | O_TRUNC,
+                                     0600, errp);
+    if (!fioc) {
+        return;
+    }
+
+    g_free(file_path);
+    file_path = g_strdup(filename);
+
+    qio_channel_set_name(QIO_CHANNEL(fioc), "migration-file-outgoing");
+    migration_channel_connect(s, QIO_CHANNEL(fioc), NULL, NULL);
+    object_unref(OBJECT(fioc));
+}
+
+static gboolean file_accept_incoming_migration(QIOChannel *ioc,
+                                               GIOCondition condition,
+                                               gpointer opaque)
+{
+    migration_channel_process_incoming(ioc);
+    object_unref(OBJECT(ioc));
+    return G_SOURCE_REMOVE;
+}
+
+void file_start_incoming_migration(const char *filename, Error **errp)
+{
+    QIOChannelFile *fioc;
+
+    trace_migration_file_incoming(filename);
+    fioc = qio_channel_file_new_path(filename, O_RDONLY, 0, errp);
+    if (!fioc) {
+        return;
+    }
+
+    g_free(file_path);
+    file_path = g_strdup(filename);
+
+    qio_channel_set_name(QIO_CHANNEL(fioc), "migration-file-incoming");
+    qio_channel_add_watch_full(QIO_CHANNEL(fioc), G_IO_IN,
+                               file_accept_incoming_migration,
+                               NULL, NULL,
+                               g_main_context_get_thread_default());
+}
+
+static int file_io_job_run(FileIOState *s, int fd, FileIOJob *job)
+{
+    uint8_t *buf = job->buf;
+    size_t len = job->len;
+    off_t offset = job->offset;
+
+    while (len) {
+        ssize_t ret;
+
+        if (s->write) {
+            ret = pwrite(fd, buf, len, offset);
+        } else {
+            ret = pread(fd, buf, len, offset);
+        }
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        if (ret == 0) {
+            /* the file is truncated */
+            return -EIO;
+        }
+        buf += ret;
+        len -= ret;
+        offset += ret;
+    }
+    return 0;
+}
+
+static void *file_io_thread(void *opaque)
+{
+    FileIOState *s = file_io;
+    int id = (intptr_t)opaque;
+
+    while (true) {
+        FileIOJob *job;
+        int ret;
+
+        qemu_mutex_lock(&s->lock);
+        while (QSIMPLEQ_EMPTY(&s->jobs) && !s->quit) {
+            qemu_cond_wait(&s->job_cond, &s->lock);
+        }
+        job = QSIMPLEQ_FIRST(&s->jobs);
+        if (!job) {
+            qemu_mutex_unlock(&s->lock);
+            break;
+        }
+        QSIMPLEQ_REMOVE_HEAD(&s->jobs, next);
+        qemu_mutex_unlock(&s->lock);
+
+        ret = file_io_job_run(s, s->fds[id], job);
+        g_free(job);
+
+        qemu_mutex_lock(&s->lock);
+        if (ret < 0 && !s->error) {
+            trace_file_io_thread_error(id, ret);
+            atomic_set(&s->error, ret);
+        }
+        s->nr_jobs--;
+        qemu_cond_broadcast(&s->done_cond);
+        qemu_mutex_unlock(&s->lock);
+    }
+
+    return NULL;
+}
+
+/*
+ * Hand the pending request to the threads; only whole chunks unless
+ * @all is set.  Blocks while the queue is full.
+ */
+static void file_io_submit(FileIOState *s, bool all)
+{
+    FileIOJob *p = &s->pending;
+
+    qemu_mutex_lock(&s->lock);
+    while (p->len >= FILE_IO_CHUNK || (all && p->len)) {
+        size_t len = MIN(p->len, FILE_IO_CHUNK);
+        FileIOJob *job;
+
+        while (s->nr_jobs >= s->nr_threads * FILE_IO_QUEUE_DEPTH) {
+            qemu_cond_wait(&s->done_cond, &s->lock);
+        }
+
+        job = g_new(FileIOJob, 1);
+        job->buf = p->buf;
+        job->len = len;
+        job->offset = p->offset;
+        QSIMPLEQ_INSERT_TAIL(&s->jobs, job, next);
+        s->nr_jobs++;
+        qemu_cond_signal(&s->job_cond);
+
+        p->buf += len;
+        p->offset += len;
+        p->len -= len;
+    }
+    qemu_mutex_unlock(&s->lock);
+}
+
+/**
+ * file_io_setup: start the threads doing the I/O at fixed offsets
+ *
+ * There are as many threads as multifd-channels, and their file
+ * descriptors are opened with O_DIRECT if the direct-io capability is
+ * set.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @write: whether the file is saved or loaded
+ * @errp: pointer to an error
+ */
+int file_io_setup(bool write, Error **errp)
+{
+    FileIOState *s;
+    int flags = write ? O_WRONLY : O_RDONLY;
+    bool direct = migrate_direct_io();
+    int i;
+
+    if (!file_path) {
+        error_setg(errp, "mapped-ram requires a file: migration URI");
+        return -1;
+    }
+
+#ifdef O_DIRECT
+    if (direct) {
+        flags |= O_DIRECT;
+    }
+#endif
+
+    s = g_new0(FileIOState, 1);
+    s->write = write;
+    s->nr_threads = migrate_multifd_channels();
+    s->threads = g_new0(QemuThread, s->nr_threads);
+    s->fds = g_new(int, s->nr_threads);
+    qemu_mutex_init(&s->lock);
+    qemu_cond_init(&s->job_cond);
+    qemu_cond_init(&s->done_cond);
+    QSIMPLEQ_INIT(&s->jobs);
+
+    for (i = 0; i < s->nr_threads; i++) {
+        s->fds[i] = qemu_open(file_path, flags);
+        if (s->fds[i] < 0) {
+            error_setg_errno(errp, errno, "Failed to open migration file '%s'",
+                             file_path);
+            while (i--) {
+                qemu_close(s->fds[i]);
+            }
+            qemu_cond_destroy(&s->done_cond);
+            qemu_cond_destroy(&s->job_cond);
+            qemu_mutex_destroy(&s->lock);
+            g_free(s->fds);
+            g_free(s->threads);
+            g_free(s);
+            return -1;
+        }
+    }
+
+    trace_file_io_setup(s->nr_threads, write, direct);
+    file_io = s;
+    for (i = 0; i < s->nr_threads; i++) {
+        char *name = g_strdup_printf("fileio_%d", i);
+
+        qemu_thread_create(&s->threads[i], name, file_io_thread,
+                           (void *)(intptr_t)i, QEMU_THREAD_JOINABLE);
+        g_free(name);
+    }
+    return 0;
+}
+
+/**
+ * file_io_queue: queue a read or write at a fixed offset of the file
+ *
+ * Contiguous requests are merged and the I/O happens asynchronously,
+ * so @buf has to stay valid until file_io_flush().
+ *
+ * Returns 0 or the first error hit by the threads so far
+ *
+ * @buf: memory to read into or write from
+ * @len: length of the request
+ * @offset: offset in the file
+ */
+int file_io_queue(void *buf, size_t len, off_t offset)
+{
+    FileIOState *s = file_io;
+    FileIOJob *p = &s->pending;
+
+    if (p->len && (p->buf + p->len != buf || p->offset + p->len != offset)) {
+        file_io_submit(s, true);
+    }
+    if (!p->len) {
+        p->buf = buf;
+        p->offset = offset;
+    }
+    p->len += len;
+    if (p->len >= FILE_IO_CHUNK) {
+        file_io_submit(s, false);
+    }
+
+    return atomic_read(&s->error);
+}
+
+/**
+ * file_io_flush: wait for all the queued requests to complete
+ *
+ * Returns 0 for success or negative errno for error
+ *
+ * @errp: pointer to an error
+ */
+int file_io_flush(Error **errp)
+{
+    FileIOState *s = file_io;
+    int ret;
+
+    file_io_submit(s, true);
+
+    qemu_mutex_lock(&s->lock);
+    while (s->nr_jobs) {
+        qemu_cond_wait(&s->done_cond, &s->lock);
+    }
+    ret = s->error;
+    qemu_mutex_unlock(&s->lock);
+
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to %s migration file '%s'",
+                         s->write ? "write" : "read", file_path);
+    }
+    return ret;
+}
+
+/**
+ * file_io_cleanup: stop the threads, dropping the queued requests
+ */
+void file_io_cleanup(void)
+{
+    FileIOState *s = file_io;
+    FileIOJob *job;
+    int i;
+
+    if (!s) {
+        return;
+    }
+
+    qemu_mutex_lock(&s->lock);
+    while ((job = QSIMPLEQ_FIRST(&s->jobs))) {
+        QSIMPLEQ_REMOVE_HEAD(&s->jobs, next);
+        g_free(job);
+        s->nr_jobs--;
+    }
+    s->quit = true;
+    qemu_cond_broadcast(&s->job_cond);
+    qemu_mutex_unlock(&s->lock);
+
+    for (i = 0; i < s->nr_threads; i++) {
+        qemu_thread_join(&s->threads[i]);
+        qemu_close(s->fds[i]);
+    }
+
+    qemu_cond_destroy(&s->done_cond);
+    qemu_cond_destroy(&s->job_cond);
+    qemu_mutex_destroy(&s->lock);
+    g_free(s->fds);
+    g_free(s->threads);
+    g_free(s);
+    file_io = NULL;
+}
@@ -0,0 +1,23 @@
+/*
+ * QEMU live migration to and from a file
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_MIGRATION_FILE_H
+#define QEMU_MIGRATION_FILE_H
+
+/* Alignment of the offsets and lengths of the file I/O */
+#define FILE_IO_ALIGN 4096
+
+void file_start_incoming_migration(const char *filename, Error **errp);
+
+void file_start_outgoing_migration(MigrationState *s, const char *filename,
+                                   Error **errp);
+
+int file_io_setup(bool write, Error **errp);
+int file_io_queue(void *buf, size_t len, off_t offset);
+int file_io_flush(Error **errp);
+void file_io_cleanup(void);
+#endif
@@ -20,6 +20,7 @@
 #include "migration/blocker.h"
 #include "exec.h"
 #include "fd.h"
+#include "file.h"
 #include "socket.h"
 #include "sysemu/runstate.h"
 #include "sysemu/sysemu.h"
@@ -153,6 +154,7 @@ void migration_object_init(void)
         g_array_new(FALSE, TRUE, sizeof(struct PostCopyFD));
     qemu_mutex_init(&current_incoming->rp_mutex);
     qemu_event_init(&current_incoming->main_thread_load_event, false);
+    qemu_event_init(&current_incoming->postcopy_listen_event, false);
     qemu_sem_init(&current_incoming->postcopy_pause_sem_dst, 0);
     qemu_sem_init(&current_incoming->postcopy_pause_sem_fault, 0);
 
@@ -212,12 +214,17 @@ void migration_incoming_state_destroy(void)
         qemu_fclose(mis->from_src_file);
         mis->from_src_file = NULL;
     }
+    if (mis->postcopy_qemufile_dst) {
+        qemu_fclose(mis->postcopy_qemufile_dst);
+        mis->postcopy_qemufile_dst = NULL;
+    }
     if (mis->postcopy_remote_fds) {
         g_array_free(mis->postcopy_remote_fds, TRUE);
         mis->postcopy_remote_fds = NULL;
     }
 
     qemu_event_reset(&mis->main_thread_load_event);
+    qemu_event_reset(&mis->postcopy_listen_event);
 
     if (mis->socket_address_list) {
         qapi_free_SocketAddressList(mis->socket_address_list);
@@ -368,6 +375,8 @@ void qemu_start_incoming_migration(const char *uri, Error **errp)
         unix_start_incoming_migration(p, errp);
     } else if (strstart(uri, "fd:", &p)) {
         fd_start_incoming_migration(p, errp);
+    } else if (strstart(uri, "file:", &p)) {
+        file_start_incoming_migration(p, errp);
     } else {
         error_setg(errp, "unknown migration protocol: %s", uri);
     }
@@ -599,18 +608,24 @@ void migration_ioc_process_incoming(QIOChannel *ioc, Error **errp)
 
         /*
          * Common migration only needs one channel, so we can start
-         * right now.  Multifd needs more than one channel, we wait.
+         * right now.  Multifd and postcopy-preempt need more than one
+         * channel, we wait.
          */
-        start_migration = !migrate_use_multifd();
-    } else {
+        start_migration = !migrate_use_multifd() &&
+                          !migrate_postcopy_preempt();
+    } else if (migrate_use_multifd()) {
         Error *local_err = NULL;
         /* Multiple connections */
-        assert(migrate_use_multifd());
         start_migration = multifd_recv_new_channel(ioc, &local_err);
         if (local_err) {
             error_propagate(errp, local_err);
             return;
         }
+    } else {
+        /* The second connection is the postcopy preempt channel */
+        assert(migrate_postcopy_preempt());
+        postcopy_preempt_new_channel(mis, qemu_fopen_channel_input(ioc));
+        start_migration = true;
     }
 
     if (start_migration) {
@@ -631,6 +646,10 @@ bool migration_has_all_channels(void)
 
     all_channels = multifd_recv_all_channels_created();
 
+    if (migrate_postcopy_preempt()) {
+        all_channels = all_channels && mis->postcopy_qemufile_dst != NULL;
+    }
+
     return all_channels && mis->from_src_file != NULL;
 }
 
@@ -1030,6 +1049,61 @@ static bool migrate_caps_check(bool *cap_list,
         }
     }
 
+    if (cap_list[MIGRATION_CAPABILITY_POSTCOPY_PREEMPT]) {
+        if (!cap_list[MIGRATION_CAPABILITY_POSTCOPY_RAM]) {
+            error_setg(errp, "Postcopy preempt requires postcopy-ram");
+            return false;
+        }
+
+        /*
+         * The destination tells the extra channels apart only by their
+         * arrival order, so the preempt channel cannot be mixed with the
+         * multifd ones.
+         */
+        if (cap_list[MIGRATION_CAPABILITY_MULTIFD]) {
+            error_setg(errp, "Postcopy preempt is not compatible with multifd");
+            return false;
+        }
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_MAPPED_RAM]) {
+        /*
+         * The pages are written in place, there is nothing like a stream
+         * of pages for these to act on.
+         */
+        if (cap_list[MIGRATION_CAPABILITY_XBZRLE] ||
+            cap_list[MIGRATION_CAPABILITY_COMPRESS] ||
+            cap_list[MIGRATION_CAPABILITY_POSTCOPY_RAM] ||
+            cap_list[MIGRATION_CAPABILITY_MULTIFD] ||
+            cap_list[MIGRATION_CAPABILITY_X_COLO] ||
+            cap_list[MIGRATION_CAPABILITY_RDMA_PIN_ALL]) {
+            error_setg(errp, "Mapped-ram is not compatible with xbzrle, "
+                       "compress, postcopy-ram, multifd, x-colo or "
+                       "rdma-pin-all");
+            return false;
+        }
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_DIRECT_IO]) {
+#ifndef O_DIRECT
+        error_setg(errp, "Direct I/O is not supported by this host");
+        return false;
+#endif
+        if (!cap_list[MIGRATION_CAPABILITY_MAPPED_RAM]) {
+            error_setg(errp, "Direct I/O requires mapped-ram");
+            return false;
+        }
+        /*
+         * Pages are read and written one by one at their offset in the
+         * file, which must be aligned for O_DIRECT.
+         */
+        if (qemu_target_page_size() < FILE_IO_ALIGN) {
+            error_setg(errp, "Direct I/O requires a target page size of at "
+                       "least %d bytes", FILE_IO_ALIGN);
+            return false;
+        }
+    }
+
     return true;
 }
 
@@ -1051,13 +1125,13 @@ static void fill_destination_migration_info(MigrationInfo *info)
     case MIGRATION_STATUS_CANCELLING:
     case MIGRATION_STATUS_CANCELLED:
     case MIGRATION_STATUS_ACTIVE:
-    case MIGRATION_STATUS_POSTCOPY_ACTIVE:
     case MIGRATION_STATUS_POSTCOPY_PAUSED:
     case MIGRATION_STATUS_POSTCOPY_RECOVER:
     case MIGRATION_STATUS_FAILED:
     case MIGRATION_STATUS_COLO:
         info->has_status = true;
         break;
+    case MIGRATION_STATUS_POSTCOPY_ACTIVE:
     case MIGRATION_STATUS_COMPLETED:
         info->has_status = true;
         fill_destination_postcopy_migration_info(info);
@@ -1522,6 +1596,7 @@ static void migrate_fd_cleanup(MigrationState *s)
         qemu_mutex_lock_iothread();
 
         multifd_save_cleanup();
+        postcopy_preempt_close(s);
         qemu_mutex_lock(&s->qemu_file_lock);
         tmp = s->to_dst_file;
         s->to_dst_file = NULL;
@@ -1617,6 +1692,9 @@ static void migrate_fd_cancel(MigrationState *s)
     if (s->state == MIGRATION_STATUS_CANCELLING && f) {
         qemu_file_shutdown(f);
     }
+    if (s->state == MIGRATION_STATUS_CANCELLING && s->postcopy_qemufile_src) {
+        qemu_file_shutdown(s->postcopy_qemufile_src);
+    }
     if (s->state == MIGRATION_STATUS_CANCELLING && s->block_inactive) {
         Error *local_err = NULL;
 
@@ -1938,6 +2016,24 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         return;
     }
 
+    if (migrate_mapped_ram() && !strstart(uri, "file:", NULL)) {
+        error_setg(errp, "mapped-ram requires a file: migration URI");
+        migrate_set_state(&s->state, MIGRATION_STATUS_SETUP,
+                          MIGRATION_STATUS_FAILED);
+        block_cleanup_parameters(s);
+        return;
+    }
+
+    if (migrate_postcopy_preempt() && !strstart(uri, "tcp:", NULL) &&
+        !strstart(uri, "unix:", NULL)) {
+        error_setg(errp, "postcopy-preempt requires a tcp: or unix: "
+                   "migration URI");
+        migrate_set_state(&s->state, MIGRATION_STATUS_SETUP,
+                          MIGRATION_STATUS_FAILED);
+        block_cleanup_parameters(s);
+        return;
+    }
+
     if (strstart(uri, "tcp:", &p)) {
         tcp_start_outgoing_migration(s, p, &local_err);
 #ifdef CONFIG_RDMA
@@ -1950,6 +2046,8 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         unix_start_outgoing_migration(s, p, &local_err);
     } else if (strstart(uri, "fd:", &p)) {
         fd_start_outgoing_migration(s, p, &local_err);
+    } else if (strstart(uri, "file:", &p)) {
+        file_start_outgoing_migration(s, p, &local_err);
     } else {
         error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "uri",
                    "a valid migration protocol");
@@ -2045,6 +2143,33 @@ bool migrate_postcopy_ram(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY_RAM];
 }
 
+bool migrate_postcopy_preempt(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY_PREEMPT];
+}
+
+bool migrate_mapped_ram(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_MAPPED_RAM];
+}
+
+bool migrate_direct_io(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_DIRECT_IO];
+}
+
 bool migrate_postcopy(void)
 {
     return migrate_postcopy_ram() || migrate_dirty_bitmaps();
@@ -2551,6 +2676,12 @@ static int postcopy_start(MigrationState *ms)
     int64_t bandwidth = migrate_max_postcopy_bandwidth();
     bool restart_block = false;
     int cur_state = MIGRATION_STATUS_ACTIVE;
+
+    if (postcopy_preempt_wait_channel(ms)) {
+        migrate_set_state(&ms->state, ms->state, MIGRATION_STATUS_FAILED);
+        return -1;
+    }
+
     if (!migrate_pause_before_switchover()) {
         migrate_set_state(&ms->state, MIGRATION_STATUS_ACTIVE,
                           MIGRATION_STATUS_POSTCOPY_ACTIVE);
@@ -2931,6 +3062,12 @@ static MigThrError postcopy_pause(MigrationState *s)
         qemu_file_shutdown(file);
         qemu_fclose(file);
 
+        /*
+         * The preempt channel is not re-established on recovery; urgent
+         * pages will travel on the main channel from now on.
+         */
+        postcopy_preempt_close(s);
+
         error_report("Detected IO failure for postcopy. "
                      "Migration paused.");
 
@@ -2985,6 +3122,9 @@ static MigThrError migration_detect_error(MigrationState *s)
 
     /* Try to detect any file errors */
     ret = qemu_file_get_error_obj(s->to_dst_file, &local_error);
+    if (!ret && s->postcopy_qemufile_src) {
+        ret = qemu_file_get_error_obj(s->postcopy_qemufile_src, &local_error);
+    }
     if (!ret) {
         /* Everything is fine */
         assert(!local_error);
@@ -3367,6 +3507,11 @@ void migrate_fd_connect(MigrationState *s, Error *error_in)
         migrate_fd_cleanup(s);
         return;
     }
+
+    if (migrate_postcopy_preempt()) {
+        postcopy_preempt_setup(s);
+    }
+
     qemu_thread_create(&s->thread, "live_migration", migration_thread, s,
                        QEMU_THREAD_JOINABLE);
     s->migration_thread_running = true;
@@ -3470,6 +3615,10 @@ static Property migration_properties[] = {
     DEFINE_PROP_MIG_CAP("x-block", MIGRATION_CAPABILITY_BLOCK),
     DEFINE_PROP_MIG_CAP("x-return-path", MIGRATION_CAPABILITY_RETURN_PATH),
     DEFINE_PROP_MIG_CAP("x-multifd", MIGRATION_CAPABILITY_MULTIFD),
+    DEFINE_PROP_MIG_CAP("x-postcopy-preempt",
+                        MIGRATION_CAPABILITY_POSTCOPY_PREEMPT),
+    DEFINE_PROP_MIG_CAP("x-mapped-ram", MIGRATION_CAPABILITY_MAPPED_RAM),
+    DEFINE_PROP_MIG_CAP("x-direct-io", MIGRATION_CAPABILITY_DIRECT_IO),
 
     DEFINE_PROP_END_OF_LIST(),
 };
@@ -3495,6 +3644,7 @@ static void migration_instance_finalize(Object *obj)
     qemu_sem_destroy(&ms->pause_sem);
     qemu_sem_destroy(&ms->postcopy_pause_sem);
     qemu_sem_destroy(&ms->postcopy_pause_rp_sem);
+    qemu_sem_destroy(&ms->postcopy_qemufile_src_sem);
     qemu_sem_destroy(&ms->rp_state.rp_sem);
     error_free(ms->error);
 }
@@ -3534,6 +3684,7 @@ static void migration_instance_init(Object *obj)
 
     qemu_sem_init(&ms->postcopy_pause_sem, 0);
     qemu_sem_init(&ms->postcopy_pause_rp_sem, 0);
+    qemu_sem_init(&ms->postcopy_qemufile_src_sem, 0);
     qemu_sem_init(&ms->rp_state.rp_sem, 0);
     qemu_sem_init(&ms->rate_limit_sem, 0);
     qemu_mutex_init(&ms->qemu_file_lock);
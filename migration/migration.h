@@ -43,6 +43,33 @@ struct PostcopyBlocktimeContext;
  */
 #define CLEAR_BITMAP_SHIFT_MAX            31
 
+/*
+ * RAM pages can travel on two different channels during postcopy: the
+ * main migration stream carries the background (precopy-like) pages,
+ * while with postcopy-preempt a second channel is dedicated to the
+ * pages that the destination explicitly requested after a fault.
+ */
+typedef enum {
+    RAM_CHANNEL_PRECOPY = 0,
+    RAM_CHANNEL_POSTCOPY = 1,
+    RAM_CHANNEL_MAX,
+} RamChannel;
+
+/*
+ * Per-channel state used to assemble a host page on the destination
+ * before it is atomically placed with postcopy_place_page().  A host
+ * page sent on one channel can be interrupted by pages of the other
+ * channel, so the partial state must survive across stream sections.
+ */
+typedef struct PostcopyTmpPage {
+    /* Temporary host page that is later 'placed' */
+    void *tmp_huge_page;
+    /* Host address of the last target page received for this host page */
+    void *last_host;
+    /* Whether all target pages received so far were zero */
+    bool all_zero;
+} PostcopyTmpPage;
+
 /* State for the incoming migration */
 struct MigrationIncomingState {
     QEMUFile *from_src_file;
@@ -75,8 +102,16 @@ struct MigrationIncomingState {
     QemuMutex rp_mutex;    /* We send replies from multiple threads */
     /* RAMBlock of last request sent to source */
     RAMBlock *last_rb;
-    void     *postcopy_tmp_page;
+    PostcopyTmpPage postcopy_tmp_pages[RAM_CHANNEL_MAX];
     void     *postcopy_tmp_zero_page;
+    /* Set once pages can be placed, multifd channels wait for it */
+    QemuEvent postcopy_listen_event;
+    /* Last RAMBlock received on each channel, for RAM_SAVE_FLAG_CONTINUE */
+    RAMBlock *last_recv_block[RAM_CHANNEL_MAX];
+    /* Channel carrying urgent page requests (postcopy-preempt) */
+    QEMUFile *postcopy_qemufile_dst;
+    bool      have_postcopy_prio_thread;
+    QemuThread postcopy_prio_thread;
     /* PostCopyFD's for external userfaultfds & handlers of shared memory */
     GArray   *postcopy_remote_fds;
 
@@ -241,6 +276,15 @@ struct MigrationState
     /* Needed by postcopy-pause state */
     QemuSemaphore postcopy_pause_sem;
     QemuSemaphore postcopy_pause_rp_sem;
+
+    /*
+     * Channel dedicated to urgent postcopy page requests when the
+     * postcopy-preempt capability is set, and a semaphore posted once
+     * its asynchronous connection has completed (successfully or not).
+     */
+    QEMUFile *postcopy_qemufile_src;
+    QemuSemaphore postcopy_qemufile_src_sem;
+
     /*
      * Whether we abort the migration if decompression errors are
      * detected at the destination. It is left at false for qemu
@@ -287,6 +331,9 @@ bool migrate_postcopy(void);
 
 bool migrate_release_ram(void);
 bool migrate_postcopy_ram(void);
+bool migrate_postcopy_preempt(void);
+bool migrate_mapped_ram(void);
+bool migrate_direct_io(void);
 bool migrate_zero_blocks(void);
 bool migrate_dirty_bitmaps(void);
 bool migrate_ignore_shared(void);
@@ -17,6 +17,9 @@
 #include "qapi/qmp/qerror.h"
 #include "qapi/error.h"
 #include "qemu/host-utils.h"
+#include "qemu/thread.h"
+#include "qemu/atomic.h"
+#include "qemu/rcu.h"
 #include "page_cache.h"
 
 #ifdef DEBUG_CACHE
@@ -32,13 +35,19 @@
 
 typedef struct CacheItem CacheItem;
 
+/*
+ * Each item has its own lock so that several threads can use the cache
+ * at the same time; they only contend when hitting the same item.
+ */
 struct CacheItem {
+    QemuSpin lock;
     uint64_t it_addr;
     uint64_t it_age;
     uint8_t *it_data;
 };
 
 struct PageCache {
+    struct rcu_head rcu;
     CacheItem *page_cache;
     size_t page_size;
     size_t max_num_items;
@@ -88,6 +97,7 @@ PageCache *cache_init(int64_t new_size, size_t page_size, Error **errp)
     }
 
     for (i = 0; i < cache->max_num_items; i++) {
+        qemu_spin_init(&cache->page_cache[i].lock);
         cache->page_cache[i].it_data = NULL;
         cache->page_cache[i].it_age = 0;
         cache->page_cache[i].it_addr = -1;
@@ -112,6 +122,11 @@ void cache_fini(PageCache *cache)
     g_free(cache);
 }
 
+void cache_fini_rcu(PageCache *cache)
+{
+    call_rcu(cache, cache_fini, rcu);
+}
+
 static size_t cache_get_cache_pos(const PageCache *cache,
                                   uint64_t address)
 {
@@ -140,15 +155,52 @@ bool cache_is_cached(const PageCache *cache, uint64_t addr,
                      uint64_t current_age)
 {
     CacheItem *it;
+    bool ret = false;
 
     it = cache_get_by_addr(cache, addr);
 
+    qemu_spin_lock(&it->lock);
     if (it->it_addr == addr) {
         /* update the it_age when the cache hit */
         it->it_age = current_age;
-        return true;
+        ret = true;
+    }
+    qemu_spin_unlock(&it->lock);
+    return ret;
+}
+
+bool cache_lookup(const PageCache *cache, uint64_t addr,
+                  uint64_t current_age, uint8_t *buf)
+{
+    CacheItem *it;
+    bool ret = false;
+
+    it = cache_get_by_addr(cache, addr);
+
+    qemu_spin_lock(&it->lock);
+    if (it->it_addr == addr) {
+        it->it_age = current_age;
+        memcpy(buf, it->it_data, cache->page_size);
+        ret = true;
+    }
+    qemu_spin_unlock(&it->lock);
+    return ret;
+}
+
+bool cache_update(PageCache *cache, uint64_t addr, const uint8_t *pdata)
+{
+    CacheItem *it;
+    bool ret = false;
+
+    it = cache_get_by_addr(cache, addr);
+
+    qemu_spin_lock(&it->lock);
+    if (it->it_addr == addr) {
+        memcpy(it->it_data, pdata, cache->page_size);
+        ret = true;
     }
-    return false;
+    qemu_spin_unlock(&it->lock);
+    return ret;
 }
 
 int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
@@ -156,29 +208,34 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
 {
 
     CacheItem *it;
+    int ret = -1;
 
     /* actual update of entry */
     it = cache_get_by_addr(cache, addr);
 
+    qemu_spin_lock(&it->lock);
     if (it->it_data && it->it_addr != addr &&
         it->it_age + CACHED_PAGE_LIFETIME > current_age) {
         /* the cache page is fresh, don't replace it */
-        return -1;
+        goto out;
     }
     /* allocate page */
     if (!it->it_data) {
         it->it_data = g_try_malloc(cache->page_size);
         if (!it->it_data) {
             DPRINTF("Error allocating page\n");
-            return -1;
+            goto out;
         }
-        cache->num_items++;
+        atomic_inc(&cache->num_items);
     }
 
     memcpy(it->it_data, pdata, cache->page_size);
 
     it->it_age = current_age;
     it->it_addr = addr;
+    ret = 0;
 
-    return 0;
+out:
+    qemu_spin_unlock(&it->lock);
+    return ret;
 }
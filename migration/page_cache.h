@@ -35,6 +35,13 @@ PageCache *cache_init(int64_t cache_size, size_t page_size, Error **errp);
  */
 void cache_fini(PageCache *cache);
 
+/**
+ * cache_fini_rcu: free all cache resources once the current RCU readers
+ * are done with it
+ * @cache pointer to the PageCache struct
+ */
+void cache_fini_rcu(PageCache *cache);
+
 /**
  * cache_is_cached: Checks to see if the page is cached
  *
@@ -47,10 +54,38 @@ void cache_fini(PageCache *cache);
 bool cache_is_cached(const PageCache *cache, uint64_t addr,
                      uint64_t current_age);
 
+/**
+ * cache_lookup: Copy the data cached for an addr
+ *
+ * Unlike get_cached_data(), this is safe while other threads use the
+ * cache.
+ *
+ * Returns %true if the page was cached and copied to @buf
+ *
+ * @cache pointer to the PageCache struct
+ * @addr: page addr
+ * @current_age: current bitmap generation
+ * @buf: where to copy the cached page to
+ */
+bool cache_lookup(const PageCache *cache, uint64_t addr,
+                  uint64_t current_age, uint8_t *buf);
+
+/**
+ * cache_update: Replace the data cached for an addr
+ *
+ * Returns %true if the page was still cached and got updated
+ *
+ * @cache pointer to the PageCache struct
+ * @addr: page addr
+ * @pdata: pointer to the new page contents
+ */
+bool cache_update(PageCache *cache, uint64_t addr, const uint8_t *pdata);
+
 /**
  * get_cached_data: Get the data cached for an addr
  *
- * Returns pointer to the data cached or NULL if not cached
+ * Returns pointer to the data cached or NULL if not cached.  The
+ * pointer is only stable while nobody else uses the cache.
  *
  * @cache pointer to the PageCache struct
  * @addr: page addr
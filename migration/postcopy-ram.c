@@ -29,6 +29,9 @@
 #include "sysemu/sysemu.h"
 #include "sysemu/balloon.h"
 #include "qemu/error-report.h"
+#include "qemu/host-utils.h"
+#include "qemu-file-channel.h"
+#include "socket.h"
 #include "trace.h"
 #include "hw/boards.h"
 
@@ -92,6 +95,25 @@ int postcopy_notify(enum PostcopyNotifyReason reason, Error **errp)
 #include <sys/eventfd.h>
 #include <linux/userfaultfd.h>
 
+/*
+ * Fault latencies are kept in a log-linear histogram: every power of two
+ * is split in 2^FAULT_LAT_SUB_BITS linear sub-buckets, so that any
+ * percentile read back from it is within 1/8 of the real value.
+ */
+#define FAULT_LAT_SUB_BITS  3
+#define FAULT_LAT_SUB_COUNT (1 << FAULT_LAT_SUB_BITS)
+#define FAULT_LAT_BUCKETS   (64 * FAULT_LAT_SUB_COUNT)
+
+typedef struct PostcopyFaultLatencyContext {
+    /* Protects all the fields below */
+    QemuMutex lock;
+    /* host page address -> time (us) the page was requested from the source */
+    GHashTable *pending;
+    uint64_t count;
+    uint64_t max;
+    uint64_t buckets[FAULT_LAT_BUCKETS];
+} PostcopyFaultLatencyContext;
+
 typedef struct PostcopyBlocktimeContext {
     /* time when page fault initiated per vCPU */
     uint32_t *page_fault_vcpu_time;
@@ -105,6 +127,8 @@ typedef struct PostcopyBlocktimeContext {
     /* number of vCPU are suspended */
     int smp_cpus_down;
     uint64_t start_time;
+    /* request to placement latency of the faulted host pages */
+    PostcopyFaultLatencyContext latency;
 
     /*
      * Handler for exit event, necessary for
@@ -115,6 +139,8 @@ typedef struct PostcopyBlocktimeContext {
 
 static void destroy_blocktime_context(struct PostcopyBlocktimeContext *ctx)
 {
+    g_hash_table_destroy(ctx->latency.pending);
+    qemu_mutex_destroy(&ctx->latency.lock);
     g_free(ctx->page_fault_vcpu_time);
     g_free(ctx->vcpu_addr);
     g_free(ctx->vcpu_blocktime);
@@ -137,6 +163,9 @@ static struct PostcopyBlocktimeContext *blocktime_context_new(void)
     ctx->vcpu_addr = g_new0(uintptr_t, smp_cpus);
     ctx->vcpu_blocktime = g_new0(uint32_t, smp_cpus);
 
+    qemu_mutex_init(&ctx->latency.lock);
+    ctx->latency.pending = g_hash_table_new(g_direct_hash, g_direct_equal);
+
     ctx->exit_notifier.notify = migration_exit_cb;
     ctx->start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
     qemu_add_exit_notifier(&ctx->exit_notifier);
@@ -159,6 +188,117 @@ static uint32List *get_vcpu_blocktime_list(PostcopyBlocktimeContext *ctx)
     return list;
 }
 
+static unsigned int fault_latency_bucket(uint64_t us)
+{
+    int shift;
+
+    if (us < FAULT_LAT_SUB_COUNT) {
+        return us;
+    }
+    shift = 63 - clz64(us) - FAULT_LAT_SUB_BITS;
+    return (shift + 1) * FAULT_LAT_SUB_COUNT +
+           ((us >> shift) & (FAULT_LAT_SUB_COUNT - 1));
+}
+
+/* Highest latency that falls into bucket @idx */
+static uint64_t fault_latency_bucket_limit(unsigned int idx)
+{
+    int shift;
+
+    if (idx < FAULT_LAT_SUB_COUNT) {
+        return idx;
+    }
+    shift = idx / FAULT_LAT_SUB_COUNT - 1;
+    return (((uint64_t)FAULT_LAT_SUB_COUNT + idx % FAULT_LAT_SUB_COUNT)
+            << shift) + (1ULL << shift) - 1;
+}
+
+/* Called with lat->lock held */
+static uint64_t fault_latency_percentile(PostcopyFaultLatencyContext *lat,
+                                         unsigned int permille)
+{
+    uint64_t target = (lat->count * permille + 999) / 1000;
+    uint64_t seen = 0;
+    unsigned int i;
+
+    for (i = 0; i < FAULT_LAT_BUCKETS; i++) {
+        seen += lat->buckets[i];
+        if (seen && seen >= target) {
+            return MIN(fault_latency_bucket_limit(i), lat->max);
+        }
+    }
+    return lat->max;
+}
+
+static PostcopyFaultLatency *get_fault_latency(PostcopyBlocktimeContext *ctx)
+{
+    PostcopyFaultLatencyContext *lat = &ctx->latency;
+    PostcopyFaultLatency *info = g_new0(PostcopyFaultLatency, 1);
+
+    qemu_mutex_lock(&lat->lock);
+    info->count = lat->count;
+    info->p50 = fault_latency_percentile(lat, 500);
+    info->p90 = fault_latency_percentile(lat, 900);
+    info->p99 = fault_latency_percentile(lat, 990);
+    info->p999 = fault_latency_percentile(lat, 999);
+    info->max = lat->max;
+    qemu_mutex_unlock(&lat->lock);
+
+    return info;
+}
+
+/*
+ * Remember when the host page at @haddr was requested from the source.
+ * Only the first request is recorded if the page faults several times.
+ */
+static void mark_postcopy_fault_latency_begin(uintptr_t haddr)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    PostcopyBlocktimeContext *dc = mis->blocktime_ctx;
+    gpointer key = (gpointer)haddr;
+
+    if (!dc) {
+        return;
+    }
+
+    qemu_mutex_lock(&dc->latency.lock);
+    if (!g_hash_table_contains(dc->latency.pending, key)) {
+        g_hash_table_insert(dc->latency.pending, key,
+                            (gpointer)(uintptr_t)
+                            qemu_clock_get_us(QEMU_CLOCK_REALTIME));
+    }
+    qemu_mutex_unlock(&dc->latency.lock);
+}
+
+/* Account the host page at @haddr as placed, if it had been requested */
+static void mark_postcopy_fault_latency_end(uintptr_t haddr)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    PostcopyBlocktimeContext *dc = mis->blocktime_ctx;
+    PostcopyFaultLatencyContext *lat;
+    gpointer key = (gpointer)haddr;
+    gpointer value;
+    uint64_t now, us;
+
+    if (!dc) {
+        return;
+    }
+    lat = &dc->latency;
+
+    qemu_mutex_lock(&lat->lock);
+    if (g_hash_table_size(lat->pending) &&
+        g_hash_table_lookup_extended(lat->pending, key, NULL, &value)) {
+        g_hash_table_remove(lat->pending, key);
+        now = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+        us = now - MIN(now, (uint64_t)(uintptr_t)value);
+        lat->buckets[fault_latency_bucket(us)]++;
+        lat->count++;
+        lat->max = MAX(lat->max, us);
+        trace_mark_postcopy_fault_latency_end(haddr, us);
+    }
+    qemu_mutex_unlock(&lat->lock);
+}
+
 /*
  * This function just populates MigrationInfo from postcopy's
  * blocktime context. It will not populate MigrationInfo,
@@ -179,6 +319,8 @@ void fill_destination_postcopy_migration_info(MigrationInfo *info)
     info->postcopy_blocktime = bc->total_blocktime;
     info->has_postcopy_vcpu_blocktime = true;
     info->postcopy_vcpu_blocktime = get_vcpu_blocktime_list(bc);
+    info->has_postcopy_fault_latency = true;
+    info->postcopy_fault_latency = get_fault_latency(bc);
 }
 
 static uint32_t get_postcopy_total_blocktime(void)
@@ -539,8 +681,22 @@ static void postcopy_balloon_inhibit(bool state)
  */
 int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
 {
+    int i;
+
     trace_postcopy_ram_incoming_cleanup_entry();
 
+    if (mis->have_postcopy_prio_thread) {
+        /*
+         * On success the source ends the preempt channel with an EOS;
+         * on failure nothing more will come, so unblock the reader.
+         */
+        if (mis->state == MIGRATION_STATUS_FAILED) {
+            qemu_file_shutdown(mis->postcopy_qemufile_dst);
+        }
+        qemu_thread_join(&mis->postcopy_prio_thread);
+        mis->have_postcopy_prio_thread = false;
+    }
+
     if (mis->have_fault_thread) {
         Error *local_err = NULL;
 
@@ -579,9 +735,13 @@ int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
 
     postcopy_state_set(POSTCOPY_INCOMING_END);
 
-    if (mis->postcopy_tmp_page) {
-        munmap(mis->postcopy_tmp_page, mis->largest_page_size);
-        mis->postcopy_tmp_page = NULL;
+    for (i = 0; i < RAM_CHANNEL_MAX; i++) {
+        PostcopyTmpPage *tmp_page = &mis->postcopy_tmp_pages[i];
+
+        if (tmp_page->tmp_huge_page) {
+            munmap(tmp_page->tmp_huge_page, mis->largest_page_size);
+            tmp_page->tmp_huge_page = NULL;
+        }
     }
     if (mis->postcopy_tmp_zero_page) {
         munmap(mis->postcopy_tmp_zero_page, mis->largest_page_size);
@@ -997,6 +1157,9 @@ static void *postcopy_ram_fault_thread(void *opaque)
             mark_postcopy_blocktime_begin(
                     (uintptr_t)(msg.arg.pagefault.address),
                                 msg.arg.pagefault.feat.ptid, rb);
+            mark_postcopy_fault_latency_begin(
+                    (uintptr_t)msg.arg.pagefault.address &
+                    ~(uintptr_t)(qemu_ram_pagesize(rb) - 1));
 
 retry:
             /*
@@ -1094,6 +1257,31 @@ retry:
     return NULL;
 }
 
+/*
+ * Allocate the zero host page used to place zero huge pages.
+ * returns 0 on success
+ */
+static int postcopy_tmp_zero_page_setup(MigrationIncomingState *mis)
+{
+    if (mis->postcopy_tmp_zero_page) {
+        return 0;
+    }
+
+    mis->postcopy_tmp_zero_page = mmap(NULL, mis->largest_page_size,
+                                       PROT_READ | PROT_WRITE,
+                                       MAP_PRIVATE | MAP_ANONYMOUS,
+                                       -1, 0);
+    if (mis->postcopy_tmp_zero_page == MAP_FAILED) {
+        int e = errno;
+        mis->postcopy_tmp_zero_page = NULL;
+        error_report("%s: %s mapping large zero page",
+                     __func__, strerror(e));
+        return -e;
+    }
+    memset(mis->postcopy_tmp_zero_page, '\0', mis->largest_page_size);
+    return 0;
+}
+
 int postcopy_ram_enable_notify(MigrationIncomingState *mis)
 {
     /* Open the fd for the kernel to give us userfaults */
@@ -1128,6 +1316,23 @@ int postcopy_ram_enable_notify(MigrationIncomingState *mis)
     qemu_sem_destroy(&mis->fault_thread_sem);
     mis->have_fault_thread = true;
 
+    /*
+     * Pages may be placed from the listen thread, the preempt thread and
+     * the multifd channels; set up the zero page they share now rather
+     * than lazily from all of them.
+     */
+    if (postcopy_tmp_zero_page_setup(mis)) {
+        return -1;
+    }
+
+    if (migrate_postcopy_preempt()) {
+        /* Urgent pages are received by their own thread */
+        qemu_thread_create(&mis->postcopy_prio_thread, "postcopy/prio",
+                           postcopy_preempt_thread, mis,
+                           QEMU_THREAD_JOINABLE);
+        mis->have_postcopy_prio_thread = true;
+    }
+
     /* Mark so that we get notified of accesses to unwritten areas */
     if (foreach_not_ignored_block(ram_block_enable_notify, mis)) {
         error_report("ram_block_enable_notify failed");
@@ -1140,6 +1345,9 @@ int postcopy_ram_enable_notify(MigrationIncomingState *mis)
      */
     postcopy_balloon_inhibit(true);
 
+    /* multifd channels may place pages from now on */
+    qemu_event_set(&mis->postcopy_listen_event);
+
     trace_postcopy_ram_enable_notify();
 
     return 0;
@@ -1167,6 +1375,7 @@ static int qemu_ufd_copy_ioctl(int userfault_fd, void *host_addr,
         ramblock_recv_bitmap_set_range(rb, host_addr,
                                        pagesize / qemu_target_page_size());
         mark_postcopy_blocktime_end((uintptr_t)host_addr);
+        mark_postcopy_fault_latency_end((uintptr_t)host_addr);
 
     }
     return ret;
@@ -1241,19 +1450,10 @@ int postcopy_place_page_zero(MigrationIncomingState *mis, void *host,
                                                                       host));
     } else {
         /* The kernel can't use UFFDIO_ZEROPAGE for hugepages */
-        if (!mis->postcopy_tmp_zero_page) {
-            mis->postcopy_tmp_zero_page = mmap(NULL, mis->largest_page_size,
-                                               PROT_READ | PROT_WRITE,
-                                               MAP_PRIVATE | MAP_ANONYMOUS,
-                                               -1, 0);
-            if (mis->postcopy_tmp_zero_page == MAP_FAILED) {
-                int e = errno;
-                mis->postcopy_tmp_zero_page = NULL;
-                error_report("%s: %s mapping large zero page",
-                             __func__, strerror(e));
-                return -e;
-            }
-            memset(mis->postcopy_tmp_zero_page, '\0', mis->largest_page_size);
+        int ret = postcopy_tmp_zero_page_setup(mis);
+
+        if (ret) {
+            return ret;
         }
         return postcopy_place_page(mis, host, mis->postcopy_tmp_zero_page,
                                    rb);
@@ -1264,24 +1464,27 @@ int postcopy_place_page_zero(MigrationIncomingState *mis, void *host,
  * Returns a target page of memory that can be mapped at a later point in time
  * using postcopy_place_page
  * The same address is used repeatedly, postcopy_place_page just takes the
- * backing page away.
+ * backing page away.  Each channel gets its own page since host pages
+ * received on different channels may be assembled at the same time.
  * Returns: Pointer to allocated page
  *
  */
-void *postcopy_get_tmp_page(MigrationIncomingState *mis)
-{
-    if (!mis->postcopy_tmp_page) {
-        mis->postcopy_tmp_page = mmap(NULL, mis->largest_page_size,
-                             PROT_READ | PROT_WRITE, MAP_PRIVATE |
-                             MAP_ANONYMOUS, -1, 0);
-        if (mis->postcopy_tmp_page == MAP_FAILED) {
-            mis->postcopy_tmp_page = NULL;
+void *postcopy_get_tmp_page(MigrationIncomingState *mis, RamChannel channel)
+{
+    PostcopyTmpPage *tmp_page = &mis->postcopy_tmp_pages[channel];
+
+    if (!tmp_page->tmp_huge_page) {
+        tmp_page->tmp_huge_page = mmap(NULL, mis->largest_page_size,
+                                       PROT_READ | PROT_WRITE, MAP_PRIVATE |
+                                       MAP_ANONYMOUS, -1, 0);
+        if (tmp_page->tmp_huge_page == MAP_FAILED) {
+            tmp_page->tmp_huge_page = NULL;
             error_report("%s: %s", __func__, strerror(errno));
             return NULL;
         }
     }
 
-    return mis->postcopy_tmp_page;
+    return tmp_page->tmp_huge_page;
 }
 
 #else
@@ -1341,7 +1544,7 @@ int postcopy_place_page_zero(MigrationIncomingState *mis, void *host,
     return -1;
 }
 
-void *postcopy_get_tmp_page(MigrationIncomingState *mis)
+void *postcopy_get_tmp_page(MigrationIncomingState *mis, RamChannel channel)
 {
     assert(0);
     return NULL;
@@ -1489,3 +1692,138 @@ void postcopy_unregister_shared_ufd(struct PostCopyFD *pcfd)
         }
     }
 }
+
+/* ------------------------------------------------------------------------- */
+/* Postcopy preemption: a dedicated channel for urgent page requests         */
+
+static void postcopy_preempt_send_channel_new(QIOTask *task, gpointer opaque)
+{
+    MigrationState *s = opaque;
+    QIOChannel *ioc = QIO_CHANNEL(qio_task_get_source(task));
+    Error *local_err = NULL;
+
+    if (qio_task_propagate_error(task, &local_err)) {
+        trace_postcopy_preempt_send_channel_error(
+                error_get_pretty(local_err));
+        migrate_set_error(s, local_err);
+        error_free(local_err);
+    } else if (migration_is_setup_or_active(s->state)) {
+        qio_channel_set_delay(ioc, false);
+        s->postcopy_qemufile_src = qemu_fopen_channel_output(ioc);
+        trace_postcopy_preempt_new_channel();
+    }
+
+    /* The QEMUFile, if any, holds its own reference to the channel */
+    object_unref(OBJECT(ioc));
+    qemu_sem_post(&s->postcopy_qemufile_src_sem);
+}
+
+/*
+ * Start connecting the preempt channel.  This is asynchronous; the
+ * migration thread only waits for it when switching to postcopy.
+ */
+void postcopy_preempt_setup(MigrationState *s)
+{
+    Error *local_err = NULL;
+
+    /* Drop a completion left over by a previous migration */
+    while (qemu_sem_timedwait(&s->postcopy_qemufile_src_sem, 0) == 0) {
+        /* nothing */
+    }
+
+    if (!socket_send_channel_available()) {
+        error_setg(&local_err, "postcopy-preempt requires a tcp: or unix: "
+                   "migration URI");
+        migrate_set_error(s, local_err);
+        error_free(local_err);
+        /* postcopy_preempt_wait_channel() fails on the missing channel */
+        qemu_sem_post(&s->postcopy_qemufile_src_sem);
+        return;
+    }
+    socket_send_channel_create(postcopy_preempt_send_channel_new, s);
+}
+
+/*
+ * Wait until the preempt channel is connected.  Returns 0 on success
+ * (or when postcopy-preempt isn't in use), -1 if the channel could not
+ * be established.
+ */
+int postcopy_preempt_wait_channel(MigrationState *s)
+{
+    if (!migrate_postcopy_preempt()) {
+        return 0;
+    }
+
+    qemu_sem_wait(&s->postcopy_qemufile_src_sem);
+    if (!s->postcopy_qemufile_src) {
+        error_report("%s: postcopy preempt channel not available", __func__);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Release the source side of the preempt channel; urgent pages fall back
+ * to the main channel afterwards.  Only called from the migration thread
+ * or once it has been joined.
+ */
+void postcopy_preempt_close(MigrationState *s)
+{
+    QEMUFile *file = s->postcopy_qemufile_src;
+
+    if (!file) {
+        return;
+    }
+
+    s->postcopy_qemufile_src = NULL;
+    qemu_file_shutdown(file);
+    qemu_fclose(file);
+}
+
+void postcopy_preempt_new_channel(MigrationIncomingState *mis, QEMUFile *file)
+{
+    /* Only read by the postcopy prio thread, which can block */
+    qemu_file_set_blocking(file, true);
+    mis->postcopy_qemufile_dst = file;
+    trace_postcopy_preempt_new_channel();
+}
+
+/*
+ * Receive the pages sent on the preempt channel until the source ends it
+ * with an EOS.  On failure the error is recorded and both channels are shut
+ * down, so that the main load fails as well and postcopy pauses instead of
+ * waiting for pages that will never arrive.  The pages that never made it
+ * are sent again on the main channel once recovery has resynchronised the
+ * received bitmap.
+ */
+void *postcopy_preempt_thread(void *opaque)
+{
+    MigrationIncomingState *mis = opaque;
+    Error *local_err = NULL;
+    int ret;
+
+    trace_postcopy_preempt_thread_entry();
+    rcu_register_thread();
+
+    rcu_read_lock();
+    ret = ram_load_postcopy(mis->postcopy_qemufile_dst, RAM_CHANNEL_POSTCOPY);
+    rcu_read_unlock();
+
+    /* Nothing to report if the channel was shut down because we failed */
+    if (ret < 0 && mis->state != MIGRATION_STATUS_FAILED) {
+        error_setg_errno(&local_err, -ret,
+                         "Failed to load pages from the postcopy preempt "
+                         "channel");
+        migrate_set_error(migrate_get_current(), local_err);
+        error_report_err(local_err);
+        qemu_file_shutdown(mis->postcopy_qemufile_dst);
+        if (mis->from_src_file) {
+            qemu_file_shutdown(mis->from_src_file);
+        }
+    }
+
+    rcu_unregister_thread();
+    trace_postcopy_preempt_thread_exit(ret);
+    return NULL;
+}
@@ -105,7 +105,7 @@ typedef enum {
  * using postcopy_place_page
  * Returns: Pointer to allocated page
  */
-void *postcopy_get_tmp_page(MigrationIncomingState *mis);
+void *postcopy_get_tmp_page(MigrationIncomingState *mis, RamChannel channel);
 
 PostcopyState postcopy_state_get(void);
 /* Set the state and return the old state */
@@ -186,4 +186,13 @@ int postcopy_wake_shared(struct PostCopyFD *pcfd, uint64_t client_addr,
 int postcopy_request_shared_page(struct PostCopyFD *pcfd, RAMBlock *rb,
                                  uint64_t client_addr, uint64_t offset);
 
+/* Source side of the postcopy preempt channel */
+void postcopy_preempt_setup(MigrationState *s);
+int postcopy_preempt_wait_channel(MigrationState *s);
+void postcopy_preempt_close(MigrationState *s);
+
+/* Destination side of the postcopy preempt channel */
+void postcopy_preempt_new_channel(MigrationIncomingState *mis, QEMUFile *file);
+void *postcopy_preempt_thread(void *opaque);
+
 #endif
@@ -628,6 +628,45 @@ int64_t qemu_ftell(QEMUFile *f)
     return f->pos;
 }
 
+/*
+ * Continue reading or writing at @offset of the underlying file, which
+ * must be seekable.  Buffered data is flushed when writing and dropped
+ * when reading.
+ *
+ * Returns 0 on success or a negative errno, which is also set as the
+ * file error.
+ */
+int qemu_file_set_offset(QEMUFile *f, int64_t offset)
+{
+    Error *local_error = NULL;
+    int ret;
+
+    if (!f->ops->seek) {
+        qemu_file_set_error(f, -ENOTSUP);
+        return -ENOTSUP;
+    }
+
+    if (qemu_file_is_writable(f)) {
+        qemu_fflush(f);
+    } else {
+        f->buf_index = 0;
+        f->buf_size = 0;
+    }
+
+    ret = qemu_file_get_error(f);
+    if (ret) {
+        return ret;
+    }
+
+    ret = f->ops->seek(f->opaque, offset, &local_error);
+    if (ret < 0) {
+        qemu_file_set_error_obj(f, ret, local_error);
+        return ret;
+    }
+    f->pos = offset;
+    return 0;
+}
+
 int qemu_file_rate_limit(QEMUFile *f)
 {
     if (qemu_file_get_error(f)) {
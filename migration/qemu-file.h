@@ -103,6 +103,12 @@ typedef QEMUFile *(QEMURetPathFunc)(void *opaque);
 typedef int (QEMUFileShutdownFunc)(void *opaque, bool rd, bool wr,
                                    Error **errp);
 
+/*
+ * Move to an absolute offset of a seekable file, returns 0 on success
+ * or a negative errno.
+ */
+typedef int (QEMUFileSeekFunc)(void *opaque, int64_t offset, Error **errp);
+
 typedef struct QEMUFileOps {
     QEMUFileGetBufferFunc *get_buffer;
     QEMUFileCloseFunc *close;
@@ -110,6 +116,7 @@ typedef struct QEMUFileOps {
     QEMUFileWritevBufferFunc *writev_buffer;
     QEMURetPathFunc *get_return_path;
     QEMUFileShutdownFunc *shut_down;
+    QEMUFileSeekFunc *seek;
 } QEMUFileOps;
 
 typedef struct QEMUFileHooks {
@@ -125,6 +132,7 @@ int qemu_get_fd(QEMUFile *f);
 int qemu_fclose(QEMUFile *f);
 int64_t qemu_ftell(QEMUFile *f);
 int64_t qemu_ftell_fast(QEMUFile *f);
+int qemu_file_set_offset(QEMUFile *f, int64_t offset);
 /*
  * put_buffer without copying the buffer.
  * The buffer should be available till it is sent asynchronously.
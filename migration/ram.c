@@ -34,10 +34,12 @@
 #include "qemu/bitmap.h"
 #include "qemu/main-loop.h"
 #include "qemu/pmem.h"
+#include "qemu/units.h"
 #include "xbzrle.h"
 #include "ram.h"
 #include "migration.h"
 #include "socket.h"
+#include "file.h"
 #include "migration/register.h"
 #include "migration/misc.h"
 #include "qemu-file.h"
@@ -127,7 +129,7 @@ static void XBZRLE_cache_unlock(void)
  */
 int xbzrle_cache_resize(int64_t new_size, Error **errp)
 {
-    PageCache *new_cache;
+    PageCache *new_cache, *old_cache;
     int64_t ret = 0;
 
     /* Check for truncation */
@@ -151,8 +153,16 @@ int xbzrle_cache_resize(int64_t new_size, Error **errp)
             goto out;
         }
 
-        cache_fini(XBZRLE.cache);
-        XBZRLE.cache = new_cache;
+        /*
+         * multifd channels may still be using the old cache.  Publish the
+         * new one first, so that they can't pick up the old one after it
+         * has been queued for freeing.  Nothing is copied over: the new
+         * cache starts empty and pages missing from it are sent whole, so
+         * an item that a channel is updating concurrently can't be torn.
+         */
+        old_cache = XBZRLE.cache;
+        atomic_rcu_set(&XBZRLE.cache, new_cache);
+        cache_fini_rcu(old_cache);
     }
 out:
     XBZRLE_cache_unlock();
@@ -302,6 +312,16 @@ struct RAMSrcPageRequest {
     QSIMPLEQ_ENTRY(RAMSrcPageRequest) next_req;
 };
 
+/*
+ * A host page whose sending on the main channel was interrupted to serve
+ * an urgent postcopy request; it is resumed once the requests are served.
+ */
+typedef struct PostcopyPreemptState {
+    bool preempted;
+    RAMBlock *ram_block;
+    unsigned long ram_page;
+} PostcopyPreemptState;
+
 /* State of RAM for migration */
 struct RAMState {
     /* QEMUFile used for this migration */
@@ -351,6 +371,10 @@ struct RAMState {
     /* Queue of outstanding page requests from the destination */
     QemuMutex src_page_req_mutex;
     QSIMPLEQ_HEAD(, RAMSrcPageRequest) src_page_requests;
+    /* Channel that f currently points to (postcopy-preempt only) */
+    RamChannel postcopy_channel;
+    /* Host page interrupted by an urgent request (postcopy-preempt only) */
+    PostcopyPreemptState postcopy_preempt_state;
 };
 typedef struct RAMState RAMState;
 
@@ -407,6 +431,10 @@ struct PageSearchStatus {
     unsigned long page;
     /* Set once we wrap around */
     bool         complete_round;
+    /* Whether the page was explicitly requested by the destination */
+    bool         postcopy_requested;
+    /* Channel the page should be sent on (postcopy-preempt only) */
+    RamChannel   postcopy_target_channel;
 };
 typedef struct PageSearchStatus PageSearchStatus;
 
@@ -582,10 +610,24 @@ exit:
 #define MULTIFD_VERSION 1
 
 #define MULTIFD_FLAG_SYNC (1 << 0)
+/* pages have to be placed atomically, one host page at a time */
+#define MULTIFD_FLAG_POSTCOPY (1 << 1)
+/* pages are XBZRLE encoded against the previously sent version */
+#define MULTIFD_FLAG_XBZRLE (1 << 2)
 
 /* This value needs to be a multiple of qemu_target_page_size() */
 #define MULTIFD_PACKET_SIZE (512 * 1024)
 
+/*
+ * During postcopy a whole host page has to travel in a single packet.
+ * Packets are grown up to this size to fit huge pages; blocks with
+ * bigger host pages keep using the main channel in postcopy.
+ */
+#define MULTIFD_POSTCOPY_PACKET_SIZE_MAX (2 * 1024 * 1024)
+
+/* XBZRLE page length meaning that the page is sent unencoded */
+#define MULTIFD_XBZRLE_RAW 0x80000000U
+
 typedef struct {
     uint32_t magic;
     uint32_t version;
@@ -663,6 +705,16 @@ typedef struct {
     uint64_t num_pages;
     /* syncs main thread and channels */
     QemuSemaphore sem_sync;
+    /* XBZRLE cache generation for the pending packet */
+    uint64_t xbzrle_generation;
+    /* encoded length of each page */
+    uint32_t *xbzrle_len;
+    /* encoded pages */
+    uint8_t *xbzrle_buf;
+    /* copy of the cached page being encoded against */
+    uint8_t *xbzrle_prev;
+    /* copy of the page being encoded */
+    uint8_t *xbzrle_current;
 }  MultiFDSendParams;
 
 typedef struct {
@@ -700,6 +752,12 @@ typedef struct {
     uint64_t num_pages;
     /* syncs main thread and channels */
     QemuSemaphore sem_sync;
+    /* encoded length of each page */
+    uint32_t *xbzrle_len;
+    /* encoded pages */
+    uint8_t *xbzrle_buf;
+    /* pages waiting to be placed during postcopy */
+    uint8_t *postcopy_buf;
 } MultiFDRecvParams;
 
 static int multifd_send_initial_packet(MultiFDSendParams *p, Error **errp)
@@ -764,6 +822,23 @@ static int multifd_recv_initial_packet(QIOChannel *c, Error **errp)
     return msg.id;
 }
 
+/*
+ * multifd_packet_page_count: number of pages in a multifd packet
+ *
+ * Both sides need to agree on it.  With postcopy enabled the packets
+ * are sized to hold the largest host page.
+ */
+static uint32_t multifd_packet_page_count(void)
+{
+    size_t size = MULTIFD_PACKET_SIZE;
+
+    if (migrate_postcopy_ram()) {
+        size = MAX(size, MIN(qemu_ram_pagesize_largest(),
+                             MULTIFD_POSTCOPY_PACKET_SIZE_MAX));
+    }
+    return size / qemu_target_page_size();
+}
+
 static MultiFDPages_t *multifd_pages_init(size_t size)
 {
     MultiFDPages_t *pages = g_new0(MultiFDPages_t, 1);
@@ -791,7 +866,7 @@ static void multifd_pages_clear(MultiFDPages_t *pages)
 static void multifd_send_fill_packet(MultiFDSendParams *p)
 {
     MultiFDPacket_t *packet = p->packet;
-    uint32_t page_max = MULTIFD_PACKET_SIZE / qemu_target_page_size();
+    uint32_t page_max = p->pages->allocated;
     int i;
 
     packet->magic = cpu_to_be32(MULTIFD_MAGIC);
@@ -854,6 +929,13 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
     if (packet->pages_alloc > p->pages->allocated) {
         multifd_pages_clear(p->pages);
         p->pages = multifd_pages_init(packet->pages_alloc);
+        /* reallocated on demand with the new size */
+        g_free(p->xbzrle_len);
+        p->xbzrle_len = NULL;
+        g_free(p->xbzrle_buf);
+        p->xbzrle_buf = NULL;
+        g_free(p->postcopy_buf);
+        p->postcopy_buf = NULL;
     }
 
     p->pages->used = be32_to_cpu(packet->pages_used);
@@ -876,6 +958,17 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
                        packet->ramblock);
             return -1;
         }
+        p->pages->block = block;
+    }
+
+    if ((p->flags & MULTIFD_FLAG_POSTCOPY) && !p->postcopy_buf) {
+        p->postcopy_buf = g_malloc(p->pages->allocated * TARGET_PAGE_SIZE);
+    }
+
+    if (migration_incoming_in_colo_state() && !block->colo_cache) {
+        error_setg(errp, "multifd: colo_cache is NULL in block %s",
+                   block->idstr);
+        return -1;
     }
 
     for (i = 0; i < p->pages->used; i++) {
@@ -887,7 +980,20 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
                        offset, block->max_length);
             return -1;
         }
-        p->pages->iov[i].iov_base = block->host + offset;
+        p->pages->offset[i] = offset;
+        if (p->flags & MULTIFD_FLAG_POSTCOPY) {
+            /* guest memory can't be written directly during postcopy */
+            p->pages->iov[i].iov_base = p->postcopy_buf + i * TARGET_PAGE_SIZE;
+        } else if (migration_incoming_in_colo_state()) {
+            /*
+             * Like colo_cache_from_block_offset(), the bitmap tells
+             * colo_flush_ram_cache() which pages to flush.
+             */
+            p->pages->iov[i].iov_base = block->colo_cache + offset;
+            set_bit_atomic(offset >> TARGET_PAGE_BITS, block->bmap);
+        } else {
+            p->pages->iov[i].iov_base = block->host + offset;
+        }
         p->pages->iov[i].iov_len = TARGET_PAGE_SIZE;
     }
 
@@ -950,9 +1056,19 @@ static int multifd_send_pages(RAMState *rs)
     p->pages->used = 0;
 
     p->packet_num = multifd_send_state->packet_num++;
+    if (migration_in_postcopy()) {
+        p->flags |= MULTIFD_FLAG_POSTCOPY;
+    } else if (!rs->ram_bulk_stage && migrate_use_xbzrle()) {
+        p->flags |= MULTIFD_FLAG_XBZRLE;
+        p->xbzrle_generation = ram_counters.dirty_sync_count;
+    }
     p->pages->block = NULL;
     multifd_send_state->pages = p->pages;
     p->pages = pages;
+    /*
+     * XBZRLE packets are accounted at their unencoded size, the channel
+     * only knows how much it saved once the pages are encoded.
+     */
     transferred = ((uint64_t) pages->used) * TARGET_PAGE_SIZE + p->packet_len;
     qemu_file_update_transfer(rs->f, transferred);
     ram_counters.multifd_bytes += transferred;
@@ -966,6 +1082,17 @@ static int multifd_send_pages(RAMState *rs)
 static int multifd_queue_page(RAMState *rs, RAMBlock *block, ram_addr_t offset)
 {
     MultiFDPages_t *pages = multifd_send_state->pages;
+    size_t pagesize = qemu_ram_pagesize(block);
+
+    /* Don't split a host page across packets during postcopy */
+    if (migration_in_postcopy() && pages->used &&
+        QEMU_IS_ALIGNED(offset, pagesize) &&
+        pages->used + (pagesize >> TARGET_PAGE_BITS) > pages->allocated) {
+        if (multifd_send_pages(rs) < 0) {
+            return -1;
+        }
+        pages = multifd_send_state->pages;
+    }
 
     if (!pages->block) {
         pages->block = block;
@@ -993,6 +1120,43 @@ static int multifd_queue_page(RAMState *rs, RAMBlock *block, ram_addr_t offset)
     return 1;
 }
 
+/**
+ * multifd_send_flush: send the pages queued so far
+ *
+ * Used during postcopy when the destination is waiting for a page
+ * that sits in a packet that isn't full yet.
+ *
+ * @rs: current RAM state
+ */
+static void multifd_send_flush(RAMState *rs)
+{
+    if (!migrate_use_multifd() || !multifd_send_state->pages->used) {
+        return;
+    }
+    if (multifd_send_pages(rs) < 0) {
+        error_report("%s: multifd_send_pages fail", __func__);
+    }
+}
+
+/**
+ * multifd_postcopy_page: check whether a page can be sent by multifd
+ * during postcopy
+ *
+ * Requested pages stay on the main channel, they would otherwise wait
+ * for a packet to fill up.  So do pages of blocks whose host page
+ * doesn't fit in a packet, since the destination places them whole.
+ *
+ * @pss: data about the page we want to send
+ */
+static bool multifd_postcopy_page(PageSearchStatus *pss)
+{
+    MultiFDPages_t *pages = multifd_send_state->pages;
+
+    return !pss->postcopy_requested &&
+           qemu_ram_pagesize(pss->block) <=
+           (size_t)pages->allocated * TARGET_PAGE_SIZE;
+}
+
 static void multifd_send_terminate_threads(Error *err)
 {
     int i;
@@ -1047,6 +1211,14 @@ void multifd_save_cleanup(void)
         p->packet_len = 0;
         g_free(p->packet);
         p->packet = NULL;
+        g_free(p->xbzrle_len);
+        p->xbzrle_len = NULL;
+        g_free(p->xbzrle_buf);
+        p->xbzrle_buf = NULL;
+        g_free(p->xbzrle_prev);
+        p->xbzrle_prev = NULL;
+        g_free(p->xbzrle_current);
+        p->xbzrle_current = NULL;
     }
     qemu_sem_destroy(&multifd_send_state->channels_ready);
     g_free(multifd_send_state->params);
@@ -1101,6 +1273,92 @@ static void multifd_send_sync_main(RAMState *rs)
     trace_multifd_send_sync_main(multifd_send_state->packet_num);
 }
 
+/**
+ * multifd_send_xbzrle_pages: XBZRLE encode and send the pages of a packet
+ *
+ * The pages are followed by one length per page and then the encoded
+ * data.  A length of 0 means the page didn't change since it was last
+ * sent and MULTIFD_XBZRLE_RAW means the page is sent unencoded.
+ *
+ * The cache is shared by all the channels.  Its items have their own
+ * locks, so the channels only take XBZRLE.lock once per packet to
+ * account the statistics; the encoding itself works on private copies.
+ * The cache itself is protected by RCU against resizing.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: channel sending the packet
+ * @used: number of pages in the packet
+ * @errp: pointer to an error
+ */
+static int multifd_send_xbzrle_pages(MultiFDSendParams *p, uint32_t used,
+                                     Error **errp)
+{
+    RAMBlock *block = p->pages->block;
+    uint64_t generation = p->xbzrle_generation;
+    uint64_t cache_miss = 0, overflow = 0, pages = 0, bytes = 0;
+    PageCache *cache;
+    struct iovec iov[2];
+    size_t size = 0;
+    uint32_t i;
+
+    rcu_read_lock();
+    cache = atomic_rcu_read(&XBZRLE.cache);
+    for (i = 0; i < used; i++) {
+        ram_addr_t addr = block->offset + p->pages->offset[i];
+        uint8_t *buf = p->xbzrle_buf + size;
+        int encoded_len = -1;
+
+        memcpy(p->xbzrle_current, p->pages->iov[i].iov_base,
+               TARGET_PAGE_SIZE);
+        if (!cache) {
+            /* XBZRLE is being torn down, just send the page */
+        } else if (!cache_lookup(cache, addr, generation, p->xbzrle_prev)) {
+            cache_miss++;
+            cache_insert(cache, addr, p->xbzrle_current, generation);
+        } else {
+            encoded_len = xbzrle_encode_buffer(p->xbzrle_prev,
+                                               p->xbzrle_current,
+                                               TARGET_PAGE_SIZE, buf,
+                                               TARGET_PAGE_SIZE);
+            /* Another channel may have reused the cache slot meanwhile */
+            if (encoded_len != 0) {
+                cache_update(cache, addr, p->xbzrle_current);
+            }
+            if (encoded_len == -1) {
+                overflow++;
+            } else if (encoded_len > 0) {
+                pages++;
+                bytes += encoded_len;
+            }
+        }
+
+        if (encoded_len == -1) {
+            memcpy(buf, p->xbzrle_current, TARGET_PAGE_SIZE);
+            p->xbzrle_len[i] = cpu_to_be32(MULTIFD_XBZRLE_RAW);
+            size += TARGET_PAGE_SIZE;
+        } else {
+            p->xbzrle_len[i] = cpu_to_be32(encoded_len);
+            size += encoded_len;
+        }
+    }
+    rcu_read_unlock();
+
+    XBZRLE_cache_lock();
+    xbzrle_counters.cache_miss += cache_miss;
+    xbzrle_counters.overflow += overflow;
+    xbzrle_counters.pages += pages;
+    xbzrle_counters.bytes += bytes;
+    XBZRLE_cache_unlock();
+
+    iov[0].iov_base = p->xbzrle_len;
+    iov[0].iov_len = used * sizeof(uint32_t);
+    iov[1].iov_base = p->xbzrle_buf;
+    iov[1].iov_len = size;
+
+    return qio_channel_writev_all(p->c, iov, size ? 2 : 1, errp);
+}
+
 static void *multifd_send_thread(void *opaque)
 {
     MultiFDSendParams *p = opaque;
@@ -1144,8 +1402,12 @@ static void *multifd_send_thread(void *opaque)
             }
 
             if (used) {
-                ret = qio_channel_writev_all(p->c, p->pages->iov,
-                                             used, &local_err);
+                if (flags & MULTIFD_FLAG_XBZRLE) {
+                    ret = multifd_send_xbzrle_pages(p, used, &local_err);
+                } else {
+                    ret = qio_channel_writev_all(p->c, p->pages->iov,
+                                                 used, &local_err);
+                }
                 if (ret != 0) {
                     break;
                 }
@@ -1217,7 +1479,7 @@ static void multifd_new_send_channel_async(QIOTask *task, gpointer opaque)
 int multifd_save_setup(void)
 {
     int thread_count;
-    uint32_t page_count = MULTIFD_PACKET_SIZE / qemu_target_page_size();
+    uint32_t page_count = multifd_packet_page_count();
     uint8_t i;
 
     if (!migrate_use_multifd()) {
@@ -1242,6 +1504,12 @@ int multifd_save_setup(void)
         p->packet_len = sizeof(MultiFDPacket_t)
                       + sizeof(ram_addr_t) * page_count;
         p->packet = g_malloc0(p->packet_len);
+        if (migrate_use_xbzrle()) {
+            p->xbzrle_len = g_new0(uint32_t, page_count);
+            p->xbzrle_buf = g_malloc(page_count * TARGET_PAGE_SIZE);
+            p->xbzrle_prev = g_malloc(TARGET_PAGE_SIZE);
+            p->xbzrle_current = g_malloc(TARGET_PAGE_SIZE);
+        }
         p->name = g_strdup_printf("multifdsend_%d", i);
         socket_send_channel_create(multifd_new_send_channel_async, p);
     }
@@ -1286,6 +1554,8 @@ static void multifd_recv_terminate_threads(Error *err)
         qio_channel_shutdown(p->c, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
         qemu_mutex_unlock(&p->mutex);
     }
+    /* Don't leave channels waiting to place postcopy pages */
+    qemu_event_set(&migration_incoming_get_current()->postcopy_listen_event);
 }
 
 int multifd_load_cleanup(Error **errp)
@@ -1320,6 +1590,12 @@ int multifd_load_cleanup(Error **errp)
         p->packet_len = 0;
         g_free(p->packet);
         p->packet = NULL;
+        g_free(p->xbzrle_len);
+        p->xbzrle_len = NULL;
+        g_free(p->xbzrle_buf);
+        p->xbzrle_buf = NULL;
+        g_free(p->postcopy_buf);
+        p->postcopy_buf = NULL;
     }
     qemu_sem_destroy(&multifd_recv_state->sem_sync);
     g_free(multifd_recv_state->params);
@@ -1357,6 +1633,137 @@ static void multifd_recv_sync_main(void)
     trace_multifd_recv_sync_main(multifd_recv_state->packet_num);
 }
 
+/**
+ * multifd_recv_xbzrle_pages: receive and decode XBZRLE encoded pages
+ *
+ * See multifd_send_xbzrle_pages() for the format.  Pages are decoded
+ * in place, against the previous version already in guest memory.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: channel receiving the packet
+ * @used: number of pages in the packet
+ * @errp: pointer to an error
+ */
+static int multifd_recv_xbzrle_pages(MultiFDRecvParams *p, uint32_t used,
+                                     Error **errp)
+{
+    uint8_t *data;
+    size_t size = 0;
+    uint32_t i;
+
+    if (!p->xbzrle_buf) {
+        p->xbzrle_len = g_new0(uint32_t, p->pages->allocated);
+        p->xbzrle_buf = g_malloc(p->pages->allocated * TARGET_PAGE_SIZE);
+    }
+
+    if (qio_channel_read_all(p->c, (char *)p->xbzrle_len,
+                             used * sizeof(uint32_t), errp)) {
+        return -1;
+    }
+
+    for (i = 0; i < used; i++) {
+        uint32_t len = be32_to_cpu(p->xbzrle_len[i]);
+
+        p->xbzrle_len[i] = len;
+        if (len == MULTIFD_XBZRLE_RAW) {
+            len = TARGET_PAGE_SIZE;
+        } else if (len > TARGET_PAGE_SIZE) {
+            error_setg(errp, "multifd: XBZRLE page with length %u, "
+                       "maximum is %u", len, (unsigned)TARGET_PAGE_SIZE);
+            return -1;
+        }
+        size += len;
+    }
+
+    if (size && qio_channel_read_all(p->c, (char *)p->xbzrle_buf, size,
+                                     errp)) {
+        return -1;
+    }
+
+    data = p->xbzrle_buf;
+    for (i = 0; i < used; i++) {
+        uint32_t len = p->xbzrle_len[i];
+        void *host = p->pages->iov[i].iov_base;
+
+        if (len == MULTIFD_XBZRLE_RAW) {
+            memcpy(host, data, TARGET_PAGE_SIZE);
+            data += TARGET_PAGE_SIZE;
+        } else if (len) {
+            if (xbzrle_decode_buffer(data, len, host,
+                                     TARGET_PAGE_SIZE) == -1) {
+                error_setg(errp, "multifd: failed to decode XBZRLE page "
+                           "at offset " RAM_ADDR_FMT " of block %s",
+                           p->pages->offset[i], p->pages->block->idstr);
+                return -1;
+            }
+            data += len;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * multifd_recv_place_pages: place the pages of a postcopy packet
+ *
+ * Guest memory can only be filled atomically during postcopy, one host
+ * page at a time.  The source never splits a host page across packets,
+ * so every host page can be placed from the channel buffer directly.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: channel receiving the packet
+ * @used: number of pages in the packet
+ * @errp: pointer to an error
+ */
+static int multifd_recv_place_pages(MultiFDRecvParams *p, uint32_t used,
+                                    Error **errp)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    RAMBlock *block = p->pages->block;
+    size_t pagesize = qemu_ram_pagesize(block);
+    uint32_t host_pages = pagesize >> TARGET_PAGE_BITS;
+    uint32_t i, j;
+    int ret;
+
+    /* userfaultfd is only armed once the main stream reaches LISTEN */
+    qemu_event_wait(&mis->postcopy_listen_event);
+
+    for (i = 0; i < used; i += host_pages) {
+        ram_addr_t offset = p->pages->offset[i];
+        void *host = block->host + offset;
+        uint8_t *from = p->postcopy_buf + i * TARGET_PAGE_SIZE;
+
+        if (p->quit) {
+            return 0;
+        }
+
+        for (j = 0; j < host_pages; j++) {
+            if (!QEMU_IS_ALIGNED(offset, pagesize) || i + j >= used ||
+                p->pages->offset[i + j] != offset + j * TARGET_PAGE_SIZE) {
+                error_setg(errp, "multifd: incomplete host page at offset "
+                           RAM_ADDR_FMT " of block %s", offset, block->idstr);
+                return -1;
+            }
+        }
+
+        if (buffer_is_zero(from, pagesize)) {
+            ret = postcopy_place_page_zero(mis, host, block);
+        } else {
+            ret = postcopy_place_page(mis, host, from, block);
+        }
+        if (ret) {
+            error_setg_errno(errp, -ret, "multifd: failed to place page at "
+                             "offset " RAM_ADDR_FMT " of block %s", offset,
+                             block->idstr);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
 static void *multifd_recv_thread(void *opaque)
 {
     MultiFDRecvParams *p = opaque;
@@ -1399,8 +1806,15 @@ static void *multifd_recv_thread(void *opaque)
         qemu_mutex_unlock(&p->mutex);
 
         if (used) {
-            ret = qio_channel_readv_all(p->c, p->pages->iov,
-                                        used, &local_err);
+            if (flags & MULTIFD_FLAG_XBZRLE) {
+                ret = multifd_recv_xbzrle_pages(p, used, &local_err);
+            } else {
+                ret = qio_channel_readv_all(p->c, p->pages->iov,
+                                            used, &local_err);
+            }
+            if (ret == 0 && (flags & MULTIFD_FLAG_POSTCOPY)) {
+                ret = multifd_recv_place_pages(p, used, &local_err);
+            }
             if (ret != 0) {
                 break;
             }
@@ -1428,7 +1842,7 @@ static void *multifd_recv_thread(void *opaque)
 int multifd_load_setup(void)
 {
     int thread_count;
-    uint32_t page_count = MULTIFD_PACKET_SIZE / qemu_target_page_size();
+    uint32_t page_count = multifd_packet_page_count();
     uint8_t i;
 
     if (!migrate_use_multifd()) {
@@ -1846,6 +2260,25 @@ static void migration_bitmap_sync(RAMState *rs)
     }
 
     trace_migration_bitmap_sync_start();
+    if (migrate_mapped_ram()) {
+        Error *local_err = NULL;
+        int ret;
+
+        /*
+         * A page queued before the sync could otherwise be written after
+         * the copy queued after it.  A write error fails the migration;
+         * rs->f is only missing for the first sync, before anything has
+         * been queued.
+         */
+        ret = file_io_flush(&local_err);
+        if (ret < 0) {
+            migrate_set_error(migrate_get_current(), local_err);
+            error_report_err(local_err);
+            if (rs->f) {
+                qemu_file_set_error(rs->f, ret);
+            }
+        }
+    }
     memory_global_dirty_log_sync();
 
     qemu_mutex_lock(&rs->bitmap_mutex);
@@ -2278,6 +2711,132 @@ static bool find_dirty_block(RAMState *rs, PageSearchStatus *pss, bool *again)
     }
 }
 
+/* Whether urgent pages currently go out on the preempt channel */
+static bool postcopy_preempt_active(void)
+{
+    return migrate_postcopy_preempt() && migration_in_postcopy() &&
+           migrate_get_current()->postcopy_qemufile_src;
+}
+
+static void postcopy_preempt_reset(RAMState *rs)
+{
+    memset(&rs->postcopy_preempt_state, 0, sizeof(PostcopyPreemptState));
+}
+
+/*
+ * Whether an urgent request is waiting while we are sending a huge
+ * background page on the main channel.  Small pages are never worth
+ * interrupting since they are a single target page.
+ */
+static bool postcopy_needs_preempt(RAMState *rs, PageSearchStatus *pss)
+{
+    if (!postcopy_preempt_active()) {
+        return false;
+    }
+
+    if (qemu_ram_pagesize(pss->block) == TARGET_PAGE_SIZE) {
+        return false;
+    }
+
+    /* Requested pages have the same priority as the incoming ones */
+    if (pss->postcopy_requested) {
+        return false;
+    }
+
+    return !QSIMPLEQ_EMPTY_ATOMIC(&rs->src_page_requests);
+}
+
+static void postcopy_do_preempt(RAMState *rs, PageSearchStatus *pss)
+{
+    PostcopyPreemptState *p_state = &rs->postcopy_preempt_state;
+
+    trace_postcopy_preempt_triggered(pss->block->idstr, pss->page);
+
+    /*
+     * Remember where we stopped so that the rest of the host page is sent
+     * on the same channel once the urgent requests are served: the
+     * destination assembles it in the temporary page of that channel.
+     */
+    p_state->ram_block = pss->block;
+    p_state->ram_page = pss->page;
+    p_state->preempted = true;
+}
+
+static bool postcopy_preempt_triggered(RAMState *rs)
+{
+    return rs->postcopy_preempt_state.preempted;
+}
+
+/* Whether @offset in @block lies in the host page we preempted */
+static bool postcopy_preempted_contains(RAMState *rs, RAMBlock *block,
+                                        ram_addr_t offset)
+{
+    PostcopyPreemptState *state = &rs->postcopy_preempt_state;
+    size_t pagesize_bits;
+
+    if (!state->preempted || block != state->ram_block) {
+        return false;
+    }
+
+    pagesize_bits = qemu_ram_pagesize(block) >> TARGET_PAGE_BITS;
+    return ((offset >> TARGET_PAGE_BITS) & ~(pagesize_bits - 1)) ==
+           (state->ram_page & ~(pagesize_bits - 1));
+}
+
+static void postcopy_preempt_restore(RAMState *rs, PageSearchStatus *pss,
+                                     bool postcopy_requested)
+{
+    PostcopyPreemptState *state = &rs->postcopy_preempt_state;
+
+    assert(state->preempted);
+
+    pss->block = state->ram_block;
+    pss->page = state->ram_page;
+    pss->complete_round = false;
+    pss->postcopy_requested = postcopy_requested;
+    /* The first part of the host page went out on the main channel */
+    pss->postcopy_target_channel = RAM_CHANNEL_PRECOPY;
+
+    trace_postcopy_preempt_restored(pss->block->idstr, pss->page);
+    postcopy_preempt_reset(rs);
+}
+
+/* Point rs->f at the channel that the page in @pss has to be sent on */
+static void postcopy_preempt_choose_channel(RAMState *rs, PageSearchStatus *pss)
+{
+    MigrationState *s = migrate_get_current();
+    RamChannel channel = pss->postcopy_target_channel;
+
+    if (channel == rs->postcopy_channel) {
+        return;
+    }
+
+    if (channel == RAM_CHANNEL_PRECOPY) {
+        rs->f = s->to_dst_file;
+    } else {
+        rs->f = s->postcopy_qemufile_src;
+    }
+    rs->postcopy_channel = channel;
+
+    /*
+     * RAM_SAVE_FLAG_CONTINUE refers to the last block sent on the same
+     * channel, so start afresh after switching.
+     */
+    rs->last_sent_block = NULL;
+
+    trace_postcopy_preempt_switch_channel(channel);
+}
+
+/* Go back to the main channel, e.g. before closing a section on it */
+static void postcopy_preempt_reset_channel(RAMState *rs)
+{
+    if (rs->postcopy_channel != RAM_CHANNEL_PRECOPY) {
+        rs->f = migrate_get_current()->to_dst_file;
+        rs->postcopy_channel = RAM_CHANNEL_PRECOPY;
+        rs->last_sent_block = NULL;
+    }
+}
+
 /**
  * unqueue_page: gets a page of the queue
  *
@@ -2336,6 +2895,17 @@ static bool get_queued_page(RAMState *rs, PageSearchStatus *pss)
 
     do {
         block = unqueue_page(rs, &offset);
+
+        if (block && postcopy_preempted_contains(rs, block, offset)) {
+            trace_postcopy_preempt_hit(block->idstr, offset);
+            /*
+             * The page wanted is the one we preempted: part of it is
+             * already on the main channel, so finish it there first.
+             */
+            postcopy_preempt_restore(rs, pss, true);
+            return true;
+        }
+
         /*
          * We're sending this page, and since it's postcopy nothing else
          * will dirty it, and we must make sure it doesn't get sent again
@@ -2350,6 +2920,13 @@ static bool get_queued_page(RAMState *rs, PageSearchStatus *pss)
             if (!dirty) {
                 trace_get_queued_page_not_dirty(block->idstr, (uint64_t)offset,
                        page, test_bit(page, block->unsentmap));
+                /*
+                 * It may still be waiting for its multifd packet to fill
+                 * up, push it out since the destination is stalled on it.
+                 */
+                if (migration_in_postcopy()) {
+                    multifd_send_flush(rs);
+                }
             } else {
                 trace_get_queued_page(block->idstr, (uint64_t)offset, page);
             }
@@ -2379,6 +2956,8 @@ static bool get_queued_page(RAMState *rs, PageSearchStatus *pss)
          * really rare.
          */
         pss->complete_round = false;
+        pss->postcopy_requested = true;
+        pss->postcopy_target_channel = RAM_CHANNEL_POSTCOPY;
     }
 
     return !!block;
@@ -2528,6 +3107,132 @@ static bool save_compress_page(RAMState *rs, RAMBlock *block, ram_addr_t offset)
     return false;
 }
 
+/*
+ * With mapped-ram, the header of each RAMBlock in the stream is followed
+ * by the offsets in the file of a bitmap of the pages present in the
+ * file and of the pages themselves, each one at its offset in the block.
+ * Both regions are skipped by the stream and accessed with file_io_*().
+ */
+#define MAPPED_RAM_HDR_VERSION 1
+#define MAPPED_RAM_HDR_SIZE (4 + 3 * 8)
+/* Alignment of the pages, so that huge pages are written in one go */
+#define MAPPED_RAM_FILE_OFFSET_ALIGNMENT (1 * MiB)
+
+/* The bitmap is stored as little endian 64-bit words */
+static size_t mapped_ram_bitmap_size(ram_addr_t length)
+{
+    uint64_t pages = length >> TARGET_PAGE_BITS;
+
+    return ROUND_UP(DIV_ROUND_UP(pages, 64) * sizeof(uint64_t),
+                    FILE_IO_ALIGN);
+}
+
+/**
+ * mapped_ram_save_ramblock: lay out a RAMBlock in the migration file
+ *
+ * Returns zero to indicate success or negative on error
+ *
+ * @f: QEMUFile where to send the data
+ * @block: block being described
+ */
+static int mapped_ram_save_ramblock(QEMUFile *f, RAMBlock *block)
+{
+    size_t bitmap_size = mapped_ram_bitmap_size(block->used_length);
+
+    block->bitmap_offset = ROUND_UP(qemu_ftell_fast(f) + MAPPED_RAM_HDR_SIZE,
+                                    FILE_IO_ALIGN);
+    block->pages_offset = ROUND_UP(block->bitmap_offset + bitmap_size,
+                                   MAPPED_RAM_FILE_OFFSET_ALIGNMENT);
+    block->file_bmap = bitmap_new(block->used_length >> TARGET_PAGE_BITS);
+
+    qemu_put_be32(f, MAPPED_RAM_HDR_VERSION);
+    qemu_put_be64(f, TARGET_PAGE_SIZE);
+    qemu_put_be64(f, block->bitmap_offset);
+    qemu_put_be64(f, block->pages_offset);
+
+    /* The stream goes on after the pages */
+    return qemu_file_set_offset(f, block->pages_offset + block->used_length);
+}
+
+/**
+ * ram_save_mapped_page: write a page at its offset in the migration file
+ *
+ * Returns the number of pages written or negative on error
+ *
+ * @rs: current RAM state
+ * @block: block that contains the page we want to send
+ * @offset: offset inside the block for the page
+ */
+static int ram_save_mapped_page(RAMState *rs, RAMBlock *block,
+                                ram_addr_t offset)
+{
+    uint8_t *p = block->host + offset;
+    unsigned long page = offset >> TARGET_PAGE_BITS;
+    int ret;
+
+    /*
+     * Zero pages are left out of the bitmap, the RAM of the destination
+     * is zero already.  A stale copy may stay in the file, it's ignored.
+     */
+    if (buffer_is_zero(p, TARGET_PAGE_SIZE)) {
+        clear_bit(page, block->file_bmap);
+        ram_counters.duplicate++;
+        return 1;
+    }
+
+    set_bit(page, block->file_bmap);
+    ret = file_io_queue(p, TARGET_PAGE_SIZE, block->pages_offset + offset);
+    if (ret < 0) {
+        return ret;
+    }
+
+    qemu_file_update_transfer(rs->f, TARGET_PAGE_SIZE);
+    ram_counters.transferred += TARGET_PAGE_SIZE;
+    ram_counters.normal++;
+    return 1;
+}
+
+/**
+ * mapped_ram_save_bitmaps: write the bitmaps of pages once all are saved
+ *
+ * Returns zero to indicate success or negative on error, which is also
+ * set as the error of @f
+ *
+ * @f: QEMUFile where the RAM is being sent
+ */
+static int mapped_ram_save_bitmaps(QEMUFile *f)
+{
+    Error *local_err = NULL;
+    RAMBlock *block;
+    int ret;
+
+    RAMBLOCK_FOREACH_MIGRATABLE(block) {
+        unsigned long nbits = block->used_length >> TARGET_PAGE_BITS;
+        size_t size = mapped_ram_bitmap_size(block->used_length);
+        unsigned long *le_bitmap = qemu_memalign(FILE_IO_ALIGN, size);
+
+        memset(le_bitmap, 0, size);
+        bitmap_to_le(le_bitmap, block->file_bmap, nbits);
+        ret = file_io_queue(le_bitmap, size, block->bitmap_offset);
+        if (ret < 0) {
+            /* Still wait for the threads, they may be using le_bitmap */
+            file_io_flush(NULL);
+        } else {
+            ret = file_io_flush(&local_err);
+        }
+        qemu_vfree(le_bitmap);
+        if (ret < 0) {
+            if (local_err) {
+                error_report_err(local_err);
+            }
+            qemu_file_set_error(f, ret);
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
 /**
  * ram_save_target_page: save one target page
  *
@@ -2542,16 +3247,37 @@ static int ram_save_target_page(RAMState *rs, PageSearchStatus *pss,
 {
     RAMBlock *block = pss->block;
     ram_addr_t offset = pss->page << TARGET_PAGE_BITS;
+    /*
+     * do not use multifd for compression as the first page in the new
+     * block should be posted out before sending the compressed page
+     */
+    bool use_multifd = !save_page_use_compression(rs) &&
+                       migrate_use_multifd();
     int res;
 
     if (control_save_page(rs, block, offset, &res)) {
         return res;
     }
 
+    if (migrate_mapped_ram()) {
+        return ram_save_mapped_page(rs, block, offset);
+    }
+
     if (save_compress_page(rs, block, offset)) {
         return 1;
     }
 
+    if (use_multifd && migration_in_postcopy()) {
+        if (multifd_postcopy_page(pss)) {
+            /*
+             * Zero pages go through multifd too, the destination needs
+             * the whole host page in the same packet to place it.
+             */
+            return ram_save_multifd_page(rs, block, offset);
+        }
+        use_multifd = false;
+    }
+
     res = save_zero_page(rs, block, offset);
     if (res > 0) {
         /* Must let xbzrle know, otherwise a previous (now 0'd) cached
@@ -2566,11 +3292,7 @@ static int ram_save_target_page(RAMState *rs, PageSearchStatus *pss,
         return res;
     }
 
-    /*
-     * do not use multifd for compression as the first page in the new
-     * block should be posted out before sending the compressed page
-     */
-    if (!save_page_use_compression(rs) && migrate_use_multifd()) {
+    if (use_multifd) {
         return ram_save_multifd_page(rs, block, offset);
     }
 
@@ -2608,6 +3330,11 @@ static int ram_save_host_page(RAMState *rs, PageSearchStatus *pss,
     }
 
     do {
+        if (postcopy_needs_preempt(rs, pss)) {
+            postcopy_do_preempt(rs, pss);
+            break;
+        }
+
         /* Check the pages is dirty and if it is send it */
         if (!migration_bitmap_clear_dirty(rs, pss->block, pss->page)) {
             pss->page++;
@@ -2628,6 +3355,15 @@ static int ram_save_host_page(RAMState *rs, PageSearchStatus *pss,
     } while ((pss->page & (pagesize_bits - 1)) &&
              offset_in_ramblock(pss->block, pss->page << TARGET_PAGE_BITS));
 
+    /*
+     * The destination is waiting for this page; don't let it sit in the
+     * buffer of the preempt channel until more data comes along.
+     */
+    if (pss->postcopy_requested &&
+        rs->postcopy_channel == RAM_CHANNEL_POSTCOPY) {
+        qemu_fflush(rs->f);
+    }
+
     /* The offset we leave with is the last one we looked at */
     pss->page--;
     return pages;
@@ -2662,6 +3398,8 @@ static int ram_find_and_save_block(RAMState *rs, bool last_stage)
     pss.block = rs->last_seen_block;
     pss.page = rs->last_page;
     pss.complete_round = false;
+    pss.postcopy_requested = false;
+    pss.postcopy_target_channel = RAM_CHANNEL_PRECOPY;
 
     if (!pss.block) {
         pss.block = QLIST_FIRST_RCU(&ram_list.blocks);
@@ -2672,11 +3410,22 @@ static int ram_find_and_save_block(RAMState *rs, bool last_stage)
         found = get_queued_page(rs, &pss);
 
         if (!found) {
-            /* priority queue empty, so just search for something dirty */
-            found = find_dirty_block(rs, &pss, &again);
+            if (postcopy_preempt_triggered(rs)) {
+                /* Resume the host page that an urgent request interrupted */
+                postcopy_preempt_restore(rs, &pss, false);
+                found = true;
+            } else {
+                /* priority queue empty, so just search for something dirty */
+                pss.postcopy_requested = false;
+                pss.postcopy_target_channel = RAM_CHANNEL_PRECOPY;
+                found = find_dirty_block(rs, &pss, &again);
+            }
         }
 
         if (found) {
+            if (postcopy_preempt_active()) {
+                postcopy_preempt_choose_channel(rs, &pss);
+            }
             pages = ram_save_host_page(rs, &pss, last_stage);
         }
     } while (!pages && again);
@@ -2750,11 +3499,13 @@ static void xbzrle_cleanup(void)
 {
     XBZRLE_cache_lock();
     if (XBZRLE.cache) {
-        cache_fini(XBZRLE.cache);
+        PageCache *cache = XBZRLE.cache;
+
+        atomic_rcu_set(&XBZRLE.cache, NULL);
+        cache_fini_rcu(cache);
         g_free(XBZRLE.encoded_buf);
         g_free(XBZRLE.current_buf);
         g_free(XBZRLE.zero_target_page);
-        XBZRLE.cache = NULL;
         XBZRLE.encoded_buf = NULL;
         XBZRLE.current_buf = NULL;
         XBZRLE.zero_target_page = NULL;
@@ -2781,8 +3532,14 @@ static void ram_save_cleanup(void *opaque)
         block->unsentmap = NULL;
     }
 
+    RAMBLOCK_FOREACH_MIGRATABLE(block) {
+        g_free(block->file_bmap);
+        block->file_bmap = NULL;
+    }
+
     xbzrle_cleanup();
     compress_threads_save_cleanup();
+    file_io_cleanup();
     ram_state_cleanup(rsp);
 }
 
@@ -3354,6 +4111,9 @@ static void ram_state_resume_prepare(RAMState *rs, QEMUFile *out)
 
     /* Update RAMState cache of output QEMUFile */
     rs->f = out;
+    rs->postcopy_channel = RAM_CHANNEL_PRECOPY;
+    /* Whatever was sent of a preempted page gets resent as a whole */
+    postcopy_preempt_reset(rs);
 
     trace_ram_state_resume_prepare(pages);
 }
@@ -3424,15 +4184,23 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
 {
     RAMState **rsp = opaque;
     RAMBlock *block;
+    Error *local_err = NULL;
 
     if (compress_threads_save_setup()) {
         return -1;
     }
 
+    if (migrate_mapped_ram() && file_io_setup(true, &local_err)) {
+        error_report_err(local_err);
+        compress_threads_save_cleanup();
+        return -1;
+    }
+
     /* migration has already setup the bitmap, reuse it. */
     if (!migration_in_colo_state()) {
         if (ram_init_all(rsp) != 0) {
             compress_threads_save_cleanup();
+            file_io_cleanup();
             return -1;
         }
     }
@@ -3452,6 +4220,10 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
         if (migrate_ignore_shared()) {
             qemu_put_be64(f, block->mr->addr);
         }
+        if (migrate_mapped_ram() && mapped_ram_save_ramblock(f, block)) {
+            rcu_read_unlock();
+            return -1;
+        }
     }
 
     rcu_read_unlock();
@@ -3538,6 +4310,7 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
         }
         i++;
     }
+    postcopy_preempt_reset_channel(rs);
     rcu_read_unlock();
 
     /*
@@ -3601,9 +4374,22 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
         }
     }
 
+    if (postcopy_preempt_active()) {
+        QEMUFile *pf = migrate_get_current()->postcopy_qemufile_src;
+
+        /* Nothing else goes on the preempt channel, end its stream */
+        postcopy_preempt_reset_channel(rs);
+        qemu_put_be64(pf, RAM_SAVE_FLAG_EOS);
+        qemu_fflush(pf);
+    }
+
     flush_compressed_data(rs);
     ram_control_after_iterate(f, RAM_CONTROL_FINISH);
 
+    if (!ret && migrate_mapped_ram()) {
+        ret = mapped_ram_save_bitmaps(f);
+    }
+
     rcu_read_unlock();
 
     multifd_send_sync_main(rs);
@@ -3686,9 +4472,11 @@ static int load_xbzrle(QEMUFile *f, ram_addr_t addr, void *host)
  * @f: QEMUFile where to read the data from
  * @flags: Page flags (mostly to see if it's a continuation of previous block)
  */
-static inline RAMBlock *ram_block_from_stream(QEMUFile *f, int flags)
+static inline RAMBlock *ram_block_from_stream(QEMUFile *f, int flags,
+                                              int channel)
 {
-    static RAMBlock *block = NULL;
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    RAMBlock *block = mis->last_recv_block[channel];
     char id[256];
     uint8_t len;
 
@@ -3715,6 +4503,8 @@ static inline RAMBlock *ram_block_from_stream(QEMUFile *f, int flags)
         return NULL;
     }
 
+    mis->last_recv_block[channel] = block;
+
     return block;
 }
 
@@ -3955,6 +4745,110 @@ static void decompress_data_with_multi_threads(QEMUFile *f,
     qemu_mutex_unlock(&decomp_done_lock);
 }
 
+/*
+ * Threads copying the pages received in the colo cache to the SVM's RAM.
+ * Each one flushes its own slice of every RAMBlock.
+ */
+typedef struct {
+    QemuThread thread;
+    /* posted when there is a round of flushing to do */
+    QemuSemaphore sem;
+    int id;
+} ColoFlushParam;
+
+static struct {
+    ColoFlushParam *params;
+    int nr_threads;
+    /* blocks of the current round, NULL terminated */
+    RAMBlock **blocks;
+    QemuSemaphore done_sem;
+    bool quit;
+} colo_flush_state;
+
+static void colo_flush_block_slice(RAMBlock *block, int id, int nr_threads)
+{
+    unsigned long pages = block->used_length >> TARGET_PAGE_BITS;
+    unsigned long words = BITS_TO_LONGS(pages);
+    /* slices are whole words, so threads never share a bitmap word */
+    unsigned long start = MIN(words * id / nr_threads * BITS_PER_LONG, pages);
+    unsigned long end = MIN(words * (id + 1) / nr_threads * BITS_PER_LONG,
+                            pages);
+    unsigned long page = find_next_bit(block->bmap, end, start);
+
+    while (page < end) {
+        unsigned long next = find_next_zero_bit(block->bmap, end, page);
+        ram_addr_t offset = (ram_addr_t)page << TARGET_PAGE_BITS;
+
+        bitmap_clear(block->bmap, page, next - page);
+        memcpy(block->host + offset, block->colo_cache + offset,
+               (ram_addr_t)(next - page) << TARGET_PAGE_BITS);
+        page = find_next_bit(block->bmap, end, next);
+    }
+}
+
+static void *colo_flush_thread(void *opaque)
+{
+    ColoFlushParam *p = opaque;
+    int i;
+
+    while (true) {
+        qemu_sem_wait(&p->sem);
+        if (atomic_read(&colo_flush_state.quit)) {
+            break;
+        }
+        for (i = 0; colo_flush_state.blocks[i]; i++) {
+            colo_flush_block_slice(colo_flush_state.blocks[i], p->id,
+                                   colo_flush_state.nr_threads);
+        }
+        qemu_sem_post(&colo_flush_state.done_sem);
+    }
+
+    return NULL;
+}
+
+static void colo_flush_threads_setup(void)
+{
+    int i;
+
+    colo_flush_state.nr_threads = migrate_multifd_channels();
+    colo_flush_state.params = g_new0(ColoFlushParam,
+                                     colo_flush_state.nr_threads);
+    colo_flush_state.quit = false;
+    qemu_sem_init(&colo_flush_state.done_sem, 0);
+
+    for (i = 0; i < colo_flush_state.nr_threads; i++) {
+        ColoFlushParam *p = &colo_flush_state.params[i];
+
+        p->id = i;
+        qemu_sem_init(&p->sem, 0);
+        qemu_thread_create(&p->thread, "colo_flush", colo_flush_thread, p,
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+static void colo_flush_threads_cleanup(void)
+{
+    int i;
+
+    if (!colo_flush_state.params) {
+        return;
+    }
+
+    atomic_set(&colo_flush_state.quit, true);
+    for (i = 0; i < colo_flush_state.nr_threads; i++) {
+        qemu_sem_post(&colo_flush_state.params[i].sem);
+    }
+    for (i = 0; i < colo_flush_state.nr_threads; i++) {
+        ColoFlushParam *p = &colo_flush_state.params[i];
+
+        qemu_thread_join(&p->thread);
+        qemu_sem_destroy(&p->sem);
+    }
+    qemu_sem_destroy(&colo_flush_state.done_sem);
+    g_free(colo_flush_state.params);
+    colo_flush_state.params = NULL;
+}
+
 /*
  * colo cache: this is for secondary VM, we cache the whole
  * memory of the secondary VM, it is need to hold the global lock
@@ -3996,6 +4890,7 @@ int colo_init_ram_cache(void)
     ram_state = g_new0(RAMState, 1);
     ram_state->migration_dirty_pages = 0;
     qemu_mutex_init(&ram_state->bitmap_mutex);
+    colo_flush_threads_setup();
     memory_global_dirty_log_start();
 
     return 0;
@@ -4019,6 +4914,7 @@ void colo_release_ram_cache(void)
     RAMBlock *block;
 
     memory_global_dirty_log_stop();
+    colo_flush_threads_cleanup();
     RAMBLOCK_FOREACH_NOT_IGNORED(block) {
         g_free(block->bmap);
         block->bmap = NULL;
@@ -4049,10 +4945,18 @@ void colo_release_ram_cache(void)
  */
 static int ram_load_setup(QEMUFile *f, void *opaque)
 {
+    Error *local_err = NULL;
+
     if (compress_threads_load_setup(f)) {
         return -1;
     }
 
+    if (migrate_mapped_ram() && file_io_setup(false, &local_err)) {
+        error_report_err(local_err);
+        compress_threads_load_cleanup();
+        return -1;
+    }
+
     xbzrle_load_setup();
     ramblock_recv_map_init();
 
@@ -4071,6 +4975,7 @@ static int ram_load_cleanup(void *opaque)
 
     xbzrle_load_cleanup();
     compress_threads_load_cleanup();
+    file_io_cleanup();
 
     RAMBLOCK_FOREACH_NOT_IGNORED(rb) {
         g_free(rb->receivedmap);
@@ -4101,21 +5006,23 @@ int ram_postcopy_incoming_init(MigrationIncomingState *mis)
  *
  * Returns 0 for success or -errno in case of error
  *
- * Called in postcopy mode by ram_load().
+ * Called in postcopy mode by ram_load(), and by the postcopy prio
+ * thread for the preempt channel.
  * rcu_read_lock is taken prior to this being called.
  *
  * @f: QEMUFile where to send the data
+ * @channel: RAM_CHANNEL_PRECOPY or RAM_CHANNEL_POSTCOPY, the channel
+ *           @f belongs to
  */
-static int ram_load_postcopy(QEMUFile *f)
+int ram_load_postcopy(QEMUFile *f, int channel)
 {
     int flags = 0, ret = 0;
     bool place_needed = false;
     bool matches_target_page_size = false;
     MigrationIncomingState *mis = migration_incoming_get_current();
+    PostcopyTmpPage *tmp_page = &mis->postcopy_tmp_pages[channel];
     /* Temporary page that is later 'placed' */
-    void *postcopy_host_page = postcopy_get_tmp_page(mis);
-    void *last_host = NULL;
-    bool all_zero = false;
+    void *postcopy_host_page = postcopy_get_tmp_page(mis, channel);
 
     while (!ret && !(flags & RAM_SAVE_FLAG_EOS)) {
         ram_addr_t addr;
@@ -4139,10 +5046,10 @@ static int ram_load_postcopy(QEMUFile *f)
         flags = addr & ~TARGET_PAGE_MASK;
         addr &= TARGET_PAGE_MASK;
 
-        trace_ram_load_postcopy_loop((uint64_t)addr, flags);
+        trace_ram_load_postcopy_loop(channel, (uint64_t)addr, flags);
         place_needed = false;
         if (flags & (RAM_SAVE_FLAG_ZERO | RAM_SAVE_FLAG_PAGE)) {
-            block = ram_block_from_stream(f, flags);
+            block = ram_block_from_stream(f, flags, channel);
 
             host = host_from_ram_block_offset(block, addr);
             if (!host) {
@@ -4165,16 +5072,17 @@ static int ram_load_postcopy(QEMUFile *f)
                           ((uintptr_t)host & (block->page_size - 1));
             /* If all TP are zero then we can optimise the place */
             if (!((uintptr_t)host & (block->page_size - 1))) {
-                all_zero = true;
+                tmp_page->all_zero = true;
             } else {
                 /* not the 1st TP within the HP */
-                if (host != (last_host + TARGET_PAGE_SIZE)) {
+                if (host != (tmp_page->last_host + TARGET_PAGE_SIZE)) {
                     error_report("Non-sequential target page %p/%p",
-                                  host, last_host);
+                                  host, tmp_page->last_host);
                     ret = -EINVAL;
                     break;
                 }
             }
+            tmp_page->last_host = host;
 
 
             /*
@@ -4185,19 +5093,18 @@ static int ram_load_postcopy(QEMUFile *f)
                                      (block->page_size - 1)) == 0;
             place_source = postcopy_host_page;
         }
-        last_host = host;
 
         switch (flags & ~RAM_SAVE_FLAG_CONTINUE) {
         case RAM_SAVE_FLAG_ZERO:
             ch = qemu_get_byte(f);
             memset(page_buffer, ch, TARGET_PAGE_SIZE);
             if (ch) {
-                all_zero = false;
+                tmp_page->all_zero = false;
             }
             break;
 
         case RAM_SAVE_FLAG_PAGE:
-            all_zero = false;
+            tmp_page->all_zero = false;
             if (!matches_target_page_size) {
                 /* For huge pages, we always use temporary buffer */
                 qemu_get_buffer(f, page_buffer, TARGET_PAGE_SIZE);
@@ -4216,7 +5123,9 @@ static int ram_load_postcopy(QEMUFile *f)
             break;
         case RAM_SAVE_FLAG_EOS:
             /* normal exit */
-            multifd_recv_sync_main();
+            if (channel == RAM_CHANNEL_PRECOPY) {
+                multifd_recv_sync_main();
+            }
             break;
         default:
             error_report("Unknown combination of migration flags: %#x"
@@ -4234,7 +5143,7 @@ static int ram_load_postcopy(QEMUFile *f)
             /* This gets called at the last target page in the host page */
             void *place_dest = host + TARGET_PAGE_SIZE - block->page_size;
 
-            if (all_zero) {
+            if (tmp_page->all_zero) {
                 ret = postcopy_place_page_zero(mis, place_dest,
                                                block);
             } else {
@@ -4266,9 +5175,8 @@ static bool postcopy_is_running(void)
 static void colo_flush_ram_cache(void)
 {
     RAMBlock *block = NULL;
-    void *dst_host;
-    void *src_host;
-    unsigned long offset = 0;
+    int nr_blocks = 0;
+    int i;
 
     memory_global_dirty_log_sync();
     rcu_read_lock();
@@ -4279,26 +5187,119 @@ static void colo_flush_ram_cache(void)
 
     trace_colo_flush_ram_cache_begin(ram_state->migration_dirty_pages);
     rcu_read_lock();
-    block = QLIST_FIRST_RCU(&ram_list.blocks);
 
-    while (block) {
-        offset = migration_bitmap_find_dirty(ram_state, block, offset);
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        nr_blocks++;
+    }
+    colo_flush_state.blocks = g_new0(RAMBlock *, nr_blocks + 1);
+    nr_blocks = 0;
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        colo_flush_state.blocks[nr_blocks++] = block;
+    }
 
-        if (offset << TARGET_PAGE_BITS >= block->used_length) {
-            offset = 0;
-            block = QLIST_NEXT_RCU(block, next);
-        } else {
-            migration_bitmap_clear_dirty(ram_state, block, offset);
-            dst_host = block->host + (offset << TARGET_PAGE_BITS);
-            src_host = block->colo_cache + (offset << TARGET_PAGE_BITS);
-            memcpy(dst_host, src_host, TARGET_PAGE_SIZE);
-        }
+    /*
+     * The SVM is stopped and the multifd channels are synced, nothing
+     * else touches the bitmaps while the threads are flushing.
+     */
+    for (i = 0; i < colo_flush_state.nr_threads; i++) {
+        qemu_sem_post(&colo_flush_state.params[i].sem);
     }
+    for (i = 0; i < colo_flush_state.nr_threads; i++) {
+        qemu_sem_wait(&colo_flush_state.done_sem);
+    }
+    ram_state->migration_dirty_pages = 0;
+
+    g_free(colo_flush_state.blocks);
+    colo_flush_state.blocks = NULL;
 
     rcu_read_unlock();
     trace_colo_flush_ram_cache_end();
 }
 
+/**
+ * mapped_ram_load_ramblock: queue the reads of the pages of a RAMBlock
+ *
+ * The reads are only waited for once all the blocks are queued.
+ *
+ * Returns 0 for success or -errno in case of error
+ *
+ * @f: QEMUFile where to receive the data
+ * @block: block being loaded
+ * @length: length of the block in the file
+ */
+static int mapped_ram_load_ramblock(QEMUFile *f, RAMBlock *block,
+                                    ram_addr_t length)
+{
+    Error *local_err = NULL;
+    unsigned long nbits = length >> TARGET_PAGE_BITS;
+    size_t size = mapped_ram_bitmap_size(length);
+    unsigned long *le_bitmap, *bitmap, first, last;
+    uint64_t page_size, bitmap_offset, pages_offset;
+    uint32_t version;
+    int ret;
+
+    version = qemu_get_be32(f);
+    page_size = qemu_get_be64(f);
+    bitmap_offset = qemu_get_be64(f);
+    pages_offset = qemu_get_be64(f);
+    ret = qemu_file_get_error(f);
+    if (ret) {
+        return ret;
+    }
+
+    if (version != MAPPED_RAM_HDR_VERSION || page_size != TARGET_PAGE_SIZE ||
+        !QEMU_IS_ALIGNED(bitmap_offset, FILE_IO_ALIGN) ||
+        !QEMU_IS_ALIGNED(pages_offset, FILE_IO_ALIGN)) {
+        error_report("Invalid mapped-ram header for block %s: version %u "
+                     "page size %" PRIu64, block->idstr, version, page_size);
+        return -EINVAL;
+    }
+
+    le_bitmap = qemu_memalign(FILE_IO_ALIGN, size);
+    ret = file_io_queue(le_bitmap, size, bitmap_offset);
+    if (ret < 0) {
+        /* Still wait for the threads, they may be using le_bitmap */
+        file_io_flush(NULL);
+    } else {
+        ret = file_io_flush(&local_err);
+    }
+    if (ret < 0) {
+        if (local_err) {
+            error_report_err(local_err);
+        }
+        qemu_file_set_error(f, ret);
+        qemu_vfree(le_bitmap);
+        return ret;
+    }
+    bitmap = bitmap_new(nbits);
+    bitmap_from_le(bitmap, le_bitmap, nbits);
+    qemu_vfree(le_bitmap);
+
+    for (first = find_first_bit(bitmap, nbits); first < nbits;
+         first = find_next_bit(bitmap, nbits, last)) {
+        last = find_next_zero_bit(bitmap, nbits, first);
+        ret = file_io_queue(block->host +
+                            ((ram_addr_t)first << TARGET_PAGE_BITS),
+                            (ram_addr_t)(last - first) << TARGET_PAGE_BITS,
+                            pages_offset +
+                            ((ram_addr_t)first << TARGET_PAGE_BITS));
+        if (ret < 0) {
+            /* file_io_cleanup() waits for the pages already queued */
+            error_report("Failed to read the pages of block %s: %s",
+                         block->idstr, strerror(-ret));
+            qemu_file_set_error(f, ret);
+            g_free(bitmap);
+            return ret;
+        }
+    }
+    g_free(bitmap);
+
+    trace_mapped_ram_load_ramblock(block->idstr, bitmap_offset, pages_offset);
+
+    /* The stream goes on after the pages */
+    return qemu_file_set_offset(f, pages_offset + length);
+}
+
 /**
  * ram_load_precopy: load pages in precopy case
  *
@@ -4338,7 +5339,8 @@ static int ram_load_precopy(QEMUFile *f)
 
         if (flags & (RAM_SAVE_FLAG_ZERO | RAM_SAVE_FLAG_PAGE |
                      RAM_SAVE_FLAG_COMPRESS_PAGE | RAM_SAVE_FLAG_XBZRLE)) {
-            RAMBlock *block = ram_block_from_stream(f, flags);
+            RAMBlock *block = ram_block_from_stream(f, flags,
+                                                    RAM_CHANNEL_PRECOPY);
 
             /*
              * After going into COLO, we should load the Page into colo_cache.
@@ -4412,6 +5414,9 @@ static int ram_load_precopy(QEMUFile *f)
                             ret = -EINVAL;
                         }
                     }
+                    if (!ret && migrate_mapped_ram()) {
+                        ret = mapped_ram_load_ramblock(f, block, length);
+                    }
                     ram_control_load_hook(f, RAM_CONTROL_BLOCK_REG,
                                           block->idstr);
                 } else {
@@ -4422,6 +5427,14 @@ static int ram_load_precopy(QEMUFile *f)
 
                 total_ram_bytes -= length;
             }
+            if (!ret && migrate_mapped_ram()) {
+                Error *local_err = NULL;
+
+                ret = file_io_flush(&local_err);
+                if (ret < 0) {
+                    error_report_err(local_err);
+                }
+            }
             break;
 
         case RAM_SAVE_FLAG_ZERO:
@@ -4497,7 +5510,7 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
     rcu_read_lock();
 
     if (postcopy_running) {
-        ret = ram_load_postcopy(f);
+        ret = ram_load_postcopy(f, RAM_CHANNEL_PRECOPY);
     } else {
         ret = ram_load_precopy(f);
     }
@@ -1747,6 +1747,7 @@ static void *postcopy_ram_listen_thread(void *opaque)
 {
     MigrationIncomingState *mis = migration_incoming_get_current();
     QEMUFile *f = mis->from_src_file;
+    Error *local_err = NULL;
     int load_res;
 
     migrate_set_state(&mis->state, MIGRATION_STATUS_ACTIVE,
@@ -1786,6 +1787,10 @@ static void *postcopy_ram_listen_thread(void *opaque)
          */
         qemu_event_wait(&mis->main_thread_load_event);
     }
+    /* multifd channels place pages, stop them before userfaultfd goes */
+    if (multifd_load_cleanup(&local_err) != 0) {
+        error_report_err(local_err);
+    }
     postcopy_ram_incoming_cleanup(mis);
 
     if (load_res < 0) {
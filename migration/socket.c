@@ -32,6 +32,15 @@ struct SocketOutgoingArgs {
     SocketAddress *saddr;
 } outgoing_args;
 
+/*
+ * Whether the outgoing migration uses a socket, so that more channels can be
+ * connected to the same address.
+ */
+bool socket_send_channel_available(void)
+{
+    return outgoing_args.saddr != NULL;
+}
+
 void socket_send_channel_create(QIOTaskFunc f, void *data)
 {
     QIOChannelSocket *sioc = qio_channel_socket_new();
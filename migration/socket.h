@@ -20,6 +20,7 @@
 #include "io/channel.h"
 #include "io/task.h"
 
+bool socket_send_channel_available(void);
 void socket_send_channel_create(QIOTaskFunc f, void *data);
 int socket_send_channel_destroy(QIOChannel *send);
 
@@ -12,6 +12,7 @@
  */
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
+#include "qemu/host-utils.h"
 #include "xbzrle.h"
 
 /*
@@ -24,17 +25,14 @@
 
   length = uleb128 encoded integer
  */
-int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
-                         uint8_t *dst, int dlen)
+static int xbzrle_encode_buffer_int(uint8_t *old_buf, uint8_t *new_buf,
+                                    int slen, uint8_t *dst, int dlen)
 {
     uint32_t zrun_len = 0, nzrun_len = 0;
     int d = 0, i = 0;
     long res;
     uint8_t *nzrun_start = NULL;
 
-    g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
-               sizeof(long)));
-
     while (i < slen) {
         /* overflow */
         if (d + 2 > dlen) {
@@ -126,6 +124,372 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
     return d;
 }
 
+#if defined(CONFIG_AVX2_OPT) || defined(CONFIG_AVX512BW_OPT) || \
+    defined(__SSE2__) || \
+    (defined(__aarch64__) && !defined(HOST_WORDS_BIGENDIAN))
+#define XBZRLE_VECTOR
+
+/*
+ * The vectorized encoders first compare the pages 64 bytes at a time
+ * and build a bitmap with a bit set for each byte that changed.  The
+ * runs are then found by walking the bitmap, which gives the same
+ * output as xbzrle_encode_buffer_int().
+ */
+#define XBZRLE_MASK_MAX_LEN (64 * 1024)
+
+/* Complete the bitmap for the bytes following the last 64 byte block */
+static void xbzrle_mask_tail(uint64_t *mask, const uint8_t *old_buf,
+                             const uint8_t *new_buf, int i, int slen)
+{
+    uint64_t m = 0;
+    int start = i;
+
+    if (i == slen) {
+        return;
+    }
+    for (; i < slen; i++) {
+        m |= (uint64_t)(old_buf[i] != new_buf[i]) << (i - start);
+    }
+    mask[start / 64] = m;
+}
+
+/*
+ * Return the index of the first byte from @i that changed (@changed)
+ * or didn't change (!@changed), or @slen if there is none.
+ */
+static inline int xbzrle_mask_next(const uint64_t *mask, int i, int slen,
+                                   bool changed)
+{
+    while (i < slen) {
+        uint64_t m = mask[i / 64];
+
+        if (!changed) {
+            m = ~m;
+        }
+        m >>= i % 64;
+        if (m) {
+            return MIN(i + ctz64(m), slen);
+        }
+        i = (i | 63) + 1;
+    }
+    return slen;
+}
+
+static int xbzrle_encode_mask(const uint64_t *mask, uint8_t *new_buf,
+                              int slen, uint8_t *dst, int dlen)
+{
+    int zrun_len, nzrun_len;
+    int d = 0, i = 0, next;
+
+    while (i < slen) {
+        /* overflow */
+        if (d + 2 > dlen) {
+            return -1;
+        }
+
+        next = xbzrle_mask_next(mask, i, slen, true);
+        zrun_len = next - i;
+        i = next;
+
+        /* buffer unchanged */
+        if (zrun_len == slen) {
+            return 0;
+        }
+
+        /* skip last zero run */
+        if (i == slen) {
+            return d;
+        }
+
+        d += uleb128_encode_small(dst + d, zrun_len);
+
+        /* overflow */
+        if (d + 2 > dlen) {
+            return -1;
+        }
+
+        next = xbzrle_mask_next(mask, i, slen, false);
+        nzrun_len = next - i;
+
+        d += uleb128_encode_small(dst + d, nzrun_len);
+        /* overflow */
+        if (d + nzrun_len > dlen) {
+            return -1;
+        }
+        memcpy(dst + d, new_buf + i, nzrun_len);
+        d += nzrun_len;
+        i = next;
+    }
+
+    return d;
+}
+#endif /* XBZRLE_VECTOR */
+
+#if defined(CONFIG_AVX2_OPT) || defined(CONFIG_AVX512BW_OPT) || \
+    defined(__SSE2__)
+/* Do not use push_options pragmas unnecessarily, because clang
+ * does not support them.
+ */
+#if defined(CONFIG_AVX2_OPT) || defined(CONFIG_AVX512BW_OPT)
+#pragma GCC push_options
+#pragma GCC target("sse2")
+#endif
+#include <emmintrin.h>
+
+static int xbzrle_encode_sse2(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                              uint8_t *dst, int dlen)
+{
+    uint64_t mask[XBZRLE_MASK_MAX_LEN / 64];
+    int i;
+
+    for (i = 0; i + 64 <= slen; i += 64) {
+        __m128i *o = (__m128i *)(old_buf + i);
+        __m128i *n = (__m128i *)(new_buf + i);
+        uint64_t eq0 = _mm_movemask_epi8(_mm_cmpeq_epi8(
+                           _mm_loadu_si128(o), _mm_loadu_si128(n)));
+        uint64_t eq1 = _mm_movemask_epi8(_mm_cmpeq_epi8(
+                           _mm_loadu_si128(o + 1), _mm_loadu_si128(n + 1)));
+        uint64_t eq2 = _mm_movemask_epi8(_mm_cmpeq_epi8(
+                           _mm_loadu_si128(o + 2), _mm_loadu_si128(n + 2)));
+        uint64_t eq3 = _mm_movemask_epi8(_mm_cmpeq_epi8(
+                           _mm_loadu_si128(o + 3), _mm_loadu_si128(n + 3)));
+
+        mask[i / 64] = ~(eq0 | (eq1 << 16) | (eq2 << 32) | (eq3 << 48));
+    }
+    xbzrle_mask_tail(mask, old_buf, new_buf, i, slen);
+
+    return xbzrle_encode_mask(mask, new_buf, slen, dst, dlen);
+}
+#if defined(CONFIG_AVX2_OPT) || defined(CONFIG_AVX512BW_OPT)
+#pragma GCC pop_options
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+static int xbzrle_encode_avx2(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                              uint8_t *dst, int dlen)
+{
+    uint64_t mask[XBZRLE_MASK_MAX_LEN / 64];
+    int i;
+
+    for (i = 0; i + 64 <= slen; i += 64) {
+        __m256i o0 = _mm256_loadu_si256((__m256i *)(old_buf + i));
+        __m256i n0 = _mm256_loadu_si256((__m256i *)(new_buf + i));
+        __m256i o1 = _mm256_loadu_si256((__m256i *)(old_buf + i + 32));
+        __m256i n1 = _mm256_loadu_si256((__m256i *)(new_buf + i + 32));
+        uint32_t eq0 = _mm256_movemask_epi8(_mm256_cmpeq_epi8(o0, n0));
+        uint32_t eq1 = _mm256_movemask_epi8(_mm256_cmpeq_epi8(o1, n1));
+
+        mask[i / 64] = ~(((uint64_t)eq1 << 32) | eq0);
+    }
+    xbzrle_mask_tail(mask, old_buf, new_buf, i, slen);
+
+    return xbzrle_encode_mask(mask, new_buf, slen, dst, dlen);
+}
+#pragma GCC pop_options
+#endif /* CONFIG_AVX2_OPT */
+
+#ifdef CONFIG_AVX512BW_OPT
+#pragma GCC push_options
+#pragma GCC target("avx512bw")
+#include <immintrin.h>
+
+static int xbzrle_encode_avx512bw(uint8_t *old_buf, uint8_t *new_buf,
+                                  int slen, uint8_t *dst, int dlen)
+{
+    uint64_t mask[XBZRLE_MASK_MAX_LEN / 64];
+    int i;
+
+    for (i = 0; i + 64 <= slen; i += 64) {
+        __m512i o = _mm512_loadu_si512(old_buf + i);
+        __m512i n = _mm512_loadu_si512(new_buf + i);
+
+        mask[i / 64] = _mm512_cmpneq_epi8_mask(o, n);
+    }
+    xbzrle_mask_tail(mask, old_buf, new_buf, i, slen);
+
+    return xbzrle_encode_mask(mask, new_buf, slen, dst, dlen);
+}
+#pragma GCC pop_options
+#endif /* CONFIG_AVX512BW_OPT */
+
+/* Note that for test_xbzrle_encode_next_accel, the most preferred
+ * ISA must have the least significant bit.
+ */
+#define CACHE_AVX512BW 1
+#define CACHE_AVX2     2
+#define CACHE_SSE2     4
+
+/* Make sure that these variables are appropriately initialized when
+ * SSE2 is enabled on the compiler command-line, but the compiler is
+ * too old to support the ISA specific options.
+ */
+#if defined(CONFIG_AVX2_OPT) || defined(CONFIG_AVX512BW_OPT)
+# define INIT_CACHE 0
+# define INIT_ACCEL xbzrle_encode_buffer_int
+#else
+# ifndef __SSE2__
+#  error "ISA selection confusion"
+# endif
+# define INIT_CACHE CACHE_SSE2
+# define INIT_ACCEL xbzrle_encode_sse2
+#endif
+
+static unsigned cpuid_cache = INIT_CACHE;
+static int (*encode_accel)(uint8_t *, uint8_t *, int, uint8_t *, int) =
+    INIT_ACCEL;
+
+static void init_accel(unsigned cache)
+{
+    int (*fn)(uint8_t *, uint8_t *, int, uint8_t *, int) =
+        xbzrle_encode_buffer_int;
+
+    if (cache & CACHE_SSE2) {
+        fn = xbzrle_encode_sse2;
+    }
+#ifdef CONFIG_AVX2_OPT
+    if (cache & CACHE_AVX2) {
+        fn = xbzrle_encode_avx2;
+    }
+#endif
+#ifdef CONFIG_AVX512BW_OPT
+    if (cache & CACHE_AVX512BW) {
+        fn = xbzrle_encode_avx512bw;
+    }
+#endif
+    encode_accel = fn;
+}
+
+#if defined(CONFIG_AVX2_OPT) || defined(CONFIG_AVX512BW_OPT)
+#include "qemu/cpuid.h"
+
+static void __attribute__((constructor)) init_cpuid_cache(void)
+{
+    int max = __get_cpuid_max(0, NULL);
+    int a, b, c, d;
+    unsigned cache = 0;
+
+    if (max >= 1) {
+        __cpuid(1, a, b, c, d);
+        if (d & bit_SSE2) {
+            cache |= CACHE_SSE2;
+        }
+
+        /* We must check that AVX is not just available, but usable.  */
+        if ((c & bit_OSXSAVE) && (c & bit_AVX) && max >= 7) {
+            int bv;
+            __asm("xgetbv" : "=a"(bv), "=d"(d) : "c"(0));
+            __cpuid_count(7, 0, a, b, c, d);
+#ifdef CONFIG_AVX2_OPT
+            if ((bv & 6) == 6 && (b & bit_AVX2)) {
+                cache |= CACHE_AVX2;
+            }
+#endif
+#ifdef CONFIG_AVX512BW_OPT
+            /* The OS must also save the opmask and upper ZMM registers */
+            if ((bv & 0xe6) == 0xe6 && (b & bit_AVX512BW)) {
+                cache |= CACHE_AVX512BW;
+            }
+#endif
+        }
+    }
+    cpuid_cache = cache;
+    init_accel(cache);
+}
+#endif /* CONFIG_AVX2_OPT || CONFIG_AVX512BW_OPT */
+
+bool test_xbzrle_encode_next_accel(void)
+{
+    /* If no bits set, we just tested xbzrle_encode_buffer_int, and there
+       are no more acceleration options to test.  */
+    if (cpuid_cache == 0) {
+        return false;
+    }
+    /* Disable the accelerator we used before and select a new one.  */
+    cpuid_cache &= cpuid_cache - 1;
+    init_accel(cpuid_cache);
+    return true;
+}
+
+#elif defined(XBZRLE_VECTOR)
+#include <arm_neon.h>
+
+/* Gather the top bit of each byte of the four vectors, in order */
+static uint64_t xbzrle_neon_movemask(uint8x16_t m0, uint8x16_t m1,
+                                     uint8x16_t m2, uint8x16_t m3)
+{
+    static const uint8_t bits[16] = {
+        1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128
+    };
+    uint8x16_t b = vld1q_u8(bits);
+    uint8x16_t s0 = vpaddq_u8(vandq_u8(m0, b), vandq_u8(m1, b));
+    uint8x16_t s1 = vpaddq_u8(vandq_u8(m2, b), vandq_u8(m3, b));
+
+    s0 = vpaddq_u8(s0, s1);
+    s0 = vpaddq_u8(s0, s0);
+    return vgetq_lane_u64(vreinterpretq_u64_u8(s0), 0);
+}
+
+static int xbzrle_encode_neon(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                              uint8_t *dst, int dlen)
+{
+    uint64_t mask[XBZRLE_MASK_MAX_LEN / 64];
+    int i;
+
+    for (i = 0; i + 64 <= slen; i += 64) {
+        uint8x16_t e0 = vceqq_u8(vld1q_u8(old_buf + i),
+                                 vld1q_u8(new_buf + i));
+        uint8x16_t e1 = vceqq_u8(vld1q_u8(old_buf + i + 16),
+                                 vld1q_u8(new_buf + i + 16));
+        uint8x16_t e2 = vceqq_u8(vld1q_u8(old_buf + i + 32),
+                                 vld1q_u8(new_buf + i + 32));
+        uint8x16_t e3 = vceqq_u8(vld1q_u8(old_buf + i + 48),
+                                 vld1q_u8(new_buf + i + 48));
+
+        mask[i / 64] = ~xbzrle_neon_movemask(e0, e1, e2, e3);
+    }
+    xbzrle_mask_tail(mask, old_buf, new_buf, i, slen);
+
+    return xbzrle_encode_mask(mask, new_buf, slen, dst, dlen);
+}
+
+/* NEON is always there on AArch64, so no need to probe for it */
+static int (*encode_accel)(uint8_t *, uint8_t *, int, uint8_t *, int) =
+    xbzrle_encode_neon;
+
+bool test_xbzrle_encode_next_accel(void)
+{
+    if (encode_accel == xbzrle_encode_buffer_int) {
+        return false;
+    }
+    encode_accel = xbzrle_encode_buffer_int;
+    return true;
+}
+
+#else
+bool test_xbzrle_encode_next_accel(void)
+{
+    return false;
+}
+#endif
+
+int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                         uint8_t *dst, int dlen)
+{
+    g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
+               sizeof(long)));
+
+#ifdef XBZRLE_VECTOR
+    if (likely(slen <= XBZRLE_MASK_MAX_LEN)) {
+        return encode_accel(old_buf, new_buf, slen, dst, dlen);
+    }
+#endif
+    return xbzrle_encode_buffer_int(old_buf, new_buf, slen, dst, dlen);
+}
+
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen)
 {
     int i = 0, d = 0;
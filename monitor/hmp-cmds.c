@@ -342,6 +342,16 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
         g_free(str);
         visit_free(v);
     }
+
+    if (info->has_postcopy_fault_latency) {
+        PostcopyFaultLatency *lat = info->postcopy_fault_latency;
+
+        monitor_printf(mon, "postcopy fault latency (us): count=%" PRIu64
+                       " p50=%" PRIu64 " p90=%" PRIu64 " p99=%" PRIu64
+                       " p99.9=%" PRIu64 " max=%" PRIu64 "\n",
+                       lat->count, lat->p50, lat->p90, lat->p99,
+                       lat->p999, lat->max);
+    }
     if (info->has_socket_address) {
         SocketAddressList *addr;
 
@@ -2353,7 +2363,8 @@ void hmp_nbd_server_start(Monitor *mon, const QDict *qdict)
         }
 
         qmp_nbd_server_add(info->value->device, false, NULL,
-                           true, writable, false, NULL, &local_err);
+                           true, writable, false, NULL, false, NULL,
+                           &local_err);
 
         if (local_err != NULL) {
             qmp_nbd_server_stop(NULL);
@@ -2375,7 +2386,7 @@ void hmp_nbd_server_add(Monitor *mon, const QDict *qdict)
     Error *local_err = NULL;
 
     qmp_nbd_server_add(device, !!name, name, true, writable,
-                       false, NULL, &local_err);
+                       false, NULL, false, NULL, &local_err);
     hmp_handle_error(mon, &local_err);
 }
 
@@ -23,6 +23,11 @@
 #include "trace.h"
 #include "nbd-internal.h"
 #include "qemu/units.h"
+#include "block/thread-pool.h"
+
+#ifdef CONFIG_LINUX
+#include <sys/sendfile.h>
+#endif
 
 #define NBD_META_ID_BASE_ALLOCATION 0
 #define NBD_META_ID_DIRTY_BITMAP 1
@@ -89,6 +94,11 @@ struct NBDExport {
 
     AioContext *ctx;
 
+    /* AioContexts that connections are spread over, instead of ctx */
+    AioContext **conn_ctxs;
+    int nr_conn_ctxs;
+    int next_conn_ctx;
+
     BlockBackend *eject_notifier_blk;
     Notifier eject_notifier;
 
@@ -121,6 +131,12 @@ struct NBDClient {
 
     Coroutine *recv_coroutine;
 
+    /*
+     * AioContext that the connection runs in, if it is not the export's.
+     * Requests still call the block layer in the export's AioContext.
+     */
+    AioContext *conn_ctx;
+
     CoMutex send_lock;
     Coroutine *send_coroutine;
 
@@ -1345,40 +1361,64 @@ static int nbd_receive_request(QIOChannel *ioc, NBDRequest *request,
 
 void nbd_client_get(NBDClient *client)
 {
-    client->refcount++;
+    atomic_inc(&client->refcount);
+}
+
+static void nbd_client_free(NBDClient *client)
+{
+    qio_channel_detach_aio_context(client->ioc);
+    object_unref(OBJECT(client->sioc));
+    object_unref(OBJECT(client->ioc));
+    if (client->tlscreds) {
+        object_unref(OBJECT(client->tlscreds));
+    }
+    g_free(client->tlsauthz);
+    if (client->exp) {
+        QTAILQ_REMOVE(&client->exp->clients, client, next);
+        nbd_export_put(client->exp);
+    }
+    g_free(client);
+}
+
+static void nbd_client_free_bh(void *opaque)
+{
+    NBDClient *client = opaque;
+    AioContext *ctx = qemu_get_current_aio_context();
+
+    aio_context_acquire(ctx);
+    nbd_client_free(client);
+    aio_context_release(ctx);
 }
 
 void nbd_client_put(NBDClient *client)
 {
-    if (--client->refcount == 0) {
+    if (atomic_fetch_dec(&client->refcount) == 1) {
         /* The last reference should be dropped by client->close,
          * which is called by client_close.
          */
-        assert(client->closing);
+        assert(atomic_read(&client->closing));
 
-        qio_channel_detach_aio_context(client->ioc);
-        object_unref(OBJECT(client->sioc));
-        object_unref(OBJECT(client->ioc));
-        if (client->tlscreds) {
-            object_unref(OBJECT(client->tlscreds));
-        }
-        g_free(client->tlsauthz);
-        if (client->exp) {
-            QTAILQ_REMOVE(&client->exp->clients, client, next);
-            nbd_export_put(client->exp);
+        /* The list of clients belongs to the export's AioContext */
+        if (client->conn_ctx) {
+            AioContext *ctx = atomic_read(&client->exp->ctx) ?:
+                              qemu_get_aio_context();
+
+            if (qemu_get_current_aio_context() != ctx) {
+                aio_bh_schedule_oneshot(ctx, nbd_client_free_bh, client);
+                return;
+            }
         }
-        g_free(client);
+        nbd_client_free(client);
     }
 }
 
 static void client_close(NBDClient *client, bool negotiated)
 {
-    if (client->closing) {
+    /* Connections in an iothread may be closed from there and by the export */
+    if (atomic_xchg(&client->closing, true)) {
         return;
     }
 
-    client->closing = true;
-
     /* Force requests to finish.  They will drop their own references,
      * then we'll close the socket and free the NBDClient.
      */
@@ -1426,9 +1466,13 @@ static void blk_aio_attached(AioContext *ctx, void *opaque)
 
     trace_nbd_blk_aio_attached(exp->name, ctx);
 
-    exp->ctx = ctx;
+    atomic_set(&exp->ctx, ctx);
 
     QTAILQ_FOREACH(client, &exp->clients, next) {
+        if (client->conn_ctx) {
+            /* Follows the export in nbd_co_enter_export() */
+            continue;
+        }
         qio_channel_attach_aio_context(client->ioc, ctx);
         if (client->recv_coroutine) {
             aio_co_schedule(ctx, client->recv_coroutine);
@@ -1447,10 +1491,12 @@ static void blk_aio_detach(void *opaque)
     trace_nbd_blk_aio_detach(exp->name, exp->ctx);
 
     QTAILQ_FOREACH(client, &exp->clients, next) {
-        qio_channel_detach_aio_context(client->ioc);
+        if (!client->conn_ctx) {
+            qio_channel_detach_aio_context(client->ioc);
+        }
     }
 
-    exp->ctx = NULL;
+    atomic_set(&exp->ctx, NULL);
 }
 
 static void nbd_eject_notifier(Notifier *n, void *data)
@@ -1625,6 +1671,8 @@ void nbd_export_get(NBDExport *exp)
 
 void nbd_export_put(NBDExport *exp)
 {
+    int i;
+
     assert(exp->refcount > 0);
     if (exp->refcount == 1) {
         nbd_export_close(exp);
@@ -1660,10 +1708,33 @@ void nbd_export_put(NBDExport *exp)
             g_free(exp->export_bitmap_context);
         }
 
+        for (i = 0; i < exp->nr_conn_ctxs; i++) {
+            aio_context_unref(exp->conn_ctxs[i]);
+        }
+        g_free(exp->conn_ctxs);
         g_free(exp);
     }
 }
 
+/*
+ * Spread the connections to @exp round-robin over the @n AioContexts in
+ * @ctxs, for example those of a set of iothreads.  Each connection
+ * receives requests and sends replies in its own AioContext, and moves
+ * to the export's AioContext only to call the block layer.
+ */
+void nbd_export_set_conn_contexts(NBDExport *exp, AioContext **ctxs, int n)
+{
+    int i;
+
+    assert(!exp->nr_conn_ctxs && QTAILQ_EMPTY(&exp->clients));
+    exp->conn_ctxs = g_new(AioContext *, n);
+    for (i = 0; i < n; i++) {
+        aio_context_ref(ctxs[i]);
+        exp->conn_ctxs[i] = ctxs[i];
+    }
+    exp->nr_conn_ctxs = n;
+}
+
 BlockBackend *nbd_export_get_blockdev(NBDExport *exp)
 {
     return exp->blk;
@@ -1678,12 +1749,45 @@ void nbd_export_close_all(void)
     }
 }
 
+/* Move to the export's AioContext before calling the block layer */
+static void coroutine_fn nbd_co_enter_export(NBDClient *client)
+{
+    AioContext *ctx;
+
+    if (!client->conn_ctx) {
+        return;
+    }
+
+    /* Check again after moving, the export may have moved meanwhile */
+    while ((ctx = atomic_read(&client->exp->ctx)) !=
+           qemu_get_current_aio_context()) {
+        if (ctx) {
+            aio_co_reschedule_self(ctx);
+        } else if (qemu_get_current_aio_context() != qemu_get_aio_context()) {
+            /* The export is between two AioContexts, the main loop does that */
+            aio_co_reschedule_self(qemu_get_aio_context());
+        } else {
+            aio_co_schedule(qemu_get_aio_context(), qemu_coroutine_self());
+            qemu_coroutine_yield();
+        }
+    }
+}
+
+/* Move back to the connection's AioContext to use the socket */
+static void coroutine_fn nbd_co_leave_export(NBDClient *client)
+{
+    if (client->conn_ctx) {
+        aio_co_reschedule_self(client->conn_ctx);
+    }
+}
+
 static int coroutine_fn nbd_co_send_iov(NBDClient *client, struct iovec *iov,
                                         unsigned niov, Error **errp)
 {
     int ret;
 
     g_assert(qemu_in_coroutine());
+    nbd_co_leave_export(client);
     qemu_co_mutex_lock(&client->send_lock);
     client->send_coroutine = qemu_coroutine_self();
 
@@ -1797,6 +1901,158 @@ static int coroutine_fn nbd_co_send_structured_error(NBDClient *client,
     return nbd_co_send_iov(client, iov, 1 + !!iov[1].iov_len, errp);
 }
 
+#ifdef CONFIG_LINUX
+typedef struct NBDSendfileData {
+    int out_fd;
+    int in_fd;
+    off_t pos;
+    size_t len;
+} NBDSendfileData;
+
+static int nbd_sendfile_worker(void *opaque)
+{
+    NBDSendfileData *data = opaque;
+    ssize_t len;
+
+    do {
+        len = sendfile(data->out_fd, data->in_fd, &data->pos, data->len);
+    } while (len < 0 && errno == EINTR);
+
+    return len < 0 ? -errno : len;
+}
+
+/*
+ * Send the reply to a read request with the data taken straight from the
+ * host file behind the export, using sendfile(), instead of reading it into
+ * a buffer and copying it to the socket.  This is only possible on plain
+ * (non-TLS) sockets, for exports whose data is stored verbatim in a host
+ * file, and for replies that carry the data in a single piece.
+ *
+ * sendfile() reads the file synchronously when the data is not in the
+ * page cache, so it runs in the thread pool rather than stalling every
+ * client of the AioContext.
+ *
+ * Requests that extend past the end of the host file, like the tail of a
+ * raw image whose size is not a multiple of the sector size, are left to
+ * the block layer, which reads zeroes there.  As the reply header is sent
+ * before the data is read, a read error cannot be reported to the client
+ * and the connection is dropped instead.
+ *
+ * Returns 1 if the reply was sent, 0 if the caller must send it the usual
+ * way, -errno if sending failed.
+ */
+static int coroutine_fn nbd_co_send_read_direct(NBDClient *client,
+                                                NBDRequest *request,
+                                                Error **errp)
+{
+    NBDExport *exp = client->exp;
+    BlockDriverState *bs = blk_bs(exp->blk);
+    BlockAcctCookie cookie;
+    NBDStructuredReadData chunk;
+    NBDSimpleReply reply;
+    NBDSendfileData data;
+    struct iovec iov;
+    struct stat st;
+    int64_t fd_offset;
+    int fd, ret = 0;
+
+    if (client->tlscreds || !request->len || !bs) {
+        return 0;
+    }
+
+    nbd_co_enter_export(client);
+    /* Keep the export from being drained while we use its file */
+    blk_inc_in_flight(exp->blk);
+
+    fd = bdrv_get_host_fd(bs, &fd_offset);
+    if (fd < 0) {
+        goto out_fallback;
+    }
+    trace_nbd_co_send_read_direct(request->handle, request->from, fd,
+                                  fd_offset, request->len);
+
+    /* The node may close or replace its file descriptor while we yield */
+    fd = qemu_dup(fd);
+    if (fd < 0) {
+        goto out_fallback;
+    }
+    data = (NBDSendfileData) {
+        .out_fd = client->sioc->fd,
+        .in_fd  = fd,
+        .pos    = fd_offset + exp->dev_offset + request->from,
+        .len    = request->len,
+    };
+    if (fstat(fd, &st) < 0 || data.pos + request->len > st.st_size) {
+        qemu_close(fd);
+        goto out_fallback;
+    }
+
+    if (client->structured_reply) {
+        set_be_chunk(&chunk.h, NBD_REPLY_FLAG_DONE,
+                     NBD_REPLY_TYPE_OFFSET_DATA, request->handle,
+                     sizeof(chunk) - sizeof(chunk.h) + request->len);
+        stq_be_p(&chunk.offset, request->from);
+        iov.iov_base = &chunk;
+        iov.iov_len = sizeof(chunk);
+    } else {
+        set_be_simple_reply(&reply, 0, request->handle);
+        iov.iov_base = &reply;
+        iov.iov_len = sizeof(reply);
+    }
+
+    block_acct_start(blk_get_stats(exp->blk), &cookie, request->len,
+                     BLOCK_ACCT_READ);
+
+    nbd_co_leave_export(client);
+    qemu_co_mutex_lock(&client->send_lock);
+    client->send_coroutine = qemu_coroutine_self();
+    qio_channel_set_cork(client->ioc, true);
+
+    if (qio_channel_writev_all(client->ioc, &iov, 1, errp) < 0) {
+        ret = -EIO;
+    }
+    while (!ret && data.len) {
+        ThreadPool *pool = aio_get_thread_pool(qemu_get_current_aio_context());
+        int len = thread_pool_submit_co(pool, nbd_sendfile_worker, &data);
+
+        if (len == -EAGAIN) {
+            qio_channel_yield(client->ioc, G_IO_OUT);
+            continue;
+        }
+        if (len < 0) {
+            error_setg_errno(errp, -len,
+                             "Failed to send data from the export file");
+            ret = -EIO;
+            break;
+        }
+        if (len == 0) {
+            error_setg(errp, "Export file was truncated during a read");
+            ret = -EIO;
+            break;
+        }
+        data.len -= len;
+    }
+
+    qio_channel_set_cork(client->ioc, false);
+    client->send_coroutine = NULL;
+    qemu_co_mutex_unlock(&client->send_lock);
+    qemu_close(fd);
+
+    if (ret < 0) {
+        block_acct_failed(blk_get_stats(exp->blk), &cookie);
+    } else {
+        block_acct_done(blk_get_stats(exp->blk), &cookie);
+        ret = 1;
+    }
+    blk_dec_in_flight(exp->blk);
+    return ret;
+
+out_fallback:
+    blk_dec_in_flight(exp->blk);
+    return 0;
+}
+#endif
+
 /* Do a sparse read and send the structured reply to the client.
  * Returns -errno if sending fails. bdrv_block_status_above() failure is
  * reported to the client, at which point this function succeeds.
@@ -1814,12 +2070,14 @@ static int coroutine_fn nbd_co_send_sparse_read(NBDClient *client,
 
     while (progress < size) {
         int64_t pnum;
-        int status = bdrv_block_status_above(blk_bs(exp->blk), NULL,
-                                             offset + progress,
-                                             size - progress, &pnum, NULL,
-                                             NULL);
+        int status;
         bool final;
 
+        nbd_co_enter_export(client);
+        status = bdrv_block_status_above(blk_bs(exp->blk), NULL,
+                                         offset + progress, size - progress,
+                                         &pnum, NULL, NULL);
+
         if (status < 0) {
             char *msg = g_strdup_printf("unable to check for holes: %s",
                                         strerror(-status));
@@ -1968,6 +2226,7 @@ static int nbd_co_send_block_status(NBDClient *client, uint64_t handle,
     NBDExtent *extents = g_new(NBDExtent, nb_extents);
     uint64_t final_length = length;
 
+    nbd_co_enter_export(client);
     ret = blockstatus_to_extents(bs, offset, &final_length, extents,
                                  &nb_extents);
     if (ret < 0) {
@@ -2053,6 +2312,7 @@ static int nbd_co_send_bitmap(NBDClient *client, uint64_t handle,
     NBDExtent *extents = g_new(NBDExtent, nb_extents);
     uint64_t final_length = length;
 
+    nbd_co_enter_export(client);
     nb_extents = bitmap_to_extents(bitmap, offset, &final_length, extents,
                                    nb_extents, dont_fragment);
 
@@ -2202,6 +2462,7 @@ static coroutine_fn int nbd_do_cmd_read(NBDClient *client, NBDRequest *request,
 
     /* XXX: NBD Protocol only documents use of FUA with WRITE */
     if (request->flags & NBD_CMD_FLAG_FUA) {
+        nbd_co_enter_export(client);
         ret = blk_co_flush(exp->blk);
         if (ret < 0) {
             return nbd_send_generic_reply(client, request->handle, ret,
@@ -2209,6 +2470,15 @@ static coroutine_fn int nbd_do_cmd_read(NBDClient *client, NBDRequest *request,
         }
     }
 
+#ifdef CONFIG_LINUX
+    if (!client->structured_reply || (request->flags & NBD_CMD_FLAG_DF)) {
+        ret = nbd_co_send_read_direct(client, request, errp);
+        if (ret) {
+            return ret < 0 ? ret : 0;
+        }
+    }
+#endif
+
     if (client->structured_reply && !(request->flags & NBD_CMD_FLAG_DF) &&
         request->len)
     {
@@ -2216,6 +2486,7 @@ static coroutine_fn int nbd_do_cmd_read(NBDClient *client, NBDRequest *request,
                                        data, request->len, errp);
     }
 
+    nbd_co_enter_export(client);
     ret = blk_pread(exp->blk, request->from + exp->dev_offset, data,
                     request->len);
     if (ret < 0) {
@@ -2252,6 +2523,7 @@ static coroutine_fn int nbd_do_cmd_cache(NBDClient *client, NBDRequest *request,
 
     assert(request->type == NBD_CMD_CACHE);
 
+    nbd_co_enter_export(client);
     ret = blk_co_preadv(exp->blk, request->from + exp->dev_offset, request->len,
                         NULL, BDRV_REQ_COPY_ON_READ | BDRV_REQ_PREFETCH);
 
@@ -2283,6 +2555,7 @@ static coroutine_fn int nbd_handle_request(NBDClient *client,
         if (request->flags & NBD_CMD_FLAG_FUA) {
             flags |= BDRV_REQ_FUA;
         }
+        nbd_co_enter_export(client);
         ret = blk_pwrite(exp->blk, request->from + exp->dev_offset,
                          data, request->len, flags);
         return nbd_send_generic_reply(client, request->handle, ret,
@@ -2296,6 +2569,7 @@ static coroutine_fn int nbd_handle_request(NBDClient *client,
         if (!(request->flags & NBD_CMD_FLAG_NO_HOLE)) {
             flags |= BDRV_REQ_MAY_UNMAP;
         }
+        nbd_co_enter_export(client);
         ret = blk_pwrite_zeroes(exp->blk, request->from + exp->dev_offset,
                                 request->len, flags);
         return nbd_send_generic_reply(client, request->handle, ret,
@@ -2306,11 +2580,13 @@ static coroutine_fn int nbd_handle_request(NBDClient *client,
         abort();
 
     case NBD_CMD_FLUSH:
+        nbd_co_enter_export(client);
         ret = blk_co_flush(exp->blk);
         return nbd_send_generic_reply(client, request->handle, ret,
                                       "flush failed", errp);
 
     case NBD_CMD_TRIM:
+        nbd_co_enter_export(client);
         ret = blk_co_pdiscard(exp->blk, request->from + exp->dev_offset,
                               request->len);
         if (ret == 0 && request->flags & NBD_CMD_FLAG_FUA) {
@@ -2380,7 +2656,7 @@ static coroutine_fn void nbd_trip(void *opaque)
     Error *local_err = NULL;
 
     trace_nbd_trip();
-    if (client->closing) {
+    if (atomic_read(&client->closing)) {
         nbd_client_put(client);
         return;
     }
@@ -2389,7 +2665,7 @@ static coroutine_fn void nbd_trip(void *opaque)
     ret = nbd_co_receive_request(req, &request, &local_err);
     client->recv_coroutine = NULL;
 
-    if (client->closing) {
+    if (atomic_read(&client->closing)) {
         /*
          * The client may be closed when we are blocked in
          * nbd_co_receive_request()
@@ -2414,6 +2690,7 @@ static coroutine_fn void nbd_trip(void *opaque)
     } else {
         ret = nbd_handle_request(client, &request, req->data, &local_err);
     }
+    nbd_co_leave_export(client);
     if (ret < 0) {
         error_prepend(&local_err, "Failed to send reply: ");
         goto disconnect;
@@ -2446,7 +2723,8 @@ static void nbd_client_receive_next_request(NBDClient *client)
     if (!client->recv_coroutine && client->nb_requests < MAX_NBD_REQUESTS) {
         nbd_client_get(client);
         client->recv_coroutine = qemu_coroutine_create(nbd_trip, client);
-        aio_co_schedule(client->exp->ctx, client->recv_coroutine);
+        aio_co_schedule(client->conn_ctx ?: client->exp->ctx,
+                        client->recv_coroutine);
     }
 }
 
@@ -2465,6 +2743,15 @@ static coroutine_fn void nbd_co_client_start(void *opaque)
         return;
     }
 
+    if (client->exp->nr_conn_ctxs) {
+        NBDExport *exp = client->exp;
+
+        client->conn_ctx = exp->conn_ctxs[exp->next_conn_ctx];
+        exp->next_conn_ctx = (exp->next_conn_ctx + 1) % exp->nr_conn_ctxs;
+        trace_nbd_co_client_start_conn_ctx(exp->name, client->conn_ctx);
+        qio_channel_attach_aio_context(client->ioc, client->conn_ctx);
+    }
+
     nbd_client_receive_next_request(client);
 }
 
@@ -70,6 +70,8 @@ enum {
     OPTION_PREALLOCATION = 265,
     OPTION_SHRINK = 266,
     OPTION_SALVAGE = 267,
+    OPTION_RANDOM = 268,
+    OPTION_COMPRESS_THREADS = 269,
 };
 
 typedef enum OutputFormat {
@@ -178,6 +180,8 @@ static void QEMU_NORETURN help(void)
            "  '-m' specifies how many coroutines work in parallel during the convert\n"
            "       process (defaults to 8)\n"
            "  '-W' allow to write to the target out of order rather than sequential\n"
+           "  '--compress-threads' sets how many clusters of a compressed qcow2 target\n"
+           "       are compressed in parallel (defaults to 4)\n"
            "\n"
            "Parameters to snapshot subcommand:\n"
            "  'snapshot' is the name of the snapshot to create, apply or delete\n"
@@ -190,6 +194,8 @@ static void QEMU_NORETURN help(void)
            "  '-f' first image format\n"
            "  '-F' second image format\n"
            "  '-s' run in Strict mode - fail on different image size or sector allocation\n"
+           "  '-m' specifies how many coroutines work in parallel during the compare\n"
+           "       process (defaults to 8)\n"
            "\n"
            "Parameters to dd subcommand:\n"
            "  'bs=BYTES' read and write up to BYTES bytes at a time "
@@ -616,16 +622,24 @@ static void dump_human_image_check(ImageCheck *check, bool quiet)
     }
 }
 
+static void check_status_cb(BlockDriverState *bs,
+                            int64_t offset, int64_t total_work_size,
+                            void *opaque)
+{
+    qemu_progress_print(100.f * offset / total_work_size, 0);
+}
+
 static int collect_image_check(BlockDriverState *bs,
                    ImageCheck *check,
                    const char *filename,
                    const char *fmt,
-                   int fix)
+                   int fix,
+                   BlockDriverCheckStatusCB *status_cb)
 {
     int ret;
     BdrvCheckResult result;
 
-    ret = bdrv_check(bs, &result, fix);
+    ret = bdrv_check(bs, &result, fix, status_cb, NULL);
     if (ret < 0) {
         return ret;
     }
@@ -678,6 +692,7 @@ static int img_check(int argc, char **argv)
     bool quiet = false;
     bool image_opts = false;
     bool force_share = false;
+    bool progress = false;
 
     fmt = NULL;
     output = NULL;
@@ -695,7 +710,7 @@ static int img_check(int argc, char **argv)
             {"force-share", no_argument, 0, 'U'},
             {0, 0, 0, 0}
         };
-        c = getopt_long(argc, argv, ":hf:r:T:qU",
+        c = getopt_long(argc, argv, ":hf:r:T:pqU",
                         long_options, &option_index);
         if (c == -1) {
             break;
@@ -731,6 +746,9 @@ static int img_check(int argc, char **argv)
         case 'T':
             cache = optarg;
             break;
+        case 'p':
+            progress = true;
+            break;
         case 'q':
             quiet = true;
             break;
@@ -783,8 +801,17 @@ static int img_check(int argc, char **argv)
     }
     bs = blk_bs(blk);
 
+    /* The progress would end up in the middle of the JSON output */
+    if (quiet || output_format == OFORMAT_JSON) {
+        progress = false;
+    }
+    qemu_progress_init(progress, 1.0);
+    qemu_progress_print(0, 100);
+
     check = g_new0(ImageCheck, 1);
-    ret = collect_image_check(bs, check, filename, fmt, fix);
+    ret = collect_image_check(bs, check, filename, fmt, fix, check_status_cb);
+    qemu_progress_print(100, 0);
+    qemu_progress_end();
 
     if (ret == -ENOTSUP) {
         error_report("This image format does not support checks");
@@ -808,7 +835,7 @@ static int img_check(int argc, char **argv)
                     check->corruptions_fixed);
         }
 
-        ret = collect_image_check(bs, check, filename, fmt, 0);
+        ret = collect_image_check(bs, check, filename, fmt, 0, NULL);
 
         check->leaks_fixed          = leaks_fixed;
         check->corruptions_fixed    = corruptions_fixed;
@@ -1222,44 +1249,211 @@ static int compare_buffers(const uint8_t *buf1, const uint8_t *buf2,
 
 #define IO_BUF_SIZE (2 * MiB)
 
+#define MAX_COROUTINES 16
+
+typedef struct ImgCompareState {
+    BlockBackend *blk[2];
+    const char *filename[2];
+    int64_t total_size[2];
+    /* Both images are compared up to here, the larger one is checked after */
+    int64_t common_size;
+    int64_t end;
+    bool strict;
+    int64_t offset;
+    /* Lowest offset at which the images differ, INT64_MAX if none */
+    int64_t mismatch_offset;
+    bool status_mismatch;
+    long num_coroutines;
+    int running_coroutines;
+    CoMutex lock;
+    /*
+     * Lowest offset at which an error occurred, INT64_MAX if none, with the
+     * exit code and the message for it
+     */
+    int64_t error_offset;
+    int error_ret;
+    char *error_msg;
+} ImgCompareState;
+
+static void compare_set_mismatch(ImgCompareState *s, int64_t offset,
+                                 bool status_mismatch)
+{
+    if (offset < s->mismatch_offset) {
+        s->mismatch_offset = offset;
+        s->status_mismatch = status_mismatch;
+    }
+}
+
 /*
- * Check if passed sectors are empty (not allocated or contain only 0 bytes)
- *
- * Intended for use by 'qemu-img compare': Returns 0 in case sectors are
- * filled with 0, 1 if sectors contain non-zero data (this is a comparison
- * failure), and 4 on error (the exit status for read errors), after emitting
- * an error message.
- *
- * @param blk:  BlockBackend for the image
- * @param offset: Starting offset to check
- * @param bytes: Number of bytes to check
- * @param filename: Name of disk file we are checking (logging purpose)
- * @param buffer: Allocated buffer for storing read data
- * @param quiet: Flag for quiet mode
+ * Record an error at @offset.  Like mismatches, only the one at the lowest
+ * offset is reported, so the message is printed once all coroutines are
+ * done.  Takes ownership of @msg.
  */
-static int check_empty_sectors(BlockBackend *blk, int64_t offset,
-                               int64_t bytes, const char *filename,
-                               uint8_t *buffer, bool quiet)
+static void compare_set_error(ImgCompareState *s, int64_t offset, int ret,
+                              char *msg)
 {
-    int ret = 0;
-    int64_t idx;
+    if (offset < s->error_offset) {
+        g_free(s->error_msg);
+        s->error_offset = offset;
+        s->error_ret = ret;
+        s->error_msg = msg;
+    } else {
+        g_free(msg);
+    }
+}
+
+static int coroutine_fn compare_co_read(ImgCompareState *s, int i,
+                                        int64_t offset, int64_t bytes,
+                                        uint8_t *buf)
+{
+    int ret = blk_co_pread(s->blk[i], offset, bytes, buf, 0);
 
-    ret = blk_pread(blk, offset, buffer, bytes);
     if (ret < 0) {
-        error_report("Error while reading offset %" PRId64 " of %s: %s",
-                     offset, filename, strerror(-ret));
-        return 4;
-    }
-    idx = find_nonzero(buffer, bytes);
-    if (idx >= 0) {
-        qprintf(quiet, "Content mismatch at offset %" PRId64 "!\n",
-                offset + idx);
-        return 1;
+        compare_set_error(s, offset, 4,
+                          g_strdup_printf("Error while reading offset %"
+                                          PRId64 " of %s: %s", offset,
+                                          s->filename[i], strerror(-ret)));
+        return ret;
     }
-
     return 0;
 }
 
+/*
+ * Picks the next range to compare, based on the block status of both
+ * images.  This is serialized by s->lock, so that ranges are handed out in
+ * order; the data is read and compared without the lock.  Sets *read_both
+ * if the range is allocated in both images, or *check_zero to the index of
+ * the image that must read as zeroes in the range.  Returns the length of
+ * the range, or 0 if there is nothing left to do.
+ */
+static int64_t coroutine_fn compare_next_range(ImgCompareState *s,
+                                               int64_t *offset,
+                                               bool *read_both,
+                                               int *check_zero)
+{
+    int64_t pnum1, pnum2, chunk;
+    int status1, status2;
+
+    *offset = s->offset;
+    *read_both = false;
+    *check_zero = -1;
+
+    if (*offset >= MIN(s->end, MIN(s->mismatch_offset, s->error_offset))) {
+        return 0;
+    }
+
+    if (*offset >= s->common_size) {
+        int over = s->total_size[0] > s->total_size[1] ? 0 : 1;
+
+        status1 = bdrv_block_status_above(blk_bs(s->blk[over]), NULL, *offset,
+                                          s->end - *offset, &chunk, NULL,
+                                          NULL);
+        if (status1 < 0) {
+            compare_set_error(s, *offset, 3,
+                              g_strdup_printf("Sector allocation test failed "
+                                              "for %s", s->filename[over]));
+            return 0;
+        }
+        if (status1 & BDRV_BLOCK_ALLOCATED && !(status1 & BDRV_BLOCK_ZERO)) {
+            chunk = MIN(chunk, IO_BUF_SIZE);
+            *check_zero = over;
+        }
+        s->offset += chunk;
+        return chunk;
+    }
+
+    status1 = bdrv_block_status_above(blk_bs(s->blk[0]), NULL, *offset,
+                                      s->total_size[0] - *offset, &pnum1, NULL,
+                                      NULL);
+    if (status1 < 0) {
+        compare_set_error(s, *offset, 3,
+                          g_strdup_printf("Sector allocation test failed "
+                                          "for %s", s->filename[0]));
+        return 0;
+    }
+
+    status2 = bdrv_block_status_above(blk_bs(s->blk[1]), NULL, *offset,
+                                      s->total_size[1] - *offset, &pnum2, NULL,
+                                      NULL);
+    if (status2 < 0) {
+        compare_set_error(s, *offset, 3,
+                          g_strdup_printf("Sector allocation test failed "
+                                          "for %s", s->filename[1]));
+        return 0;
+    }
+
+    assert(pnum1 && pnum2);
+    chunk = MIN(pnum1, pnum2);
+
+    if (s->strict && status1 != status2) {
+        compare_set_mismatch(s, *offset, true);
+        return 0;
+    }
+
+    if ((status1 & BDRV_BLOCK_ZERO) && (status2 & BDRV_BLOCK_ZERO)) {
+        /* nothing to do */
+    } else if ((status1 & BDRV_BLOCK_ALLOCATED) ==
+               (status2 & BDRV_BLOCK_ALLOCATED)) {
+        if (status1 & BDRV_BLOCK_ALLOCATED) {
+            chunk = MIN(chunk, IO_BUF_SIZE);
+            *read_both = true;
+        }
+    } else {
+        chunk = MIN(chunk, IO_BUF_SIZE);
+        *check_zero = status1 & BDRV_BLOCK_ALLOCATED ? 0 : 1;
+    }
+
+    s->offset += chunk;
+    return chunk;
+}
+
+static void coroutine_fn compare_co_do_compare(void *opaque)
+{
+    ImgCompareState *s = opaque;
+    uint8_t *buf1 = blk_blockalign(s->blk[0], IO_BUF_SIZE);
+    uint8_t *buf2 = blk_blockalign(s->blk[1], IO_BUF_SIZE);
+
+    s->running_coroutines++;
+
+    for (;;) {
+        int64_t offset, chunk, pnum, idx;
+        bool read_both;
+        int check_zero;
+
+        qemu_co_mutex_lock(&s->lock);
+        chunk = compare_next_range(s, &offset, &read_both, &check_zero);
+        qemu_co_mutex_unlock(&s->lock);
+        if (!chunk) {
+            break;
+        }
+
+        if (read_both) {
+            if (compare_co_read(s, 0, offset, chunk, buf1) < 0 ||
+                compare_co_read(s, 1, offset, chunk, buf2) < 0) {
+                break;
+            }
+            if (compare_buffers(buf1, buf2, chunk, &pnum)) {
+                compare_set_mismatch(s, offset, false);
+            } else if (pnum != chunk) {
+                compare_set_mismatch(s, offset + pnum, false);
+            }
+        } else if (check_zero >= 0) {
+            if (compare_co_read(s, check_zero, offset, chunk, buf1) < 0) {
+                break;
+            }
+            idx = find_nonzero(buf1, chunk);
+            if (idx >= 0) {
+                compare_set_mismatch(s, offset + idx, false);
+            }
+        }
+        qemu_progress_print(((float) chunk / s->end) * 100, 100);
+    }
+
+    qemu_vfree(buf1);
+    qemu_vfree(buf2);
+    s->running_coroutines--;
+}
+
 /*
  * Compares two images. Exit codes:
  *
@@ -1271,22 +1465,16 @@ static int img_compare(int argc, char **argv)
 {
     const char *fmt1 = NULL, *fmt2 = NULL, *cache, *filename1, *filename2;
     BlockBackend *blk1, *blk2;
-    BlockDriverState *bs1, *bs2;
     int64_t total_size1, total_size2;
-    uint8_t *buf1 = NULL, *buf2 = NULL;
-    int64_t pnum1, pnum2;
-    int allocated1, allocated2;
     int ret = 0; /* return value - 0 Ident, 1 Different, >1 Error */
     bool progress = false, quiet = false, strict = false;
     int flags;
     bool writethrough;
-    int64_t total_size;
-    int64_t offset = 0;
-    int64_t chunk;
-    int c;
-    uint64_t progress_base;
+    int c, i;
     bool image_opts = false;
     bool force_share = false;
+    long num_coroutines = 8;
+    ImgCompareState s;
 
     cache = BDRV_DEFAULT_CACHE;
     for (;;) {
@@ -1297,7 +1485,7 @@ static int img_compare(int argc, char **argv)
             {"force-share", no_argument, 0, 'U'},
             {0, 0, 0, 0}
         };
-        c = getopt_long(argc, argv, ":hf:F:T:pqsU",
+        c = getopt_long(argc, argv, ":hf:F:T:pqsUm:",
                         long_options, NULL);
         if (c == -1) {
             break;
@@ -1333,6 +1521,15 @@ static int img_compare(int argc, char **argv)
         case 'U':
             force_share = true;
             break;
+        case 'm':
+            if (qemu_strtol(optarg, NULL, 0, &num_coroutines) ||
+                num_coroutines < 1 || num_coroutines > MAX_COROUTINES) {
+                error_report("Invalid number of coroutines. Allowed number of"
+                             " coroutines is between 1 and %d", MAX_COROUTINES);
+                ret = 2;
+                goto out4;
+            }
+            break;
         case OPTION_OBJECT: {
             QemuOpts *opts;
             opts = qemu_opts_parse_noisily(&qemu_object_opts,
@@ -1391,11 +1588,6 @@ static int img_compare(int argc, char **argv)
         ret = 2;
         goto out2;
     }
-    bs1 = blk_bs(blk1);
-    bs2 = blk_bs(blk2);
-
-    buf1 = blk_blockalign(blk1, IO_BUF_SIZE);
-    buf2 = blk_blockalign(blk2, IO_BUF_SIZE);
     total_size1 = blk_getlength(blk1);
     if (total_size1 < 0) {
         error_report("Can't get size of %s: %s",
@@ -1410,8 +1602,6 @@ static int img_compare(int argc, char **argv)
         ret = 4;
         goto out;
     }
-    total_size = MIN(total_size1, total_size2);
-    progress_base = MAX(total_size1, total_size2);
 
     qemu_progress_print(0, 100);
 
@@ -1421,131 +1611,60 @@ static int img_compare(int argc, char **argv)
         goto out;
     }
 
-    while (offset < total_size) {
-        int status1, status2;
-
-        status1 = bdrv_block_status_above(bs1, NULL, offset,
-                                          total_size1 - offset, &pnum1, NULL,
-                                          NULL);
-        if (status1 < 0) {
-            ret = 3;
-            error_report("Sector allocation test failed for %s", filename1);
-            goto out;
-        }
-        allocated1 = status1 & BDRV_BLOCK_ALLOCATED;
-
-        status2 = bdrv_block_status_above(bs2, NULL, offset,
-                                          total_size2 - offset, &pnum2, NULL,
-                                          NULL);
-        if (status2 < 0) {
-            ret = 3;
-            error_report("Sector allocation test failed for %s", filename2);
-            goto out;
-        }
-        allocated2 = status2 & BDRV_BLOCK_ALLOCATED;
-
-        assert(pnum1 && pnum2);
-        chunk = MIN(pnum1, pnum2);
-
-        if (strict) {
-            if (status1 != status2) {
-                ret = 1;
-                qprintf(quiet, "Strict mode: Offset %" PRId64
-                        " block status mismatch!\n", offset);
-                goto out;
-            }
-        }
-        if ((status1 & BDRV_BLOCK_ZERO) && (status2 & BDRV_BLOCK_ZERO)) {
-            /* nothing to do */
-        } else if (allocated1 == allocated2) {
-            if (allocated1) {
-                int64_t pnum;
-
-                chunk = MIN(chunk, IO_BUF_SIZE);
-                ret = blk_pread(blk1, offset, buf1, chunk);
-                if (ret < 0) {
-                    error_report("Error while reading offset %" PRId64
-                                 " of %s: %s",
-                                 offset, filename1, strerror(-ret));
-                    ret = 4;
-                    goto out;
-                }
-                ret = blk_pread(blk2, offset, buf2, chunk);
-                if (ret < 0) {
-                    error_report("Error while reading offset %" PRId64
-                                 " of %s: %s",
-                                 offset, filename2, strerror(-ret));
-                    ret = 4;
-                    goto out;
-                }
-                ret = compare_buffers(buf1, buf2, chunk, &pnum);
-                if (ret || pnum != chunk) {
-                    qprintf(quiet, "Content mismatch at offset %" PRId64 "!\n",
-                            offset + (ret ? 0 : pnum));
-                    ret = 1;
-                    goto out;
-                }
-            }
-        } else {
-            chunk = MIN(chunk, IO_BUF_SIZE);
-            if (allocated1) {
-                ret = check_empty_sectors(blk1, offset, chunk,
-                                          filename1, buf1, quiet);
-            } else {
-                ret = check_empty_sectors(blk2, offset, chunk,
-                                          filename2, buf1, quiet);
-            }
-            if (ret) {
-                goto out;
-            }
-        }
-        offset += chunk;
-        qemu_progress_print(((float) chunk / progress_base) * 100, 100);
+    /*
+     * Ranges are handed out to the coroutines in order.  A difference or an
+     * error found by one of them stops the others from starting on ranges
+     * after it, and whichever is at the lowest offset is reported, as if the
+     * images were compared sequentially.
+     */
+    s = (ImgCompareState) {
+        .blk                = { blk1, blk2 },
+        .filename           = { filename1, filename2 },
+        .total_size         = { total_size1, total_size2 },
+        .common_size        = MIN(total_size1, total_size2),
+        .end                = MAX(total_size1, total_size2),
+        .strict             = strict,
+        .mismatch_offset    = INT64_MAX,
+        .num_coroutines     = num_coroutines,
+        .error_offset       = INT64_MAX,
+    };
+    qemu_co_mutex_init(&s.lock);
+    for (i = 0; i < s.num_coroutines; i++) {
+        Coroutine *co = qemu_coroutine_create(compare_co_do_compare, &s);
+        qemu_coroutine_enter(co);
+    }
+    while (s.running_coroutines) {
+        main_loop_wait(false);
     }
 
-    if (total_size1 != total_size2) {
-        BlockBackend *blk_over;
-        const char *filename_over;
+    if (s.error_msg && s.error_offset <= s.mismatch_offset) {
+        error_report("%s", s.error_msg);
+        ret = s.error_ret;
+    }
+    g_free(s.error_msg);
+    if (ret) {
+        goto out;
+    }
 
+    if (total_size1 != total_size2 && s.mismatch_offset >= s.common_size) {
         qprintf(quiet, "Warning: Image size mismatch!\n");
-        if (total_size1 > total_size2) {
-            blk_over = blk1;
-            filename_over = filename1;
+    }
+    if (s.mismatch_offset != INT64_MAX) {
+        if (s.status_mismatch) {
+            qprintf(quiet, "Strict mode: Offset %" PRId64
+                    " block status mismatch!\n", s.mismatch_offset);
         } else {
-            blk_over = blk2;
-            filename_over = filename2;
-        }
-
-        while (offset < progress_base) {
-            ret = bdrv_block_status_above(blk_bs(blk_over), NULL, offset,
-                                          progress_base - offset, &chunk,
-                                          NULL, NULL);
-            if (ret < 0) {
-                ret = 3;
-                error_report("Sector allocation test failed for %s",
-                             filename_over);
-                goto out;
-
-            }
-            if (ret & BDRV_BLOCK_ALLOCATED && !(ret & BDRV_BLOCK_ZERO)) {
-                chunk = MIN(chunk, IO_BUF_SIZE);
-                ret = check_empty_sectors(blk_over, offset, chunk,
-                                          filename_over, buf1, quiet);
-                if (ret) {
-                    goto out;
-                }
-            }
-            offset += chunk;
-            qemu_progress_print(((float) chunk / progress_base) * 100, 100);
+            qprintf(quiet, "Content mismatch at offset %" PRId64 "!\n",
+                    s.mismatch_offset);
         }
+        ret = 1;
+        goto out;
     }
 
     qprintf(quiet, "Images are identical.\n");
     ret = 0;
 
 out:
-    qemu_vfree(buf1);
-    qemu_vfree(buf2);
     blk_unref(blk2);
 out2:
     blk_unref(blk1);
@@ -1561,8 +1680,6 @@ enum ImgConvertBlockStatus {
     BLK_BACKING_FILE,
 };
 
-#define MAX_COROUTINES 16
-
 typedef struct ImgConvertState {
     BlockBackend **src;
     int64_t *src_sectors;
@@ -1851,6 +1968,33 @@ static int coroutine_fn convert_co_copy_range(ImgConvertState *s, int64_t sector
     return 0;
 }
 
+/*
+ * Let the coroutine waiting to write at @wr_offs go ahead.  With @schedule
+ * it only runs once the caller has yielded.
+ */
+static void convert_pass_write_turn(ImgConvertState *s, int64_t wr_offs,
+                                    bool schedule)
+{
+    int i;
+
+    s->wr_offs = wr_offs;
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i] && s->wait_sector_num[i] == s->wr_offs) {
+            if (schedule) {
+                aio_co_schedule(qemu_get_aio_context(), s->co[i]);
+            } else {
+                /*
+                 * A -> B -> A cannot occur because A has
+                 * s->wait_sector_num[i] == -1 during A -> B.  Therefore
+                 * B will never enter A during this time window.
+                 */
+                qemu_coroutine_enter(s->co[i]);
+            }
+            break;
+        }
+    }
+}
+
 static void coroutine_fn convert_co_do_copy(void *opaque)
 {
     ImgConvertState *s = opaque;
@@ -1874,6 +2018,7 @@ static void coroutine_fn convert_co_do_copy(void *opaque)
         int64_t sector_num;
         enum ImgConvertBlockStatus status;
         bool copy_range;
+        bool early_turn;
 
         qemu_co_mutex_lock(&s->lock);
         if (s->ret != -EINPROGRESS || s->sector_num >= s->total_sectors) {
@@ -1926,6 +2071,17 @@ retry:
             s->wait_sector_num[index] = -1;
         }
 
+        /*
+         * The format drivers place compressed clusters in the order in which
+         * the writes were issued (qcow2 before it compresses them), not in
+         * the order they complete.  So the next cluster may be issued as soon
+         * as this write has yielded, and both are compressed in parallel.
+         */
+        early_turn = s->wr_in_order && s->compressed && !copy_range;
+        if (early_turn) {
+            convert_pass_write_turn(s, sector_num + n, true);
+        }
+
         if (s->ret == -EINPROGRESS) {
             if (copy_range) {
                 ret = convert_co_copy_range(s, sector_num, n);
@@ -1943,21 +2099,10 @@ retry:
             }
         }
 
-        if (s->wr_in_order) {
+        if (s->wr_in_order && !early_turn) {
             /* reenter the coroutine that might have waited
              * for this write to complete */
-            s->wr_offs = sector_num + n;
-            for (i = 0; i < s->num_coroutines; i++) {
-                if (s->co[i] && s->wait_sector_num[i] == s->wr_offs) {
-                    /*
-                     * A -> B -> A cannot occur because A has
-                     * s->wait_sector_num[i] == -1 during A -> B.  Therefore
-                     * B will never enter A during this time window.
-                     */
-                    qemu_coroutine_enter(s->co[i]);
-                    break;
-                }
-            }
+            convert_pass_write_turn(s, sector_num + n, false);
         }
     }
 
@@ -2060,6 +2205,7 @@ static int img_convert(int argc, char **argv)
     int64_t ret = -EINVAL;
     bool force_share = false;
     bool explict_min_sparse = false;
+    long compress_threads = 0;
 
     ImgConvertState s = (ImgConvertState) {
         /* Need at least 4k of zeros for sparse detection */
@@ -2078,6 +2224,8 @@ static int img_convert(int argc, char **argv)
             {"force-share", no_argument, 0, 'U'},
             {"target-image-opts", no_argument, 0, OPTION_TARGET_IMAGE_OPTS},
             {"salvage", no_argument, 0, OPTION_SALVAGE},
+            {"compress-threads", required_argument, 0,
+             OPTION_COMPRESS_THREADS},
             {0, 0, 0, 0}
         };
         c = getopt_long(argc, argv, ":hf:O:B:Cco:l:S:pt:T:qnm:WU",
@@ -2183,6 +2331,13 @@ static int img_convert(int argc, char **argv)
         case 'U':
             force_share = true;
             break;
+        case OPTION_COMPRESS_THREADS:
+            if (qemu_strtol(optarg, NULL, 0, &compress_threads) ||
+                compress_threads < 1 || compress_threads > INT_MAX) {
+                error_report("Invalid number of compression threads");
+                goto fail_getopt;
+            }
+            break;
         case OPTION_OBJECT: {
             QemuOpts *object_opts;
             object_opts = qemu_opts_parse_noisily(&qemu_object_opts,
@@ -2229,6 +2384,18 @@ static int img_convert(int argc, char **argv)
         goto fail_getopt;
     }
 
+    if (compress_threads && !s.compressed) {
+        error_report("--compress-threads requires -c");
+        goto fail_getopt;
+    }
+
+    if (compress_threads && tgt_image_opts) {
+        error_report("--compress-threads and --target-image-opts are "
+                     "mutually exclusive; set compress-threads in the "
+                     "target image options instead");
+        goto fail_getopt;
+    }
+
     if (tgt_image_opts && !skip_create) {
         error_report("--target-image-opts requires use of -n flag");
         goto fail_getopt;
@@ -2440,7 +2607,15 @@ static int img_convert(int argc, char **argv)
         goto out;
     }
 
-    if (skip_create) {
+    if (compress_threads) {
+        /* A runtime option of the target format driver (qcow2) */
+        if (!open_opts) {
+            open_opts = qdict_new();
+        }
+        qdict_put_int(open_opts, "compress-threads", compress_threads);
+    }
+
+    if (skip_create && tgt_image_opts) {
         s.target = img_open(tgt_image_opts, out_filename, out_fmt,
                             flags, writethrough, s.quiet, false);
     } else {
@@ -4086,6 +4261,7 @@ typedef struct BenchData {
     int n;
     int flush_interval;
     bool drain_on_flush;
+    bool random;
     uint8_t *buf;
     QEMUIOVector *qiov;
 
@@ -4153,6 +4329,11 @@ static void bench_cb(void *opaque, int ret)
          * and b->offset is ready for the next submission.
          */
         b->in_flight++;
+        if (b->random) {
+            /* Any offset aligned to the request size within the image */
+            offset = g_random_double() * (b->image_size / b->bufsize);
+            offset *= b->bufsize;
+        }
         b->offset += b->step;
         b->offset %= b->image_size;
         if (b->write) {
@@ -4182,6 +4363,7 @@ static int img_bench(int argc, char **argv)
     size_t step = 0;
     int flush_interval = 0;
     bool drain_on_flush = true;
+    bool random = false;
     int64_t image_size;
     BlockBackend *blk = NULL;
     BenchData data = {};
@@ -4199,10 +4381,12 @@ static int img_bench(int argc, char **argv)
             {"image-opts", no_argument, 0, OPTION_IMAGE_OPTS},
             {"pattern", required_argument, 0, OPTION_PATTERN},
             {"no-drain", no_argument, 0, OPTION_NO_DRAIN},
+            {"random", no_argument, 0, OPTION_RANDOM},
             {"force-share", no_argument, 0, 'U'},
             {0, 0, 0, 0}
         };
-        c = getopt_long(argc, argv, ":hc:d:f:no:qs:S:t:wU", long_options, NULL);
+        c = getopt_long(argc, argv, ":hc:d:f:ni:o:qs:S:t:wU", long_options,
+                        NULL);
         if (c == -1) {
             break;
         }
@@ -4245,6 +4429,14 @@ static int img_bench(int argc, char **argv)
         case 'n':
             flags |= BDRV_O_NATIVE_AIO;
             break;
+        case 'i':
+            ret = bdrv_parse_aio(optarg, &flags);
+            if (ret < 0) {
+                error_report("Invalid aio option: %s", optarg);
+                ret = -1;
+                goto out;
+            }
+            break;
         case 'o':
         {
             offset = cvtnum(optarg);
@@ -4324,6 +4516,9 @@ static int img_bench(int argc, char **argv)
         case OPTION_NO_DRAIN:
             drain_on_flush = false;
             break;
+        case OPTION_RANDOM:
+            random = true;
+            break;
         case OPTION_IMAGE_OPTS:
             image_opts = true;
             break;
@@ -4345,6 +4540,11 @@ static int img_bench(int argc, char **argv)
         ret = -1;
         goto out;
     }
+    if (random && (offset || step)) {
+        error_report("--random can't be used with an offset or a step size");
+        ret = -1;
+        goto out;
+    }
 
     blk = img_open(image_opts, filename, fmt, flags, writethrough, quiet,
                    force_share);
@@ -4370,11 +4570,18 @@ static int img_bench(int argc, char **argv)
         .write          = is_write,
         .flush_interval = flush_interval,
         .drain_on_flush = drain_on_flush,
+        .random         = random,
     };
-    printf("Sending %d %s requests, %d bytes each, %d in parallel "
-           "(starting at offset %" PRId64 ", step size %d)\n",
-           data.n, data.write ? "write" : "read", data.bufsize, data.nrreq,
-           data.offset, data.step);
+    if (random) {
+        printf("Sending %d %s requests, %d bytes each, %d in parallel "
+               "(at random offsets)\n",
+               data.n, data.write ? "write" : "read", data.bufsize, data.nrreq);
+    } else {
+        printf("Sending %d %s requests, %d bytes each, %d in parallel "
+               "(starting at offset %" PRId64 ", step size %d)\n",
+               data.n, data.write ? "write" : "read", data.bufsize,
+               data.nrreq, data.offset, data.step);
+    }
     if (flush_interval) {
         printf("Sending flush every %d requests\n", flush_interval);
     }
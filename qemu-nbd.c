@@ -135,7 +135,7 @@ static void usage(const char *name)
 "                            '[ID_OR_NAME]'\n"
 "  -n, --nocache             disable host cache\n"
 "      --cache=MODE          set cache mode (none, writeback, ...)\n"
-"      --aio=MODE            set AIO mode (native or threads)\n"
+"      --aio=MODE            set AIO mode (native, io_uring or threads)\n"
 "      --discard=MODE        set discard mode (ignore, unmap)\n"
 "      --detect-zeroes=MODE  set detect-zeroes mode (off, on, unmap)\n"
 "      --image-opts          treat FILE as a full set of image options\n"
@@ -718,13 +718,9 @@ int main(int argc, char **argv)
                 exit(EXIT_FAILURE);
             }
             seen_aio = true;
-            if (!strcmp(optarg, "native")) {
-                flags |= BDRV_O_NATIVE_AIO;
-            } else if (!strcmp(optarg, "threads")) {
-                /* this is the default */
-            } else {
-               error_report("invalid aio mode `%s'", optarg);
-               exit(EXIT_FAILURE);
+            if (bdrv_parse_aio(optarg, &flags) < 0) {
+                error_report("invalid aio mode `%s'", optarg);
+                exit(EXIT_FAILURE);
             }
             break;
         case QEMU_NBD_OPT_DISCARD:
@@ -1172,6 +1168,16 @@ int main(int argc, char **argv)
         fd_size = limit;
     }
 
+    /*
+     * All clients go through the same BlockBackend, so a flush from one of
+     * them covers the writes completed by the others.  Only say so if more
+     * than one client can connect at a time, or clients that open extra
+     * connections would wait for them forever.
+     */
+    if (shared > 1) {
+        nbdflags |= NBD_FLAG_CAN_MULTI_CONN;
+    }
+
     export = nbd_export_new(bs, dev_offset, fd_size, export_name,
                             export_description, bitmap, nbdflags,
                             nbd_export_closed, writethrough, NULL,
@@ -0,0 +1,159 @@
+/*
+ * Image conversion speed benchmark
+ *
+ * Writes a whole image sequentially with several requests in flight, the
+ * way qemu-img convert does, and then reads it back.  This mostly measures
+ * how well a format driver handles metadata updates and concurrent
+ * requests; qcow2 is included as a reference for vmdk and vhdx.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "block/block.h"
+#include "sysemu/block-backend.h"
+#include "qapi/error.h"
+#include "qapi/qmp/qdict.h"
+#include "qemu/main-loop.h"
+#include "qemu/units.h"
+
+#define IMG_SIZE (1 * GiB)
+#define REQ_SIZE (2 * MiB)
+/* The default number of coroutines of qemu-img convert */
+#define IN_FLIGHT 8
+
+typedef struct ConvertState {
+    BlockBackend *blk;
+    bool write;
+    int64_t offset;
+    int in_flight;
+    int ret;
+} ConvertState;
+
+typedef struct ConvertRequest {
+    ConvertState *s;
+    QEMUIOVector qiov;
+    uint8_t *buf;
+} ConvertRequest;
+
+static void convert_submit(ConvertRequest *req);
+
+static void convert_cb(void *opaque, int ret)
+{
+    ConvertRequest *req = opaque;
+    ConvertState *s = req->s;
+
+    s->in_flight--;
+    if (ret < 0) {
+        s->ret = ret;
+        return;
+    }
+    convert_submit(req);
+}
+
+static void convert_submit(ConvertRequest *req)
+{
+    ConvertState *s = req->s;
+
+    if (s->offset >= IMG_SIZE || s->ret < 0) {
+        return;
+    }
+
+    s->in_flight++;
+    if (s->write) {
+        blk_aio_pwritev(s->blk, s->offset, &req->qiov, 0, convert_cb, req);
+    } else {
+        blk_aio_preadv(s->blk, s->offset, &req->qiov, 0, convert_cb, req);
+    }
+    s->offset += REQ_SIZE;
+}
+
+static void convert_run(BlockBackend *blk, ConvertRequest *reqs, bool write)
+{
+    ConvertState s = {
+        .blk = blk,
+        .write = write,
+    };
+    int i;
+
+    for (i = 0; i < IN_FLIGHT; i++) {
+        reqs[i].s = &s;
+        convert_submit(&reqs[i]);
+    }
+    while (s.in_flight) {
+        aio_poll(qemu_get_aio_context(), true);
+    }
+    g_assert_cmpint(s.ret, ==, 0);
+
+    /* Include writing back cached metadata */
+    if (write) {
+        g_assert_cmpint(blk_flush(blk), ==, 0);
+    }
+}
+
+static void test_convert_speed(const void *opaque)
+{
+    const char *fmt = opaque;
+    ConvertRequest reqs[IN_FLIGHT];
+    BlockBackend *blk;
+    QDict *options;
+    char *filename;
+    double total;
+    int fd, i;
+
+    fd = g_file_open_tmp("qemu-benchmark-convert-XXXXXX", &filename, NULL);
+    g_assert(fd >= 0);
+    close(fd);
+
+    bdrv_img_create(filename, fmt, NULL, NULL, NULL, IMG_SIZE, 0, true,
+                    &error_abort);
+    options = qdict_new();
+    qdict_put_str(options, "driver", fmt);
+    blk = blk_new_open(filename, NULL, options, BDRV_O_RDWR, &error_abort);
+
+    for (i = 0; i < IN_FLIGHT; i++) {
+        reqs[i].buf = qemu_blockalign(blk_bs(blk), REQ_SIZE);
+        memset(reqs[i].buf, 0xa5 + i, REQ_SIZE);
+        qemu_iovec_init_buf(&reqs[i].qiov, reqs[i].buf, REQ_SIZE);
+    }
+
+    total = (double)IMG_SIZE / MiB;
+
+    g_test_timer_start();
+    convert_run(blk, reqs, true);
+    g_test_timer_elapsed();
+    g_print("%s: write done: %.2f MB in %.2f secs: %.2f MB/sec\n", fmt,
+            total, g_test_timer_last(), total / g_test_timer_last());
+
+    g_test_timer_start();
+    convert_run(blk, reqs, false);
+    g_test_timer_elapsed();
+    g_print("%s: read done: %.2f MB in %.2f secs: %.2f MB/sec\n", fmt,
+            total, g_test_timer_last(), total / g_test_timer_last());
+
+    for (i = 0; i < IN_FLIGHT; i++) {
+        qemu_vfree(reqs[i].buf);
+    }
+    blk_unref(blk);
+    unlink(filename);
+    g_free(filename);
+}
+
+int main(int argc, char **argv)
+{
+    static const char *const formats[] = { "qcow2", "vmdk", "vhdx" };
+    char name[64];
+    int i;
+
+    bdrv_init();
+    qemu_init_main_loop(&error_abort);
+    g_test_init(&argc, &argv, NULL);
+
+    for (i = 0; i < ARRAY_SIZE(formats); i++) {
+        snprintf(name, sizeof(name), "/block/convert/speed-%s", formats[i]);
+        g_test_add_data_func(name, formats[i], test_convert_speed);
+    }
+
+    return g_test_run();
+}
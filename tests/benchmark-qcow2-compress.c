@@ -0,0 +1,137 @@
+/*
+ * qcow2 cluster compression speed benchmark
+ *
+ * Compares the compression ratio and the compression/decompression
+ * throughput of the qcow2 compression types on 64k clusters.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "block/qcow2.h"
+
+#define CLUSTER_SIZE (64 * KiB)
+#define NB_CLUSTERS 64
+
+/*
+ * Semi-compressible data: runs of text interleaved with random bytes,
+ * so that the ratio is in the range of a typical guest filesystem.
+ */
+static void fill_cluster(uint8_t *buf)
+{
+    static const char text[] =
+        "The quick brown fox jumps over the lazy dog. 0123456789 ";
+    size_t i = 0;
+
+    while (i < CLUSTER_SIZE) {
+        size_t len = MIN(g_test_rand_int_range(16, 256), CLUSTER_SIZE - i);
+        size_t j;
+
+        if (g_test_rand_int_range(0, 3)) {
+            for (j = 0; j < len; j++) {
+                buf[i + j] = text[(i + j) % (sizeof(text) - 1)];
+            }
+        } else {
+            for (j = 0; j < len; j++) {
+                buf[i + j] = g_test_rand_int();
+            }
+        }
+        i += len;
+    }
+}
+
+static void test_compress_speed(const void *opaque)
+{
+    Qcow2CompressionType type = (uintptr_t)opaque;
+    uint8_t *in, *out, *check;
+    size_t out_len[NB_CLUSTERS];
+    size_t in_total = 0, out_total = 0;
+    double total;
+    int i;
+
+    in = g_malloc(NB_CLUSTERS * CLUSTER_SIZE);
+    out = g_malloc(NB_CLUSTERS * CLUSTER_SIZE);
+    check = g_malloc(CLUSTER_SIZE);
+    for (i = 0; i < NB_CLUSTERS; i++) {
+        fill_cluster(in + i * CLUSTER_SIZE);
+    }
+
+    total = 0.0;
+    g_test_timer_start();
+    do {
+        for (i = 0; i < NB_CLUSTERS; i++) {
+            ssize_t ret = qcow2_compress(type, out + i * CLUSTER_SIZE,
+                                         CLUSTER_SIZE - 1,
+                                         in + i * CLUSTER_SIZE, CLUSTER_SIZE);
+            g_assert(ret > 0 || ret == -ENOMEM);
+            out_len[i] = ret > 0 ? ret : 0;
+        }
+        total += NB_CLUSTERS * CLUSTER_SIZE;
+    } while (g_test_timer_elapsed() < 5.0);
+
+    total /= MiB;
+    g_print("%s: ", Qcow2CompressionType_str(type));
+    g_print("compress done: %.2f MB in %.2f secs: ",
+            total, g_test_timer_last());
+    g_print("%.2f MB/sec\n", total / g_test_timer_last());
+
+    for (i = 0; i < NB_CLUSTERS; i++) {
+        in_total += CLUSTER_SIZE;
+        out_total += out_len[i] ?: CLUSTER_SIZE;
+    }
+    g_print("%s: ratio %.3f (%zu -> %zu bytes)\n",
+            Qcow2CompressionType_str(type),
+            (double)in_total / out_total, in_total, out_total);
+
+    /* Verify every cluster once, outside of the timed loop */
+    for (i = 0; i < NB_CLUSTERS; i++) {
+        if (!out_len[i]) {
+            continue;
+        }
+        g_assert(qcow2_decompress(type, check, CLUSTER_SIZE,
+                                  out + i * CLUSTER_SIZE, out_len[i]) >= 0);
+        g_assert(!memcmp(check, in + i * CLUSTER_SIZE, CLUSTER_SIZE));
+    }
+
+    total = 0.0;
+    g_test_timer_start();
+    do {
+        for (i = 0; i < NB_CLUSTERS; i++) {
+            if (!out_len[i]) {
+                continue;
+            }
+            g_assert(qcow2_decompress(type, check, CLUSTER_SIZE,
+                                      out + i * CLUSTER_SIZE,
+                                      out_len[i]) >= 0);
+            total += CLUSTER_SIZE;
+        }
+    } while (g_test_timer_elapsed() < 5.0);
+
+    total /= MiB;
+    g_print("%s: ", Qcow2CompressionType_str(type));
+    g_print("decompress done: %.2f MB in %.2f secs: ",
+            total, g_test_timer_last());
+    g_print("%.2f MB/sec\n", total / g_test_timer_last());
+
+    g_free(check);
+    g_free(out);
+    g_free(in);
+}
+
+int main(int argc, char **argv)
+{
+    int i;
+    char name[64];
+
+    g_test_init(&argc, &argv, NULL);
+
+    for (i = 0; i < QCOW2_COMPRESSION_TYPE__MAX; i++) {
+        snprintf(name, sizeof(name), "/qcow2/compress/speed-%s",
+                 Qcow2CompressionType_str(i));
+        g_test_add_data_func(name, (void *)(uintptr_t)i, test_compress_speed);
+    }
+
+    return g_test_run();
+}
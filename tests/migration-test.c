@@ -1041,6 +1041,47 @@ static void test_precopy_tcp(void)
     g_free(uri);
 }
 
+static void test_precopy_file_mapped_ram(void)
+{
+    char *uri = g_strdup_printf("file:%s/migfile", tmpfs);
+    QTestState *from, *to;
+    QDict *rsp;
+
+    if (test_migrate_start(&from, &to, "defer", false, false)) {
+        return;
+    }
+
+    migrate_set_capability(from, "mapped-ram", true);
+    migrate_set_capability(to, "mapped-ram", true);
+    migrate_set_parameter_int(from, "multifd-channels", 4);
+    migrate_set_parameter_int(to, "multifd-channels", 4);
+    /* 1GB/s */
+    migrate_set_parameter_int(from, "max-bandwidth", 1000000000);
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    /* The file has to be complete before the destination reads it */
+    migrate(from, uri, "{}");
+
+    if (!got_stop) {
+        qtest_qmp_eventwait(from, "STOP");
+    }
+    wait_for_migration_complete(from);
+
+    rsp = wait_command(to, "{ 'execute': 'migrate-incoming',"
+                           "  'arguments': { 'uri': %s }}", uri);
+    qobject_unref(rsp);
+
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+
+    test_migrate_end(from, to, true);
+    cleanup("migfile");
+    g_free(uri);
+}
+
 static void test_migrate_fd_proto(void)
 {
     QTestState *from, *to;
@@ -1180,6 +1221,8 @@ int main(int argc, char **argv)
     /* qtest_add_func("/migration/ignore_shared", test_ignore_shared); */
     qtest_add_func("/migration/xbzrle/unix", test_xbzrle_unix);
     qtest_add_func("/migration/fd_proto", test_migrate_fd_proto);
+    qtest_add_func("/migration/precopy/file/mapped-ram",
+                   test_precopy_file_mapped_ram);
 
     ret = g_test_run();
 
@@ -27,6 +27,8 @@
 #include "crypto/init.h"
 #include "crypto/xts.h"
 #include "crypto/aes.h"
+#include "crypto/cipher.h"
+#include "qapi/error.h"
 
 typedef struct {
     const char *path;
@@ -498,6 +500,78 @@ static void test_xts_unaligned(const void *opaque)
 }
 
 
+/*
+ * The cipher API may use the host AES instructions instead of
+ * xts_encrypt(), so check that it gives the same output, including
+ * when a buffer is processed in several calls.  The lengths cover
+ * both the multi-block loop and the single-block tail.
+ */
+static void test_xts_cipher(const void *opaque)
+{
+    const QCryptoXTSTestData *data = opaque;
+    uint8_t key[64], in[512], out[512], ref[512], Torg[16], T[16];
+    QCryptoCipherAlgorithm alg;
+    QCryptoCipher *cipher;
+    struct TestAES aesdata;
+    struct TestAES aestweak;
+    size_t len, i;
+
+    alg = data->keylen == 32 ? QCRYPTO_CIPHER_ALG_AES_128 :
+                               QCRYPTO_CIPHER_ALG_AES_256;
+    if (!qcrypto_cipher_supports(alg, QCRYPTO_CIPHER_MODE_XTS)) {
+        return;
+    }
+
+    memcpy(key, data->key1, data->keylen / 2);
+    memcpy(key + data->keylen / 2, data->key2, data->keylen / 2);
+    cipher = qcrypto_cipher_new(alg, QCRYPTO_CIPHER_MODE_XTS,
+                                key, data->keylen, &error_abort);
+
+    AES_set_encrypt_key(data->key1, data->keylen / 2 * 8, &aesdata.enc);
+    AES_set_decrypt_key(data->key1, data->keylen / 2 * 8, &aesdata.dec);
+    AES_set_encrypt_key(data->key2, data->keylen / 2 * 8, &aestweak.enc);
+    AES_set_decrypt_key(data->key2, data->keylen / 2 * 8, &aestweak.dec);
+
+    STORE64L(data->seqnum, Torg);
+    memset(Torg + 8, 0, 8);
+
+    g_assert(qcrypto_cipher_setiv(cipher, Torg, 16, &error_abort) == 0);
+    g_assert(qcrypto_cipher_encrypt(cipher, data->PTX, out, data->PTLEN,
+                                    &error_abort) == 0);
+    g_assert(memcmp(out, data->CTX, data->PTLEN) == 0);
+
+    g_assert(qcrypto_cipher_setiv(cipher, Torg, 16, &error_abort) == 0);
+    g_assert(qcrypto_cipher_decrypt(cipher, data->CTX, out, data->PTLEN,
+                                    &error_abort) == 0);
+    g_assert(memcmp(out, data->PTX, data->PTLEN) == 0);
+
+    for (i = 0; i < sizeof(in); i++) {
+        in[i] = data->PTX[i % data->PTLEN] ^ i;
+    }
+    for (len = 16; len <= sizeof(in) / 2; len += 16) {
+        memcpy(T, Torg, sizeof(T));
+        xts_encrypt(&aesdata, &aestweak,
+                    test_xts_aes_encrypt,
+                    test_xts_aes_decrypt,
+                    T, 2 * len, ref, in);
+
+        g_assert(qcrypto_cipher_setiv(cipher, Torg, 16, &error_abort) == 0);
+        g_assert(qcrypto_cipher_encrypt(cipher, in, out, len,
+                                        &error_abort) == 0);
+        g_assert(qcrypto_cipher_encrypt(cipher, in + len, out + len, len,
+                                        &error_abort) == 0);
+        g_assert(memcmp(out, ref, 2 * len) == 0);
+
+        g_assert(qcrypto_cipher_setiv(cipher, Torg, 16, &error_abort) == 0);
+        g_assert(qcrypto_cipher_decrypt(cipher, ref, out, 2 * len,
+                                        &error_abort) == 0);
+        g_assert(memcmp(out, in, 2 * len) == 0);
+    }
+
+    qcrypto_cipher_free(cipher);
+}
+
+
 int main(int argc, char **argv)
 {
     size_t i;
@@ -523,6 +597,13 @@ int main(int argc, char **argv)
         path = g_strdup_printf("%s/unaligned", test_data[i].path);
         g_test_add_data_func(path, &test_data[i], test_xts_unaligned);
         g_free(path);
+
+        /* the cipher API only takes whole blocks */
+        if (!(test_data[i].PTLEN % 16)) {
+            path = g_strdup_printf("%s/cipher", test_data[i].path);
+            g_test_add_data_func(path, &test_data[i], test_xts_cipher);
+            g_free(path);
+        }
     }
 
     return g_test_run();
@@ -1122,6 +1122,250 @@ static void test_hbitmap_next_dirty_area_after_truncate(TestHBitmapData *data,
     test_hbitmap_next_dirty_area_check(data, 0, UINT64_MAX);
 }
 
+/* Check that @hb has the same bits set as the shadow bitmap of @data */
+static void hbitmap_test_check_same(TestHBitmapData *data, HBitmap *hb)
+{
+    HBitmap *orig = data->hb;
+
+    data->hb = hb;
+    hbitmap_test_check(data, 0);
+    data->hb = orig;
+}
+
+static HBitmap *hbitmap_test_merge_a(void)
+{
+    HBitmap *a = hbitmap_alloc(L3, 0);
+
+    hbitmap_set(a, 0, L1 + 3);
+    hbitmap_set(a, L2 + 7, 1);
+    return a;
+}
+
+static HBitmap *hbitmap_test_merge_b(void)
+{
+    HBitmap *b = hbitmap_alloc(L3, 0);
+
+    hbitmap_set(b, L1, L1);
+    hbitmap_set(b, L2 + 8, 1);
+    hbitmap_set(b, L2 * 3, L2);
+    hbitmap_set(b, L3 - 1, 1);
+    return b;
+}
+
+static void test_hbitmap_merge(TestHBitmapData *data, const void *unused)
+{
+    HBitmap *a, *b, *result;
+
+    /* The shadow bitmap holds the expected result */
+    hbitmap_test_init(data, L3, 0);
+    hbitmap_test_set(data, 0, L1 + 3);
+    hbitmap_test_set(data, L2 + 7, 1);
+    hbitmap_test_set(data, L1, L1);
+    hbitmap_test_set(data, L2 + 8, 1);
+    hbitmap_test_set(data, L2 * 3, L2);
+    hbitmap_test_set(data, L3 - 1, 1);
+
+    a = hbitmap_test_merge_a();
+    b = hbitmap_test_merge_b();
+    result = hbitmap_alloc(L3, 0);
+    hbitmap_set(result, L2 * 2, 1);
+    g_assert(hbitmap_merge(a, b, result));
+    hbitmap_test_check_same(data, result);
+
+    g_assert(hbitmap_merge(a, b, a));
+    hbitmap_test_check_same(data, a);
+    hbitmap_free(a);
+
+    a = hbitmap_test_merge_a();
+    g_assert(hbitmap_merge(a, b, b));
+    hbitmap_test_check_same(data, b);
+
+    hbitmap_free(result);
+    hbitmap_free(b);
+    hbitmap_free(a);
+}
+
+static void test_hbitmap_accel_check(TestHBitmapData *data)
+{
+    uint64_t size = hbitmap_serialization_size(data->hb, 0, L3);
+    uint8_t *buf = g_malloc0(size);
+    HBitmap *copy = hbitmap_alloc(L3, 0);
+    int i;
+
+    for (i = 0; i < 16; i++) {
+        test_hbitmap_next_zero_check(data, L2 * 2 * i);
+        test_hbitmap_next_zero_check(data, L2 * 2 * i + L1 + 1);
+    }
+    test_hbitmap_next_zero_check(data, L3 - L2);
+    test_hbitmap_next_zero_check_range(data, 0, L2 * 8);
+
+    /* The count of a deserialized bitmap is computed from scratch */
+    hbitmap_serialize_part(data->hb, buf, 0, L3);
+    hbitmap_deserialize_part(copy, buf, 0, L3, true);
+    g_assert_cmpint(hbitmap_count(copy), ==, hbitmap_count(data->hb));
+
+    hbitmap_free(copy);
+    g_free(buf);
+}
+
+static void test_hbitmap_accel(TestHBitmapData *data, const void *unused)
+{
+    int i;
+
+    /*
+     * Runs of full words whose ends fall on every word of a scan block,
+     * plus a partial word, and one run that reaches the end of the bitmap
+     */
+    hbitmap_test_init(data, L3, 0);
+    for (i = 0; i < 16; i++) {
+        hbitmap_test_set(data, L2 * 2 * i, L1 * (i + 1) + i);
+    }
+    hbitmap_test_set(data, L3 - L2, L2);
+
+    if (g_test_perf()) {
+        /* Keep the best kernels for the perf tests */
+        test_hbitmap_accel_check(data);
+    } else {
+        do {
+            test_hbitmap_accel_check(data);
+        } while (test_hbitmap_next_accel());
+    }
+}
+
+static void test_hbitmap_extents(TestHBitmapData *data, const void *unused)
+{
+    HBitmapExtent extents[3];
+    HBitmapIter iter, copy_iter;
+    HBitmap *copy;
+    uint64_t start = 0, prev_end = 0;
+    size_t i, n, total = 0;
+    int64_t next;
+
+    hbitmap_test_init(data, L3, 4);
+    hbitmap_set(data->hb, 0, 1);
+    hbitmap_set(data->hb, 100, L1 * 16);
+    hbitmap_set(data->hb, L2 * 16, L2);
+    hbitmap_set(data->hb, L3 - 1, 1);
+
+    copy = hbitmap_alloc(L3, 4);
+    do {
+        n = hbitmap_get_extents(data->hb, &start, L3, extents,
+                                ARRAY_SIZE(extents));
+        for (i = 0; i < n; i++) {
+            g_assert_cmpint(extents[i].start, >=, prev_end);
+            g_assert_cmpint(extents[i].count, >, 0);
+            prev_end = extents[i].start + extents[i].count;
+        }
+        hbitmap_set_extents(copy, extents, n);
+        total += n;
+    } while (start < L3);
+
+    g_assert_cmpint(total, ==, 4);
+    g_assert_cmpint(hbitmap_count(copy), ==, hbitmap_count(data->hb));
+
+    hbitmap_iter_init(&iter, data->hb, 0);
+    hbitmap_iter_init(&copy_iter, copy, 0);
+    do {
+        next = hbitmap_iter_next(&iter);
+        g_assert_cmpint(hbitmap_iter_next(&copy_iter), ==, next);
+    } while (next >= 0);
+
+    hbitmap_free(copy);
+}
+
+/* 16 TiB at 64 KiB granularity */
+#define PERF_SIZE                  (UINT64_C(1) << 44)
+#define PERF_GRANULARITY           16
+#define PERF_ITERATIONS            10
+
+static void perf_hbitmap_next_zero(void)
+{
+    HBitmap *hb = hbitmap_alloc(PERF_SIZE, PERF_GRANULARITY);
+    double duration;
+    int i;
+
+    hbitmap_set(hb, 0, PERF_SIZE);
+
+    g_test_timer_start();
+    for (i = 0; i < PERF_ITERATIONS; i++) {
+        g_assert_cmpint(hbitmap_next_zero(hb, 0, UINT64_MAX), ==, -1);
+    }
+    duration = g_test_timer_elapsed();
+
+    g_test_message("next_zero over a full bitmap, %d iterations: %f s",
+                   PERF_ITERATIONS, duration);
+    hbitmap_free(hb);
+}
+
+static void perf_hbitmap_merge(void)
+{
+    HBitmap *a = hbitmap_alloc(PERF_SIZE, PERF_GRANULARITY);
+    HBitmap *sparse = hbitmap_alloc(PERF_SIZE, PERF_GRANULARITY);
+    HBitmap *dense = hbitmap_alloc(PERF_SIZE, PERF_GRANULARITY);
+    uint64_t offset;
+    double duration;
+    int i;
+
+    /* One dirty cluster per GiB, and half of all clusters */
+    for (offset = 0; offset < PERF_SIZE; offset += 1 << 30) {
+        hbitmap_set(sparse, offset, 1);
+    }
+    for (offset = 0; offset < PERF_SIZE; offset += 1 << 24) {
+        hbitmap_set(dense, offset, 1 << 23);
+    }
+
+    g_test_timer_start();
+    for (i = 0; i < PERF_ITERATIONS; i++) {
+        g_assert(hbitmap_merge(a, sparse, a));
+    }
+    duration = g_test_timer_elapsed();
+    g_test_message("merge of a sparse bitmap, %d iterations: %f s",
+                   PERF_ITERATIONS, duration);
+
+    g_test_timer_start();
+    for (i = 0; i < PERF_ITERATIONS; i++) {
+        g_assert(hbitmap_merge(sparse, dense, a));
+    }
+    duration = g_test_timer_elapsed();
+    g_test_message("merge of a dense bitmap, %d iterations: %f s",
+                   PERF_ITERATIONS, duration);
+
+    hbitmap_free(dense);
+    hbitmap_free(sparse);
+    hbitmap_free(a);
+}
+
+static void perf_hbitmap_extents(void)
+{
+    HBitmap *hb = hbitmap_alloc(PERF_SIZE, PERF_GRANULARITY);
+    HBitmap *copy = hbitmap_alloc(PERF_SIZE, PERF_GRANULARITY);
+    HBitmapExtent extents[1024];
+    uint64_t offset, start;
+    size_t n, total = 0;
+    double duration;
+
+    /* 1 MiB dirty every 64 MiB */
+    for (offset = 0; offset < PERF_SIZE; offset += 1 << 26) {
+        hbitmap_set(hb, offset, 1 << 20);
+    }
+
+    g_test_timer_start();
+    start = 0;
+    do {
+        n = hbitmap_get_extents(hb, &start, PERF_SIZE, extents,
+                                ARRAY_SIZE(extents));
+        hbitmap_set_extents(copy, extents, n);
+        total += n;
+    } while (start < PERF_SIZE);
+    duration = g_test_timer_elapsed();
+
+    g_assert_cmpint(hbitmap_count(copy), ==, hbitmap_count(hb));
+    g_test_message("export and import of %zu extents: %f s", total, duration);
+
+    hbitmap_free(copy);
+    hbitmap_free(hb);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -1199,6 +1443,16 @@ int main(int argc, char **argv)
     hbitmap_test_add("/hbitmap/next_dirty_area/next_dirty_area_after_truncate",
                      test_hbitmap_next_dirty_area_after_truncate);
 
+    hbitmap_test_add("/hbitmap/merge/same_granularity", test_hbitmap_merge);
+    hbitmap_test_add("/hbitmap/accel", test_hbitmap_accel);
+    hbitmap_test_add("/hbitmap/extents/roundtrip", test_hbitmap_extents);
+
+    if (g_test_perf()) {
+        g_test_add_func("/hbitmap/perf/next_zero", perf_hbitmap_next_zero);
+        g_test_add_func("/hbitmap/perf/merge", perf_hbitmap_merge);
+        g_test_add_func("/hbitmap/perf/extents", perf_hbitmap_extents);
+    }
+
     g_test_run();
 
     return 0;
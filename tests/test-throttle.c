@@ -729,6 +729,17 @@ static void test_groups(void)
     throttle_group_get_config(tgm3, &cfg2);
     g_assert(!memcmp(&cfg1, &cfg2, sizeof(cfg1)));
 
+    /* Weights are per member and default to 1 */
+    g_assert_cmpuint(throttle_group_get_weight(tgm1), ==, 1);
+    throttle_group_set_weight(tgm1, 4);
+    g_assert_cmpuint(throttle_group_get_weight(tgm1), ==, 4);
+    g_assert_cmpuint(throttle_group_get_weight(tgm3), ==, 1);
+
+    /* ...and are kept when a member changes group */
+    throttle_group_unregister_tgm(tgm1);
+    throttle_group_register_tgm(tgm1, "foo", blk_get_aio_context(blk1));
+    g_assert_cmpuint(throttle_group_get_weight(tgm1), ==, 4);
+
     throttle_group_unregister_tgm(tgm1);
     throttle_group_unregister_tgm(tgm2);
     throttle_group_unregister_tgm(tgm3);
@@ -738,6 +749,81 @@ static void test_groups(void)
     g_assert(tgm3->throttle_state == NULL);
 }
 
+#define DRR_REQS 32
+
+typedef struct {
+    ThrottleGroupMember *tgm;
+    int id;
+    int *order;
+    int *done;
+} DRRRequest;
+
+static void coroutine_fn test_drr_co(void *opaque)
+{
+    DRRRequest *req = opaque;
+
+    throttle_group_co_io_limits_intercept(req->tgm, 512, false);
+    req->order[(*req->done)++] = req->id;
+}
+
+/* Two members with weights 3:1 get their queued requests started 3:1 */
+static void test_groups_drr(void)
+{
+    ThrottleConfig cfg1;
+    BlockBackend *blk[2];
+    ThrottleGroupMember *tgm[2];
+    DRRRequest reqs[2 * DRR_REQS];
+    int order[2 * DRR_REQS];
+    int done = 0, sync_done, count[2] = { 0, 0 };
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        blk[i] = blk_new(qemu_get_aio_context(), 0, BLK_PERM_ALL);
+        tgm[i] = &blk_get_public(blk[i])->throttle_group_member;
+        throttle_group_register_tgm(tgm[i], "drr", blk_get_aio_context(blk[i]));
+    }
+    throttle_group_set_weight(tgm[0], 3);
+    throttle_group_set_weight(tgm[1], 1);
+
+    /* 100 IOPS: the first few requests pass, then one starts every 10 ms */
+    throttle_config_init(&cfg1);
+    cfg1.buckets[THROTTLE_OPS_TOTAL].avg = 100;
+    throttle_group_config(tgm[0], &cfg1);
+
+    /* Submit alternately so that both members have requests queued */
+    for (i = 0; i < 2 * DRR_REQS; i++) {
+        reqs[i] = (DRRRequest) {
+            .tgm = tgm[i % 2],
+            .id = i % 2,
+            .order = order,
+            .done = &done,
+        };
+        qemu_coroutine_enter(qemu_coroutine_create(test_drr_co, &reqs[i]));
+    }
+    sync_done = done;
+    g_assert_cmpint(sync_done, <, DRR_REQS / 2);
+
+    while (done < 2 * DRR_REQS) {
+        aio_poll(ctx, true);
+    }
+
+    /*
+     * While both members have requests queued, every round starts three
+     * requests of the first one and one of the second.  Skip the first
+     * rounds, where the turn may be in the middle of a share.
+     */
+    for (i = sync_done + 8; i < sync_done + 24; i++) {
+        count[order[i]]++;
+    }
+    g_assert_cmpint(count[0], ==, 12);
+    g_assert_cmpint(count[1], ==, 4);
+
+    for (i = 0; i < 2; i++) {
+        throttle_group_unregister_tgm(tgm[i]);
+        blk_unref(blk[i]);
+    }
+}
+
 int main(int argc, char **argv)
 {
     qemu_init_main_loop(&error_fatal);
@@ -765,6 +851,7 @@ int main(int argc, char **argv)
     g_test_add_func("/throttle/config_functions",   test_config_functions);
     g_test_add_func("/throttle/accounting",         test_accounting);
     g_test_add_func("/throttle/groups",             test_groups);
+    g_test_add_func("/throttle/groups/drr",         test_groups_drr);
     return g_test_run();
 }
 
@@ -13,6 +13,7 @@
 #include "qemu/osdep.h"
 #include "qemu-common.h"
 #include "qemu/cutils.h"
+#include "qemu/units.h"
 #include "../migration/xbzrle.h"
 
 #define PAGE_SIZE 4096
@@ -174,6 +175,145 @@ static void test_encode_decode(void)
     }
 }
 
+#define ACCEL_PAGES 64
+
+/*
+ * Most buffers don't end on a 64 byte boundary, so that the bytes after
+ * the last full block (xbzrle_mask_tail) are covered too.  The last ones
+ * are shorter than a single block.
+ */
+static int accel_page_len(int i)
+{
+    if (i == 0) {
+        return PAGE_SIZE;
+    } else if (i < ACCEL_PAGES - 16) {
+        return PAGE_SIZE - i;
+    } else {
+        return i - (ACCEL_PAGES - 16) + 1;
+    }
+}
+
+/*
+ * Fill @old with random data and @new with a copy of it that has
+ * runs of differences of random length at random places.  Every other
+ * buffer also differs in the last byte of its @len first ones.
+ */
+static void fill_accel_page(uint8_t *old, uint8_t *new, int len)
+{
+    int i, nr_runs = g_test_rand_int_range(0, 64);
+
+    for (i = 0; i < PAGE_SIZE; i++) {
+        old[i] = g_test_rand_int();
+    }
+    memcpy(new, old, PAGE_SIZE);
+
+    for (i = 0; i < nr_runs; i++) {
+        int start = g_test_rand_int_range(0, PAGE_SIZE);
+        int len = g_test_rand_int_range(1, 200);
+        int j;
+
+        for (j = start; j < MIN(start + len, PAGE_SIZE); j++) {
+            new[j] = ~old[j];
+        }
+    }
+
+    if (len % 2) {
+        new[len - 1] = ~old[len - 1];
+    }
+}
+
+static void encode_decode_accel(uint8_t *old, uint8_t *new,
+                                uint8_t *compressed, int *dlen,
+                                bool check)
+{
+    uint8_t *buf = g_malloc(PAGE_SIZE);
+    uint8_t *decoded = g_malloc(PAGE_SIZE);
+    int i, len;
+
+    for (i = 0; i < ACCEL_PAGES; i++) {
+        uint8_t *o = old + i * PAGE_SIZE;
+        uint8_t *n = new + i * PAGE_SIZE;
+        int slen = accel_page_len(i);
+        int rc;
+
+        len = xbzrle_encode_buffer(o, n, slen, buf, PAGE_SIZE);
+        if (!check) {
+            dlen[i] = len;
+            memcpy(compressed + i * PAGE_SIZE, buf, MAX(len, 0));
+            continue;
+        }
+        g_assert_cmpint(len, ==, dlen[i]);
+        if (len <= 0) {
+            continue;
+        }
+        g_assert(memcmp(buf, compressed + i * PAGE_SIZE, len) == 0);
+
+        /* The unchanged run at the end, if any, isn't encoded */
+        memcpy(decoded, o, PAGE_SIZE);
+        rc = xbzrle_decode_buffer(buf, len, decoded, slen);
+        g_assert(rc > 0 && rc <= slen);
+        g_assert(memcmp(decoded, n, slen) == 0);
+    }
+
+    g_free(buf);
+    g_free(decoded);
+}
+
+static void encode_speed(uint8_t *old, uint8_t *new)
+{
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    double total = 0.0;
+    int i = 0;
+
+    g_test_timer_start();
+    do {
+        xbzrle_encode_buffer(old + i * PAGE_SIZE, new + i * PAGE_SIZE,
+                             PAGE_SIZE, compressed, PAGE_SIZE);
+        i = (i + 1) % ACCEL_PAGES;
+        total += PAGE_SIZE;
+    } while (g_test_timer_elapsed() < 5.0);
+
+    total /= MiB;
+    g_print("xbzrle encode: ");
+    g_print("done: %.2f MB in %.2f secs: ", total, g_test_timer_last());
+    g_print("%.2f MB/sec\n", total / g_test_timer_last());
+
+    g_free(compressed);
+}
+
+/*
+ * All the encoders must produce the same output, check the accelerated
+ * ones against whatever is selected at startup and end with the plain
+ * C version.
+ */
+static void test_encode_decode_accel(void)
+{
+    uint8_t *old = g_malloc(ACCEL_PAGES * PAGE_SIZE);
+    uint8_t *new = g_malloc(ACCEL_PAGES * PAGE_SIZE);
+    uint8_t *compressed = g_malloc(ACCEL_PAGES * PAGE_SIZE);
+    int *dlen = g_new(int, ACCEL_PAGES);
+    int i;
+
+    for (i = 0; i < ACCEL_PAGES; i++) {
+        fill_accel_page(old + i * PAGE_SIZE, new + i * PAGE_SIZE,
+                        accel_page_len(i));
+    }
+
+    if (g_test_perf()) {
+        encode_speed(old, new);
+    } else {
+        encode_decode_accel(old, new, compressed, dlen, false);
+        do {
+            encode_decode_accel(old, new, compressed, dlen, true);
+        } while (test_xbzrle_encode_next_accel());
+    }
+
+    g_free(old);
+    g_free(new);
+    g_free(compressed);
+    g_free(dlen);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -186,6 +326,7 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    g_test_add_func("/xbzrle/encode_decode_accel", test_encode_decode_accel);
 
     return g_test_run();
 }
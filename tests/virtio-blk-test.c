@@ -344,6 +344,20 @@ static void basic(void *obj, void *data, QGuestAllocator *t_alloc)
 
 }
 
+/* Requests on the last of several virtqueues served by an iothread */
+static void iothread_multiqueue(void *obj, void *data,
+                                QGuestAllocator *t_alloc)
+{
+    QVirtioBlk *blk_if = obj;
+    QVirtQueue *vq0, *vq1;
+
+    vq0 = qvirtqueue_setup(blk_if->vdev, t_alloc, 0);
+    vq1 = qvirtqueue_setup(blk_if->vdev, t_alloc, 1);
+    test_basic(blk_if->vdev, t_alloc, vq1);
+    qvirtqueue_cleanup(blk_if->vdev->bus, vq1, t_alloc);
+    qvirtqueue_cleanup(blk_if->vdev->bus, vq0, t_alloc);
+}
+
 static void indirect(void *obj, void *u_data, QGuestAllocator *t_alloc)
 {
     QVirtQueue *vq;
@@ -786,6 +800,11 @@ static void register_virtio_blk_test(void)
     qos_add_test("nxvirtq", "virtio-blk-pci",
                       test_nonexistent_virtqueue, &opts);
     qos_add_test("hotplug", "virtio-blk-pci", pci_hotplug, &opts);
+
+    opts.edge.before_cmd_line = "-object iothread,id=iothread0";
+    opts.edge.extra_device_opts = "iothread=iothread0,num-queues=2";
+    qos_add_test("iothread-multiqueue", "virtio-blk-pci",
+                 iothread_multiqueue, &opts);
 }
 
 libqos_init(register_virtio_blk_test);
@@ -101,6 +101,212 @@ struct HBitmap {
     uint64_t sizes[HBITMAP_LEVELS];
 };
 
+/* Number of words that the scanning loops below look at per iteration.
+ * Combining them with a single test keeps the loops branch-light.
+ */
+#define HB_SCAN_WORDS          8
+
+/* Return the index of the first word in [pos, end) that is not equal to
+ * @pattern, or @end if there is none.
+ */
+static size_t hb_find_word_not_int(const unsigned long *words, size_t pos,
+                                   size_t end, unsigned long pattern)
+{
+    while (pos + HB_SCAN_WORDS <= end) {
+        unsigned long diff = 0;
+        unsigned i;
+
+        for (i = 0; i < HB_SCAN_WORDS; i++) {
+            diff |= words[pos + i] ^ pattern;
+        }
+        if (diff) {
+            break;
+        }
+        pos += HB_SCAN_WORDS;
+    }
+
+    while (pos < end && words[pos] == pattern) {
+        pos++;
+    }
+    return pos;
+}
+
+/* Count the set bits in @n words.  Independent accumulators let the
+ * population counts of consecutive words proceed in parallel.
+ */
+static uint64_t hb_count_words_int(const unsigned long *words, size_t n)
+{
+    uint64_t count[4] = { 0 };
+    size_t i;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        count[0] += ctpopl(words[i]);
+        count[1] += ctpopl(words[i + 1]);
+        count[2] += ctpopl(words[i + 2]);
+        count[3] += ctpopl(words[i + 3]);
+    }
+    for (; i < n; i++) {
+        count[0] += ctpopl(words[i]);
+    }
+
+    return count[0] + count[1] + count[2] + count[3];
+}
+
+/*
+ * Unless QEMU is built with -mpopcnt, ctpopl() is a call to a libgcc
+ * routine.  On a 16 TiB disk with 64 KiB granularity, counting the bottom
+ * level of a dirty bitmap takes 4M such calls, so use the POPCNT
+ * instruction when the host has it.  Scanning for the end of a run of
+ * equal words is done 256 bits at a time with AVX2; GCC does not vectorize
+ * hb_find_word_not_int() at -O2.
+ */
+#if defined(CONFIG_AVX2_OPT) && HOST_LONG_BITS == 64
+/*
+ * Note that due to restrictions/bugs wrt __builtin functions in gcc <= 4.8,
+ * the includes have to be within the corresponding push_options region, and
+ * therefore the regions themselves have to be ordered with increasing ISA.
+ */
+#pragma GCC push_options
+#pragma GCC target("popcnt")
+
+static uint64_t hb_count_words_popcnt(const unsigned long *words, size_t n)
+{
+    uint64_t count[4] = { 0 };
+    size_t i;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        count[0] += __builtin_popcountl(words[i]);
+        count[1] += __builtin_popcountl(words[i + 1]);
+        count[2] += __builtin_popcountl(words[i + 2]);
+        count[3] += __builtin_popcountl(words[i + 3]);
+    }
+    for (; i < n; i++) {
+        count[0] += __builtin_popcountl(words[i]);
+    }
+
+    return count[0] + count[1] + count[2] + count[3];
+}
+
+#pragma GCC pop_options
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+static size_t hb_find_word_not_avx2(const unsigned long *words, size_t pos,
+                                    size_t end, unsigned long pattern)
+{
+    __m256i pat = _mm256_set1_epi64x(pattern);
+
+    QEMU_BUILD_BUG_ON(HB_SCAN_WORDS * sizeof(unsigned long) !=
+                      2 * sizeof(__m256i));
+
+    while (pos + HB_SCAN_WORDS <= end) {
+        const __m256i *p = (const __m256i *)(words + pos);
+        __m256i diff = _mm256_xor_si256(_mm256_loadu_si256(p), pat) |
+                       _mm256_xor_si256(_mm256_loadu_si256(p + 1), pat);
+
+        if (!_mm256_testz_si256(diff, diff)) {
+            break;
+        }
+        pos += HB_SCAN_WORDS;
+    }
+
+    while (pos < end && words[pos] == pattern) {
+        pos++;
+    }
+    return pos;
+}
+
+#pragma GCC pop_options
+
+/*
+ * Note that for test_hbitmap_next_accel, the most preferred
+ * ISA must have the least significant bit.
+ */
+#define CACHE_AVX2    1
+#define CACHE_POPCNT  2
+
+static unsigned cpuid_cache;
+#endif /* CONFIG_AVX2_OPT && HOST_LONG_BITS == 64 */
+
+static size_t (*hb_find_word_not)(const unsigned long *words, size_t pos,
+                                  size_t end, unsigned long pattern) =
+    hb_find_word_not_int;
+static uint64_t (*hb_count_words)(const unsigned long *words, size_t n) =
+    hb_count_words_int;
+
+#if defined(CONFIG_AVX2_OPT) && HOST_LONG_BITS == 64
+#include "qemu/cpuid.h"
+
+static void init_accel(unsigned cache)
+{
+    hb_find_word_not = (cache & CACHE_AVX2) ? hb_find_word_not_avx2
+                                            : hb_find_word_not_int;
+    hb_count_words = (cache & CACHE_POPCNT) ? hb_count_words_popcnt
+                                            : hb_count_words_int;
+}
+
+static void __attribute__((constructor)) init_cpuid_cache(void)
+{
+    int max = __get_cpuid_max(0, NULL);
+    int a, b, c, d;
+    unsigned cache = 0;
+
+    if (max >= 1) {
+        __cpuid(1, a, b, c, d);
+        if (c & bit_POPCNT) {
+            cache |= CACHE_POPCNT;
+        }
+
+        /* We must check that AVX is not just available, but usable.  */
+        if ((c & bit_OSXSAVE) && (c & bit_AVX) && max >= 7) {
+            int bv;
+            __asm("xgetbv" : "=a"(bv), "=d"(d) : "c"(0));
+            __cpuid_count(7, 0, a, b, c, d);
+            if ((bv & 6) == 6 && (b & bit_AVX2)) {
+                cache |= CACHE_AVX2;
+            }
+        }
+    }
+    cpuid_cache = cache;
+    init_accel(cache);
+}
+
+bool test_hbitmap_next_accel(void)
+{
+    /*
+     * If no bits set, we just tested the C versions, and there
+     * are no more acceleration options to test.
+     */
+    if (cpuid_cache == 0) {
+        return false;
+    }
+    /* Disable the accelerator we used before and select a new one.  */
+    cpuid_cache &= cpuid_cache - 1;
+    init_accel(cpuid_cache);
+    return true;
+}
+#else
+bool test_hbitmap_next_accel(void)
+{
+    return false;
+}
+#endif
+
+/* Count all set bits in the bottom level */
+static uint64_t hb_count_all(const HBitmap *hb)
+{
+    const unsigned long *last_lev = hb->levels[HBITMAP_LEVELS - 1];
+    size_t full = hb->size >> BITS_PER_LEVEL;
+    unsigned tail = hb->size & (BITS_PER_LONG - 1);
+    uint64_t count = hb_count_words(last_lev, full);
+
+    if (tail) {
+        count += ctpopl(last_lev[full] & ((1UL << tail) - 1));
+    }
+    return count;
+}
+
 /* Advance hbi to the next nonzero word and return it.  hbi->pos
  * is updated.  Returns zero if we reach the end of the bitmap.
  */
@@ -219,10 +425,7 @@ int64_t hbitmap_next_zero(const HBitmap *hb, uint64_t start, uint64_t count)
     assert((start >> hb->granularity) < hb->size);
 
     if (cur == (unsigned long)-1) {
-        do {
-            pos++;
-        } while (pos < sz && last_lev[pos] == (unsigned long)-1);
-
+        pos = hb_find_word_not(last_lev, pos + 1, sz, (unsigned long)-1);
         if (pos >= sz) {
             return -1;
         }
@@ -283,6 +486,36 @@ bool hbitmap_next_dirty_area(const HBitmap *hb, uint64_t *start,
     return true;
 }
 
+size_t hbitmap_get_extents(const HBitmap *hb, uint64_t *start, uint64_t end,
+                           HBitmapExtent *extents, size_t max_extents)
+{
+    size_t n = 0;
+
+    while (n < max_extents && *start < end) {
+        uint64_t offset = *start;
+        uint64_t count = end - *start;
+
+        if (!hbitmap_next_dirty_area(hb, &offset, &count)) {
+            *start = end;
+            break;
+        }
+        extents[n++] = (HBitmapExtent) { .start = offset, .count = count };
+        *start = offset + count;
+    }
+
+    return n;
+}
+
+void hbitmap_set_extents(HBitmap *hb, const HBitmapExtent *extents,
+                         size_t nb_extents)
+{
+    size_t i;
+
+    for (i = 0; i < nb_extents; i++) {
+        hbitmap_set(hb, extents[i].start, extents[i].count);
+    }
+}
+
 bool hbitmap_empty(const HBitmap *hb)
 {
     return hb->count == 0;
@@ -686,7 +919,7 @@ void hbitmap_deserialize_finish(HBitmap *bitmap)
     }
 
     bitmap->levels[0][0] |= 1UL << (BITS_PER_LONG - 1);
-    bitmap->count = hb_count_between(bitmap, 0, bitmap->size - 1);
+    bitmap->count = hb_count_all(bitmap);
 }
 
 void hbitmap_free(HBitmap *hb)
@@ -804,6 +1037,34 @@ static void hbitmap_sparse_merge(HBitmap *dst, const HBitmap *src)
     }
 }
 
+/**
+ * hb_merge_words: performs dst = dst | src
+ * for bitmaps with the same size and granularity.  Only the nonzero words
+ * of src are visited, so this is cheap when src is sparse.
+ */
+static void hb_merge_words(HBitmap *dst, const HBitmap *src)
+{
+    unsigned long *last_lev = dst->levels[HBITMAP_LEVELS - 1];
+    HBitmapIter hbi;
+    unsigned long cur;
+    size_t pos;
+
+    hbitmap_iter_init(&hbi, src, 0);
+    while ((pos = hbitmap_iter_next_word(&hbi, &cur)) != (size_t)-1) {
+        unsigned long old = last_lev[pos];
+
+        if ((old | cur) == old) {
+            continue;
+        }
+        last_lev[pos] = old | cur;
+        dst->count += ctpopl(old | cur) - ctpopl(old);
+        if (!old) {
+            /* The word became nonzero, tell the levels above */
+            hb_set_between(dst, HBITMAP_LEVELS - 2, pos, pos);
+        }
+    }
+}
+
 /**
  * Given HBitmaps A and B, let R := A (BITOR) B.
  * Bitmaps A and B will not be modified,
@@ -815,7 +1076,6 @@ static void hbitmap_sparse_merge(HBitmap *dst, const HBitmap *src)
 bool hbitmap_merge(const HBitmap *a, const HBitmap *b, HBitmap *result)
 {
     int i;
-    uint64_t j;
 
     if (!hbitmap_can_merge(a, b) || !hbitmap_can_merge(a, result)) {
         return false;
@@ -845,19 +1105,23 @@ bool hbitmap_merge(const HBitmap *a, const HBitmap *b, HBitmap *result)
         return true;
     }
 
-    /* This merge is O(size), as BITS_PER_LONG and HBITMAP_LEVELS are constant.
-     * It may be possible to improve running times for sparsely populated maps
-     * by using hbitmap_iter_next, but this is suboptimal for dense maps.
+    /* Copy one operand into the result unless it is already there, then OR
+     * in the nonzero words of the other one.  The copy is O(size) but is a
+     * plain memcpy; the OR is proportional to the number of nonzero words.
      */
     assert(a->size == b->size);
-    for (i = HBITMAP_LEVELS - 1; i >= 0; i--) {
-        for (j = 0; j < a->sizes[i]; j++) {
-            result->levels[i][j] = a->levels[i][j] | b->levels[i][j];
+    if (result == b) {
+        b = a;
+        a = result;
+    }
+    if (result != a) {
+        for (i = HBITMAP_LEVELS - 1; i >= 0; i--) {
+            memcpy(result->levels[i], a->levels[i],
+                   a->sizes[i] * sizeof(unsigned long));
         }
+        result->count = a->count;
     }
-
-    /* Recompute the dirty count */
-    result->count = hb_count_between(result, 0, result->size - 1);
+    hb_merge_words(result, b);
 
     return true;
 }
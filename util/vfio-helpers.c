@@ -89,6 +89,10 @@ struct QEMUVFIOState {
     uint64_t high_water_mark;
     IOVAMapping *mappings;
     int nr_mappings;
+    /* Index of the last mapping found by qemu_vfio_find_mapping(), or -1.
+     * Consecutive requests usually hit the same RAM block, so this saves
+     * the binary search in the common case. */
+    int last_mapping;
 };
 
 /**
@@ -416,6 +420,7 @@ static void qemu_vfio_open_common(QEMUVFIOState *s)
     ram_block_notifier_add(&s->ram_notifier);
     s->low_water_mark = QEMU_VFIO_IOVA_MIN;
     s->high_water_mark = QEMU_VFIO_IOVA_MAX;
+    s->last_mapping = -1;
     qemu_ram_foreach_block(qemu_vfio_init_ramblock, s);
 }
 
@@ -469,6 +474,13 @@ static IOVAMapping *qemu_vfio_find_mapping(QEMUVFIOState *s, void *host,
     IOVAMapping *q = p ? p + s->nr_mappings - 1 : NULL;
     IOVAMapping *mid;
     trace_qemu_vfio_find_mapping(s, host);
+    if (s->last_mapping >= 0 && s->last_mapping < s->nr_mappings) {
+        mid = &s->mappings[s->last_mapping];
+        if (mid->host <= host && mid->host + mid->size > host) {
+            *index = s->last_mapping;
+            return mid;
+        }
+    }
     if (!p) {
         *index = -1;
         return NULL;
@@ -496,6 +508,7 @@ static IOVAMapping *qemu_vfio_find_mapping(QEMUVFIOState *s, void *host,
     if (mid >= &s->mappings[0] &&
         mid->host <= host && mid->host + mid->size > host) {
         assert(mid < &s->mappings[s->nr_mappings]);
+        s->last_mapping = *index;
         return mid;
     }
     /* At this point *index + 1 is the right position to insert the new
@@ -520,6 +533,7 @@ static IOVAMapping *qemu_vfio_add_mapping(QEMUVFIOState *s,
     trace_qemu_vfio_new_mapping(s, host, size, index, iova);
 
     assert(index >= 0);
+    s->last_mapping = -1;
     s->nr_mappings++;
     s->mappings = g_renew(IOVAMapping, s->mappings, s->nr_mappings);
     insert = &s->mappings[index];
@@ -569,6 +583,7 @@ static void qemu_vfio_undo_mapping(QEMUVFIOState *s, IOVAMapping *mapping,
     assert(mapping->size > 0);
     assert(QEMU_IS_ALIGNED(mapping->size, getpagesize()));
     assert(index >= 0 && index < s->nr_mappings);
+    s->last_mapping = -1;
     if (ioctl(s->container, VFIO_IOMMU_UNMAP_DMA, &unmap)) {
         error_setg(errp, "VFIO_UNMAP_DMA failed: %d", -errno);
     }